@@ -3,7 +3,8 @@ from typing import Optional
 from nightwatch import location, term
 from nightwatch.c_dsl import Expr, ExprOrStr
 from nightwatch.generator.c.buffer_handling import get_transfer_buffer_expr, get_buffer, attach_buffer, \
-    compute_total_size, deallocate_managed_for_argument, size_to_bytes, allocate_tmp_buffer
+    compute_total_size, deallocate_managed_for_argument, size_to_bytes, allocate_tmp_buffer, \
+    DECLARE_BUFFER_SIZE_EXPR
 from nightwatch.generator.c.instrumentation import timing_code_worker
 from nightwatch.generator.c.stubs import call_function_wrapper
 from nightwatch.generator.c.util import AllocList, compute_buffer_size, for_all_elements
@@ -48,6 +49,27 @@ def convert_input_for_argument(arg: Argument, src):
             {alloc_list.insert(local_value, deallocator)}
             }}""")
 
+        # Input buffers that end up in a shadow buffer or an allocator buffer are read straight into it, so the
+        # channel does not need to hold them in the command first.
+        direct_placement = type.is_simple_buffer() & Expr(arg.input) & Expr(type.transfer).equals("NW_BUFFER") & \
+            (type.lifetime.not_equals("AVA_CALL") | type.buffer_allocator.not_equals("malloc")) & \
+            Expr(param_value).not_equals("NULL")
+
+        def direct_placement_code():
+            return type.lifetime.not_equals("AVA_CALL").if_then_else(
+                f"""
+                {DECLARE_BUFFER_SIZE_EXPR}
+                {local_value} = ({type.nonconst.spelling})ava_shadow_buffer_get_buffer(&__ava_endpoint, __chan, __cmd, {param_value},
+                        {type.lifetime}, {type.lifetime_coupled}, &__buffer_size, {type.buffer_allocator}, {type.buffer_deallocator});
+                AVA_DEBUG_ASSERT(__buffer_size % sizeof({type.pointee.spelling}) == 0);
+                command_channel_copy_buffer(__chan, __cmd, {param_value}, {local_value}, __buffer_size);
+                """.strip(),
+                f"""
+                {maybe_alloc_local_temporary_buffer()}
+                command_channel_copy_buffer(__chan, __cmd, {param_value}, {local_value},
+                        {size_to_bytes(f"({compute_buffer_size(type, original_type)})", type)});
+                """.strip())
+
         src_name = f"__src_{arg.name}_{depth}"
 
         def get_buffer_code():
@@ -64,14 +86,17 @@ def convert_input_for_argument(arg: Argument, src):
                 return """abort_with_reason("Reached code to handle buffer in non-pointer type.");"""
             copy_code = (Expr(arg.input) & Expr(local_value).not_equals(src_name)).if_then_else(
                 f"""memcpy({local_value}, {src_name}, {size_to_bytes("__buffer_size", type)});""")
-            return ((type.lifetime.not_equals("AVA_CALL") | arg.input) & Expr(param_value).not_equals("NULL")).if_then_else(
-                f"""
-                    {get_buffer_code()}
-                    {copy_code}
-                """.strip(),
-                (Expr(arg.input) | type.transfer.equals("NW_ZEROCOPY_BUFFER")).if_then_else(
-                    preassignment,
-                    maybe_alloc_local_temporary_buffer
+            return direct_placement.if_then_else(
+                direct_placement_code,
+                ((type.lifetime.not_equals("AVA_CALL") | arg.input) & Expr(param_value).not_equals("NULL")).if_then_else(
+                    f"""
+                        {get_buffer_code()}
+                        {copy_code}
+                    """.strip(),
+                    (Expr(arg.input) | type.transfer.equals("NW_ZEROCOPY_BUFFER")).if_then_else(
+                        preassignment,
+                        maybe_alloc_local_temporary_buffer
+                    )
                 )
             )
 
@@ -117,7 +142,7 @@ def convert_input_for_argument(arg: Argument, src):
             )
         )
         if rest:
-            return Expr(preassignment).then(rest).scope()
+            return (~direct_placement).if_then_else(preassignment).then(rest).scope()
         else:
             return ""
 
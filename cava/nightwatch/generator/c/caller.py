@@ -28,7 +28,7 @@ def copy_result_for_argument(arg: Argument, dest, src) -> ExprOrStr:
 
         src_name = f"__src_{arg.name}_{depth}"
 
-        def get_buffer_code():
+        def check_lifetime():
             nonlocal reported_missing_lifetime
             if not reported_missing_lifetime and \
                     ((arg.ret or arg.output and depth > 0) and type.buffer) and \
@@ -37,6 +37,9 @@ def copy_result_for_argument(arg: Argument, dest, src) -> ExprOrStr:
                 generate_expects(
                     False,
                     "Returned buffers with call lifetime are almost always incorrect. (You may want to set a lifetime.)")
+
+        def get_buffer_code():
+            check_lifetime()
             return Expr(f"""
                 {DECLARE_BUFFER_SIZE_EXPR}
                 {type.attach_to(src_name)};
@@ -54,12 +57,25 @@ def copy_result_for_argument(arg: Argument, dest, src) -> ExprOrStr:
                 return """abort_with_reason("Reached code to handle buffer in non-pointer type.");"""
             copy_code = Expr(arg.output).if_then_else(
                 f"""memcpy({param_value}, {src_name}, {size_to_bytes("__buffer_size", type)});""")
+            # Copy call-lifetime buffers straight from the channel, so that streamed buffers are never held whole.
+            check_lifetime()
+            channel_copy_code = Expr(arg.output).if_then_else(
+                f"""
+                {DECLARE_BUFFER_SIZE_EXPR}
+                __buffer_size = {compute_buffer_size(type, original_type)};
+                AVA_DEBUG_ASSERT({param_value} != NULL);
+                command_channel_copy_buffer(__chan, __cmd, {local_value}, {param_value},
+                        {size_to_bytes("__buffer_size", type)});
+                """)
             if copy_code:
                 return Expr(local_value).not_equals("NULL").if_then_else(
-                    f"""
-                    {get_buffer_code()}
-                    {copy_code}
-                    """.strip()
+                    (Expr(type.lifetime).equals("AVA_CALL") & Expr(type.transfer).equals("NW_BUFFER")).if_then_else(
+                        channel_copy_code,
+                        f"""
+                        {get_buffer_code()}
+                        {copy_code}
+                        """.strip()
+                    )
                 )
             else:
                 return ""
@@ -240,6 +256,8 @@ def return_command_implementation(f: Function):
             {timing_code_guest("after_unmarshal", str(f.name), f.generate_timing_code)}
             __local->__call_complete = 1;
             if(__local->__handler_deallocate) {{
+                if (__local->__credit_size)
+                    shadow_thread_release_credit(nw_shadow_thread_pool, __local->__credit_size);
                 free(__local);
             }}
             break;
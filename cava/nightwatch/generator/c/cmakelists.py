@@ -48,9 +48,28 @@ include_directories(
 )
 add_definitions(-D_GNU_SOURCE)
 
+# Fix the channel at compile time, so that the generated code calls its
+# methods directly instead of through the channel vtable. LOCAL cannot be
+# fixed: the API server is loaded into its own link-map namespace, so each
+# end has its own copy of the channel methods and of libc.
+set(AVA_STATIC_CHANNEL "" CACHE STRING "Channel the guestlib and API server are built for: SHM_RING, or empty to choose at run time")
+if(AVA_STATIC_CHANNEL STREQUAL "SHM_RING")
+  set(static_channel shm_ring)
+elseif(NOT AVA_STATIC_CHANNEL STREQUAL "")
+  message(FATAL_ERROR "AVA_STATIC_CHANNEL=${{AVA_STATIC_CHANNEL}} is not supported, expect SHM_RING")
+endif()
+if(static_channel)
+  set_source_files_properties(
+    {api.c_worker_spelling}
+    {api.c_library_spelling}
+    ${{CMAKE_SOURCE_DIR}}/../../worker/worker.cpp
+    ${{CMAKE_SOURCE_DIR}}/../../guestlib/src/init.cpp
+    PROPERTIES COMPILE_DEFINITIONS AVA_STATIC_CHANNEL=${{static_channel}}
+  )
+endif()
+
 add_executable(worker
   ${{CMAKE_SOURCE_DIR}}/../../worker/worker.cpp
-  ${{CMAKE_SOURCE_DIR}}/../../common/cmd_channel_shm_worker.c
   ${{CMAKE_SOURCE_DIR}}/../../worker/provision_gpu.cpp
   {' '.join(worker_srcs)}
   {api.c_worker_spelling}
@@ -66,6 +85,19 @@ add_executable(worker
   ${{CMAKE_SOURCE_DIR}}/../../common/cmd_channel_socket_utilities.cpp
   ${{CMAKE_SOURCE_DIR}}/../../common/cmd_channel_socket_tcp.cpp
   ${{CMAKE_SOURCE_DIR}}/../../common/cmd_channel_socket_vsock.cpp
+  ${{CMAKE_SOURCE_DIR}}/../../common/cmd_channel_socket_unix.cpp
+  ${{CMAKE_SOURCE_DIR}}/../../common/cmd_channel_socket_striped.cpp
+  ${{CMAKE_SOURCE_DIR}}/../../common/cmd_buffer_pool.c
+  ${{CMAKE_SOURCE_DIR}}/../../common/cmd_param_block.c
+  ${{CMAKE_SOURCE_DIR}}/../../common/cmd_channel_shm.cpp
+  ${{CMAKE_SOURCE_DIR}}/../../common/cmd_channel_shm_ring.cpp
+  ${{CMAKE_SOURCE_DIR}}/../../common/cmd_channel_socket_uring.cpp
+  ${{CMAKE_SOURCE_DIR}}/../../common/cmd_compress.c
+  ${{CMAKE_SOURCE_DIR}}/../../common/cmd_channel_socket_dedup.cpp
+  ${{CMAKE_SOURCE_DIR}}/../../common/cmd_wire.c
+  ${{CMAKE_SOURCE_DIR}}/../../common/cmd_channel_loopback.cpp
+  ${{CMAKE_SOURCE_DIR}}/../../common/cmd_channel_trace.cpp
+  ${{CMAKE_SOURCE_DIR}}/../../common/cmd_copy.c
 )
 target_link_libraries(worker
   ${{GLIB2_LIBRARIES}}
@@ -74,10 +106,19 @@ target_link_libraries(worker
   {api.libs}
 )
 
+# The same API server as a library, which the guestlib runs in process with channel = "LOCAL"
+get_target_property(worker_sources worker SOURCES)
+add_library(worker_local SHARED ${{worker_sources}})
+target_link_libraries(worker_local
+  ${{GLIB2_LIBRARIES}}
+  ${{Boost_LIBRARIES}}
+  Threads::Threads
+  {api.libs}
+)
+
 add_library(guestlib SHARED
   ${{CMAKE_SOURCE_DIR}}/../../guestlib/src/init.cpp
   ${{CMAKE_SOURCE_DIR}}/../../guestlib/src/guest_config.cpp
-  ${{CMAKE_SOURCE_DIR}}/../../common/cmd_channel_shm.c
   {' '.join(guestlib_srcs)}
   {api.c_library_spelling}
   ${{CMAKE_SOURCE_DIR}}/../../common/cmd_channel.c
@@ -92,6 +133,19 @@ add_library(guestlib SHARED
   ${{CMAKE_SOURCE_DIR}}/../../common/cmd_channel_socket_utilities.cpp
   ${{CMAKE_SOURCE_DIR}}/../../common/cmd_channel_socket_tcp.cpp
   ${{CMAKE_SOURCE_DIR}}/../../common/cmd_channel_socket_vsock.cpp
+  ${{CMAKE_SOURCE_DIR}}/../../common/cmd_channel_socket_unix.cpp
+  ${{CMAKE_SOURCE_DIR}}/../../common/cmd_channel_socket_striped.cpp
+  ${{CMAKE_SOURCE_DIR}}/../../common/cmd_buffer_pool.c
+  ${{CMAKE_SOURCE_DIR}}/../../common/cmd_param_block.c
+  ${{CMAKE_SOURCE_DIR}}/../../common/cmd_channel_shm.cpp
+  ${{CMAKE_SOURCE_DIR}}/../../common/cmd_channel_shm_ring.cpp
+  ${{CMAKE_SOURCE_DIR}}/../../common/cmd_channel_socket_uring.cpp
+  ${{CMAKE_SOURCE_DIR}}/../../common/cmd_compress.c
+  ${{CMAKE_SOURCE_DIR}}/../../common/cmd_channel_socket_dedup.cpp
+  ${{CMAKE_SOURCE_DIR}}/../../common/cmd_wire.c
+  ${{CMAKE_SOURCE_DIR}}/../../common/cmd_channel_loopback.cpp
+  ${{CMAKE_SOURCE_DIR}}/../../common/cmd_channel_trace.cpp
+  ${{CMAKE_SOURCE_DIR}}/../../common/cmd_copy.c
   ${{CMAKE_SOURCE_DIR}}/../../proto/manager_service.proto.cpp
 )
 target_link_libraries(guestlib
@@ -99,14 +153,34 @@ target_link_libraries(guestlib
   ${{Boost_LIBRARIES}}
   Threads::Threads
   ${{Config++}}
+  ${{CMAKE_DL_LIBS}}
 )
 target_compile_options(guestlib
   PUBLIC -fvisibility=hidden
 )
+
+# Replays traffic traces of the guestlib against an API server
+get_target_property(replay_sources guestlib SOURCES)
+list(REMOVE_ITEM replay_sources
+  ${{CMAKE_SOURCE_DIR}}/../../guestlib/src/init.cpp
+  {' '.join(guestlib_srcs)}
+  {api.c_library_spelling}
+)
+add_executable(ava_replay
+  ${{CMAKE_SOURCE_DIR}}/../../tools/replay/replay.cpp
+  ${{replay_sources}}
+)
+target_link_libraries(ava_replay
+  ${{GLIB2_LIBRARIES}}
+  ${{Boost_LIBRARIES}}
+  Threads::Threads
+  ${{Config++}}
+  ${{CMAKE_DL_LIBS}}
+)
 include(GNUInstallDirs)
-install(TARGETS worker
+install(TARGETS worker ava_replay
         RUNTIME DESTINATION ${{CMAKE_INSTALL_BINDIR}})
-install(TARGETS guestlib
+install(TARGETS guestlib worker_local
         LIBRARY DESTINATION ${{CMAKE_INSTALL_LIBDIR}})
     """.strip()
     return "CMakeLists.txt", cmakelists
@@ -37,7 +37,7 @@ override CXXFLAGS+={api.cxxflags} \
 GUESTLIB_LIBS+=`pkg-config --libs glib-2.0` -fvisibility=hidden
 WORKER_LIBS+=`pkg-config --libs glib-2.0` {api.libs}
 
-all: libguestlib.so worker
+all: libguestlib.so worker libworker_local.so
 
 vpath %.c ../../common/
 vpath %.cpp ../../common/
@@ -46,11 +46,15 @@ vpath %.c ../../guestlib/src/
 
 GENERAL_SOURCES_C=cmd_channel.c murmur3.c cmd_handler.c endpoint_lib.c socket.c zcopy.c \\
                   cmd_channel_record.c cmd_channel_hv.c shadow_thread_pool.c \\
-                  cmd_channel_socket_utilities.cpp cmd_channel_socket_tcp.cpp cmd_channel_socket_vsock.cpp
+                  cmd_channel_socket_utilities.cpp cmd_channel_socket_tcp.cpp cmd_channel_socket_vsock.cpp \\
+                  cmd_channel_shm.cpp cmd_channel_shm_ring.cpp cmd_channel_socket_uring.cpp cmd_buffer_pool.c cmd_param_block.c \\
+                  cmd_channel_socket_unix.cpp cmd_channel_socket_striped.cpp cmd_compress.c \\
+                  cmd_channel_socket_dedup.cpp cmd_wire.c cmd_channel_loopback.cpp \\
+                  cmd_channel_trace.cpp cmd_copy.c
 WORKER_SPECIFIC_SOURCES={api.c_worker_spelling}
-WORKER_SPECIFIC_SOURCES_C=worker.cpp cmd_channel_shm_worker.c
+WORKER_SPECIFIC_SOURCES_C=worker.cpp
 GUESTLIB_SPECIFIC_SOURCES={api.c_library_spelling}
-GUESTLIB_SPECIFIC_SOURCES_C=init.c cmd_channel_shm.c
+GUESTLIB_SPECIFIC_SOURCES_C=init.c
 
 GENERAL_OBJECTS_C=$(addprefix objs/,$(addsuffix .o,$(basename $(GENERAL_SOURCES_C))))
 WORKER_SPECIFIC_OBJECTS=$(addprefix objs/,$(patsubst %.cpp,%.o,$(WORKER_SPECIFIC_SOURCES:.c=.o)))
@@ -82,11 +86,14 @@ objs/%.o: %.cpp objs/.directory
 worker: $(GENERAL_OBJECTS_C) $(WORKER_SPECIFIC_OBJECTS) $(WORKER_SPECIFIC_OBJECTS_C)
 	$(LINKER) -I../../worker/include $^ $(CFLAGS) $(WORKER_LIBS) $(LIBS) -o $@
 
+libworker_local.so: $(GENERAL_OBJECTS_C) $(WORKER_SPECIFIC_OBJECTS) $(WORKER_SPECIFIC_OBJECTS_C)
+	$(LINKER) -I../../worker/include -shared -fPIC $(CFLAGS) $^ $(WORKER_LIBS) $(LIBS) -o $@
+
 libguestlib.so: $(GENERAL_OBJECTS_C) $(GUESTLIB_SPECIFIC_OBJECTS) $(GUESTLIB_SPECIFIC_OBJECTS_C)
 	$(LINKER) -I../../guestlib/include -shared -fPIC $(CFLAGS) $^ $(GUESTLIB_LIBS) $(LIBS) -o $@
 
 clean:
-	-rm -rf worker libguestlib.so
+	-rm -rf worker libguestlib.so libworker_local.so
 	-rm -rf objs
 
 .PHONY: all clean
@@ -40,6 +40,13 @@ def function_implementation(f: Function) -> Union[str, Expr]:
             """.strip()
 
         is_async = ~Expr(f.synchrony).equals("NW_SYNC")
+        is_deferrable = Expr(f.synchrony).equals("NW_ASYNC")
+        # Specifications with their own reply code may not answer async calls
+        is_metered = is_async & Expr(not f.api.reply_code)
+        credit_code = is_metered.if_then_else(f"""
+            const size_t __credit_size = sizeof(struct {f.call_spelling}) + __total_buffer_size;
+            shadow_thread_acquire_credit(nw_shadow_thread_pool, __credit_size);
+        """.strip())
 
         alloc_list = AllocList(f)
 
@@ -82,12 +89,14 @@ def function_implementation(f: Function) -> Union[str, Expr]:
             {"".join(compute_argument_value(a) for a in f.implicit_arguments)}
 
             {compute_total_size(f.arguments, lambda a: a.input)}
+            {credit_code}
             struct {f.call_spelling}* __cmd = (struct {f.call_spelling}*)command_channel_new_command(
                 __chan, sizeof(struct {f.call_spelling}), __total_buffer_size);
             __cmd->base.api_id = {f.api.number_spelling};
             __cmd->base.command_id = {f.call_id_spelling};
             __cmd->base.thread_id = shadow_thread_id(nw_shadow_thread_pool);
             __cmd->base.original_thread_id = __cmd->base.thread_id;
+            {is_deferrable.if_then_else("__cmd->base.flags |= COMMAND_FLAG_DEFERRABLE;")}
 
             __cmd->__call_id = __call_id;
     
@@ -102,6 +111,7 @@ def function_implementation(f: Function) -> Union[str, Expr]:
                 (struct {f.call_record_spelling}*)calloc(1, sizeof(struct {f.call_record_spelling}));
             {pack_struct("__call_record", f.arguments + f.logue_declarations, "->")}
             __call_record->__call_complete = 0;
+            __call_record->__credit_size = {is_metered.if_then_else("__credit_size", "0")};
             __call_record->__handler_deallocate = {is_async};
             ava_add_call(&__ava_endpoint, __call_id, __call_record);
 
@@ -48,6 +48,7 @@ def function_call_record_struct(f: Function, errors):
                 {"".join(argument(a) + arg_suffix for a in f.arguments).strip()}\
                 {argument(f.return_value) if not f.return_value.type.is_void else ""}\
                 {"".join(argument(a) + arg_suffix for a in f.logue_declarations).strip()}\
+                size_t __credit_size;
                 char __handler_deallocate;
                 volatile char __call_complete;
             }};
@@ -0,0 +1,213 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "common/cmd_buffer_pool.h"
+#include "common/devconf.h"
+
+#define CMD_BUFFER_POOL_CLASSES \
+    (AVA_CMD_BUFFER_POOL_MAX_SHIFT - AVA_CMD_BUFFER_POOL_MIN_SHIFT + 1)
+#define CMD_BUFFER_OVERSIZED CMD_BUFFER_POOL_CLASSES
+#define CMD_BUFFER_MAGIC     0x61766162
+
+/**
+ * Hidden header in front of every buffer. It is padded to a cache line so
+ * that the buffer keeps the 64-byte alignment of the allocation.
+ */
+struct cmd_buffer_header {
+    struct cmd_buffer_pool *pool;
+    struct cmd_buffer_header *next;
+    size_t size;
+    uint32_t size_class;
+    uint32_t magic;
+} __attribute__((aligned(64)));
+
+struct cmd_buffer_class {
+    pthread_mutex_t lock;
+    struct cmd_buffer_header *free_list;
+    size_t cached_bytes;
+} __attribute__((aligned(64)));
+
+struct cmd_buffer_pool {
+    struct cmd_buffer_class classes[CMD_BUFFER_POOL_CLASSES];
+
+    uint64_t allocs;
+    uint64_t hits;
+    uint64_t oversized;
+    uint64_t in_use_bytes;
+    uint64_t cached_bytes;
+    uint64_t peak_bytes;
+
+    /* Set by cmd_buffer_pool_free while buffers are still handed out */
+    int closed;
+};
+
+static inline uint32_t cmd_buffer_size_class(size_t size)
+{
+    uint32_t shift = AVA_CMD_BUFFER_POOL_MIN_SHIFT;
+    while (shift <= AVA_CMD_BUFFER_POOL_MAX_SHIFT && ((size_t)1 << shift) < size)
+        shift++;
+    return shift - AVA_CMD_BUFFER_POOL_MIN_SHIFT;
+}
+
+static void cmd_buffer_pool_update_peak(struct cmd_buffer_pool *pool)
+{
+    uint64_t footprint = __atomic_load_n(&pool->in_use_bytes, __ATOMIC_RELAXED) +
+                         __atomic_load_n(&pool->cached_bytes, __ATOMIC_RELAXED);
+    uint64_t peak = __atomic_load_n(&pool->peak_bytes, __ATOMIC_RELAXED);
+    while (footprint > peak &&
+           !__atomic_compare_exchange_n(&pool->peak_bytes, &peak, footprint, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+struct cmd_buffer_pool *cmd_buffer_pool_new(void)
+{
+    struct cmd_buffer_pool *pool;
+    int i;
+
+    if (posix_memalign((void **)&pool, 64, sizeof(struct cmd_buffer_pool)))
+        return NULL;
+    for (i = 0; i < CMD_BUFFER_POOL_CLASSES; i++) {
+        pthread_mutex_init(&pool->classes[i].lock, NULL);
+        pool->classes[i].free_list = NULL;
+        pool->classes[i].cached_bytes = 0;
+    }
+    pool->allocs = 0;
+    pool->hits = 0;
+    pool->oversized = 0;
+    pool->in_use_bytes = 0;
+    pool->cached_bytes = 0;
+    pool->peak_bytes = 0;
+    pool->closed = 0;
+    return pool;
+}
+
+void cmd_buffer_pool_free(struct cmd_buffer_pool *pool)
+{
+    struct cmd_buffer_header *hdr;
+    int i;
+
+    if (!pool)
+        return;
+
+    /* Commands may still be held by other threads when the channel is
+     * torn down at exit. Keep the pool header around for them; their
+     * buffers go straight back to malloc. */
+    __atomic_store_n(&pool->closed, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < CMD_BUFFER_POOL_CLASSES; i++) {
+        pthread_mutex_lock(&pool->classes[i].lock);
+        while ((hdr = pool->classes[i].free_list) != NULL) {
+            pool->classes[i].free_list = hdr->next;
+            free(hdr);
+        }
+        pool->classes[i].cached_bytes = 0;
+        pthread_mutex_unlock(&pool->classes[i].lock);
+    }
+    __atomic_store_n(&pool->cached_bytes, 0, __ATOMIC_RELAXED);
+
+    if (__atomic_load_n(&pool->in_use_bytes, __ATOMIC_ACQUIRE) != 0)
+        return;
+    for (i = 0; i < CMD_BUFFER_POOL_CLASSES; i++)
+        pthread_mutex_destroy(&pool->classes[i].lock);
+    free(pool);
+}
+
+void *cmd_buffer_pool_alloc(struct cmd_buffer_pool *pool, size_t size)
+{
+    struct cmd_buffer_header *hdr = NULL;
+    uint32_t size_class = cmd_buffer_size_class(size);
+    size_t alloc_size = size;
+
+    __atomic_fetch_add(&pool->allocs, 1, __ATOMIC_RELAXED);
+    if (size_class == CMD_BUFFER_OVERSIZED) {
+        __atomic_fetch_add(&pool->oversized, 1, __ATOMIC_RELAXED);
+    }
+    else {
+        struct cmd_buffer_class *cls = &pool->classes[size_class];
+        alloc_size = (size_t)1 << (size_class + AVA_CMD_BUFFER_POOL_MIN_SHIFT);
+
+        pthread_mutex_lock(&cls->lock);
+        hdr = cls->free_list;
+        if (hdr) {
+            cls->free_list = hdr->next;
+            cls->cached_bytes -= alloc_size;
+        }
+        pthread_mutex_unlock(&cls->lock);
+
+        if (hdr) {
+            __atomic_fetch_add(&pool->hits, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_sub(&pool->cached_bytes, alloc_size, __ATOMIC_RELAXED);
+        }
+    }
+
+    if (!hdr) {
+        if (posix_memalign((void **)&hdr, 64, sizeof(struct cmd_buffer_header) + alloc_size))
+            return NULL;
+        hdr->pool = pool;
+        hdr->size = alloc_size;
+        hdr->size_class = size_class;
+        hdr->magic = CMD_BUFFER_MAGIC;
+    }
+    hdr->next = NULL;
+
+    __atomic_fetch_add(&pool->in_use_bytes, alloc_size, __ATOMIC_RELAXED);
+    cmd_buffer_pool_update_peak(pool);
+    return (void *)(hdr + 1);
+}
+
+void cmd_buffer_pool_release(void *buf)
+{
+    struct cmd_buffer_header *hdr;
+    struct cmd_buffer_pool *pool;
+    struct cmd_buffer_class *cls;
+    int cached = 0;
+
+    if (!buf)
+        return;
+    hdr = (struct cmd_buffer_header *)buf - 1;
+    assert(hdr->magic == CMD_BUFFER_MAGIC && "buffer does not come from a cmd_buffer_pool");
+    pool = hdr->pool;
+    __atomic_fetch_sub(&pool->in_use_bytes, hdr->size, __ATOMIC_RELAXED);
+
+    if (hdr->size_class != CMD_BUFFER_OVERSIZED) {
+        cls = &pool->classes[hdr->size_class];
+        pthread_mutex_lock(&cls->lock);
+        if (!__atomic_load_n(&pool->closed, __ATOMIC_ACQUIRE) &&
+                cls->cached_bytes + hdr->size <= AVA_CMD_BUFFER_POOL_CLASS_CACHE) {
+            hdr->next = cls->free_list;
+            cls->free_list = hdr;
+            cls->cached_bytes += hdr->size;
+            cached = 1;
+        }
+        pthread_mutex_unlock(&cls->lock);
+    }
+
+    if (cached)
+        __atomic_fetch_add(&pool->cached_bytes, hdr->size, __ATOMIC_RELAXED);
+    else
+        free(hdr);
+}
+
+void cmd_buffer_pool_get_stats(struct cmd_buffer_pool *pool, struct cmd_buffer_pool_stats *stats)
+{
+    stats->allocs = __atomic_load_n(&pool->allocs, __ATOMIC_RELAXED);
+    stats->hits = __atomic_load_n(&pool->hits, __ATOMIC_RELAXED);
+    stats->oversized = __atomic_load_n(&pool->oversized, __ATOMIC_RELAXED);
+    stats->in_use_bytes = __atomic_load_n(&pool->in_use_bytes, __ATOMIC_RELAXED);
+    stats->cached_bytes = __atomic_load_n(&pool->cached_bytes, __ATOMIC_RELAXED);
+    stats->peak_bytes = __atomic_load_n(&pool->peak_bytes, __ATOMIC_RELAXED);
+}
+
+void cmd_buffer_pool_print_stats(struct cmd_buffer_pool *pool, const char *name, FILE *stream)
+{
+    struct cmd_buffer_pool_stats stats;
+
+    cmd_buffer_pool_get_stats(pool, &stats);
+    fprintf(stream, "[%s] command buffers: %lu allocs, %.1f%% hit rate, %lu oversized, "
+            "peak %lu KB, cached %lu KB, in use %lu KB\n",
+            name, stats.allocs,
+            stats.allocs ? 100.0 * stats.hits / stats.allocs : 0.0,
+            stats.oversized, stats.peak_bytes >> 10, stats.cached_bytes >> 10,
+            stats.in_use_bytes >> 10);
+}
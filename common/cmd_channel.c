@@ -1,6 +1,9 @@
 #include "common/cmd_channel_impl.h"
 #include "common/endpoint_lib.h"
 
+#include <stdlib.h>
+#include <string.h>
+
 int nw_worker_id = 0;
 int nw_global_vm_id = 1;
 
@@ -41,6 +44,26 @@ void * command_channel_get_data_region(const struct command_channel *chan, const
   return ((struct command_channel_base*)chan)->vtable->command_channel_get_data_region(chan, cmd);
 }
 
+void command_channel_read_buffer(struct command_channel* chan, const struct command_base* cmd, const void* buffer_id,
+                                 size_t size, command_channel_chunk_fn fn, void* arg) {
+  struct command_channel_vtable *vtable = ((struct command_channel_base*)chan)->vtable;
+  if (vtable->command_channel_read_buffer) {
+    vtable->command_channel_read_buffer(chan, cmd, (void *) buffer_id, size, fn, arg);
+    return;
+  }
+  fn(arg, command_channel_get_buffer(chan, cmd, buffer_id), 0, size);
+}
+
+void command_channel_copy_buffer(struct command_channel* chan, const struct command_base* cmd, const void* buffer_id,
+                                 void* dest, size_t size) {
+  struct command_channel_vtable *vtable = ((struct command_channel_base*)chan)->vtable;
+  if (vtable->command_channel_read_buffer) {
+    vtable->command_channel_read_buffer(chan, cmd, (void *) buffer_id, size, NULL, dest);
+    return;
+  }
+  memcpy(dest, command_channel_get_buffer(chan, cmd, buffer_id), size);
+}
+
 void command_channel_free_command(struct command_channel* chan, struct command_base* cmd) {
   return ((struct command_channel_base*)chan)->vtable->command_channel_free_command(chan, cmd);
 }
@@ -53,3 +76,38 @@ void command_channel_print_command(const struct command_channel *chan, const str
 void command_channel_simple_print_command(const struct command_channel *chan, const struct command_base *cmd) {
   DEBUG_PRINT_COMMAND(chan, cmd);
 }
+
+int command_channel_stats_enabled(void) {
+  const char *env = getenv("AVA_CHANNEL_STATS");
+  return env && strcmp(env, "0") && strcmp(env, "FALSE");
+}
+
+int command_channel_parse_cores(const char *list, cpu_set_t *set) {
+  const char *p = list;
+  int count = 0;
+
+  CPU_ZERO(set);
+  while (*p) {
+    char *end;
+    long first = strtol(p, &end, 10);
+    long last = first;
+    if (end == p || first < 0)
+      return -1;
+    if (*end == '-') {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+      if (end == p || last < first)
+        return -1;
+    }
+    for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+      CPU_SET(cpu, set);
+      count++;
+    }
+    p = end;
+    if (*p == ',')
+      p++;
+    else if (*p)
+      return -1;
+  }
+  return count;
+}
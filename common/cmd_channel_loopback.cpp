@@ -0,0 +1,388 @@
+#include <assert.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <deque>
+
+#include "common/cmd_buffer_pool.h"
+#include "common/cmd_channel_impl.h"
+#include "common/cmd_handler.h"
+#include "common/debug.h"
+#include "common/devconf.h"
+#include "guest_config.h"
+
+extern int nw_global_vm_id;
+
+/**
+ * In-process loopback channel.
+ *
+ * The guestlib and the API server run in the same process, so a command
+ * costs only its marshalling, dispatch and unmarshalling. Both ends share a
+ * pair of queues. A command is built in one heap buffer, the command struct
+ * followed by its data region, and sending it hands the pointer to the
+ * peer's queue. The receiver spins on its queue for a while before it
+ * sleeps on a condition variable, unless the process has a single CPU.
+ *
+ * The guestlib loads the API server from `local_worker`, the library build
+ * of the generated worker, with `dlmopen` into a new link-map namespace.
+ * The API server there resolves the API to the real library and not to the
+ * guestlib, which usually takes the library's name.
+ */
+
+namespace {
+
+extern struct command_channel_vtable command_channel_loopback_vtable;
+
+struct loopback_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t nonempty;
+    std::deque<struct command_base *> commands;
+    std::atomic<size_t> size;
+    int sleepers;
+};
+
+/* Shared by both ends, freed with the last of them */
+struct loopback_link {
+    struct loopback_queue queues[2];  /* [0]: guestlib to API server, [1]: API server to guestlib */
+    std::atomic<int> refs;
+};
+
+struct loopback_command_private {
+    uint64_t cur_offset;
+};
+
+struct command_channel_loopback {
+    struct command_channel_base base;
+    int is_worker;
+    uint8_t vm_id;
+    uint8_t init_command_type;
+    int accepted;           /* the API server end has taken the initialization command */
+
+    struct loopback_link *link;
+    struct loopback_queue *tx;
+    struct loopback_queue *rx;
+    int spin_count;         /* polls of an empty queue before sleeping, 0 on a single CPU */
+
+    /* Recycled buffers for commands built at this end */
+    struct cmd_buffer_pool *cmd_pool;
+
+    /* Statistics */
+    uint64_t sent_commands;
+    uint64_t sent_bytes;
+    uint64_t sleeps;        /* times the receiver blocked on an empty queue */
+};
+
+static inline struct loopback_command_private *loopback_private(const struct command_base *cmd)
+{
+    static_assert(sizeof(struct loopback_command_private) <= sizeof(cmd->reserved_area),
+                  "command_base::reserved_area is not large enough.");
+    return (struct loopback_command_private *)cmd->reserved_area;
+}
+
+static inline void loopback_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static void loopback_push(struct loopback_queue *queue, struct command_base *cmd)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->commands.push_back(cmd);
+    queue->size.store(queue->commands.size(), std::memory_order_release);
+    if (queue->sleepers)
+        pthread_cond_signal(&queue->nonempty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static struct command_base *loopback_pop(struct command_channel_loopback *chan)
+{
+    struct loopback_queue *queue = chan->rx;
+
+    for (int i = 0; i < chan->spin_count && !queue->size.load(std::memory_order_acquire); i++)
+        loopback_cpu_relax();
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->commands.empty()) {
+        queue->sleepers++;
+        chan->sleeps++;
+        pthread_cond_wait(&queue->nonempty, &queue->lock);
+        queue->sleepers--;
+    }
+    struct command_base *cmd = queue->commands.front();
+    queue->commands.pop_front();
+    queue->size.store(queue->commands.size(), std::memory_order_release);
+    pthread_mutex_unlock(&queue->lock);
+    return cmd;
+}
+
+/**
+ * Print a command for debugging.
+ */
+void command_channel_loopback_print_command(const struct command_channel *chan, const struct command_base *cmd)
+{
+    DEBUG_PRINT_COMMAND(chan, cmd);
+}
+
+/**
+ * Free this end of the channel. Commands still queued for it are
+ * dropped.
+ */
+void command_channel_loopback_free(struct command_channel *c)
+{
+    struct command_channel_loopback *chan = (struct command_channel_loopback *)c;
+    const char *name = chan->is_worker ? "loopback worker" : "loopback";
+
+    if (command_channel_stats_enabled()) {
+        cmd_buffer_pool_print_stats(chan->cmd_pool, name, stderr);
+        fprintf(stderr, "[%s] %lu commands sent, %lu KB of data regions; %lu sleeps\n",
+                name, chan->sent_commands, chan->sent_bytes >> 10, chan->sleeps);
+    }
+
+    pthread_mutex_lock(&chan->rx->lock);
+    for (struct command_base *cmd : chan->rx->commands)
+        cmd_buffer_pool_release(cmd);
+    chan->rx->commands.clear();
+    chan->rx->size.store(0);
+    pthread_mutex_unlock(&chan->rx->lock);
+
+    if (chan->link->refs.fetch_sub(1) == 1) {
+        for (int i = 0; i < 2; i++) {
+            pthread_mutex_destroy(&chan->link->queues[i].lock);
+            pthread_cond_destroy(&chan->link->queues[i].nonempty);
+        }
+        delete chan->link;
+    }
+    cmd_buffer_pool_free(chan->cmd_pool);
+    free(chan);
+}
+
+//! Sending
+
+/**
+ * Compute the buffer size that will actually be used for a buffer of
+ * `size`. Buffers are packed without padding.
+ */
+size_t command_channel_loopback_buffer_size(const struct command_channel *c, size_t size)
+{
+    return size;
+}
+
+/**
+ * Allocate a new command struct with size `command_struct_size` and
+ * a data region of size `data_region_size`, in a single buffer.
+ */
+struct command_base *command_channel_loopback_new_command(struct command_channel *c, size_t command_struct_size,
+                                                          size_t data_region_size)
+{
+    struct command_channel_loopback *chan = (struct command_channel_loopback *)c;
+    struct command_base *cmd =
+        (struct command_base *)cmd_buffer_pool_alloc(chan->cmd_pool, command_struct_size + data_region_size);
+
+    memset(cmd, 0, command_struct_size);
+    cmd->vm_id = chan->vm_id;
+    cmd->command_size = command_struct_size;
+    cmd->data_region = (void *)command_struct_size;
+    cmd->region_size = data_region_size;
+    loopback_private(cmd)->cur_offset = command_struct_size;
+
+    return cmd;
+}
+
+/**
+ * Attach a buffer to a command and return a location independent
+ * buffer ID. The buffer is copied into the command's data region
+ * immediately.
+ */
+void *command_channel_loopback_attach_buffer(struct command_channel *c, struct command_base *cmd, void *buffer,
+                                             size_t size)
+{
+    assert(buffer && size != 0);
+
+    struct loopback_command_private *priv = loopback_private(cmd);
+    void *offset = (void *)priv->cur_offset;
+    void *dst = (void *)((uintptr_t)cmd + priv->cur_offset);
+    priv->cur_offset += size;
+    assert(priv->cur_offset <= cmd->command_size + cmd->region_size);
+    memcpy(dst, buffer, size);
+    return offset;
+}
+
+/**
+ * Send the message and all its attached buffers. The command is handed
+ * to the peer, which frees it.
+ *
+ * This call is asynchronous and does not block for the command to
+ * complete execution.
+ */
+void command_channel_loopback_send_command(struct command_channel *c, struct command_base *cmd)
+{
+    struct command_channel_loopback *chan = (struct command_channel_loopback *)c;
+    cmd->command_type = NW_NEW_INVOCATION;
+
+    __atomic_fetch_add(&chan->sent_commands, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&chan->sent_bytes, cmd->region_size, __ATOMIC_RELAXED);
+    loopback_push(chan->tx, cmd);
+}
+
+void command_channel_loopback_transfer_command(struct command_channel *c, const struct command_channel *source,
+                                               const struct command_base *cmd)
+{
+    struct command_base *new_cmd = command_channel_loopback_new_command(c, cmd->command_size, cmd->region_size);
+    memcpy((void *)new_cmd, cmd, cmd->command_size);
+    memcpy((char *)new_cmd + cmd->command_size, command_channel_get_data_region(source, cmd), cmd->region_size);
+    new_cmd->data_region = (void *)cmd->command_size;
+    loopback_private(new_cmd)->cur_offset = cmd->command_size + cmd->region_size;
+    command_channel_loopback_send_command(c, new_cmd);
+}
+
+//! Receiving
+
+/**
+ * Receive a command from a channel. The returned Command pointer
+ * should be interpreted based on its `command_id` field.
+ *
+ * This call blocks waiting for a command to be sent along this
+ * channel.
+ */
+struct command_base *command_channel_loopback_receive_command(struct command_channel *c)
+{
+    struct command_channel_loopback *chan = (struct command_channel_loopback *)c;
+    struct command_base *cmd = loopback_pop(chan);
+
+    /* The other API server channels take the initialization command when
+     * they accept the guestlib */
+    if (chan->is_worker && !chan->accepted) {
+        struct command_handler_initialize_api_command *init_msg =
+            (struct command_handler_initialize_api_command *)cmd;
+        chan->init_command_type = init_msg->new_api_id;
+        chan->vm_id = init_msg->base.vm_id;
+        chan->accepted = 1;
+        cmd_buffer_pool_release(cmd);
+        fprintf(stderr, "[loopback] Accept guestlib with API_ID=%x\n", chan->init_command_type);
+        cmd = loopback_pop(chan);
+    }
+
+    command_channel_loopback_print_command(c, cmd);
+    return cmd;
+}
+
+/**
+ * Translate a buffer_id (as returned by
+ * `command_channel_attach_buffer` in the sender) into a data pointer.
+ * The returned pointer will be valid until
+ * `command_channel_free_command` is called on `cmd`.
+ */
+void *command_channel_loopback_get_buffer(const struct command_channel *chan, const struct command_base *cmd,
+                                          void *buffer_id)
+{
+    if (!buffer_id)
+        return NULL;
+    return (void *)((uintptr_t)cmd + (uintptr_t)buffer_id);
+}
+
+/**
+ * Returns the pointer to data region. The returned pointer is mainly
+ * used for data extraction for migration.
+ */
+void *command_channel_loopback_get_data_region(const struct command_channel *c, const struct command_base *cmd)
+{
+    return (void *)((uintptr_t)cmd + cmd->command_size);
+}
+
+/**
+ * Free a command returned by `command_channel_receive_command`. It goes
+ * back to the pool of the end that built it.
+ */
+void command_channel_loopback_free_command(struct command_channel *c, struct command_base *cmd)
+{
+    cmd_buffer_pool_release(cmd);
+}
+
+static struct command_channel_loopback *command_channel_loopback_alloc(struct loopback_link *link, int is_worker)
+{
+    struct command_channel_loopback *chan =
+        (struct command_channel_loopback *)malloc(sizeof(struct command_channel_loopback));
+    memset((void *)chan, 0, sizeof(struct command_channel_loopback));
+    command_channel_preinitialize((struct command_channel *)chan, &command_channel_loopback_vtable);
+    chan->is_worker = is_worker;
+    chan->link = link;
+    chan->tx = &link->queues[is_worker ? 1 : 0];
+    chan->rx = &link->queues[is_worker ? 0 : 1];
+    chan->cmd_pool = cmd_buffer_pool_new();
+    chan->spin_count = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? AVA_LOOPBACK_SPIN_COUNT : 0;
+    return chan;
+}
+
+}  // namespace
+
+/**
+ * Create both ends of a loopback channel.
+ * @worker_end: set to the API server end
+ * @return The guestlib end.
+ */
+struct command_channel *command_channel_loopback_new(struct command_channel **worker_end)
+{
+    struct loopback_link *link = new loopback_link;
+    for (int i = 0; i < 2; i++) {
+        pthread_mutex_init(&link->queues[i].lock, NULL);
+        pthread_cond_init(&link->queues[i].nonempty, NULL);
+        link->queues[i].size.store(0);
+        link->queues[i].sleepers = 0;
+    }
+    link->refs.store(2);
+
+    *worker_end = (struct command_channel *)command_channel_loopback_alloc(link, 1);
+    return (struct command_channel *)command_channel_loopback_alloc(link, 0);
+}
+
+/**
+ * Loopback channel guestlib endpoint. Loads the API server library named
+ * by `local_worker` and starts it on the other end.
+ */
+struct command_channel *command_channel_loopback_guest_new(void)
+{
+    const char *path = guestconfig::config->local_worker_.c_str();
+    void *worker = dlmopen(LM_ID_NEWLM, path, RTLD_NOW | RTLD_LOCAL);
+    if (!worker) {
+        fprintf(stderr, "Failed to load the API server library %s: %s\n", path, dlerror());
+        return NULL;
+    }
+    auto start = (void (*)(struct command_channel *))dlsym(worker, "nw_worker_start_local");
+    if (!start) {
+        fprintf(stderr, "%s is not an API server library: %s\n", path, dlerror());
+        dlclose(worker);
+        return NULL;
+    }
+
+    struct command_channel *worker_end;
+    struct command_channel_loopback *chan =
+        (struct command_channel_loopback *)command_channel_loopback_new(&worker_end);
+    chan->vm_id = nw_global_vm_id = 1;
+    start(worker_end);
+    fprintf(stderr, "Started API server %s in process\n", path);
+
+    return (struct command_channel *)chan;
+}
+
+namespace {
+  struct command_channel_vtable command_channel_loopback_vtable = {
+    command_channel_loopback_buffer_size,
+    command_channel_loopback_new_command,
+    command_channel_loopback_attach_buffer,
+    command_channel_loopback_send_command,
+    command_channel_loopback_transfer_command,
+    command_channel_loopback_receive_command,
+    command_channel_loopback_get_buffer,
+    command_channel_loopback_get_data_region,
+    command_channel_loopback_free_command,
+    command_channel_loopback_free,
+    command_channel_loopback_print_command
+  };
+};
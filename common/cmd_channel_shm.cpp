@@ -0,0 +1,858 @@
+#include "common/cmd_buffer_pool.h"
+#include "common/cmd_channel_impl.h"
+#include "common/cmd_copy.h"
+#include "common/cmd_param_block.h"
+#include "common/cmd_wire.h"
+#include "common/debug.h"
+#include "common/devconf.h"
+#include "common/guest_mem.h"
+#include "common/ioctl.h"
+#include "common/socket.h"
+#include "common/cmd_handler.h"
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/vm_sockets.h>
+#include <sys/types.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+
+#include "guest_config.h"
+
+/**
+ * Shared memory channel between a guestlib in a VM and its API server.
+ *
+ * Data regions are placed in the VM's parameter block, a window of the
+ * BAR that the API server maps from the host: the guestlib allocates in
+ * the first half of the data area and the API server in the second half.
+ * The command structs are sent over vsock, the "doorbell".
+ *
+ * With the guestlib's `shm_doorbell = "poll"`, command structs are also
+ * published in descriptor rings at the start of the parameter block. The
+ * receiver polls its ring for `shm_poll_spin` microseconds before it goes
+ * to sleep on the vsock socket, and the sender only rings the vsock
+ * doorbell when the receiver sleeps. Polling threads can be pinned to the
+ * cores in `shm_poll_cores`. Commands in the rings carry the compact
+ * header of cmd_wire.h in place of their `command_base`.
+ *
+ * The first command from the guestlib tells the API server where the
+ * parameter block is, so it always goes over vsock.
+ */
+
+extern int nw_global_vm_id;
+
+namespace {
+  extern struct command_channel_vtable command_channel_shm_vtable;
+}
+
+constexpr uint32_t kShmDoorbellMagic = 0x42445641;  // "AVDB"
+
+enum shm_doorbell_mode : uint32_t {
+    SHM_DOORBELL_VSOCK = 0,
+    SHM_DOORBELL_POLL,
+};
+
+/**
+ * One direction of the descriptor rings. `head` is only written by the
+ * sender and `tail` by the receiver, which sets `sleeping` before it
+ * blocks on vsock.
+ */
+struct shm_desc_ring {
+    alignas(64) uint64_t head;
+    alignas(64) uint64_t tail;
+    alignas(64) uint32_t sleeping;
+};
+
+/**
+ * Written by the guestlib at the start of the parameter block before it
+ * sends the first command.
+ */
+struct shm_doorbell_control {
+    uint32_t magic;
+    uint32_t mode;
+    uint64_t ring_size;
+    uint32_t wire_version;          /* command header encoding in the rings (COMMAND_WIRE_*) */
+    struct shm_desc_ring rings[2];  /* [0]: guestlib to worker, [1]: worker to guestlib */
+};
+
+static_assert(sizeof(struct shm_doorbell_control) <= AVA_SHM_DOORBELL_CONTROL_SIZE,
+              "AVA_SHM_DOORBELL_CONTROL_SIZE is too small.");
+
+/* Descriptor record, followed by the command header and the rest of the command struct */
+struct shm_desc_record {
+    uint64_t size;      /* record size including this header, 0 for padding to the end of the ring */
+    uint64_t padding[7];
+};
+
+struct command_channel_shm {
+    struct command_channel_base base;
+    int is_worker;
+    int sock_fd;        /* vsock connection to the peer */
+    int listen_fd;
+    int shm_fd;
+
+    struct pollfd pfd;
+    void *shm_addr;
+    size_t shm_size;
+    struct param_block param_block;
+
+    int vm_id;
+    int listen_port;
+    uint8_t init_command_type;
+
+    /* Channel locks */
+    pthread_mutex_t send_mutex;
+    pthread_mutex_t recv_mutex;
+
+    /* Recycled buffers for command structs */
+    struct cmd_buffer_pool *cmd_pool;
+
+    /* Data regions of sent commands, in this end's half of the parameter block */
+    struct cmd_param_block *param_alloc;
+
+    /* Polling doorbell; `tx` and `rx` are NULL in vsock mode */
+    struct shm_doorbell_control *control;
+    struct shm_desc_ring *tx;
+    struct shm_desc_ring *rx;
+    char *tx_data;
+    char *rx_data;
+    int handshake_sent;     /* the guestlib's first command went over vsock */
+    uint64_t spin_ns;       /* configured spin limit */
+    uint64_t spin_window;   /* current spin, adapted to how often spinning pays off */
+    cpu_set_t poll_cores;
+    int pin_poll_thread;
+    int wire_version;       /* encoding of command headers in the rings */
+
+    /* Statistics */
+    uint64_t ring_commands;
+    uint64_t doorbells;     /* wakeups sent over vsock */
+    uint64_t sleeps;        /* times the receiver blocked on vsock */
+    uint64_t recv_polls;    /* commands found while polling */
+    struct command_wire_stats wire_stats;
+};
+
+struct param_block_info nw_global_pb_info = {0, 0};
+
+static inline uint64_t shm_doorbell_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void shm_doorbell_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+/**
+ * Lay out the descriptor rings at the start of the parameter block and
+ * switch the channel to polling.
+ */
+static void shm_doorbell_enable(struct command_channel_shm *chan, uint64_t spin_us, const char *cores)
+{
+    char *base = (char *)chan->param_block.base;
+    struct shm_doorbell_control *control = (struct shm_doorbell_control *)base;
+
+    chan->control = control;
+    chan->tx = &control->rings[chan->is_worker ? 1 : 0];
+    chan->rx = &control->rings[chan->is_worker ? 0 : 1];
+    chan->tx_data = base + AVA_SHM_DOORBELL_CONTROL_SIZE + (chan->is_worker ? control->ring_size : 0);
+    chan->rx_data = base + AVA_SHM_DOORBELL_CONTROL_SIZE + (chan->is_worker ? 0 : control->ring_size);
+    chan->spin_ns = chan->spin_window = spin_us * 1000;
+    chan->wire_version = control->wire_version;
+
+    if (cores && cores[0]) {
+        if (command_channel_parse_cores(cores, &chan->poll_cores) > 0)
+            chan->pin_poll_thread = 1;
+        else
+            fprintf(stderr, "Ignore malformed SHM polling cores \"%s\"\n", cores);
+    }
+}
+
+/**
+ * Terminate the process when the peer has closed the vsock connection.
+ */
+static void command_channel_shm_peer_shutdown(struct command_channel_shm *chan)
+{
+    if (chan->is_worker) {
+        /* terminate worker when guestlib exits */
+        fprintf(stderr, "[worker#%d] guestlib shutdown\n", chan->listen_port);
+        close(chan->pfd.fd);
+        exit(-1);
+    }
+    /* terminate guestlib when worker exits */
+    DEBUG_PRINT("worker shutdown\n");
+    close(chan->pfd.fd);
+    exit(0);
+}
+
+/**
+ * Print a command for debugging.
+ */
+static void command_channel_shm_print_command(const struct command_channel *chan, const struct command_base *cmd)
+{
+    DEBUG_PRINT("struct command_base {\n"
+                "  command_type=%ld\n"
+                "  vm_id=%d\n"
+                "  flags=%d\n"
+                "  api_id=%d\n"
+                "  command_id=%ld\n"
+                "  command_size=%lx\n"
+                "  region_size=%lx\n"
+                "}\n",
+                cmd->command_type,
+                cmd->vm_id,
+                cmd->flags,
+                cmd->api_id,
+                cmd->command_id,
+                cmd->command_size,
+                cmd->region_size);
+    DEBUG_PRINT_COMMAND(chan, cmd);
+}
+
+//! Sending
+
+/**
+ * Compute the buffer size that will actually be used for a buffer of
+ * `size`. The returned value may be larger than `size`.
+ */
+static size_t command_channel_shm_buffer_size(const struct command_channel *chan, size_t size)
+{
+    // Round up to a cache line, so as to maintain the alignment of buffers
+    // when they are concatenated into the data region.
+    return cmd_param_block_align(size);
+}
+
+/**
+ * Allocate a new command struct with size `command_struct_size` and
+ * a (potientially imaginary) data region of size `data_region_size`.
+ *
+ * `data_region_size` should be computed by adding up the result of
+ * calls to `command_channel_buffer_size` on the same channel.
+ */
+static struct command_base* command_channel_shm_new_command(struct command_channel* c, size_t command_struct_size, size_t data_region_size)
+{
+    struct command_channel_shm* chan = (struct command_channel_shm *)c;
+    struct command_base *cmd = (struct command_base *)cmd_buffer_pool_alloc(chan->cmd_pool, command_struct_size);
+    static_assert(sizeof(struct block_seeker) <= sizeof(cmd->reserved_area),
+                  "command_base::reserved_area is not large enough.");
+    struct block_seeker *seeker = (struct block_seeker *)cmd->reserved_area;
+
+    memset(cmd, 0, command_struct_size);
+    cmd->command_size = command_struct_size;
+    if (data_region_size) {
+        /* The region header also keeps buffer IDs from being zero */
+        data_region_size = CMD_PARAM_BLOCK_HEADER_SIZE + cmd_param_block_align(data_region_size);
+        seeker->local_offset = cmd_param_block_reserve(chan->param_alloc, data_region_size);
+        seeker->cur_offset = seeker->local_offset + CMD_PARAM_BLOCK_HEADER_SIZE;
+        // TODO: Should the worker's data_region also have `+ chan->param_block.offset`
+        cmd->data_region = (void *)(seeker->local_offset + (chan->is_worker ? 0 : chan->param_block.offset));
+    }
+    cmd->region_size = data_region_size;
+    cmd->vm_id = chan->vm_id;
+
+    return cmd;
+}
+
+/**
+ * Attach a buffer to a command and return a location independent
+ * buffer ID. `buffer` must be valid until after the call to
+ * `command_channel_send_command`.
+ *
+ * The combined attached buffers must fit within the initially
+ * provided `data_region_size` (to `command_channel_new_command`).
+ */
+static void* command_channel_shm_attach_buffer(struct command_channel* c, struct command_base* cmd, void* buffer, size_t size)
+{
+    assert(buffer && size != 0);
+
+    struct command_channel_shm* chan = (struct command_channel_shm *)c;
+    struct block_seeker *seeker = (struct block_seeker *)cmd->reserved_area;
+    void *offset = (void *)(seeker->cur_offset - seeker->local_offset);
+    seeker->cur_offset += cmd_param_block_align(size);
+    assert(seeker->cur_offset <= seeker->local_offset + cmd->region_size);
+    void *dst = (void *)((uintptr_t)chan->param_block.base + seeker->local_offset + (uintptr_t)offset);
+    cmd_copy(dst, buffer, size, CMD_COPY_SHARED);
+
+    return offset;
+}
+
+/**
+ * Publish a command struct in the transmit ring, and ring the vsock
+ * doorbell if the receiver sleeps. The caller holds `send_mutex`.
+ */
+static void shm_doorbell_send(struct command_channel_shm *chan, struct command_base *cmd)
+{
+    struct shm_desc_ring *ring = chan->tx;
+    const uint64_t ring_size = chan->control->ring_size;
+    uint8_t header[COMMAND_WIRE_HEADER_MAX + sizeof(struct block_seeker)];
+    const char *body = (const char *)cmd;
+    size_t header_size = 0;
+    size_t body_size = cmd->command_size;
+
+    /* The receiver finds the data region at `local_offset` */
+    if (chan->wire_version != COMMAND_WIRE_VERBATIM) {
+        header_size = command_wire_encode(cmd, cmd->region_size ? offsetof(struct block_seeker, cur_offset) : 0,
+                                          header);
+        body += sizeof(struct command_base);
+        body_size -= sizeof(struct command_base);
+    }
+    const uint64_t need = sizeof(struct shm_desc_record) + cmd_param_block_align(header_size + body_size);
+    uint64_t head = ring->head;
+    uint64_t pad = (head % ring_size) + need > ring_size ? ring_size - head % ring_size : 0;
+
+    if (need > ring_size / 4) {
+        fprintf(stderr, "Command struct of %ld bytes does not fit in the SHM descriptor ring\n", cmd->command_size);
+        exit(-1);
+    }
+    /* The receiver copies commands out right away, so this rarely waits */
+    while (head + pad + need - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > ring_size)
+        sched_yield();
+
+    if (pad) {
+        ((struct shm_desc_record *)(chan->tx_data + head % ring_size))->size = 0;
+        head += pad;
+    }
+    struct shm_desc_record *record = (struct shm_desc_record *)(chan->tx_data + head % ring_size);
+    record->size = need;
+    memcpy(record + 1, header, header_size);
+    memcpy((char *)(record + 1) + header_size, body, body_size);
+    __atomic_store_n(&ring->head, head + need, __ATOMIC_SEQ_CST);
+    chan->ring_commands++;
+    chan->wire_stats.commands++;
+    chan->wire_stats.header_bytes += header_size ? header_size : sizeof(struct command_base);
+    chan->wire_stats.bytes += header_size + body_size;
+
+    /* Pairs with the receiver setting `sleeping` before checking `head` */
+    if (__atomic_load_n(&ring->sleeping, __ATOMIC_SEQ_CST)) {
+        char bell = 0;
+        send_socket(chan->sock_fd, &bell, 1);
+        chan->doorbells++;
+    }
+}
+
+/**
+ * Send the message and all its attached buffers.
+ *
+ * This call is asynchronous and does not block for the command to
+ * complete execution.
+ */
+static void command_channel_shm_send_command(struct command_channel* c, struct command_base* cmd)
+{
+    struct command_channel_shm * chan = (struct command_channel_shm *)c;
+
+    if (!chan->is_worker)
+        cmd->command_type = NW_NEW_INVOCATION;
+    else {
+        DEBUG_PRINT("[worker#%d] send message to guestlib\n", chan->listen_port);
+        command_channel_shm_print_command(c, cmd);
+    }
+
+    /* vsock interposition does not block send_message */
+    pthread_mutex_lock(&chan->send_mutex);
+    if (chan->tx && (chan->is_worker || chan->handshake_sent))
+        shm_doorbell_send(chan, cmd);
+    else
+        send_socket(chan->sock_fd, cmd, cmd->command_size);
+    chan->handshake_sent = 1;
+    pthread_mutex_unlock(&chan->send_mutex);
+
+    // Free local copy of command struct
+    cmd_buffer_pool_release(cmd);
+}
+
+static void command_channel_shm_transfer_command(struct command_channel* c, const struct command_channel *source,
+                                                 const struct command_base *cmd)
+{
+    /* `region_size` already counts the region header, which new_command adds again */
+    const size_t buffers_size = cmd->region_size > CMD_PARAM_BLOCK_HEADER_SIZE ?
+                                cmd->region_size - CMD_PARAM_BLOCK_HEADER_SIZE : 0;
+    struct command_base *new_cmd = command_channel_new_command(c, cmd->command_size, buffers_size);
+    new_cmd->api_id = cmd->api_id;
+    new_cmd->command_id = cmd->command_id;
+    new_cmd->command_type = cmd->command_type;
+    new_cmd->flags = cmd->flags;
+    new_cmd->vm_id = cmd->vm_id;
+
+    // This call relies on the fact that command_channel_shm_attach_buffer with
+    // one large buffer is identical to several calls with smaller buffers.
+    // Only the buffers after the source's region header are copied, so they
+    // land after the new header and the buffer IDs in `cmd` stay valid.
+    if (buffers_size) {
+        char *cmd_data_region = (char *)command_channel_get_data_region(source, cmd);
+        command_channel_attach_buffer(c, new_cmd, cmd_data_region + CMD_PARAM_BLOCK_HEADER_SIZE, buffers_size);
+    }
+    command_channel_send_command(c, new_cmd);
+}
+
+//! Receiving
+
+/**
+ * Take the next command struct out of the receive ring, or return NULL if
+ * the ring is empty. The caller holds `recv_mutex`.
+ */
+static struct command_base *shm_doorbell_try_receive(struct command_channel_shm *chan)
+{
+    struct shm_desc_ring *ring = chan->rx;
+    const uint64_t ring_size = chan->control->ring_size;
+    uint64_t tail = ring->tail;
+
+    if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail)
+        return NULL;
+
+    struct shm_desc_record *record = (struct shm_desc_record *)(chan->rx_data + tail % ring_size);
+    if (record->size == 0) {
+        tail += ring_size - tail % ring_size;
+        record = (struct shm_desc_record *)(chan->rx_data);
+    }
+    const char *payload = (const char *)(record + 1);
+    const size_t payload_size = record->size - sizeof(struct shm_desc_record);
+    struct command_base *cmd;
+    if (chan->wire_version == COMMAND_WIRE_VERBATIM) {
+        const struct command_base *src = (const struct command_base *)payload;
+        cmd = (struct command_base *)cmd_buffer_pool_alloc(chan->cmd_pool, src->command_size);
+        memcpy(cmd, src, src->command_size);
+    }
+    else {
+        struct command_base cmd_base;
+        size_t header_size = command_wire_decode(payload, payload_size, &cmd_base);
+        size_t body_size = cmd_base.command_size - sizeof(struct command_base);
+        if (!header_size || header_size + body_size > payload_size) {
+            fprintf(stderr, "Corrupt command in the SHM descriptor ring\n");
+            exit(-1);
+        }
+        cmd = (struct command_base *)cmd_buffer_pool_alloc(chan->cmd_pool, cmd_base.command_size);
+        memcpy(cmd, &cmd_base, sizeof(struct command_base));
+        memcpy(cmd + 1, payload + header_size, body_size);
+    }
+    __atomic_store_n(&ring->tail, tail + record->size, __ATOMIC_RELEASE);
+    return cmd;
+}
+
+/**
+ * Wait for the next command in the receive ring: spin for up to `spin_ns`,
+ * then sleep on the vsock socket until the sender rings the doorbell. The
+ * spin window halves whenever it ends in sleep, down to 1/AVA_SHM_POLL_SPIN_MIN_DIV
+ * of `spin_ns`, and grows back whenever a command arrives after the first
+ * poll, so that an idle or oversubscribed receiver does not burn its core
+ * but polling resumes once commands come in quick succession again.
+ */
+static struct command_base *shm_doorbell_receive(struct command_channel_shm *chan)
+{
+    struct command_base *cmd;
+    char bells[64];
+
+    if (chan->pin_poll_thread) {
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &chan->poll_cores);
+        chan->pin_poll_thread = 0;
+    }
+
+    for (;;) {
+        uint64_t start = shm_doorbell_now();
+        int spun = 0;
+        do {
+            for (int i = 0; i < 64; i++, spun = 1) {
+                if ((cmd = shm_doorbell_try_receive(chan))) {
+                    chan->recv_polls++;
+                    if (spun)
+                        chan->spin_window = std::min(chan->spin_ns, 2 * chan->spin_window + 1000);
+                    return cmd;
+                }
+                shm_doorbell_cpu_relax();
+            }
+        } while (shm_doorbell_now() - start < chan->spin_window);
+        chan->spin_window = std::max(chan->spin_window / 2, chan->spin_ns / AVA_SHM_POLL_SPIN_MIN_DIV);
+
+        __atomic_store_n(&chan->rx->sleeping, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&chan->rx->head, __ATOMIC_SEQ_CST) == chan->rx->tail) {
+            chan->sleeps++;
+            if (poll(&chan->pfd, 1, -1) < 0) {
+                fprintf(stderr, "failed to poll\n");
+                exit(-1);
+            }
+            if (chan->pfd.revents & POLLRDHUP)
+                command_channel_shm_peer_shutdown(chan);
+            /* Drain the doorbells; one wakeup covers all of them */
+            while (recv(chan->sock_fd, bells, sizeof(bells), MSG_DONTWAIT) > 0)
+                ;
+        }
+        __atomic_store_n(&chan->rx->sleeping, 0, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Receive a command from a channel. The returned Command pointer
+ * should be interpreted based on its `command_id` field.
+ *
+ * This call blocks waiting for a command to be sent along this
+ * channel.
+ */
+static struct command_base* command_channel_shm_receive_command(struct command_channel* c)
+{
+    struct command_channel_shm *chan = (struct command_channel_shm *)c;
+    struct command_base cmd_base;
+    struct command_base *cmd;
+    ssize_t ret;
+
+    if (chan->rx) {
+        pthread_mutex_lock(&chan->recv_mutex);
+        cmd = shm_doorbell_receive(chan);
+        pthread_mutex_unlock(&chan->recv_mutex);
+
+        command_channel_shm_print_command(c, cmd);
+        return cmd;
+    }
+
+    ret = poll(&chan->pfd, 1, -1);
+    if (ret < 0) {
+        fprintf(stderr, "failed to poll\n");
+        exit(chan->is_worker ? -1 : 0);
+    }
+
+    DEBUG_PRINT("revents=%d\n", chan->pfd.revents);
+    if (chan->pfd.revents == 0)
+        return NULL;
+
+    if (chan->pfd.revents & POLLRDHUP)
+        command_channel_shm_peer_shutdown(chan);
+
+    if (chan->pfd.revents & POLLIN) {
+        pthread_mutex_lock(&chan->recv_mutex);
+        memset(&cmd_base, 0, sizeof(struct command_base));
+        recv_socket(chan->sock_fd, &cmd_base, sizeof(struct command_base));
+        cmd = (struct command_base *)cmd_buffer_pool_alloc(chan->cmd_pool, cmd_base.command_size);
+        memcpy(cmd, &cmd_base, sizeof(struct command_base));
+        recv_socket(chan->sock_fd, (uint8_t *)cmd + sizeof(struct command_base),
+                    cmd_base.command_size - sizeof(struct command_base));
+        DEBUG_PRINT("receive new command:\n");
+        pthread_mutex_unlock(&chan->recv_mutex);
+
+        command_channel_shm_print_command(c, cmd);
+        return cmd;
+    }
+
+    return NULL;
+}
+
+/**
+ * Translate a buffer_id (as returned by
+ * `command_channel_attach_buffer` in the sender) into a data pointer.
+ * The returned pointer will be valid until
+ * `command_channel_free_command` is called on `cmd`.
+ */
+static void * command_channel_shm_get_buffer(const struct command_channel *c, const struct command_base *cmd, void* buffer_id)
+{
+    struct command_channel_shm *chan = (struct command_channel_shm *)c;
+    struct block_seeker *seeker = (struct block_seeker *)cmd->reserved_area;
+    if (buffer_id)
+        return (void *)((uintptr_t)chan->param_block.base + seeker->local_offset + (uintptr_t)buffer_id);
+    else
+        return NULL;
+}
+
+/**
+ * Returns the pointer to data region. The returned pointer is mainly
+ * used for data extraction for migration.
+ */
+static void * command_channel_shm_get_data_region(const struct command_channel *c, const struct command_base *cmd)
+{
+    struct command_channel_shm *chan = (struct command_channel_shm *)c;
+    struct block_seeker *seeker = (struct block_seeker *)cmd->reserved_area;
+    return (void *)((uintptr_t)chan->param_block.base + seeker->local_offset);
+}
+
+/**
+ * Free a command returned by `command_channel_receive_command`. Its data
+ * region is handed back to the sender.
+ */
+static void command_channel_shm_free_command(struct command_channel* c, struct command_base* cmd)
+{
+    struct command_channel_shm *chan = (struct command_channel_shm *)c;
+    struct block_seeker *seeker = (struct block_seeker *)cmd->reserved_area;
+
+    if (cmd->region_size)
+        cmd_param_block_release(chan->param_block.base, seeker->local_offset);
+    cmd_buffer_pool_release(cmd);
+}
+
+static struct command_channel_shm *command_channel_shm_alloc(int is_worker)
+{
+    struct command_channel_shm *chan = (struct command_channel_shm *)calloc(1, sizeof(struct command_channel_shm));
+    command_channel_preinitialize((struct command_channel *)chan, &command_channel_shm_vtable);
+    pthread_mutex_init(&chan->send_mutex, NULL);
+    pthread_mutex_init(&chan->recv_mutex, NULL);
+    chan->cmd_pool = cmd_buffer_pool_new();
+    chan->is_worker = is_worker;
+    return chan;
+}
+
+/**
+ * Split the data area of the parameter block, behind the descriptor
+ * rings, between the two directions.
+ */
+static void command_channel_shm_init_param_alloc(struct command_channel_shm *chan)
+{
+    const size_t area = AVA_SHM_DOORBELL_CONTROL_SIZE + 2 * AVA_SHM_DESC_RING_SIZE;
+    const size_t half = cmd_param_block_align((chan->param_block.size - area) / 2);
+
+    if (chan->is_worker)
+        chan->param_alloc = cmd_param_block_new(chan->param_block.base, area + half,
+                                                chan->param_block.size - area - half);
+    else
+        chan->param_alloc = cmd_param_block_new(chan->param_block.base, area, half);
+}
+
+/**
+ * Initialize a new command channel with vsock as doorbell and shared
+ * memory as data transport.
+ */
+struct command_channel* command_channel_shm_new()
+{
+    struct command_channel_shm *chan = command_channel_shm_alloc(0);
+
+    /* setup shared memory */
+    char dev_filename[32];
+    sprintf(dev_filename, "/dev/%s%d", VGPU_DEV_NAME, VGPU_DRIVER_MINOR);
+
+    chan->shm_fd = open(dev_filename, O_RDWR);
+    if (chan->shm_fd < 0) {
+        fprintf(stderr, "failed to open device %s\n", dev_filename);
+        exit(-1);
+    }
+
+    /* acquire vm id */
+    chan->vm_id = nw_global_vm_id = ioctl(chan->shm_fd, IOCTL_GET_VM_ID);
+    if (chan->vm_id <= 0) {
+        fprintf(stderr, "failed to retrieve vm id: %d\n", chan->vm_id);
+        exit(-1);
+    }
+    fprintf(stderr, "assigned vm_id=%d\n", chan->vm_id);
+
+    chan->param_block.size = AVA_APP_SHM_SIZE_DEFAULT;
+    chan->param_block.offset = ioctl(chan->shm_fd, IOCTL_REQUEST_SHM, chan->param_block.size);
+    chan->param_block.base = mmap(NULL, chan->param_block.size,
+                                  PROT_READ | PROT_WRITE, MAP_SHARED, chan->shm_fd, 0);
+    chan->shm_addr = chan->param_block.base;
+    chan->shm_size = chan->param_block.size;
+    nw_global_pb_info.param_local_offset = chan->param_block.offset;
+    nw_global_pb_info.param_block_size = chan->param_block.size;
+    fprintf(stderr, "param_block size=%lx, offset=%lx, base=%lx\n", chan->param_block.size, chan->param_block.offset, (uintptr_t)chan->param_block.base);
+    command_channel_shm_init_param_alloc(chan);
+
+    /* The API server reads the doorbell mode after the first command */
+    struct shm_doorbell_control *control = (struct shm_doorbell_control *)chan->param_block.base;
+    memset(control, 0, sizeof(struct shm_doorbell_control));
+    control->ring_size = AVA_SHM_DESC_RING_SIZE;
+    if (guestconfig::config->shm_doorbell_ == "poll") {
+        control->mode = SHM_DOORBELL_POLL;
+        control->wire_version = COMMAND_WIRE_VERSION;
+        shm_doorbell_enable(chan, std::max(guestconfig::config->shm_poll_spin_, 0),
+                            guestconfig::config->shm_poll_cores_.c_str());
+    }
+    else if (guestconfig::config->shm_doorbell_ != "vsock") {
+        fprintf(stderr, "Unknown shm_doorbell \"%s\", use vsock\n", guestconfig::config->shm_doorbell_.c_str());
+    }
+    __atomic_store_n(&control->magic, kShmDoorbellMagic, __ATOMIC_RELEASE);
+
+    /**
+     * Get manager's host address from ENV('AVA_MANAGER_ADDR').
+     * The address can either be a full IP:port (e.g. 0.0.0.0:3333),
+     * or only the port (3333), but the IP address is always ignored as
+     * the manager is assumed to be on the local server.
+     */
+    char *manager_full_address;
+    int manager_port;
+    manager_full_address = getenv("AVA_MANAGER_ADDR");
+    assert(manager_full_address != NULL && "AVA_MANAGER_ADDR is not set");
+    parseServerAddress(manager_full_address, NULL, NULL, &manager_port);
+    assert(manager_port > 0 && "Invalid manager port");
+
+    /* connect worker manager and send vm_id, param_block offset (inside
+     * the VM's shared memory region) and param_block size. */
+    struct sockaddr_vm sa;
+    int manager_fd = init_vm_socket(&sa, VMADDR_CID_HOST, manager_port);
+    conn_vm_socket(manager_fd, &sa);
+
+    struct command_base* msg = command_channel_shm_new_command((struct command_channel *)chan, sizeof(struct command_base), 0);
+    msg->command_type = NW_NEW_APPLICATION;
+    struct param_block_info *pb_info = (struct param_block_info *)msg->reserved_area;
+    pb_info->param_local_offset = chan->param_block.offset;
+    pb_info->param_block_size = chan->param_block.size;
+    send_socket(manager_fd, msg, sizeof(struct command_base));
+
+    recv_socket(manager_fd, msg, sizeof(struct command_base));
+    uintptr_t worker_port = *((uintptr_t *)msg->reserved_area);
+    assert(nw_worker_id == 0); // TODO: Move assignment to nw_worker_id out of unrelated constructor.
+    nw_worker_id = worker_port;
+    cmd_buffer_pool_release(msg);
+    close(manager_fd);
+
+    /* connect worker */
+    fprintf(stderr, "assigned worker at %lu\n", worker_port);
+    chan->sock_fd = init_vm_socket(&sa, VMADDR_CID_HOST, worker_port);
+    // FIXME: connect is always non-blocking for vm socket!
+    if (!getenv("AVA_WPOOL") || !strcmp(getenv("AVA_WPOOL"), "FALSE"))
+        usleep(5000000);
+    conn_vm_socket(chan->sock_fd, &sa);
+
+    chan->pfd.fd = chan->sock_fd;
+    chan->pfd.events = POLLIN | POLLRDHUP;
+
+    return (struct command_channel *)chan;
+}
+
+/**
+ * Initialize a new command channel for worker with vsock as doorbell and
+ * shared memory as data transport.
+ */
+struct command_channel* command_channel_shm_worker_new(int listen_port)
+{
+    struct command_channel_shm *chan = command_channel_shm_alloc(1);
+
+    /* set up worker info */
+    chan->shm_size = AVA_HOST_SHM_SIZE;
+
+    // TODO: notify executor when VM created or destroyed
+    chan->listen_port = listen_port;
+    assert(nw_worker_id == 0); // TODO: Move assignment to nw_worker_id out of unrelated constructor.
+    nw_worker_id = listen_port;
+
+    /* setup shared memory */
+    if ((chan->shm_fd = open("/dev/kvm-vgpu", O_RDWR | O_NONBLOCK)) < 0) {
+        printf("failed to open /dev/kvm-vgpu\n");
+        exit(0);
+    }
+    chan->shm_addr = mmap(NULL, chan->shm_size,
+                          PROT_READ | PROT_WRITE, MAP_SHARED, chan->shm_fd, 0);
+    if (chan->shm_addr == MAP_FAILED) {
+        printf("mmap shared memory failed: %s\n", strerror(errno));
+        // TODO: add exit labels
+        exit(0);
+    }
+    else
+        printf("mmap shared memory to 0x%lx\n", (uintptr_t)chan->shm_addr);
+
+    /* connect guestlib */
+    struct sockaddr_vm sa_listen;
+    chan->listen_fd = init_vm_socket(&sa_listen, VMADDR_CID_ANY, chan->listen_port);
+    listen_vm_socket(chan->listen_fd, &sa_listen);
+
+    printf("[worker&%d] waiting for guestlib connection\n", listen_port);
+    chan->sock_fd = accept_vm_socket(chan->listen_fd, NULL);
+    printf("[worker@%d] guestlib connection accepted\n", listen_port);
+
+    struct command_handler_initialize_api_command init_msg;
+    recv_socket(chan->sock_fd, &init_msg, sizeof(struct command_handler_initialize_api_command));
+    chan->init_command_type = init_msg.new_api_id;
+    chan->vm_id = init_msg.base.vm_id;
+    /* worker uses the last half of the parameter block.
+     *   base: start address of the whole parameter block;
+     *   size: size of the block;
+     *   offset: offset of the block to the VM's shared memory base. */
+    chan->param_block.offset = init_msg.pb_info.param_local_offset;
+    chan->param_block.size = init_msg.pb_info.param_block_size;
+    chan->param_block.base = (char *)chan->shm_addr + (chan->vm_id - 1) * AVA_GUEST_SHM_SIZE + chan->param_block.offset;
+    command_channel_shm_init_param_alloc(chan);
+    printf("[worker@%d] vm_id=%d, api_id=%x, pb_info={%lx,%lx}\n", listen_port, chan->vm_id, chan->init_command_type,
+            chan->param_block.size, chan->param_block.offset);
+
+    /* AVA_SHM_POLL_SPIN=<us> and AVA_SHM_POLL_CORES=<cpu list> tune polling */
+    struct shm_doorbell_control *control = (struct shm_doorbell_control *)chan->param_block.base;
+    if (__atomic_load_n(&control->magic, __ATOMIC_ACQUIRE) == kShmDoorbellMagic &&
+            control->mode == SHM_DOORBELL_POLL && control->ring_size == AVA_SHM_DESC_RING_SIZE) {
+        if (control->wire_version > COMMAND_WIRE_VERSION) {
+            fprintf(stderr, "[worker@%d] guestlib uses command wire format %u, newer than %d\n",
+                    listen_port, control->wire_version, COMMAND_WIRE_VERSION);
+            exit(-1);
+        }
+        const char *spin_env = getenv("AVA_SHM_POLL_SPIN");
+        shm_doorbell_enable(chan, spin_env ? strtoull(spin_env, NULL, 0) : AVA_SHM_POLL_SPIN_DEFAULT,
+                            getenv("AVA_SHM_POLL_CORES"));
+        printf("[worker@%d] guestlib polls the descriptor rings, wire format %d\n", listen_port, chan->wire_version);
+    }
+
+    if (ioctl(chan->shm_fd, KVM_NOTIFY_NEW_WORKER, (unsigned long)chan->vm_id) < 0) {
+        printf("failed to notify worker id\n");
+        exit(0);
+    }
+    printf("[worker#%d] kvm-vgpu notified\n", chan->vm_id);
+
+    // TODO: also poll netlink socket, and put the swapping task in the same
+    // task queue just as the normal invocations.
+    chan->pfd.fd = chan->sock_fd;
+    chan->pfd.events = POLLIN | POLLRDHUP;
+
+    return (struct command_channel *)chan;
+}
+
+/**
+ * Disconnect this command channel and free all resources associated
+ * with it.
+ */
+static void command_channel_shm_free(struct command_channel* c)
+{
+    struct command_channel_shm *chan = (struct command_channel_shm *)c;
+    const char *name = chan->is_worker ? "shm worker" : "shm";
+
+    pthread_mutex_destroy(&chan->send_mutex);
+    pthread_mutex_destroy(&chan->recv_mutex);
+    if (command_channel_stats_enabled()) {
+        cmd_buffer_pool_print_stats(chan->cmd_pool, name, stderr);
+        cmd_param_block_print_stats(chan->param_alloc, name, stderr);
+        if (chan->tx)
+            fprintf(stderr, "[%s] doorbell: %lu commands through the ring, %lu doorbells sent; "
+                    "%lu commands received by polling, %lu sleeps\n",
+                    name, chan->ring_commands, chan->doorbells, chan->recv_polls, chan->sleeps);
+        command_wire_print_stats(&chan->wire_stats, chan->wire_version, name, stderr);
+        cmd_copy_print_stats(name, stderr);
+    }
+    cmd_buffer_pool_free(chan->cmd_pool);
+    cmd_param_block_free(chan->param_alloc);
+
+    munmap(chan->shm_addr, chan->shm_size);
+    // TODO: unmap slabs
+    // TODO: destroy sems
+
+    close(chan->sock_fd);
+    if (chan->listen_fd > 0)
+        close(chan->listen_fd);
+    if (chan->shm_fd > 0)
+        close(chan->shm_fd);
+    free(chan);
+}
+
+namespace {
+  struct command_channel_vtable command_channel_shm_vtable = {
+    command_channel_shm_buffer_size,
+    command_channel_shm_new_command,
+    command_channel_shm_attach_buffer,
+    command_channel_shm_send_command,
+    command_channel_shm_transfer_command,
+    command_channel_shm_receive_command,
+    command_channel_shm_get_buffer,
+    command_channel_shm_get_data_region,
+    command_channel_shm_free_command,
+    command_channel_shm_free,
+    command_channel_shm_print_command
+  };
+}  // namespace
+
+// warning TODO: Does there need to be a separate socket specific function which handles listening/accepting instead of connecting?
+
+// warning TODO: Make a header file "cmd_channel_socket.h" for the command_channel_socket_new and other socket specific APIs.
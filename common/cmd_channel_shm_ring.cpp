@@ -0,0 +1,794 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "common/cmd_channel_impl.h"
+#include "common/cmd_copy.h"
+#include "common/cmd_channel_static.h"
+#include "common/devconf.h"
+#include "common/debug.h"
+#include "common/cmd_handler.h"
+#include "cmd_channel_socket_utilities.h"
+#include "guest_config.h"
+
+extern int nw_global_vm_id;
+
+/**
+ * Same-host shared-memory ring channel.
+ *
+ * The API server creates a POSIX shared memory object named
+ * `AVA_SHM_RING_NAME_PREFIX<worker_port>` which holds two byte rings, one
+ * per direction. The guestlib maps the same object, so neither a hypervisor,
+ * `/dev/ava_zcopy` nor a vsock doorbell is involved.
+ *
+ * Every command (the command struct followed by its data region) is a
+ * record in the sender's ring. `new_command` reserves the record in place,
+ * `attach_buffer` copies directly into shared memory and `send_command` only
+ * publishes the record. The receiver returns a pointer into the ring, so no
+ * allocation nor copy is made on the receive path; the record is released
+ * when the command is freed. Records are released out of order, and the ring
+ * tail only advances over a contiguous run of freed records.
+ *
+ * Commands which do not fit into a ring are allocated on the heap and
+ * streamed as a sequence of fragment records, which the receiver reassembles.
+ *
+ * Both sides spin for a while and then sleep on a futex in the shared region,
+ * so an idle channel does not burn CPU.
+ */
+
+namespace {
+
+extern struct command_channel_vtable command_channel_shm_ring_vtable;
+
+constexpr uint32_t kRingMagic = 0x41564152;  /* "AVAR" */
+constexpr uint64_t kRingAlign = 64;
+
+enum shm_ring_record_state : uint32_t {
+    RECORD_WRITING = 1,
+    RECORD_READY,
+    RECORD_CONSUMED,
+    RECORD_FREED,
+};
+
+enum shm_ring_record_kind : uint32_t {
+    RECORD_COMMAND = 1,
+    RECORD_PADDING,
+    RECORD_FRAGMENT,
+};
+
+/**
+ * Record header. The payload follows the header and is therefore
+ * aligned to a cache line.
+ */
+struct alignas(kRingAlign) shm_ring_record {
+    std::atomic<uint32_t> state;
+    uint32_t kind;
+    uint64_t size;          /* Record size including this header */
+    uint64_t payload_size;
+    uint64_t total_size;    /* Size of the reassembled command for fragments */
+};
+
+/**
+ * One direction of the channel. `head` is only written by the producer
+ * and `tail` is only written by the consumer.
+ */
+struct shm_ring {
+    alignas(kRingAlign) std::atomic<uint64_t> head;
+    std::atomic<uint32_t> data_seq;
+    std::atomic<uint32_t> data_waiters;
+    alignas(kRingAlign) std::atomic<uint64_t> tail;
+    std::atomic<uint32_t> space_seq;
+    std::atomic<uint32_t> space_waiters;
+    alignas(kRingAlign) uint64_t offset;    /* Offset of the ring data from the region base */
+    uint64_t capacity;
+};
+
+struct shm_ring_region {
+    std::atomic<uint32_t> magic;
+    std::atomic<uint32_t> connected;
+    std::atomic<int32_t> worker_pid;
+    std::atomic<int32_t> guest_pid;
+    uint64_t region_size;
+    struct shm_ring rings[2];   /* [0]: guestlib to worker, [1]: worker to guestlib */
+};
+
+enum shm_ring_command_origin : uint32_t {
+    SHM_RING_COMMAND_RING = 1,
+    SHM_RING_COMMAND_HEAP,
+};
+
+/**
+ * Channel private data stored in `command_base::reserved_area`.
+ */
+struct shm_ring_command_private {
+    uint64_t cur_offset;
+    uint32_t origin;
+};
+
+struct command_channel_shm_ring {
+    struct command_channel_base base;
+    uint8_t vm_id;
+    int listen_port;
+    uint8_t init_command_type;
+    int is_worker;
+
+    char shm_name[NAME_MAX];
+    struct shm_ring_region *region;
+    size_t region_size;
+
+    struct shm_ring *tx;
+    struct shm_ring *rx;
+    char *tx_data;
+    char *rx_data;
+
+    /* Consumer cursor into `rx`, advanced under `recv_mutex` */
+    std::atomic<uint64_t> rx_read;
+
+    /* Channel locks */
+    pthread_mutex_t send_mutex;
+    pthread_mutex_t recv_mutex;
+    pthread_mutex_t release_mutex;
+};
+
+static inline uint64_t shm_ring_align(uint64_t size)
+{
+    return (size + kRingAlign - 1) & ~(kRingAlign - 1);
+}
+
+static inline void shm_ring_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static inline struct shm_ring_command_private *shm_ring_private(const struct command_base *cmd)
+{
+    static_assert(sizeof(struct shm_ring_command_private) <= sizeof(cmd->reserved_area),
+                  "command_base::reserved_area is not large enough.");
+    return (struct shm_ring_command_private *)cmd->reserved_area;
+}
+
+static inline struct shm_ring_record *shm_ring_record_at(char *data, const struct shm_ring *ring, uint64_t cursor)
+{
+    return (struct shm_ring_record *)(data + cursor % ring->capacity);
+}
+
+static inline struct shm_ring_record *shm_ring_record_of(const struct command_base *cmd)
+{
+    return (struct shm_ring_record *)((uintptr_t)cmd - sizeof(struct shm_ring_record));
+}
+
+static inline long shm_ring_futex_wait(std::atomic<uint32_t> *addr, uint32_t val, const struct timespec *timeout)
+{
+    return syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAIT, val, timeout, NULL, 0);
+}
+
+static inline long shm_ring_futex_wake(std::atomic<uint32_t> *addr)
+{
+    return syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static int shm_ring_peer_alive(const struct command_channel_shm_ring *chan)
+{
+    pid_t peer = chan->is_worker ? chan->region->guest_pid.load() : chan->region->worker_pid.load();
+    return peer <= 0 || kill(peer, 0) == 0 || errno != ESRCH;
+}
+
+/**
+ * Spin and then sleep on `seq` until `ready` returns true. Terminates the
+ * process when the other endpoint has exited, the same as the socket
+ * channels do.
+ */
+template <typename Predicate>
+static void shm_ring_wait(const struct command_channel_shm_ring *chan,
+                          std::atomic<uint32_t> *seq, std::atomic<uint32_t> *waiters,
+                          Predicate ready)
+{
+    for (int i = 0; i < AVA_SHM_RING_SPIN_COUNT; i++) {
+        if (ready())
+            return;
+        shm_ring_cpu_relax();
+    }
+
+    const struct timespec timeout = {1, 0};
+    while (true) {
+        waiters->fetch_add(1);
+        uint32_t observed = seq->load();
+        if (ready()) {
+            waiters->fetch_sub(1);
+            return;
+        }
+        shm_ring_futex_wait(seq, observed, &timeout);
+        waiters->fetch_sub(1);
+        if (ready())
+            return;
+
+        if (!shm_ring_peer_alive(chan)) {
+            DEBUG_PRINT("command_channel_shm_ring shutdown\n");
+            exit(-1);
+        }
+    }
+}
+
+static inline void shm_ring_notify(std::atomic<uint32_t> *seq, std::atomic<uint32_t> *waiters)
+{
+    seq->fetch_add(1);
+    if (waiters->load())
+        shm_ring_futex_wake(seq);
+}
+
+/**
+ * Largest payload which is sent as a single record. Larger commands are
+ * fragmented so that a single command can never occupy the whole ring.
+ */
+static inline uint64_t shm_ring_max_payload(const struct shm_ring *ring)
+{
+    return ring->capacity / 4 - sizeof(struct shm_ring_record);
+}
+
+/**
+ * Reserve a record for `payload_size` bytes in the transmit ring. The record
+ * is left in the RECORD_WRITING state and must be published with
+ * `shm_ring_publish`. The caller must hold `send_mutex`.
+ */
+static struct shm_ring_record *shm_ring_reserve(struct command_channel_shm_ring *chan, uint64_t payload_size, uint32_t kind)
+{
+    struct shm_ring *ring = chan->tx;
+    const uint64_t capacity = ring->capacity;
+    const uint64_t need = shm_ring_align(sizeof(struct shm_ring_record) + payload_size);
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    const uint64_t pos = head % capacity;
+    const uint64_t pad = (pos + need > capacity) ? capacity - pos : 0;
+    struct shm_ring_record *record;
+
+    assert(need <= capacity / 2);
+    shm_ring_wait(chan, &ring->space_seq, &ring->space_waiters, [&]() {
+        return head + pad + need - ring->tail.load(std::memory_order_acquire) <= capacity;
+    });
+
+    /* Records never wrap around the end of the ring */
+    if (pad) {
+        record = shm_ring_record_at(chan->tx_data, ring, head);
+        record->kind = RECORD_PADDING;
+        record->size = pad;
+        record->payload_size = 0;
+        record->state.store(RECORD_READY, std::memory_order_relaxed);
+        head += pad;
+    }
+
+    record = shm_ring_record_at(chan->tx_data, ring, head);
+    record->kind = kind;
+    record->size = need;
+    record->payload_size = payload_size;
+    record->total_size = payload_size;
+    record->state.store(RECORD_WRITING, std::memory_order_relaxed);
+    ring->head.store(head + need, std::memory_order_release);
+
+    return record;
+}
+
+static inline void shm_ring_publish(struct command_channel_shm_ring *chan, struct shm_ring_record *record)
+{
+    record->state.store(RECORD_READY, std::memory_order_release);
+    shm_ring_notify(&chan->tx->data_seq, &chan->tx->data_waiters);
+}
+
+/**
+ * Advance the tail of the receive ring over freed records and wake up the
+ * producer if it is waiting for space.
+ */
+static void shm_ring_release(struct command_channel_shm_ring *chan)
+{
+    struct shm_ring *ring = chan->rx;
+
+    pthread_mutex_lock(&chan->release_mutex);
+    const uint64_t read = chan->rx_read.load(std::memory_order_acquire);
+    const uint64_t old_tail = ring->tail.load(std::memory_order_relaxed);
+    uint64_t tail = old_tail;
+    while (tail < read) {
+        struct shm_ring_record *record = shm_ring_record_at(chan->rx_data, ring, tail);
+        if (record->state.load(std::memory_order_acquire) != RECORD_FREED)
+            break;
+        tail += record->size;
+    }
+    if (tail != old_tail) {
+        ring->tail.store(tail, std::memory_order_release);
+        shm_ring_notify(&ring->space_seq, &ring->space_waiters);
+    }
+    pthread_mutex_unlock(&chan->release_mutex);
+}
+
+/**
+ * Wait for the next published record in the receive ring and consume it.
+ * The caller must hold `recv_mutex`.
+ */
+static struct shm_ring_record *shm_ring_next_record(struct command_channel_shm_ring *chan)
+{
+    struct shm_ring *ring = chan->rx;
+
+    while (true) {
+        const uint64_t read = chan->rx_read.load(std::memory_order_relaxed);
+        struct shm_ring_record *record = shm_ring_record_at(chan->rx_data, ring, read);
+        shm_ring_wait(chan, &ring->data_seq, &ring->data_waiters, [&]() {
+            return read < ring->head.load(std::memory_order_acquire) &&
+                   record->state.load(std::memory_order_acquire) == RECORD_READY;
+        });
+
+        if (record->kind == RECORD_PADDING) {
+            record->state.store(RECORD_FREED, std::memory_order_release);
+            chan->rx_read.store(read + record->size, std::memory_order_release);
+            shm_ring_release(chan);
+            continue;
+        }
+
+        record->state.store(RECORD_CONSUMED, std::memory_order_relaxed);
+        chan->rx_read.store(read + record->size, std::memory_order_release);
+        return record;
+    }
+}
+
+/**
+ * Stream the concatenation of `count` memory spans through the transmit ring
+ * as fragment records. The caller must hold `send_mutex`.
+ */
+static void shm_ring_send_fragments(struct command_channel_shm_ring *chan,
+                                    const void *const *spans, const size_t *span_sizes, int count)
+{
+    const uint64_t max_payload = shm_ring_max_payload(chan->tx);
+    uint64_t total_size = 0;
+    int i;
+
+    for (i = 0; i < count; i++)
+        total_size += span_sizes[i];
+
+    uint64_t sent = 0;
+    size_t span_offset = 0;
+    i = 0;
+    while (sent < total_size) {
+        const uint64_t payload_size = std::min(max_payload, total_size - sent);
+        struct shm_ring_record *record = shm_ring_reserve(chan, payload_size, RECORD_FRAGMENT);
+        record->total_size = total_size;
+
+        char *dst = (char *)(record + 1);
+        uint64_t copied = 0;
+        while (copied < payload_size) {
+            const size_t n = std::min((size_t)(payload_size - copied), span_sizes[i] - span_offset);
+            cmd_copy(dst + copied, (const char *)spans[i] + span_offset, n, CMD_COPY_SHARED);
+            copied += n;
+            span_offset += n;
+            if (span_offset == span_sizes[i]) {
+                i++;
+                span_offset = 0;
+            }
+        }
+
+        shm_ring_publish(chan, record);
+        sent += payload_size;
+    }
+}
+
+}  // namespace
+
+/**
+ * Print a command for debugging.
+ */
+static void command_channel_shm_ring_print_command(const struct command_channel *chan, const struct command_base *cmd)
+{
+    DEBUG_PRINT_COMMAND(chan, cmd);
+}
+
+/**
+ * Disconnect this command channel and free all resources associated
+ * with it.
+ */
+static void command_channel_shm_ring_free(struct command_channel *c)
+{
+    struct command_channel_shm_ring *chan = (struct command_channel_shm_ring *)c;
+    munmap(chan->region, chan->region_size);
+    if (chan->is_worker)
+        shm_unlink(chan->shm_name);
+    pthread_mutex_destroy(&chan->send_mutex);
+    pthread_mutex_destroy(&chan->recv_mutex);
+    pthread_mutex_destroy(&chan->release_mutex);
+    if (command_channel_stats_enabled())
+        cmd_copy_print_stats(chan->is_worker ? "shm_ring worker" : "shm_ring", stderr);
+    free(chan);
+}
+
+//! Sending
+
+/**
+ * Compute the buffer size that will actually be used for a buffer of
+ * `size`. Buffers are packed without padding so that shadow buffer
+ * headers stay adjacent to their data.
+ */
+size_t command_channel_shm_ring_buffer_size(const struct command_channel *c, size_t size)
+{
+    return size;
+}
+
+/**
+ * Allocate a new command struct with size `command_struct_size` and
+ * a data region of size `data_region_size`.
+ *
+ * The command is allocated directly in the transmit ring unless it is too
+ * large to fit, in which case it is allocated on the heap and fragmented
+ * when it is sent.
+ */
+struct command_base *command_channel_shm_ring_new_command(struct command_channel *c, size_t command_struct_size, size_t data_region_size)
+{
+    struct command_channel_shm_ring *chan = (struct command_channel_shm_ring *)c;
+    const uint64_t total_size = command_struct_size + data_region_size;
+    struct command_base *cmd;
+    uint32_t origin;
+
+    if (total_size <= shm_ring_max_payload(chan->tx)) {
+        pthread_mutex_lock(&chan->send_mutex);
+        struct shm_ring_record *record = shm_ring_reserve(chan, total_size, RECORD_COMMAND);
+        pthread_mutex_unlock(&chan->send_mutex);
+        cmd = (struct command_base *)(record + 1);
+        origin = SHM_RING_COMMAND_RING;
+    }
+    else {
+        cmd = (struct command_base *)malloc(total_size);
+        origin = SHM_RING_COMMAND_HEAP;
+    }
+
+    memset(cmd, 0, command_struct_size);
+    cmd->vm_id = chan->vm_id;
+    cmd->command_size = command_struct_size;
+    cmd->data_region = (void *)command_struct_size;
+    cmd->region_size = data_region_size;
+
+    struct shm_ring_command_private *priv = shm_ring_private(cmd);
+    priv->cur_offset = command_struct_size;
+    priv->origin = origin;
+
+    return cmd;
+}
+
+/**
+ * Attach a buffer to a command and return a location independent
+ * buffer ID. The buffer is copied into the command's data region
+ * immediately.
+ */
+void *command_channel_shm_ring_attach_buffer(struct command_channel *c, struct command_base *cmd, void *buffer, size_t size)
+{
+    assert(buffer && size != 0);
+
+    struct shm_ring_command_private *priv = shm_ring_private(cmd);
+    void *offset = (void *)priv->cur_offset;
+    void *dst = (void *)((uintptr_t)cmd + priv->cur_offset);
+    priv->cur_offset += size;
+    assert(priv->cur_offset <= cmd->command_size + cmd->region_size);
+    cmd_copy(dst, buffer, size, priv->origin == SHM_RING_COMMAND_RING ? CMD_COPY_SHARED : CMD_COPY_PRIVATE);
+    return offset;
+}
+
+/**
+ * Send the message and all its attached buffers.
+ *
+ * This call is asynchronous and does not block for the command to
+ * complete execution.
+ */
+void command_channel_shm_ring_send_command(struct command_channel *c, struct command_base *cmd)
+{
+    struct command_channel_shm_ring *chan = (struct command_channel_shm_ring *)c;
+    cmd->command_type = NW_NEW_INVOCATION;
+
+    if (shm_ring_private(cmd)->origin == SHM_RING_COMMAND_RING) {
+        shm_ring_publish(chan, shm_ring_record_of(cmd));
+        return;
+    }
+
+    const void *spans[] = {cmd};
+    const size_t span_sizes[] = {cmd->command_size + cmd->region_size};
+    pthread_mutex_lock(&chan->send_mutex);
+    shm_ring_send_fragments(chan, spans, span_sizes, 1);
+    pthread_mutex_unlock(&chan->send_mutex);
+
+    // Free the local copy of the command and buffers.
+    free(cmd);
+}
+
+static void command_channel_shm_ring_transfer_command(struct command_channel *c, const struct command_channel *source,
+                                               const struct command_base *cmd)
+{
+    struct command_channel_shm_ring *chan = (struct command_channel_shm_ring *)c;
+    void *cmd_data_region = command_channel_get_data_region(source, cmd);
+    const uint64_t total_size = cmd->command_size + cmd->region_size;
+
+    pthread_mutex_lock(&chan->send_mutex);
+    if (total_size <= shm_ring_max_payload(chan->tx)) {
+        struct shm_ring_record *record = shm_ring_reserve(chan, total_size, RECORD_COMMAND);
+        memcpy((void *)(record + 1), cmd, cmd->command_size);
+        cmd_copy((char *)(record + 1) + cmd->command_size, cmd_data_region, cmd->region_size, CMD_COPY_SHARED);
+        shm_ring_publish(chan, record);
+    }
+    else {
+        const void *spans[] = {cmd, cmd_data_region};
+        const size_t span_sizes[] = {cmd->command_size, cmd->region_size};
+        shm_ring_send_fragments(chan, spans, span_sizes, 2);
+    }
+    pthread_mutex_unlock(&chan->send_mutex);
+}
+
+//! Receiving
+
+/**
+ * Receive a command from a channel. The returned Command pointer
+ * should be interpreted based on its `command_id` field.
+ *
+ * This call blocks waiting for a command to be sent along this
+ * channel.
+ */
+struct command_base *command_channel_shm_ring_receive_command(struct command_channel *c)
+{
+    struct command_channel_shm_ring *chan = (struct command_channel_shm_ring *)c;
+    struct command_base *cmd;
+
+    pthread_mutex_lock(&chan->recv_mutex);
+    struct shm_ring_record *record = shm_ring_next_record(chan);
+    if (record->kind == RECORD_COMMAND) {
+        cmd = (struct command_base *)(record + 1);
+        shm_ring_private(cmd)->origin = SHM_RING_COMMAND_RING;
+    }
+    else {
+        /* Reassemble a fragmented command on the heap */
+        assert(record->kind == RECORD_FRAGMENT);
+        const uint64_t total_size = record->total_size;
+        uint64_t received = 0;
+        cmd = (struct command_base *)malloc(total_size);
+        while (true) {
+            memcpy((char *)cmd + received, record + 1, record->payload_size);
+            received += record->payload_size;
+            record->state.store(RECORD_FREED, std::memory_order_release);
+            shm_ring_release(chan);
+            if (received >= total_size)
+                break;
+            record = shm_ring_next_record(chan);
+            assert(record->kind == RECORD_FRAGMENT);
+        }
+        shm_ring_private(cmd)->origin = SHM_RING_COMMAND_HEAP;
+    }
+    pthread_mutex_unlock(&chan->recv_mutex);
+
+    command_channel_shm_ring_print_command(c, cmd);
+    return cmd;
+}
+
+/**
+ * Translate a buffer_id (as returned by
+ * `command_channel_attach_buffer` in the sender) into a data pointer.
+ * The returned pointer will be valid until
+ * `command_channel_free_command` is called on `cmd`.
+ */
+void *command_channel_shm_ring_get_buffer(const struct command_channel *chan, const struct command_base *cmd, void *buffer_id)
+{
+    return (void *)((uintptr_t)cmd + (uintptr_t)buffer_id);
+}
+
+/**
+ * Returns the pointer to data region. The returned pointer is mainly
+ * used for data extraction for migration.
+ */
+static void *command_channel_shm_ring_get_data_region(const struct command_channel *c, const struct command_base *cmd)
+{
+    return (void *)((uintptr_t)cmd + cmd->command_size);
+}
+
+/**
+ * Free a command returned by `command_channel_receive_command`. The ring
+ * space of the command becomes reusable once all earlier commands are
+ * freed as well.
+ */
+void command_channel_shm_ring_free_command(struct command_channel *c, struct command_base *cmd)
+{
+    struct command_channel_shm_ring *chan = (struct command_channel_shm_ring *)c;
+
+    if (shm_ring_private(cmd)->origin == SHM_RING_COMMAND_HEAP) {
+        free(cmd);
+        return;
+    }
+
+    shm_ring_record_of(cmd)->state.store(RECORD_FREED, std::memory_order_release);
+    shm_ring_release(chan);
+}
+
+static struct command_channel_shm_ring *command_channel_shm_ring_alloc(int worker_port, int is_worker)
+{
+    struct command_channel_shm_ring *chan =
+        (struct command_channel_shm_ring *)malloc(sizeof(struct command_channel_shm_ring));
+    memset((void *)chan, 0, sizeof(struct command_channel_shm_ring));
+    command_channel_preinitialize((struct command_channel *)chan, &command_channel_shm_ring_vtable);
+    pthread_mutex_init(&chan->send_mutex, NULL);
+    pthread_mutex_init(&chan->recv_mutex, NULL);
+    pthread_mutex_init(&chan->release_mutex, NULL);
+    chan->rx_read.store(0);
+    chan->listen_port = worker_port;
+    chan->is_worker = is_worker;
+    snprintf(chan->shm_name, sizeof(chan->shm_name), "%s%d", AVA_SHM_RING_NAME_PREFIX, worker_port);
+    return chan;
+}
+
+static void command_channel_shm_ring_attach_rings(struct command_channel_shm_ring *chan)
+{
+    struct shm_ring *to_worker = &chan->region->rings[0];
+    struct shm_ring *to_guest = &chan->region->rings[1];
+
+    chan->tx = chan->is_worker ? to_guest : to_worker;
+    chan->rx = chan->is_worker ? to_worker : to_guest;
+    chan->tx_data = (char *)chan->region + chan->tx->offset;
+    chan->rx_data = (char *)chan->region + chan->rx->offset;
+}
+
+/**
+ * Shared-memory ring channel guestlib endpoint.
+ *
+ * The `manager_tcp` is required to assign the API server, which must be
+ * spawned with `AVA_CHANNEL=SHM_RING` on the same host.
+ */
+struct command_channel *command_channel_shm_ring_guest_new()
+{
+    std::vector<std::string> worker_address = chansocketutil::request_worker_assignment();
+    if (worker_address.empty())
+        return NULL;
+
+    char worker_name[128];
+    int worker_port;
+    parseServerAddress(worker_address[0].c_str(), NULL, worker_name, &worker_port);
+    assert(worker_port > 0 && "Invalid API server port");
+    DEBUG_PRINT("Assigned worker at %s:%d\n", worker_name, worker_port);
+
+    struct command_channel_shm_ring *chan = command_channel_shm_ring_alloc(worker_port, 0);
+    chan->vm_id = nw_global_vm_id = 1;
+    nw_worker_id = worker_port;
+
+    /* The API server may not have created the shared memory object yet. */
+    int shm_fd = -1;
+    auto connect_start = std::chrono::steady_clock::now();
+    while (true) {
+        shm_fd = shm_open(chan->shm_name, O_RDWR, 0600);
+        if (shm_fd >= 0) {
+            struct stat shm_stat;
+            fstat(shm_fd, &shm_stat);
+            if ((size_t)shm_stat.st_size >= sizeof(struct shm_ring_region)) {
+                chan->region = (struct shm_ring_region *)mmap(NULL, sizeof(struct shm_ring_region),
+                                                              PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+                if (chan->region != MAP_FAILED && chan->region->magic.load() == kRingMagic)
+                    break;
+                if (chan->region != MAP_FAILED)
+                    munmap(chan->region, sizeof(struct shm_ring_region));
+            }
+            close(shm_fd);
+        }
+
+        auto connect_checkpoint = std::chrono::steady_clock::now();
+        if ((uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+              connect_checkpoint - connect_start).count() > guestconfig::config->connect_timeout_) {
+            std::cerr << "Connection to " << chan->shm_name << " timeout" << std::endl;
+            command_channel_shm_ring_free((struct command_channel *)chan);
+            return NULL;
+        }
+        usleep(1000);
+    }
+
+    chan->region_size = chan->region->region_size;
+    munmap(chan->region, sizeof(struct shm_ring_region));
+    chan->region = (struct shm_ring_region *)mmap(NULL, chan->region_size, PROT_READ | PROT_WRITE,
+                                                  MAP_SHARED | MAP_POPULATE, shm_fd, 0);
+    close(shm_fd);
+    if (chan->region == MAP_FAILED) {
+        perror("mmap shm ring");
+        exit(EXIT_FAILURE);
+    }
+    command_channel_shm_ring_attach_rings(chan);
+
+    std::cerr << "Connect target API server at " << chan->shm_name << std::endl;
+    chan->region->guest_pid.store(getpid());
+    chan->region->connected.store(1);
+    shm_ring_futex_wake(&chan->region->connected);
+
+    return (struct command_channel *)chan;
+}
+
+/**
+ * Shared-memory ring channel API server endpoint.
+ * @worker_port: the port assigned to the worker, which names the shared
+ * memory object.
+ */
+struct command_channel *command_channel_shm_ring_worker_new(int worker_port)
+{
+    struct command_channel_shm_ring *chan = command_channel_shm_ring_alloc(worker_port, 1);
+    const uint64_t ring_size = AVA_SHM_RING_SIZE_DEFAULT;
+
+    chan->region_size = shm_ring_align(sizeof(struct shm_ring_region)) + 2 * ring_size;
+
+    shm_unlink(chan->shm_name);
+    int shm_fd = shm_open(chan->shm_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (shm_fd < 0) {
+        perror("shm_open");
+        exit(EXIT_FAILURE);
+    }
+    if (ftruncate(shm_fd, chan->region_size) < 0) {
+        perror("ftruncate shm ring");
+        exit(EXIT_FAILURE);
+    }
+    chan->region = (struct shm_ring_region *)mmap(NULL, chan->region_size, PROT_READ | PROT_WRITE,
+                                                  MAP_SHARED | MAP_POPULATE, shm_fd, 0);
+    close(shm_fd);
+    if (chan->region == MAP_FAILED) {
+        perror("mmap shm ring");
+        exit(EXIT_FAILURE);
+    }
+
+    struct shm_ring_region *region = chan->region;
+    region->region_size = chan->region_size;
+    for (int i = 0; i < 2; i++) {
+        struct shm_ring *ring = &region->rings[i];
+        ring->head.store(0);
+        ring->tail.store(0);
+        ring->data_seq.store(0);
+        ring->data_waiters.store(0);
+        ring->space_seq.store(0);
+        ring->space_waiters.store(0);
+        ring->offset = shm_ring_align(sizeof(struct shm_ring_region)) + i * ring_size;
+        ring->capacity = ring_size;
+    }
+    region->guest_pid.store(0);
+    region->worker_pid.store(getpid());
+    region->connected.store(0);
+    region->magic.store(kRingMagic);
+    command_channel_shm_ring_attach_rings(chan);
+
+    fprintf(stderr, "[%d] Waiting for guestlib connection at %s\n", chan->listen_port, chan->shm_name);
+    while (!region->connected.load())
+        shm_ring_futex_wait(&region->connected, 0, NULL);
+
+    /* Receive handler initialization API */
+    struct command_base *init_cmd = command_channel_shm_ring_receive_command((struct command_channel *)chan);
+    struct command_handler_initialize_api_command *init_msg =
+        (struct command_handler_initialize_api_command *)init_cmd;
+    chan->init_command_type = init_msg->new_api_id;
+    chan->vm_id = init_msg->base.vm_id;
+    command_channel_shm_ring_free_command((struct command_channel *)chan, init_cmd);
+    fprintf(stderr, "[%d] Accept guestlib with API_ID=%x\n",
+            chan->listen_port, chan->init_command_type);
+
+    return (struct command_channel *)chan;
+}
+
+namespace {
+  struct command_channel_vtable command_channel_shm_ring_vtable = {
+    command_channel_shm_ring_buffer_size,
+    command_channel_shm_ring_new_command,
+    command_channel_shm_ring_attach_buffer,
+    command_channel_shm_ring_send_command,
+    command_channel_shm_ring_transfer_command,
+    command_channel_shm_ring_receive_command,
+    command_channel_shm_ring_get_buffer,
+    command_channel_shm_ring_get_data_region,
+    command_channel_shm_ring_free_command,
+    command_channel_shm_ring_free,
+    command_channel_shm_ring_print_command
+  };
+};
@@ -0,0 +1,248 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+#include "common/cmd_channel_impl.h"
+#include "common/devconf.h"
+#include "common/murmur3.h"
+#include "cmd_channel_socket_utilities.h"
+
+/**
+ * Session deduplication of large buffers in the socket channel.
+ *
+ * Each connection has a content-addressed cache of recently sent buffers
+ * on the receiving end. The sender keeps only the keys and decides every
+ * insertion and eviction itself, and tells the receiver about them in the
+ * command that causes them. Both ends therefore see the same cache as long
+ * as commands are handled in connection order, and a buffer that the
+ * receiver already holds is sent as a slot number instead of its bytes.
+ */
+
+namespace chansocketutil {
+
+namespace {
+
+struct socket_dedup_key_hash {
+  size_t operator()(const struct socket_dedup_key& key) const { return key.hash[0]; }
+};
+
+struct socket_dedup_key_equal {
+  bool operator()(const struct socket_dedup_key& a, const struct socket_dedup_key& b) const {
+    return a.hash[0] == b.hash[0] && a.hash[1] == b.hash[1] && a.size == b.size;
+  }
+};
+
+struct socket_dedup_slot {
+  struct socket_dedup_key key;
+  std::list<uint32_t>::iterator lru;
+};
+
+}  // namespace
+
+struct socket_dedup_sender {
+  pthread_mutex_t lock;
+  size_t capacity;
+  size_t used_bytes;
+
+  std::vector<struct socket_dedup_slot> slots;
+  std::vector<uint32_t> free_slots;
+  std::list<uint32_t> lru;    /* most recently used first */
+  std::unordered_map<struct socket_dedup_key, uint32_t,
+                     socket_dedup_key_hash, socket_dedup_key_equal> index;
+};
+
+struct socket_dedup_receiver {
+  std::vector<void *> buffers;
+  std::vector<size_t> sizes;
+};
+
+/**
+ * Compute the content key of a buffer.
+ */
+void socket_dedup_hash(const void *buffer, size_t size, struct socket_dedup_key *key)
+{
+    const char *p = (const char *)buffer;
+    uint64_t chunk_hash[2];
+
+    /* MurmurHash3 takes an int length; hash larger buffers in chunks */
+    key->hash[0] = key->hash[1] = 0;
+    key->size = size;
+    while (size > 0) {
+        int n = size > (size_t)1 << 30 ? 1 << 30 : (int)size;
+        MurmurHash3_x64_128(p, n, 0xfbcdabc7 ^ (uint32_t)key->hash[0], chunk_hash);
+        key->hash[0] ^= chunk_hash[0];
+        key->hash[1] ^= chunk_hash[1];
+        p += n;
+        size -= n;
+    }
+}
+
+/**
+ * @capacity: the largest number of bytes the receiver is asked to cache
+ */
+struct socket_dedup_sender *socket_dedup_sender_new(size_t capacity)
+{
+    struct socket_dedup_sender *dedup = new socket_dedup_sender();
+
+    pthread_mutex_init(&dedup->lock, NULL);
+    dedup->capacity = capacity;
+    dedup->used_bytes = 0;
+    return dedup;
+}
+
+void socket_dedup_sender_free(struct socket_dedup_sender *dedup)
+{
+    pthread_mutex_destroy(&dedup->lock);
+    delete dedup;
+}
+
+/**
+ * Returns true if the receiver is believed to hold a buffer with `key`.
+ * The answer may be stale by the time the command is sent.
+ */
+bool socket_dedup_sender_contains(struct socket_dedup_sender *dedup, const struct socket_dedup_key *key)
+{
+    bool found;
+
+    pthread_mutex_lock(&dedup->lock);
+    found = dedup->index.count(*key) > 0;
+    pthread_mutex_unlock(&dedup->lock);
+    return found;
+}
+
+static void socket_dedup_sender_evict(struct socket_dedup_sender *dedup, std::vector<uint32_t>& drops)
+{
+    uint32_t victim = dedup->lru.back();
+    struct socket_dedup_slot& slot = dedup->slots[victim];
+
+    dedup->lru.pop_back();
+    dedup->index.erase(slot.key);
+    dedup->used_bytes -= slot.key.size;
+    dedup->free_slots.push_back(victim);
+    drops.push_back(victim);
+}
+
+/**
+ * Look up a buffer that is about to be sent. On a hit the slot holding the
+ * buffer is returned. On a miss the buffer is assigned a slot, which the
+ * receiver has to fill, after evicting the least recently used buffers
+ * into `drops`. `slot` is set to SOCKET_DEDUP_NO_SLOT when the buffer is
+ * too large to be cached.
+ * The caller holds the channel's `send_mutex`, so the decisions are made
+ * in the order the commands go out.
+ * @return True on a hit.
+ */
+bool socket_dedup_sender_lookup(struct socket_dedup_sender *dedup, const struct socket_dedup_key *key,
+                                uint32_t *slot, std::vector<uint32_t>& drops)
+{
+    pthread_mutex_lock(&dedup->lock);
+    auto it = dedup->index.find(*key);
+    if (it != dedup->index.end()) {
+        *slot = it->second;
+        struct socket_dedup_slot& s = dedup->slots[*slot];
+        dedup->lru.splice(dedup->lru.begin(), dedup->lru, s.lru);
+        pthread_mutex_unlock(&dedup->lock);
+        return true;
+    }
+
+    if (key->size > dedup->capacity) {
+        *slot = SOCKET_DEDUP_NO_SLOT;
+        pthread_mutex_unlock(&dedup->lock);
+        return false;
+    }
+    while (dedup->used_bytes + key->size > dedup->capacity ||
+            (dedup->free_slots.empty() && dedup->slots.size() == AVA_DEDUP_MAX_SLOTS))
+        socket_dedup_sender_evict(dedup, drops);
+
+    if (dedup->free_slots.empty()) {
+        *slot = dedup->slots.size();
+        dedup->slots.emplace_back();
+    }
+    else {
+        *slot = dedup->free_slots.back();
+        dedup->free_slots.pop_back();
+    }
+    struct socket_dedup_slot& s = dedup->slots[*slot];
+    s.key = *key;
+    dedup->lru.push_front(*slot);
+    s.lru = dedup->lru.begin();
+    dedup->index[*key] = *slot;
+    dedup->used_bytes += key->size;
+    pthread_mutex_unlock(&dedup->lock);
+    return false;
+}
+
+struct socket_dedup_receiver *socket_dedup_receiver_new(void)
+{
+    return new socket_dedup_receiver();
+}
+
+void socket_dedup_receiver_free(struct socket_dedup_receiver *dedup)
+{
+    for (auto buffer : dedup->buffers)
+        free(buffer);
+    delete dedup;
+}
+
+/**
+ * Release the buffer in `slot`.
+ * @return False if the slot number is invalid.
+ */
+bool socket_dedup_receiver_drop(struct socket_dedup_receiver *dedup, uint32_t slot)
+{
+    if (slot >= dedup->buffers.size())
+        return false;
+    free(dedup->buffers[slot]);
+    dedup->buffers[slot] = NULL;
+    dedup->sizes[slot] = 0;
+    return true;
+}
+
+/**
+ * Keep a copy of a received buffer in `slot`.
+ * @return False if the slot number is invalid.
+ */
+bool socket_dedup_receiver_store(struct socket_dedup_receiver *dedup, uint32_t slot,
+                                 const void *buffer, size_t size)
+{
+    if (slot >= AVA_DEDUP_MAX_SLOTS)
+        return false;
+    if (slot >= dedup->buffers.size()) {
+        dedup->buffers.resize(slot + 1, NULL);
+        dedup->sizes.resize(slot + 1, 0);
+    }
+    socket_dedup_receiver_drop(dedup, slot);
+    dedup->buffers[slot] = malloc(size);
+    memcpy(dedup->buffers[slot], buffer, size);
+    dedup->sizes[slot] = size;
+    return true;
+}
+
+/**
+ * @return The buffer in `slot`, or NULL if the slot does not hold a
+ * buffer of `size` bytes.
+ */
+const void *socket_dedup_receiver_get(struct socket_dedup_receiver *dedup, uint32_t slot, size_t size)
+{
+    if (slot >= dedup->buffers.size() || !dedup->buffers[slot] || dedup->sizes[slot] != size)
+        return NULL;
+    return dedup->buffers[slot];
+}
+
+/**
+ * Print the counters of both directions to `stream`, prefixed with `name`.
+ */
+void socket_dedup_print_stats(const struct socket_dedup_stats *stats, const char *name, FILE *stream)
+{
+    fprintf(stream, "[%s] dedup: %lu of %lu sent buffers were cached (%.1f%%), %lu KB avoided, "
+            "CPU %.3f ms hashing; %lu received buffers served from cache\n",
+            name, stats->hits, stats->buffers,
+            stats->buffers ? 100.0 * stats->hits / stats->buffers : 0.0,
+            stats->bytes_avoided >> 10, stats->hash_ns / 1e6, stats->served);
+}
+
+};  // namespace chansocketutil
@@ -0,0 +1,181 @@
+#include <assert.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common/cmd_channel_impl.h"
+#include "common/devconf.h"
+#include "common/debug.h"
+#include "cmd_channel_socket_utilities.h"
+
+namespace chansocketutil {
+
+namespace {
+  extern struct command_channel_vtable command_channel_socket_striped_vtable;
+}
+
+/**
+ * A channel striped over several connections to the same peer. Commands
+ * are mapped onto a connection by their `thread_id`, so the commands of
+ * one thread stay in order while different threads send in parallel.
+ * Both ends use the same mapping, so replies come back on the connection
+ * of the call.
+ */
+struct command_channel_socket_striped {
+  struct command_channel_base base;
+  struct command_channel_socket **stripes;
+  int count;
+
+  struct pollfd *pfds;
+  int next_stripe;
+  pthread_mutex_t recv_mutex;
+};
+
+/**
+ * Map a thread onto a stripe. The thread ID 0 used by the command handler
+ * itself always goes to the first stripe.
+ */
+static inline int socket_stripe_of_thread(int64_t thread_id, int count)
+{
+    uint64_t h = (uint64_t)thread_id * 0x9e3779b97f4a7c15ULL;
+    return (int)((h >> 32) % (uint64_t)count);
+}
+
+static inline struct command_channel *socket_stripe(struct command_channel_socket_striped *chan, int64_t thread_id)
+{
+    return (struct command_channel *)chan->stripes[socket_stripe_of_thread(thread_id, chan->count)];
+}
+
+static inline struct command_channel_vtable *socket_stripe_vtable(struct command_channel *stripe)
+{
+    return ((struct command_channel_base *)stripe)->vtable;
+}
+
+static struct command_base* command_channel_socket_striped_new_command(struct command_channel* c,
+                                                                       size_t command_struct_size,
+                                                                       size_t data_region_size)
+{
+    struct command_channel_socket_striped *chan = (struct command_channel_socket_striped *)c;
+    /* The stripe is chosen at send time; spread the buffer pools by caller. */
+    struct command_channel *stripe = socket_stripe(chan, (int64_t)pthread_self());
+    return socket_stripe_vtable(stripe)->command_channel_new_command(stripe, command_struct_size, data_region_size);
+}
+
+static void command_channel_socket_striped_send_command(struct command_channel* c, struct command_base* cmd)
+{
+    struct command_channel *stripe = socket_stripe((struct command_channel_socket_striped *)c, cmd->thread_id);
+    socket_stripe_vtable(stripe)->command_channel_send_command(stripe, cmd);
+}
+
+static void command_channel_socket_striped_transfer_command(struct command_channel* c,
+                                                            const struct command_channel *source,
+                                                            const struct command_base *cmd)
+{
+    struct command_channel *stripe = socket_stripe((struct command_channel_socket_striped *)c, cmd->thread_id);
+    socket_stripe_vtable(stripe)->command_channel_transfer_command(stripe, source, cmd);
+}
+
+/**
+ * Receive the next command from whichever connection has one. Ready
+ * connections are served in turn so that a busy thread cannot starve
+ * the others.
+ */
+static struct command_base* command_channel_socket_striped_receive_command(struct command_channel* c)
+{
+    struct command_channel_socket_striped *chan = (struct command_channel_socket_striped *)c;
+    struct command_channel *stripe = NULL;
+    struct command_base *cmd;
+    int ret;
+
+    pthread_mutex_lock(&chan->recv_mutex);
+    /* Commands already staged by an earlier read do not show up in poll */
+    for (int i = 0; i < chan->count && !stripe; i++) {
+        int s = (chan->next_stripe + i) % chan->count;
+        if (command_channel_socket_has_staged_command(chan->stripes[s])) {
+            stripe = (struct command_channel *)chan->stripes[s];
+            chan->next_stripe = (s + 1) % chan->count;
+        }
+    }
+    while (!stripe) {
+        ret = poll(chan->pfds, chan->count, -1);
+        if (ret < 0) {
+            fprintf(stderr, "failed to poll\n");
+            exit(-1);
+        }
+        for (int i = 0; i < chan->count; i++) {
+            int s = (chan->next_stripe + i) % chan->count;
+            if (chan->pfds[s].revents & (POLLIN | POLLRDHUP | POLLHUP)) {
+                stripe = (struct command_channel *)chan->stripes[s];
+                chan->next_stripe = (s + 1) % chan->count;
+                break;
+            }
+        }
+    }
+
+    /* The stripe handles peer shutdown itself. */
+    cmd = socket_stripe_vtable(stripe)->command_channel_receive_command(stripe);
+    pthread_mutex_unlock(&chan->recv_mutex);
+    return cmd;
+}
+
+static void command_channel_socket_striped_free(struct command_channel* c)
+{
+    struct command_channel_socket_striped *chan = (struct command_channel_socket_striped *)c;
+
+    for (int i = 0; i < chan->count; i++)
+        command_channel_free((struct command_channel *)chan->stripes[i]);
+    pthread_mutex_destroy(&chan->recv_mutex);
+    free(chan->pfds);
+    free(chan->stripes);
+    free(chan);
+}
+
+/**
+ * Combine connected socket channels into one striped channel. The
+ * channels must use the plain socket receive path, which leaves unread
+ * data in the socket where poll can see it.
+ * @stripes: the connected channels, in the same order on both ends
+ * @count: the number of channels
+ *
+ * The striped channel takes ownership of the channels.
+ */
+struct command_channel* command_channel_socket_striped_new(struct command_channel_socket **stripes, int count)
+{
+    struct command_channel_socket_striped *chan =
+        (struct command_channel_socket_striped *)malloc(sizeof(struct command_channel_socket_striped));
+    command_channel_preinitialize((struct command_channel *)chan, &command_channel_socket_striped_vtable);
+
+    chan->count = count;
+    chan->stripes = (struct command_channel_socket **)malloc(count * sizeof(struct command_channel_socket *));
+    chan->pfds = (struct pollfd *)malloc(count * sizeof(struct pollfd));
+    for (int i = 0; i < count; i++) {
+        assert(stripes[i]->uring == NULL && "io_uring channels cannot be striped");
+        chan->stripes[i] = stripes[i];
+        chan->pfds[i] = stripes[i]->pfd;
+    }
+    chan->next_stripe = 0;
+    pthread_mutex_init(&chan->recv_mutex, NULL);
+
+    return (struct command_channel *)chan;
+}
+
+namespace {
+  struct command_channel_vtable command_channel_socket_striped_vtable = {
+    command_channel_socket_buffer_size,
+    command_channel_socket_striped_new_command,
+    command_channel_socket_attach_buffer,
+    command_channel_socket_striped_send_command,
+    command_channel_socket_striped_transfer_command,
+    command_channel_socket_striped_receive_command,
+    command_channel_socket_get_buffer,
+    command_channel_socket_get_data_region,
+    command_channel_socket_free_command,
+    command_channel_socket_striped_free,
+    command_channel_socket_print_command,
+    command_channel_socket_read_buffer
+  };
+}  // namespace
+
+};  // namespace chansocketutil
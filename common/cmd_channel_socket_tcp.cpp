@@ -10,6 +10,7 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <chrono>
 #include <iostream>
 #include <string>
@@ -17,11 +18,13 @@
 #include <boost/algorithm/string.hpp>
 #include <boost/asio.hpp>
 
+#include "common/cmd_buffer_pool.h"
 #include "common/cmd_channel_impl.h"
 #include "common/devconf.h"
 #include "common/debug.h"
 #include "common/guest_mem.h"
 #include "common/cmd_handler.h"
+#include "common/cmd_wire.h"
 #include "cmd_channel_socket_utilities.h"
 #include "guest_config.h"
 #include "manager_service.proto.h"
@@ -35,11 +38,12 @@ namespace {
 }
 
 /**
- * TCP channel guestlib endpoint.
+ * Ask the API server manager to assign API servers to this guestlib.
  *
- * The `manager_tcp` is required to use the TCP channel.
+ * Returns the list of assigned API server addresses in `IP:PORT` format.
+ * The manager address is read from the guest configuration.
  */
-std::vector<struct command_channel*> command_channel_socket_tcp_guest_new()
+std::vector<std::string> chansocketutil::request_worker_assignment()
 {
     // Connect API server manager
     boost::asio::io_service io_service;
@@ -80,17 +84,138 @@ std::vector<struct command_channel*> command_channel_socket_tcp_guest_new()
         fprintf(stderr, "No API server is assigned");
     }
 
+    return worker_address;
+}
+
+namespace {
+  /* Sent by the guestlib on every connection before any command. */
+  struct socket_tcp_hello {
+    uint32_t magic;
+    uint16_t index;
+    uint16_t count;
+    uint16_t lane;      /* 0 for commands, 1 for the bulk lane of connection `index` */
+    uint16_t lanes;
+    uint32_t features;
+    uint16_t wire_version;  /* newest command header encoding the guestlib uses */
+    uint16_t reserved;
+  };
+  constexpr uint32_t kTcpHelloMagic = 0x34415641;  // "AVA4"
+  /* Buffers may be streamed, so both ends use the plain socket path */
+  constexpr uint32_t kTcpHelloStreams = 0x1;
+
+  /* Sent by the API server on every command connection once it has
+   * accepted all of them. */
+  struct socket_tcp_welcome {
+    uint32_t magic;
+    uint16_t wire_version;  /* command header encoding of both ends */
+    uint16_t features;      /* the features of the hello that the API server accepts */
+  };
+
+  /**
+   * Connect to an API server, retrying until the configured connect
+   * timeout expires.
+   * @return The connected socket, or -1 on timeout.
+   */
+  int socket_tcp_connect(const struct sockaddr_in *address)
+  {
+    auto connect_start = std::chrono::steady_clock::now();
+    for (;;) {
+      int fd = socket(AF_INET, SOCK_STREAM, 0);
+      setsockopt_lowlatency(fd);
+      if (!connect(fd, (const struct sockaddr *)address, sizeof(*address)))
+        return fd;
+
+      close(fd);
+      auto connect_checkpoint = std::chrono::steady_clock::now();
+      if ((uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+            connect_checkpoint - connect_start).count() > guestconfig::config->connect_timeout_)
+        return -1;
+    }
+  }
+
+  /**
+   * Receive the handler initialization command, which the guestlib sends
+   * first on the channel, without reading any byte past it.
+   */
+  void socket_tcp_recv_init(struct chansocketutil::command_channel_socket *chan,
+                            struct command_handler_initialize_api_command *init_msg)
+  {
+    if (chan->wire_version == COMMAND_WIRE_VERBATIM) {
+      recv_socket(chan->sock_fd, init_msg, sizeof(struct command_handler_initialize_api_command));
+      return;
+    }
+
+    char header[COMMAND_WIRE_HEADER_MAX];
+    struct command_base cmd_base;
+    size_t size = 0;
+    do {
+      if (size == sizeof(header)) {
+        fprintf(stderr, "[%d] Corrupt command header\n", chan->listen_port);
+        exit(-1);
+      }
+      recv_socket(chan->sock_fd, header + size++, 1);
+    } while (!chansocketutil::command_channel_socket_peek_header(chan, header, size, &cmd_base));
+    if (cmd_base.command_size != sizeof(struct command_handler_initialize_api_command) || cmd_base.region_size) {
+      fprintf(stderr, "[%d] Unexpected TCP channel handshake\n", chan->listen_port);
+      exit(-1);
+    }
+    memcpy(init_msg, &cmd_base, sizeof(struct command_base));
+    recv_socket(chan->sock_fd, (char *)init_msg + sizeof(struct command_base),
+                cmd_base.command_size - sizeof(struct command_base));
+  }
+}
+
+/**
+ * TCP channel guestlib endpoint.
+ *
+ * The `manager_tcp` is required to use the TCP channel. With
+ * `tcp_connections` greater than one, every API server is connected
+ * several times and the connections are striped by guest thread.
+ * Async calls are coalesced into shared writes for up to
+ * `tcp_coalesce_delay` microseconds, buffers of at least
+ * `tcp_compress_threshold` bytes are compressed, and large buffers that
+ * were sent before are replaced by references into a receiver cache of
+ * `tcp_dedup_cache` MB. Data regions of at least `tcp_bulk_threshold`
+ * bytes are sent on a second connection, and buffers of at least
+ * `tcp_stream_threshold` bytes are streamed behind their command. Command
+ * headers are encoded as agreed with the API server, up to
+ * `tcp_wire_version`.
+ */
+std::vector<struct command_channel*> command_channel_socket_tcp_guest_new()
+{
+    std::vector<std::string> worker_address = chansocketutil::request_worker_assignment();
+
+    int connections = std::min(std::max(guestconfig::config->tcp_connections_, 1), AVA_SOCKET_TCP_MAX_CONNECTIONS);
+    bool use_uring = guestconfig::config->tcp_io_uring_ != "off";
+    if (use_uring && connections > 1) {
+      std::cerr << "io_uring is not supported with multiple TCP connections, use the plain socket path" << std::endl;
+      use_uring = false;
+    }
+    size_t bulk_threshold = std::max(guestconfig::config->tcp_bulk_threshold_, 0);
+    if (bulk_threshold && connections > 1) {
+      std::cerr << "The bulk lane is not supported with multiple TCP connections, disable it" << std::endl;
+      bulk_threshold = 0;
+    }
+    if (bulk_threshold && use_uring) {
+      std::cerr << "io_uring is not supported with the bulk lane, use the plain socket path" << std::endl;
+      use_uring = false;
+    }
+    const int lanes = bulk_threshold ? 2 : 1;
+    size_t stream_threshold = std::max(guestconfig::config->tcp_stream_threshold_, 0);
+    if (stream_threshold && bulk_threshold) {
+      std::cerr << "Streaming is not supported with the bulk lane, disable it" << std::endl;
+      stream_threshold = 0;
+    }
+    if (stream_threshold && use_uring) {
+      std::cerr << "io_uring is not supported with streaming, use the plain socket path" << std::endl;
+      use_uring = false;
+    }
+    const int wire_version = std::min(std::max(guestconfig::config->tcp_wire_version_, 0), COMMAND_WIRE_VERSION);
+
     /* Connect API servers. */
     std::vector<struct command_channel*> channels;
+    std::vector<struct chansocketutil::command_channel_socket*> stripes;
     for (const auto& wa : worker_address) {
-      /* Create a channel for every API server. */
-      struct chansocketutil::command_channel_socket* chan =
-        (struct chansocketutil::command_channel_socket*)malloc(sizeof(struct chansocketutil::command_channel_socket));
-      command_channel_preinitialize((struct command_channel *) chan, &command_channel_socket_tcp_vtable);
-      pthread_mutex_init(&chan->send_mutex, NULL);
-      pthread_mutex_init(&chan->recv_mutex, NULL);
-      channels.push_back((struct command_channel*)chan);
-
       char worker_name[128];
       int worker_port;
       struct hostent *worker_server_info;
@@ -99,9 +224,6 @@ std::vector<struct command_channel*> command_channel_socket_tcp_guest_new()
       assert(worker_port > 0 && "Invalid API server port");
       DEBUG_PRINT("Assigned worker at %s:%d\n", worker_name, worker_port);
 
-      chan->vm_id = nw_global_vm_id = 1;
-      chan->listen_port = nw_worker_id = worker_port;
-
       /* Start a TCP client to connect API server at `worker_name:worker_port`. */
       struct sockaddr_in address;
       memset(&address, 0, sizeof(address));
@@ -109,35 +231,102 @@ std::vector<struct command_channel*> command_channel_socket_tcp_guest_new()
       address.sin_addr = *(struct in_addr *)worker_server_info->h_addr;
       address.sin_port = htons(worker_port);
       std::cerr <<  "Connect target API server (" << wa << ") at "
-                << inet_ntoa(address.sin_addr) << ":" << worker_port << std::endl;
+                << inet_ntoa(address.sin_addr) << ":" << worker_port;
+      if (connections > 1)
+        std::cerr << " with " << connections << " connections";
+      std::cerr << std::endl;
+
+      /* Create a channel for every connection. */
+      stripes.clear();
+      for (int i = 0; i < connections; i++) {
+        struct chansocketutil::command_channel_socket* chan =
+          (struct chansocketutil::command_channel_socket*)malloc(sizeof(struct chansocketutil::command_channel_socket));
+        chansocketutil::command_channel_socket_preinitialize(chan, &command_channel_socket_tcp_vtable);
+        stripes.push_back(chan);
+
+        chan->vm_id = nw_global_vm_id = 1;
+        chan->listen_fd = 0;
+        chan->listen_port = nw_worker_id = worker_port;
+
+        chan->sock_fd = socket_tcp_connect(&address);
+        if (chan->sock_fd < 0) {
+          std::cerr << "Connection to " << wa << " timeout" << std::endl;
+          goto error;
+        }
 
-      int connect_ret = -1;
-      auto connect_start = std::chrono::steady_clock::now();
-      while (connect_ret) {
-        chan->sock_fd = socket(AF_INET, SOCK_STREAM, 0);
-        setsockopt_lowlatency(chan->sock_fd);
-        connect_ret = connect(chan->sock_fd, (struct sockaddr *)&address, sizeof(address));
-        if (!connect_ret)
-          break;
+        struct socket_tcp_hello hello;
+        hello.magic = kTcpHelloMagic;
+        hello.index = i;
+        hello.count = connections;
+        hello.lane = 0;
+        hello.lanes = lanes;
+        hello.features = stream_threshold ? kTcpHelloStreams : 0;
+        hello.wire_version = wire_version;
+        hello.reserved = 0;
+        send_socket(chan->sock_fd, &hello, sizeof(hello));
+
+        if (lanes > 1) {
+          int bulk_fd = socket_tcp_connect(&address);
+          if (bulk_fd < 0) {
+            std::cerr << "Connection to " << wa << " timeout" << std::endl;
+            goto error;
+          }
+          hello.lane = 1;
+          send_socket(bulk_fd, &hello, sizeof(hello));
+          chansocketutil::command_channel_socket_enable_bulk(chan, bulk_fd, bulk_threshold);
+        }
 
-        close(chan->sock_fd);
-        auto connect_checkpoint = std::chrono::steady_clock::now();
-        if ((uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
-              connect_checkpoint - connect_start).count() > guestconfig::config->connect_timeout_) {
-          std::cerr << "Connection to " << worker_address[0] << " timeout" << std::endl;
+        chan->pfd.fd = chan->sock_fd;
+        chan->pfd.events = POLLIN | POLLRDHUP;
+
+        if (use_uring &&
+            chansocketutil::socket_uring_init(chan, guestconfig::config->tcp_io_uring_ == "sqpoll") < 0) {
+          std::cerr << "io_uring is unavailable, fall back to the plain socket path" << std::endl;
+        }
+      }
+      for (auto& chan : stripes) {
+        /* The API server answers once it has accepted every connection */
+        struct socket_tcp_welcome welcome;
+        recv_socket(chan->sock_fd, &welcome, sizeof(welcome));
+        if (welcome.magic != kTcpHelloMagic || welcome.wire_version > wire_version) {
+          std::cerr << "Unexpected TCP channel handshake from " << wa << std::endl;
           goto error;
         }
+        chan->wire_version = welcome.wire_version;
+        const bool streams = welcome.features & kTcpHelloStreams;
+        if (stream_threshold && !streams && chan == stripes[0])
+          std::cerr << "The API server at " << wa << " does not accept streamed buffers" << std::endl;
+
+        if (!chan->uring && guestconfig::config->tcp_coalesce_delay_ > 0)
+          chansocketutil::command_channel_socket_enable_coalescing(chan, guestconfig::config->tcp_coalesce_delay_);
+        chan->compress_threshold = std::max(guestconfig::config->tcp_compress_threshold_, 0);
+        chan->stream_threshold = streams ? stream_threshold : 0;
+        if (!chan->uring && guestconfig::config->tcp_dedup_cache_ > 0)
+          chan->dedup = chansocketutil::socket_dedup_sender_new(MB((size_t)guestconfig::config->tcp_dedup_cache_));
       }
 
-      chan->pfd.fd = chan->sock_fd;
-      chan->pfd.events = POLLIN | POLLRDHUP;
+      if (connections == 1)
+        channels.push_back((struct command_channel*)stripes[0]);
+      else
+        channels.push_back(chansocketutil::command_channel_socket_striped_new(stripes.data(), connections));
+      stripes.clear();
     }
 
     return channels;
 
 error:
-    for (auto& chan : channels)
+    for (auto& chan : stripes) {
+      if (chan->sock_fd >= 0)
+        close(chan->sock_fd);
+      if (chan->bulk) {
+        close(chan->bulk->fd);
+        delete chan->bulk;
+      }
+      cmd_buffer_pool_free(chan->cmd_pool);
       free(chan);
+    }
+    for (auto& chan : channels)
+      command_channel_free(chan);
     channels.clear();
     return channels;
 }
@@ -151,9 +340,7 @@ error:
 struct command_channel* command_channel_socket_tcp_worker_new(int worker_port)
 {
     struct chansocketutil::command_channel_socket *chan = (struct chansocketutil::command_channel_socket *)malloc(sizeof(struct chansocketutil::command_channel_socket));
-    command_channel_preinitialize((struct command_channel *) chan, &command_channel_socket_tcp_vtable);
-    pthread_mutex_init(&chan->send_mutex, NULL);
-    pthread_mutex_init(&chan->recv_mutex, NULL);
+    chansocketutil::command_channel_socket_preinitialize(chan, &command_channel_socket_tcp_vtable);
 
     struct sockaddr_in address;
     int addrlen = sizeof(address);
@@ -206,16 +393,129 @@ struct command_channel* command_channel_socket_tcp_worker_new(int worker_port)
     }
 #endif
 
+    /* Accept the remaining connections of a striped guestlib, and the bulk lanes */
+    struct socket_tcp_hello hello;
+    recv_socket(chan->sock_fd, &hello, sizeof(hello));
+    if (hello.magic != kTcpHelloMagic || hello.count < 1 || hello.index >= hello.count ||
+            hello.lane != 0 || hello.lanes < 1 || hello.lanes > 2 ||
+            (hello.lanes > 1 && hello.count > 1)) {
+        fprintf(stderr, "[%d] Unexpected TCP channel handshake\n", chan->listen_port);
+        exit(-1);
+    }
+    std::vector<struct chansocketutil::command_channel_socket*> stripes(hello.count, NULL);
+    std::vector<int> bulk_fds(hello.count, -1);
+    stripes[hello.index] = chan;
+    for (int i = 1; i < hello.count * hello.lanes; i++) {
+        int fd = accept(chan->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            perror("accept");
+        }
+        setsockopt_lowlatency(fd);
+
+        struct socket_tcp_hello stripe_hello;
+        recv_socket(fd, &stripe_hello, sizeof(stripe_hello));
+        if (stripe_hello.magic != kTcpHelloMagic || stripe_hello.count != hello.count ||
+                stripe_hello.index >= hello.count || stripe_hello.lanes != hello.lanes ||
+                stripe_hello.features != hello.features ||
+                stripe_hello.wire_version != hello.wire_version ||
+                stripe_hello.lane >= hello.lanes ||
+                (stripe_hello.lane == 0 && stripes[stripe_hello.index]) ||
+                (stripe_hello.lane == 1 && bulk_fds[stripe_hello.index] >= 0)) {
+            fprintf(stderr, "[%d] Unexpected TCP channel handshake\n", chan->listen_port);
+            exit(-1);
+        }
+        if (stripe_hello.lane == 1) {
+            bulk_fds[stripe_hello.index] = fd;
+            continue;
+        }
+
+        struct chansocketutil::command_channel_socket *stripe =
+            (struct chansocketutil::command_channel_socket *)malloc(sizeof(struct chansocketutil::command_channel_socket));
+        chansocketutil::command_channel_socket_preinitialize(stripe, &command_channel_socket_tcp_vtable);
+        stripe->listen_fd = 0;
+        stripe->listen_port = worker_port;
+        stripe->sock_fd = fd;
+        stripes[stripe_hello.index] = stripe;
+    }
+
+    /* AVA_TCP_COMPRESS_THRESHOLD=<bytes> compresses large buffers in replies */
+    const char *compress_env = getenv("AVA_TCP_COMPRESS_THRESHOLD");
+    size_t compress_threshold = compress_env ? strtoull(compress_env, NULL, 0) : 0;
+    /* AVA_TCP_DEDUP_CACHE=<MB> sends repeated buffers in replies by reference */
+    const char *dedup_env = getenv("AVA_TCP_DEDUP_CACHE");
+    size_t dedup_cache = dedup_env ? strtoull(dedup_env, NULL, 0) : 0;
+    /* AVA_TCP_BULK_THRESHOLD=<bytes> sends large reply regions on the guestlib's bulk lane */
+    const char *bulk_env = getenv("AVA_TCP_BULK_THRESHOLD");
+    size_t bulk_threshold = bulk_env ? strtoull(bulk_env, NULL, 0) : 0;
+#ifdef AVA_RECORD_REPLAY
+    /* Calls are recorded from their data region, which lacks streamed buffers */
+    const uint16_t features = 0;
+    if (hello.features & kTcpHelloStreams)
+        fprintf(stderr, "[%d] Streamed buffers are refused while calls are recorded\n", chan->listen_port);
+#else
+    const uint16_t features = hello.features & kTcpHelloStreams;
+#endif
+    /* AVA_TCP_STREAM_THRESHOLD=<bytes> streams large reply buffers if the guestlib streams */
+    const char *stream_env = getenv("AVA_TCP_STREAM_THRESHOLD");
+    size_t stream_threshold = stream_env && (features & kTcpHelloStreams) ?
+                              strtoull(stream_env, NULL, 0) : 0;
+    /* AVA_TCP_WIRE_VERSION=<version> caps the command header encoding */
+    const char *wire_env = getenv("AVA_TCP_WIRE_VERSION");
+    int wire_version = std::min<int>(hello.wire_version, wire_env ? atoi(wire_env) : COMMAND_WIRE_VERSION);
+    wire_version = std::max(std::min(wire_version, COMMAND_WIRE_VERSION), 0);
+
+    struct socket_tcp_welcome welcome;
+    welcome.magic = kTcpHelloMagic;
+    welcome.wire_version = wire_version;
+    welcome.features = features;
+    for (auto stripe : stripes) {
+        stripe->wire_version = wire_version;
+        send_socket(stripe->sock_fd, &welcome, sizeof(welcome));
+    }
+
     /* Receive handler initialization API */
     struct command_handler_initialize_api_command init_msg;
-    recv_socket(chan->sock_fd, &init_msg, sizeof(struct command_handler_initialize_api_command));
-    chan->init_command_type = init_msg.new_api_id;
-    chan->vm_id = init_msg.base.vm_id;
-    fprintf(stderr, "[%d] Accept guestlib with API_ID=%x\n",
-            chan->listen_port, chan->init_command_type);
+    socket_tcp_recv_init(stripes[0], &init_msg);
+    for (auto stripe : stripes) {
+        stripe->compress_threshold = compress_threshold;
+        stripe->stream_threshold = stream_threshold;
+        stripe->init_command_type = init_msg.new_api_id;
+        stripe->vm_id = init_msg.base.vm_id;
+        stripe->pfd.fd = stripe->sock_fd;
+        stripe->pfd.events = POLLIN | POLLRDHUP;
+    }
+    for (int i = 0; i < hello.count; i++) {
+        if (bulk_fds[i] >= 0)
+            chansocketutil::command_channel_socket_enable_bulk(stripes[i], bulk_fds[i], bulk_threshold);
+    }
+    fprintf(stderr, "[%d] Accept guestlib with API_ID=%x, wire format %d\n",
+            chan->listen_port, chan->init_command_type, wire_version);
+    if (hello.count > 1) {
+        fprintf(stderr, "[%d] Guestlib uses %d connections\n", chan->listen_port, hello.count);
+        if (dedup_cache > 0) {
+            for (auto stripe : stripes)
+                stripe->dedup = chansocketutil::socket_dedup_sender_new(MB(dedup_cache));
+        }
+        return chansocketutil::command_channel_socket_striped_new(stripes.data(), hello.count);
+    }
 
-    chan->pfd.fd = chan->sock_fd;
-    chan->pfd.events = POLLIN | POLLRDHUP;
+    /* AVA_TCP_IO_URING=[on | sqpoll] switches to the io_uring path */
+    const char *uring_env = getenv("AVA_TCP_IO_URING");
+    if (chan->bulk && uring_env && strcmp(uring_env, "off")) {
+        fprintf(stderr, "[%d] io_uring is not supported with the bulk lane, use the plain socket path\n",
+                chan->listen_port);
+    }
+    else if ((features & kTcpHelloStreams) && uring_env && strcmp(uring_env, "off")) {
+        fprintf(stderr, "[%d] io_uring is not supported with streaming, use the plain socket path\n",
+                chan->listen_port);
+    }
+    else if (uring_env && strcmp(uring_env, "off") &&
+        chansocketutil::socket_uring_init(chan, !strcmp(uring_env, "sqpoll")) < 0) {
+        fprintf(stderr, "[%d] io_uring is unavailable, fall back to the plain socket path\n",
+                chan->listen_port);
+    }
+    if (!chan->uring && dedup_cache > 0)
+        chan->dedup = chansocketutil::socket_dedup_sender_new(MB(dedup_cache));
 
     return (struct command_channel *)chan;
 }
@@ -224,9 +524,7 @@ struct command_channel* command_channel_socket_tcp_migration_new(int worker_port
 {
     struct chansocketutil::command_channel_socket *chan =
       (struct chansocketutil::command_channel_socket *)malloc(sizeof(struct chansocketutil::command_channel_socket));
-    command_channel_preinitialize((struct command_channel *) chan, &command_channel_socket_tcp_vtable);
-    pthread_mutex_init(&chan->send_mutex, NULL);
-    pthread_mutex_init(&chan->recv_mutex, NULL);
+    chansocketutil::command_channel_socket_preinitialize(chan, &command_channel_socket_tcp_vtable);
 
     chan->listen_port = worker_port + 2000;
 
@@ -305,7 +603,8 @@ namespace {
     chansocketutil::command_channel_socket_get_data_region,
     chansocketutil::command_channel_socket_free_command,
     chansocketutil::command_channel_socket_free,
-    chansocketutil::command_channel_socket_print_command
+    chansocketutil::command_channel_socket_print_command,
+    chansocketutil::command_channel_socket_read_buffer
   };
 };
 
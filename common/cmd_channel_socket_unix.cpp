@@ -0,0 +1,435 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <assert.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "common/cmd_buffer_pool.h"
+#include "common/cmd_channel_impl.h"
+#include "common/cmd_copy.h"
+#include "common/devconf.h"
+#include "common/debug.h"
+#include "common/cmd_handler.h"
+#include "cmd_channel_socket_utilities.h"
+#include "guest_config.h"
+
+extern int nw_global_vm_id;
+
+namespace {
+  extern struct command_channel_vtable command_channel_socket_unix_vtable;
+}
+
+/**
+ * Channel private data stored in `command_base::reserved_area`. A command
+ * whose data region lives in a shared memory file keeps the mapping in
+ * `bulk`; otherwise it is laid out like any other socket command.
+ */
+struct socket_unix_command_private {
+    struct chansocketutil::socket_command_private socket;
+    void *bulk;
+    size_t bulk_size;
+    int bulk_fd;
+};
+
+static inline struct socket_unix_command_private *socket_unix_command_private(const struct command_base *cmd)
+{
+    static_assert(sizeof(struct socket_unix_command_private) <= sizeof(cmd->reserved_area),
+                  "command_base::reserved_area is not large enough.");
+    return (struct socket_unix_command_private *)cmd->reserved_area;
+}
+
+/**
+ * Fill in the abstract socket address of the API server at `worker_port`.
+ */
+static socklen_t socket_unix_address(struct sockaddr_un *addr, int worker_port)
+{
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    int len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1,
+                       AVA_SOCKET_UNIX_NAME_PREFIX "%d", worker_port);
+    return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+//! Sending
+
+static struct command_base* command_channel_socket_unix_new_command(struct command_channel* c,
+                                                                    size_t command_struct_size,
+                                                                    size_t data_region_size)
+{
+    struct chansocketutil::command_channel_socket *chan = (struct chansocketutil::command_channel_socket *)c;
+    struct command_base *cmd;
+    struct socket_unix_command_private *priv;
+    void *bulk = MAP_FAILED;
+    int bulk_fd = -1;
+
+    if (data_region_size >= AVA_SOCKET_UNIX_FD_THRESHOLD) {
+        bulk_fd = memfd_create("ava_bulk", MFD_CLOEXEC);
+        if (bulk_fd >= 0 && ftruncate(bulk_fd, data_region_size) == 0)
+            bulk = mmap(NULL, data_region_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, bulk_fd, 0);
+        if (bulk == MAP_FAILED && bulk_fd >= 0) {
+            close(bulk_fd);
+            bulk_fd = -1;
+        }
+    }
+
+    /* Small data regions, and large ones without a shared memory file,
+     * are streamed through the socket. */
+    if (bulk == MAP_FAILED) {
+        cmd = chansocketutil::command_channel_socket_new_command(c, command_struct_size, data_region_size);
+        priv = socket_unix_command_private(cmd);
+        priv->bulk = NULL;
+        priv->bulk_size = 0;
+        priv->bulk_fd = -1;
+        return cmd;
+    }
+
+    cmd = (struct command_base *)cmd_buffer_pool_alloc(chan->cmd_pool, command_struct_size);
+    memset(cmd, 0, command_struct_size);
+    cmd->vm_id = chan->vm_id;
+    cmd->command_size = command_struct_size;
+    cmd->data_region = (void *)command_struct_size;
+    cmd->region_size = data_region_size;
+
+    priv = socket_unix_command_private(cmd);
+    priv->socket.cur_offset = command_struct_size;
+    priv->socket.sg = NULL;
+    priv->bulk = bulk;
+    priv->bulk_size = data_region_size;
+    priv->bulk_fd = bulk_fd;
+    return cmd;
+}
+
+static void* command_channel_socket_unix_attach_buffer(struct command_channel* c, struct command_base* cmd,
+                                                       void* buffer, size_t size)
+{
+    struct socket_unix_command_private *priv = socket_unix_command_private(cmd);
+    if (!priv->bulk)
+        return chansocketutil::command_channel_socket_attach_buffer(c, cmd, buffer, size);
+
+    assert(buffer && size != 0);
+    void *offset = (void *)priv->socket.cur_offset;
+    priv->socket.cur_offset += size;
+    assert(priv->socket.cur_offset <= cmd->command_size + cmd->region_size);
+    cmd_copy((char *)priv->bulk + ((uintptr_t)offset - cmd->command_size), buffer, size, CMD_COPY_SHARED);
+    return offset;
+}
+
+/**
+ * Send the command struct with the data region file descriptor attached.
+ * The receiver maps the file, so the data region never crosses the socket.
+ */
+static void command_channel_socket_unix_send_bulk(struct chansocketutil::command_channel_socket *chan,
+                                                  struct command_base *cmd)
+{
+    struct socket_unix_command_private *priv = socket_unix_command_private(cmd);
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { cmd, cmd->command_size };
+    struct msghdr msg;
+    ssize_t ret;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &priv->bulk_fd, sizeof(int));
+    /* Only the mapping is still needed here; none of it is the receiver's */
+    priv->socket.cur_offset = 0;
+
+    pthread_mutex_lock(&chan->send_mutex);
+    do {
+        ret = sendmsg(chan->sock_fd, &msg, MSG_NOSIGNAL);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+        perror("sendmsg");
+        exit(0);
+    }
+    /* The descriptor travels with the first byte; stream the rest. */
+    if ((size_t)ret < cmd->command_size)
+        send_socket(chan->sock_fd, (char *)cmd + ret, cmd->command_size - ret);
+    pthread_mutex_unlock(&chan->send_mutex);
+}
+
+static void command_channel_socket_unix_release_bulk(struct command_base *cmd)
+{
+    struct socket_unix_command_private *priv = socket_unix_command_private(cmd);
+    munmap(priv->bulk, priv->bulk_size);
+    if (priv->bulk_fd >= 0)
+        close(priv->bulk_fd);
+    cmd_buffer_pool_release(cmd);
+}
+
+static void command_channel_socket_unix_send_command(struct command_channel* c, struct command_base* cmd)
+{
+    struct chansocketutil::command_channel_socket *chan = (struct chansocketutil::command_channel_socket *)c;
+    if (!socket_unix_command_private(cmd)->bulk) {
+        chansocketutil::command_channel_socket_send_command(c, cmd);
+        return;
+    }
+
+    command_channel_socket_unix_send_bulk(chan, cmd);
+    command_channel_socket_unix_release_bulk(cmd);
+}
+
+static void command_channel_socket_unix_transfer_command(struct command_channel* c,
+                                                         const struct command_channel *source,
+                                                         const struct command_base *cmd)
+{
+    if (cmd->region_size < AVA_SOCKET_UNIX_FD_THRESHOLD) {
+        chansocketutil::command_channel_socket_transfer_command(c, source, cmd);
+        return;
+    }
+
+    struct command_base *new_cmd = command_channel_socket_unix_new_command(c, cmd->command_size, cmd->region_size);
+    struct socket_unix_command_private priv = *socket_unix_command_private(new_cmd);
+    if (!priv.bulk) {
+        chansocketutil::command_channel_socket_release_command(new_cmd);
+        chansocketutil::command_channel_socket_transfer_command(c, source, cmd);
+        return;
+    }
+
+    memcpy(new_cmd, cmd, cmd->command_size);
+    *socket_unix_command_private(new_cmd) = priv;
+    cmd_copy(priv.bulk, command_channel_get_data_region(source, cmd), cmd->region_size, CMD_COPY_SHARED);
+    command_channel_socket_unix_send_command(c, new_cmd);
+}
+
+//! Receiving
+
+/**
+ * Receive exactly `size` bytes and collect a file descriptor passed along
+ * with them. `*fd` is left at -1 when none is attached.
+ */
+static void socket_unix_recv_with_fd(int sockfd, void *buf, size_t size, int *fd)
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    size_t received = 0;
+    ssize_t ret;
+
+    *fd = -1;
+    while (received < size) {
+        struct iovec iov = { (char *)buf + received, size - received };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        ret = recvmsg(sockfd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            perror("recvmsg");
+            exit(0);
+        }
+        received += ret;
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+                memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+}
+
+static struct command_base* command_channel_socket_unix_receive_command(struct command_channel* c)
+{
+    struct chansocketutil::command_channel_socket *chan = (struct chansocketutil::command_channel_socket *)c;
+    struct socket_unix_command_private *priv;
+    struct command_base cmd_base;
+    struct command_base *cmd;
+    int bulk_fd;
+
+    chansocketutil::command_channel_socket_wait_command(chan);
+
+    pthread_mutex_lock(&chan->recv_mutex);
+    socket_unix_recv_with_fd(chan->sock_fd, &cmd_base, sizeof(struct command_base), &bulk_fd);
+    size_t inline_size = cmd_base.command_size + (bulk_fd >= 0 ? 0 : cmd_base.region_size);
+    cmd = (struct command_base *)cmd_buffer_pool_alloc(chan->cmd_pool, inline_size);
+    memcpy(cmd, &cmd_base, sizeof(struct command_base));
+    chansocketutil::command_channel_socket_clear_private(cmd);
+    recv_socket(chan->sock_fd, (uint8_t *)cmd + sizeof(struct command_base),
+                inline_size - sizeof(struct command_base));
+    pthread_mutex_unlock(&chan->recv_mutex);
+
+    priv = socket_unix_command_private(cmd);
+    priv->bulk = NULL;
+    priv->bulk_size = 0;
+    priv->bulk_fd = -1;
+    if (bulk_fd >= 0) {
+        priv->bulk = mmap(NULL, cmd->region_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, bulk_fd, 0);
+        close(bulk_fd);
+        if (priv->bulk == MAP_FAILED) {
+            perror("mmap bulk data");
+            exit(EXIT_FAILURE);
+        }
+        priv->bulk_size = cmd->region_size;
+    }
+
+    chansocketutil::command_channel_socket_print_command(c, cmd);
+    return cmd;
+}
+
+static void* command_channel_socket_unix_get_buffer(const struct command_channel *c, const struct command_base *cmd,
+                                                    void* buffer_id)
+{
+    struct socket_unix_command_private *priv = socket_unix_command_private(cmd);
+    if (!priv->bulk)
+        return chansocketutil::command_channel_socket_get_buffer(c, cmd, buffer_id);
+    if (!buffer_id)
+        return NULL;
+    return (char *)priv->bulk + ((uintptr_t)buffer_id - cmd->command_size);
+}
+
+static void* command_channel_socket_unix_get_data_region(const struct command_channel *c, const struct command_base *cmd)
+{
+    struct socket_unix_command_private *priv = socket_unix_command_private(cmd);
+    if (!priv->bulk)
+        return chansocketutil::command_channel_socket_get_data_region(c, cmd);
+    return priv->bulk;
+}
+
+static void command_channel_socket_unix_free_command(struct command_channel* c, struct command_base* cmd)
+{
+    if (!socket_unix_command_private(cmd)->bulk) {
+        chansocketutil::command_channel_socket_free_command(c, cmd);
+        return;
+    }
+    command_channel_socket_unix_release_bulk(cmd);
+}
+
+//! Constructors
+
+/**
+ * Unix-domain socket channel guestlib endpoint. The guestlib must run on
+ * the same host as the assigned API server.
+ */
+struct command_channel* command_channel_socket_unix_guest_new()
+{
+    std::vector<std::string> worker_address = chansocketutil::request_worker_assignment();
+    if (worker_address.empty())
+        return NULL;
+
+    char worker_name[128];
+    int worker_port;
+    parseServerAddress(worker_address[0].c_str(), NULL, worker_name, &worker_port);
+    assert(worker_port > 0 && "Invalid API server port");
+    DEBUG_PRINT("Assigned worker at %s:%d\n", worker_name, worker_port);
+
+    struct chansocketutil::command_channel_socket *chan =
+        (struct chansocketutil::command_channel_socket *)malloc(sizeof(struct chansocketutil::command_channel_socket));
+    chansocketutil::command_channel_socket_preinitialize(chan, &command_channel_socket_unix_vtable);
+    chan->vm_id = nw_global_vm_id = 1;
+    chan->listen_fd = 0;
+    chan->listen_port = nw_worker_id = worker_port;
+
+    struct sockaddr_un address;
+    socklen_t addrlen = socket_unix_address(&address, worker_port);
+    std::cerr << "Connect target API server at @" << address.sun_path + 1 << std::endl;
+
+    /* The API server may not be listening yet. */
+    auto connect_start = std::chrono::steady_clock::now();
+    while (true) {
+        chan->sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (!connect(chan->sock_fd, (struct sockaddr *)&address, addrlen))
+            break;
+
+        close(chan->sock_fd);
+        auto connect_checkpoint = std::chrono::steady_clock::now();
+        if ((uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+              connect_checkpoint - connect_start).count() > guestconfig::config->connect_timeout_) {
+            std::cerr << "Connection to @" << address.sun_path + 1 << " timeout" << std::endl;
+            chan->sock_fd = -1;
+            cmd_buffer_pool_free(chan->cmd_pool);
+            free(chan);
+            return NULL;
+        }
+        usleep(1000);
+    }
+
+    chan->pfd.fd = chan->sock_fd;
+    chan->pfd.events = POLLIN | POLLRDHUP;
+
+    return (struct command_channel *)chan;
+}
+
+/**
+ * Unix-domain socket channel API server endpoint.
+ * @worker_port: the port assigned to the worker by the manager, which
+ * names the listening socket.
+ */
+struct command_channel* command_channel_socket_unix_worker_new(int worker_port)
+{
+    struct chansocketutil::command_channel_socket *chan =
+        (struct chansocketutil::command_channel_socket *)malloc(sizeof(struct chansocketutil::command_channel_socket));
+    chansocketutil::command_channel_socket_preinitialize(chan, &command_channel_socket_unix_vtable);
+    chan->listen_port = worker_port;
+
+    struct sockaddr_un address;
+    socklen_t addrlen = socket_unix_address(&address, worker_port);
+
+    if ((chan->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        perror("socket");
+    }
+    if (bind(chan->listen_fd, (struct sockaddr *)&address, addrlen) < 0) {
+        perror("bind failed");
+    }
+    if (listen(chan->listen_fd, 10) < 0) {
+        perror("listen");
+    }
+
+    fprintf(stderr, "[%d] Waiting for guestlib connection at @%s\n", chan->listen_port, address.sun_path + 1);
+    chan->sock_fd = accept4(chan->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (chan->sock_fd < 0) {
+       perror("accept");
+    }
+
+    /* Receive handler initialization API */
+    struct command_handler_initialize_api_command init_msg;
+    recv_socket(chan->sock_fd, &init_msg, sizeof(struct command_handler_initialize_api_command));
+    chan->init_command_type = init_msg.new_api_id;
+    chan->vm_id = init_msg.base.vm_id;
+    fprintf(stderr, "[%d] Accept guestlib with API_ID=%x\n",
+            chan->listen_port, chan->init_command_type);
+
+    chan->pfd.fd = chan->sock_fd;
+    chan->pfd.events = POLLIN | POLLRDHUP;
+
+    return (struct command_channel *)chan;
+}
+
+namespace {
+  struct command_channel_vtable command_channel_socket_unix_vtable = {
+    chansocketutil::command_channel_socket_buffer_size,
+    command_channel_socket_unix_new_command,
+    command_channel_socket_unix_attach_buffer,
+    command_channel_socket_unix_send_command,
+    command_channel_socket_unix_transfer_command,
+    command_channel_socket_unix_receive_command,
+    command_channel_socket_unix_get_buffer,
+    command_channel_socket_unix_get_data_region,
+    command_channel_socket_unix_free_command,
+    chansocketutil::command_channel_socket_free,
+    chansocketutil::command_channel_socket_print_command
+  };
+};
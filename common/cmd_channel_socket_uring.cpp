@@ -0,0 +1,636 @@
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "common/cmd_buffer_pool.h"
+#include "common/cmd_channel_impl.h"
+#include "common/devconf.h"
+#include "common/debug.h"
+#include "common/cmd_handler.h"
+#include "cmd_channel_socket_utilities.h"
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define AVA_HAVE_IO_URING
+#endif
+
+/**
+ * io_uring variant of the socket channel.
+ *
+ * The wire format is the same as the plain socket channel, so each endpoint
+ * can enable it independently. Sends are queued and a single sender thread
+ * at a time pushes every queued command out with one vectored `sendmsg`
+ * request, so concurrent guest threads share the submission. Receives read
+ * as much as is available into a per-channel staging buffer, from which
+ * several small commands can be carved without another request. With
+ * `sqpoll` the kernel polls the submission queue and submissions do not need
+ * a system call at all. Without it every send and receive request still
+ * takes an `io_uring_enter`, so the system calls only fall behind the calls
+ * when concurrent senders share a batch.
+ *
+ * The rings are driven directly through the system calls, so no additional
+ * library is needed. `socket_uring_init` fails on kernels without io_uring
+ * (or without IORING_OP_SENDMSG / IORING_OP_RECV), and the channel then
+ * keeps using the plain socket path.
+ */
+
+namespace chansocketutil {
+
+#ifdef AVA_HAVE_IO_URING
+
+namespace {
+
+extern struct command_channel_vtable command_channel_socket_uring_vtable;
+
+struct uring_queue {
+    int fd;
+    unsigned setup_flags;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_entries;
+    unsigned *sq_flags;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+};
+
+}  // namespace
+
+struct socket_uring {
+    struct uring_queue tx;
+    struct uring_queue rx;
+
+    /* Commands waiting to be sent, protected by `send_mutex` */
+    std::vector<struct command_base *> *pending;
+    std::vector<struct command_base *> *batch;
+    std::vector<struct iovec> *iov;
+    int sending;
+
+    /* Commands referencing caller buffers wait until they are sent */
+    uint64_t enqueued;
+    uint64_t sent;
+    pthread_cond_t sent_cond;
+
+    /* Receive staging buffer, protected by `recv_mutex` */
+    char *recv_buf;
+    size_t recv_begin;
+    size_t recv_end;
+    int recv_inflight;
+};
+
+namespace {
+
+static inline int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static inline int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_queue_exit(struct uring_queue *q)
+{
+    if (q->sqes && q->sqes != MAP_FAILED)
+        munmap(q->sqes, q->sqes_size);
+    if (q->cq_ptr && q->cq_ptr != MAP_FAILED && q->cq_ptr != q->sq_ptr)
+        munmap(q->cq_ptr, q->cq_size);
+    if (q->sq_ptr && q->sq_ptr != MAP_FAILED)
+        munmap(q->sq_ptr, q->sq_size);
+    if (q->fd >= 0)
+        close(q->fd);
+    memset(q, 0, sizeof(struct uring_queue));
+    q->fd = -1;
+}
+
+/**
+ * uring_queue_init - Set up an io_uring instance
+ * @q: the queue to initialize
+ * @entries: the submission queue depth
+ * @sqpoll: use a kernel thread to poll the submission queue
+ * @attach: share the polling thread of this queue, or NULL
+ *
+ * Returns 0 on success, or -1 when io_uring is not usable.
+ */
+static int uring_queue_init(struct uring_queue *q, unsigned entries, int sqpoll, const struct uring_queue *attach)
+{
+    struct io_uring_params p;
+
+    memset(q, 0, sizeof(struct uring_queue));
+    memset(&p, 0, sizeof(p));
+    if (sqpoll) {
+        p.flags = IORING_SETUP_SQPOLL;
+        p.sq_thread_idle = AVA_SOCKET_URING_SQ_THREAD_IDLE;
+        if (attach && (attach->setup_flags & IORING_SETUP_SQPOLL)) {
+            p.flags |= IORING_SETUP_ATTACH_WQ;
+            p.wq_fd = attach->fd;
+        }
+    }
+    q->fd = sys_io_uring_setup(entries, &p);
+    if (q->fd < 0 && sqpoll) {
+        /* SQPOLL may require privileges on older kernels */
+        memset(&p, 0, sizeof(p));
+        q->fd = sys_io_uring_setup(entries, &p);
+    }
+    if (q->fd < 0)
+        return -1;
+    q->setup_flags = p.flags;
+
+    q->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    q->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        q->sq_size = q->cq_size = std::max(q->sq_size, q->cq_size);
+
+    q->sq_ptr = mmap(NULL, q->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     q->fd, IORING_OFF_SQ_RING);
+    if (q->sq_ptr == MAP_FAILED)
+        goto error;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        q->cq_ptr = q->sq_ptr;
+    }
+    else {
+        q->cq_ptr = mmap(NULL, q->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         q->fd, IORING_OFF_CQ_RING);
+        if (q->cq_ptr == MAP_FAILED)
+            goto error;
+    }
+    q->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    q->sqes = (struct io_uring_sqe *)mmap(NULL, q->sqes_size, PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE, q->fd, IORING_OFF_SQES);
+    if (q->sqes == MAP_FAILED)
+        goto error;
+
+    q->sq_head = (unsigned *)((char *)q->sq_ptr + p.sq_off.head);
+    q->sq_tail = (unsigned *)((char *)q->sq_ptr + p.sq_off.tail);
+    q->sq_mask = (unsigned *)((char *)q->sq_ptr + p.sq_off.ring_mask);
+    q->sq_entries = (unsigned *)((char *)q->sq_ptr + p.sq_off.ring_entries);
+    q->sq_flags = (unsigned *)((char *)q->sq_ptr + p.sq_off.flags);
+    q->sq_array = (unsigned *)((char *)q->sq_ptr + p.sq_off.array);
+    q->cq_head = (unsigned *)((char *)q->cq_ptr + p.cq_off.head);
+    q->cq_tail = (unsigned *)((char *)q->cq_ptr + p.cq_off.tail);
+    q->cq_mask = (unsigned *)((char *)q->cq_ptr + p.cq_off.ring_mask);
+    q->cqes = (struct io_uring_cqe *)((char *)q->cq_ptr + p.cq_off.cqes);
+    return 0;
+
+error:
+    uring_queue_exit(q);
+    return -1;
+}
+
+/**
+ * Check that the kernel supports every opcode used by the channel.
+ */
+static int uring_queue_probe(struct uring_queue *q)
+{
+    const size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = (struct io_uring_probe *)calloc(1, probe_size);
+    int supported = 0;
+
+    if (sys_io_uring_register(q->fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+        supported = probe->last_op >= IORING_OP_RECV &&
+                    (probe->ops[IORING_OP_SENDMSG].flags & IO_URING_OP_SUPPORTED) &&
+                    (probe->ops[IORING_OP_RECV].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return supported;
+}
+
+/**
+ * Get the next free submission queue entry. The caller owns the queue, and
+ * at most two requests are ever in flight per queue.
+ */
+static struct io_uring_sqe *uring_queue_get_sqe(struct uring_queue *q)
+{
+    unsigned tail = *q->sq_tail;
+    unsigned head = __atomic_load_n(q->sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head >= *q->sq_entries)
+        return NULL;
+
+    unsigned index = tail & *q->sq_mask;
+    struct io_uring_sqe *sqe = &q->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    q->sq_array[index] = index;
+    return sqe;
+}
+
+static void uring_queue_submit(struct uring_queue *q, unsigned wait_nr)
+{
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    unsigned to_submit = 1;
+
+    __atomic_store_n(q->sq_tail, *q->sq_tail + 1, __ATOMIC_RELEASE);
+    if (q->setup_flags & IORING_SETUP_SQPOLL) {
+        to_submit = 0;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(q->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP)
+            flags |= IORING_ENTER_SQ_WAKEUP;
+        else if (!wait_nr)
+            return;
+    }
+
+    while (sys_io_uring_enter(q->fd, to_submit, wait_nr, flags) < 0) {
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            perror("io_uring_enter");
+            exit(-1);
+        }
+        /* The submission has been consumed when the call is interrupted
+         * while waiting for completions. */
+        to_submit = 0;
+    }
+}
+
+/**
+ * Wait for the next completion and return its result.
+ */
+static int uring_queue_wait(struct uring_queue *q)
+{
+    int spin = (q->setup_flags & IORING_SETUP_SQPOLL) ? AVA_SOCKET_URING_SPIN_COUNT : 0;
+
+    while (true) {
+        unsigned head = *q->cq_head;
+        if (head != __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE)) {
+            int res = q->cqes[head & *q->cq_mask].res;
+            __atomic_store_n(q->cq_head, head + 1, __ATOMIC_RELEASE);
+            return res;
+        }
+        if (spin > 0) {
+            spin--;
+            continue;
+        }
+        if (sys_io_uring_enter(q->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+            perror("io_uring_enter");
+            exit(-1);
+        }
+    }
+}
+
+/**
+ * Push a batch of commands out with vectored sends. The caller must be
+ * the only active sender.
+ */
+static void socket_uring_send_batch(struct command_channel_socket *chan, std::vector<struct command_base *> &batch)
+{
+    struct socket_uring *uring = chan->uring;
+    std::vector<struct iovec> &iov = *uring->iov;
+
+    iov.clear();
+    for (auto cmd : batch)
+        command_channel_socket_command_iov(chan, cmd, iov);
+
+    size_t first = 0;
+    while (first < iov.size()) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov[first];
+        msg.msg_iovlen = std::min(iov.size() - first, (size_t)IOV_MAX);
+
+        struct io_uring_sqe *sqe = uring_queue_get_sqe(&uring->tx);
+        assert(sqe != NULL);
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = chan->sock_fd;
+        sqe->addr = (uintptr_t)&msg;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        uring_queue_submit(&uring->tx, 1);
+
+        int ret = uring_queue_wait(&uring->tx);
+        if (ret == -EINTR || ret == -EAGAIN)
+            continue;
+        if (ret <= 0) {
+            fprintf(stderr, "io_uring sendmsg: %s\n", strerror(-ret));
+            close(chan->sock_fd);
+            exit(-1);
+        }
+
+        /* Skip what has been sent */
+        size_t sent = ret;
+        while (sent > 0 && sent >= iov[first].iov_len) {
+            sent -= iov[first].iov_len;
+            first++;
+        }
+        if (sent > 0) {
+            iov[first].iov_base = (char *)iov[first].iov_base + sent;
+            iov[first].iov_len -= sent;
+        }
+    }
+
+    // Free the local copy of the commands and buffers.
+    for (auto cmd : batch)
+        command_channel_socket_release_command(cmd);
+}
+
+/**
+ * Queue a command to be sent. If no other thread is sending, this thread
+ * sends every queued command until the queue is empty. A command which
+ * references caller buffers is waited for, because the buffers are only
+ * valid until `command_channel_send_command` returns.
+ */
+static void socket_uring_enqueue(struct command_channel_socket *chan, struct command_base *cmd)
+{
+    struct socket_uring *uring = chan->uring;
+    const bool wait = command_channel_socket_command_has_references(cmd);
+
+    pthread_mutex_lock(&chan->send_mutex);
+    uring->pending->push_back(cmd);
+    const uint64_t ticket = ++uring->enqueued;
+    if (uring->sending) {
+        while (wait && uring->sent < ticket)
+            pthread_cond_wait(&uring->sent_cond, &chan->send_mutex);
+        pthread_mutex_unlock(&chan->send_mutex);
+        return;
+    }
+
+    uring->sending = 1;
+    while (!uring->pending->empty()) {
+        uring->batch->swap(*uring->pending);
+        pthread_mutex_unlock(&chan->send_mutex);
+        const size_t batch_size = uring->batch->size();
+        socket_uring_send_batch(chan, *uring->batch);
+        uring->batch->clear();
+        pthread_mutex_lock(&chan->send_mutex);
+        uring->sent += batch_size;
+        pthread_cond_broadcast(&uring->sent_cond);
+    }
+    uring->sending = 0;
+    pthread_mutex_unlock(&chan->send_mutex);
+}
+
+/**
+ * Receive into `buf` and return the received size. Terminates the process
+ * when the peer has closed the connection.
+ */
+static size_t socket_uring_recv(struct command_channel_socket *chan, void *buf, size_t size)
+{
+    struct socket_uring *uring = chan->uring;
+    int ret;
+
+    do {
+        struct io_uring_sqe *sqe = uring_queue_get_sqe(&uring->rx);
+        assert(sqe != NULL);
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = chan->sock_fd;
+        sqe->addr = (uintptr_t)buf;
+        sqe->len = size;
+        uring_queue_submit(&uring->rx, 1);
+        ret = uring_queue_wait(&uring->rx);
+    } while (ret == -EINTR || ret == -EAGAIN);
+
+    /* terminate guestlib when worker exits */
+    if (ret == 0) {
+        DEBUG_PRINT("command_channel_socket shutdown\n");
+        close(chan->sock_fd);
+        exit(-1);
+    }
+    if (ret < 0) {
+        fprintf(stderr, "io_uring recv: %s\n", strerror(-ret));
+        close(chan->sock_fd);
+        exit(-1);
+    }
+    return ret;
+}
+
+/**
+ * Reap the posted receive into the staging buffer.
+ */
+static void socket_uring_recv_reap(struct command_channel_socket *chan)
+{
+    struct socket_uring *uring = chan->uring;
+    int ret = uring_queue_wait(&uring->rx);
+    uring->recv_inflight = 0;
+
+    if (ret == -EINTR || ret == -EAGAIN)
+        return;
+    if (ret == 0) {
+        DEBUG_PRINT("command_channel_socket shutdown\n");
+        close(chan->sock_fd);
+        exit(-1);
+    }
+    if (ret < 0) {
+        fprintf(stderr, "io_uring recv: %s\n", strerror(-ret));
+        close(chan->sock_fd);
+        exit(-1);
+    }
+    uring->recv_end += ret;
+}
+
+/**
+ * Post a receive into the free tail of the staging buffer without waiting
+ * for it, so that data lands while the previous command is handled. Only
+ * used with SQPOLL where posting does not cost a system call.
+ */
+static void socket_uring_recv_post(struct command_channel_socket *chan)
+{
+    struct socket_uring *uring = chan->uring;
+
+    if (uring->recv_inflight || !(uring->rx.setup_flags & IORING_SETUP_SQPOLL))
+        return;
+    if (uring->recv_begin == uring->recv_end)
+        uring->recv_begin = uring->recv_end = 0;
+    if (uring->recv_end == AVA_SOCKET_URING_RECV_BUFFER_SIZE)
+        return;
+
+    struct io_uring_sqe *sqe = uring_queue_get_sqe(&uring->rx);
+    assert(sqe != NULL);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = chan->sock_fd;
+    sqe->addr = (uintptr_t)(uring->recv_buf + uring->recv_end);
+    sqe->len = AVA_SOCKET_URING_RECV_BUFFER_SIZE - uring->recv_end;
+    uring->recv_inflight = 1;
+    uring_queue_submit(&uring->rx, 0);
+}
+
+/**
+ * Make sure at least `need` bytes are staged.
+ */
+static void socket_uring_recv_fill(struct command_channel_socket *chan, size_t need)
+{
+    struct socket_uring *uring = chan->uring;
+
+    assert(need <= AVA_SOCKET_URING_RECV_BUFFER_SIZE);
+    while (uring->recv_end - uring->recv_begin < need) {
+        if (uring->recv_inflight) {
+            socket_uring_recv_reap(chan);
+            continue;
+        }
+        if (uring->recv_begin == uring->recv_end)
+            uring->recv_begin = uring->recv_end = 0;
+        if (AVA_SOCKET_URING_RECV_BUFFER_SIZE - uring->recv_begin < need) {
+            memmove(uring->recv_buf, uring->recv_buf + uring->recv_begin, uring->recv_end - uring->recv_begin);
+            uring->recv_end -= uring->recv_begin;
+            uring->recv_begin = 0;
+        }
+        uring->recv_end += socket_uring_recv(chan, uring->recv_buf + uring->recv_end,
+                                             AVA_SOCKET_URING_RECV_BUFFER_SIZE - uring->recv_end);
+    }
+}
+
+}  // namespace
+
+void command_channel_socket_uring_send_command(struct command_channel* c, struct command_base* cmd)
+{
+    command_channel_socket_finalize_command(cmd);
+    socket_uring_enqueue((struct command_channel_socket *)c, cmd);
+}
+
+void command_channel_socket_uring_transfer_command(struct command_channel* c, const struct command_channel *source,
+                                                   const struct command_base *cmd)
+{
+    void *cmd_data_region = command_channel_get_data_region(source, cmd);
+    struct command_base *copy = (struct command_base *)cmd_buffer_pool_alloc(
+            ((struct command_channel_socket *)c)->cmd_pool, cmd->command_size + cmd->region_size);
+
+    memcpy(copy, cmd, cmd->command_size);
+    memcpy((char *)copy + cmd->command_size, cmd_data_region, cmd->region_size);
+    command_channel_socket_clear_private(copy);
+    socket_uring_enqueue((struct command_channel_socket *)c, copy);
+}
+
+struct command_base* command_channel_socket_uring_receive_command(struct command_channel* c)
+{
+    struct command_channel_socket *chan = (struct command_channel_socket *)c;
+    struct socket_uring *uring = chan->uring;
+    struct command_base cmd_base;
+    struct command_base *cmd;
+
+    pthread_mutex_lock(&chan->recv_mutex);
+    size_t header_size;
+    while (!(header_size = command_channel_socket_peek_header(chan, uring->recv_buf + uring->recv_begin,
+                                                              uring->recv_end - uring->recv_begin, &cmd_base)))
+        socket_uring_recv_fill(chan, uring->recv_end - uring->recv_begin + 1);
+    uring->recv_begin += header_size;
+
+    const size_t total_size = cmd_base.command_size + cmd_base.region_size;
+    cmd = (struct command_base *)cmd_buffer_pool_alloc(chan->cmd_pool, total_size);
+    memcpy(cmd, &cmd_base, sizeof(struct command_base));
+    command_channel_socket_clear_private(cmd);
+
+    size_t received = sizeof(struct command_base);
+    while (received < total_size) {
+        if (uring->recv_end == uring->recv_begin) {
+            /* Large remainders go directly into the command */
+            if (total_size - received >= AVA_SOCKET_URING_RECV_BUFFER_SIZE / 2 && !uring->recv_inflight) {
+                received += socket_uring_recv(chan, (char *)cmd + received, total_size - received);
+                continue;
+            }
+            socket_uring_recv_fill(chan, 1);
+        }
+        size_t n = std::min(total_size - received, uring->recv_end - uring->recv_begin);
+        memcpy((char *)cmd + received, uring->recv_buf + uring->recv_begin, n);
+        uring->recv_begin += n;
+        received += n;
+    }
+    socket_uring_recv_post(chan);
+    cmd = command_channel_socket_expand_command(chan, cmd);
+    pthread_mutex_unlock(&chan->recv_mutex);
+
+    command_channel_socket_print_command(c, cmd);
+    return cmd;
+}
+
+void command_channel_socket_uring_free(struct command_channel* c)
+{
+    struct command_channel_socket *chan = (struct command_channel_socket *)c;
+    struct socket_uring *uring = chan->uring;
+
+    uring_queue_exit(&uring->tx);
+    uring_queue_exit(&uring->rx);
+    delete uring->pending;
+    delete uring->batch;
+    delete uring->iov;
+    pthread_cond_destroy(&uring->sent_cond);
+    free(uring->recv_buf);
+    free(uring);
+    chan->uring = NULL;
+    command_channel_socket_free(c);
+}
+
+namespace {
+  struct command_channel_vtable command_channel_socket_uring_vtable = {
+    command_channel_socket_buffer_size,
+    command_channel_socket_new_command,
+    command_channel_socket_attach_buffer,
+    command_channel_socket_uring_send_command,
+    command_channel_socket_uring_transfer_command,
+    command_channel_socket_uring_receive_command,
+    command_channel_socket_get_buffer,
+    command_channel_socket_get_data_region,
+    command_channel_socket_free_command,
+    command_channel_socket_uring_free,
+    command_channel_socket_print_command
+  };
+}  // namespace
+
+/**
+ * Switch a connected socket channel to the io_uring path.
+ * @chan: the connected socket channel
+ * @sqpoll: use kernel submission queue polling when permitted
+ *
+ * Returns 0 on success. On failure the channel is left untouched and
+ * keeps using the plain socket path.
+ */
+int socket_uring_init(struct command_channel_socket *chan, int sqpoll)
+{
+    struct socket_uring *uring = (struct socket_uring *)calloc(1, sizeof(struct socket_uring));
+
+    if (uring_queue_init(&uring->tx, AVA_SOCKET_URING_ENTRIES, sqpoll, NULL) < 0) {
+        free(uring);
+        return -1;
+    }
+    if (!uring_queue_probe(&uring->tx) ||
+            uring_queue_init(&uring->rx, AVA_SOCKET_URING_ENTRIES, sqpoll, &uring->tx) < 0) {
+        uring_queue_exit(&uring->tx);
+        free(uring);
+        return -1;
+    }
+
+    uring->pending = new std::vector<struct command_base *>();
+    uring->batch = new std::vector<struct command_base *>();
+    uring->iov = new std::vector<struct iovec>();
+    pthread_cond_init(&uring->sent_cond, NULL);
+    uring->recv_buf = (char *)malloc(AVA_SOCKET_URING_RECV_BUFFER_SIZE);
+
+    chan->uring = uring;
+    command_channel_preinitialize((struct command_channel *)chan, &command_channel_socket_uring_vtable);
+    DEBUG_PRINT("[%d] Socket channel uses io_uring%s\n", chan->listen_port,
+                (uring->tx.setup_flags & IORING_SETUP_SQPOLL) ? " with SQPOLL" : "");
+    return 0;
+}
+
+#else  // AVA_HAVE_IO_URING
+
+int socket_uring_init(struct command_channel_socket *chan, int sqpoll)
+{
+    return -1;
+}
+
+#endif  // AVA_HAVE_IO_URING
+
+};  // namespace chansocketutil
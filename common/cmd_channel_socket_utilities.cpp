@@ -1,10 +1,17 @@
+#include <algorithm>
 #include <assert.h>
 #include <errno.h>
 #include <netinet/tcp.h>
+#include <pthread.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
+#include <linux/errqueue.h>
 
+#include "common/cmd_buffer_pool.h"
 #include "common/cmd_channel_impl.h"
+#include "common/cmd_copy.h"
 #include "common/devconf.h"
 #include "common/debug.h"
 #include "common/guest_mem.h"
@@ -13,6 +20,58 @@
 
 namespace chansocketutil {
 
+/* Busy-poll setting taken by the channels created after it is set */
+static uint64_t socket_busy_poll_ns;
+static cpu_set_t socket_busy_poll_cores;
+static int socket_busy_poll_pin;
+
+/**
+ * Initialize the common fields of a socket channel.
+ */
+void command_channel_socket_preinitialize(struct command_channel_socket *chan,
+                                          struct command_channel_vtable *vtable)
+{
+    command_channel_preinitialize((struct command_channel *) chan, vtable);
+    pthread_mutex_init(&chan->send_mutex, NULL);
+    pthread_mutex_init(&chan->recv_mutex, NULL);
+    chan->zerocopy = 0;
+    chan->zerocopy_sent = 0;
+    chan->zerocopy_done = 0;
+    chan->uring = NULL;
+    chan->cmd_pool = cmd_buffer_pool_new();
+    chan->coalesce = NULL;
+    chan->compress_threshold = 0;
+    memset(&chan->compress_stats, 0, sizeof(chan->compress_stats));
+    chan->dedup = NULL;
+    chan->dedup_rx = NULL;
+    memset(&chan->dedup_stats, 0, sizeof(chan->dedup_stats));
+    chan->recv_buf = NULL;
+    chan->recv_begin = 0;
+    chan->recv_end = 0;
+    memset(&chan->recv_stats, 0, sizeof(chan->recv_stats));
+    chan->busy_poll_ns = socket_busy_poll_ns;
+    chan->busy_poll_cores = socket_busy_poll_cores;
+    chan->busy_poll_pin = socket_busy_poll_pin;
+    chan->busy_poll_cpu_time = command_channel_stats_enabled();
+    memset(&chan->busy_poll_stats, 0, sizeof(chan->busy_poll_stats));
+    chan->bulk = NULL;
+    chan->stream_threshold = 0;
+    chan->stream = NULL;
+    pthread_cond_init(&chan->stream_done, NULL);
+    memset(&chan->stream_stats, 0, sizeof(chan->stream_stats));
+    chan->wire_version = COMMAND_WIRE_VERBATIM;
+    memset(&chan->wire_stats, 0, sizeof(chan->wire_stats));
+}
+
+static void socket_coalesce_free(struct command_channel_socket *chan);
+
+static inline struct socket_command_private *socket_command_private(const struct command_base *cmd)
+{
+    static_assert(sizeof(struct socket_command_private) <= sizeof(cmd->reserved_area),
+                  "command_base::reserved_area is not large enough.");
+    return (struct socket_command_private *)cmd->reserved_area;
+}
+
 /**
  * Print a command for debugging.
  */
@@ -43,11 +102,59 @@ void command_channel_socket_print_command(const struct command_channel *chan, co
  */
 void command_channel_socket_free(struct command_channel* c) {
     struct command_channel_socket* chan = (struct command_channel_socket*)c;
+    if (chan->coalesce)
+        socket_coalesce_free(chan);
     if (chan->listen_fd)
         close(chan->listen_fd);
     close(chan->sock_fd);
     pthread_mutex_destroy(&chan->send_mutex);
     pthread_mutex_destroy(&chan->recv_mutex);
+    pthread_cond_destroy(&chan->stream_done);
+    if (command_channel_stats_enabled()) {
+        cmd_buffer_pool_print_stats(chan->cmd_pool, "socket", stderr);
+        command_wire_print_stats(&chan->wire_stats, chan->wire_version, "socket", stderr);
+        cmd_copy_print_stats("socket", stderr);
+        if (chan->compress_stats.buffers || chan->compress_stats.decompress_ns)
+            cmd_compress_print_stats(&chan->compress_stats, "socket", stderr);
+        if (chan->dedup_stats.buffers || chan->dedup_stats.served)
+            socket_dedup_print_stats(&chan->dedup_stats, "socket", stderr);
+        if (chan->recv_stats.commands)
+            fprintf(stderr, "[socket] receive: %lu commands in %lu system calls (%.2f per command), "
+                    "%lu taken from the staging buffer, %lu KB received in place\n",
+                    chan->recv_stats.commands, chan->recv_stats.syscalls,
+                    (double)chan->recv_stats.syscalls / chan->recv_stats.commands,
+                    chan->recv_stats.buffered, chan->recv_stats.direct_bytes >> 10);
+        if (chan->busy_poll_stats.receives)
+            fprintf(stderr, "[socket] busy poll: %lu of %lu reads served while spinning, "
+                    "%.1f ms of CPU time spent spinning (%.1f us per read) in %.1f ms of wall time\n",
+                    chan->busy_poll_stats.hits, chan->busy_poll_stats.receives,
+                    chan->busy_poll_stats.spin_cpu_ns / 1e6,
+                    chan->busy_poll_stats.spin_cpu_ns / 1e3 / chan->busy_poll_stats.receives,
+                    chan->busy_poll_stats.spin_ns / 1e6);
+        if (chan->bulk)
+            fprintf(stderr, "[socket] bulk lane: %lu commands (%lu MB) sent, %lu commands (%lu MB) received, "
+                    "%lu commands returned while a bulk region was in flight\n",
+                    chan->bulk->sent_commands, chan->bulk->sent_bytes >> 20,
+                    chan->bulk->received_commands, chan->bulk->received_bytes >> 20,
+                    chan->bulk->overtaking);
+        if (chan->stream_stats.sent_buffers || chan->stream_stats.received_buffers)
+            fprintf(stderr, "[socket] stream: %lu buffers (%lu MB) sent, %lu buffers (%lu MB) received, "
+                    "%lu MB of them kept whole, %lu streams not read in time for the next command\n",
+                    chan->stream_stats.sent_buffers, chan->stream_stats.sent_bytes >> 20,
+                    chan->stream_stats.received_buffers, chan->stream_stats.received_bytes >> 20,
+                    chan->stream_stats.whole_bytes >> 20, chan->stream_stats.spills);
+    }
+    if (chan->bulk) {
+        close(chan->bulk->fd);
+        pthread_mutex_destroy(&chan->bulk->send_mutex);
+        delete chan->bulk;
+    }
+    if (chan->dedup)
+        socket_dedup_sender_free(chan->dedup);
+    if (chan->dedup_rx)
+        socket_dedup_receiver_free(chan->dedup_rx);
+    free(chan->recv_buf);
+    cmd_buffer_pool_free(chan->cmd_pool);
     free(chan);
 }
 
@@ -73,21 +180,283 @@ size_t command_channel_socket_buffer_size(const struct command_channel *c, size_
  */
 struct command_base* command_channel_socket_new_command(struct command_channel* c, size_t command_struct_size, size_t data_region_size) {
     struct command_channel_socket* chan = (struct command_channel_socket *)c;
-    struct command_base *cmd = (struct command_base *)malloc(command_struct_size + data_region_size);
-    static_assert(sizeof(struct block_seeker) <= sizeof(cmd->reserved_area),
-                  "command_base::reserved_area is not large enough.");
-    struct block_seeker *seeker = (struct block_seeker *)cmd->reserved_area;
+    struct command_base *cmd;
+    struct socket_sg_list *sg = NULL;
+
+    if (data_region_size <= AVA_SOCKET_SG_THRESHOLD) {
+        cmd = (struct command_base *)cmd_buffer_pool_alloc(chan->cmd_pool, command_struct_size + data_region_size);
+    }
+    else {
+        /* Large buffers are referenced and sent with a vectored write */
+        cmd = (struct command_base *)cmd_buffer_pool_alloc(chan->cmd_pool,
+                                                           command_struct_size + AVA_SOCKET_SG_INLINE_SIZE);
+        sg = (struct socket_sg_list *)malloc(sizeof(struct socket_sg_list) + 8 * sizeof(struct iovec));
+        sg->inline_used = 0;
+        sg->count = 1;
+        sg->capacity = 8;
+        sg->chan = chan;
+        sg->region = NULL;
+        sg->streams = NULL;
+        sg->region_copy = NULL;
+        sg->wire_head = NULL;
+        sg->iov[0].iov_base = cmd;
+        sg->iov[0].iov_len = command_struct_size;
+    }
 
     memset(cmd, 0, command_struct_size);
     cmd->vm_id = chan->vm_id;
     cmd->command_size = command_struct_size;
     cmd->data_region = (void *)command_struct_size;
     cmd->region_size = data_region_size;
-    seeker->cur_offset = command_struct_size;
+
+    struct socket_command_private *priv = socket_command_private(cmd);
+    priv->cur_offset = command_struct_size;
+    priv->sg = sg;
+    priv->stream = NULL;
 
     return cmd;
 }
 
+/**
+ * Header of an encoded data region (`COMMAND_FLAG_ENCODED`) on the wire.
+ * It is followed by `count` entries in the order the receiver applies
+ * them, and then by the region with every listed buffer replaced by its
+ * encoded bytes.
+ */
+struct socket_region_table {
+  uint64_t count;
+  uint64_t raw_region_size;
+};
+
+/* Kinds of socket_region_entry, may be combined */
+#define SOCKET_REGION_COMPRESSED 0x1   /* the wire bytes are compressed */
+#define SOCKET_REGION_CACHED     0x2   /* no wire bytes; copy the cached buffer in `slot` */
+#define SOCKET_REGION_STORE      0x4   /* cache the raw bytes in `slot` */
+#define SOCKET_REGION_DROP       0x8   /* release the cached buffer in `slot`; not part of the region */
+
+struct socket_region_entry {
+  uint64_t offset;      /* offset of the buffer in the raw data region */
+  uint64_t raw_size;
+  uint64_t wire_size;
+  uint32_t kind;
+  uint32_t slot;
+};
+
+/**
+ * Encoded buffers of a command being built by the sender, in region order.
+ */
+struct socket_region_list {
+  size_t count;
+  size_t capacity;
+  struct socket_region_entry *entries;
+  int *iov;                         /* index of the wire bytes in socket_sg_list::iov */
+  void **buffers;                   /* compressed bytes, or NULL */
+  const void **raw;                 /* the attached buffers */
+  struct socket_dedup_key *keys;    /* content keys, size 0 if not deduplicated */
+
+  /* The table sent in front of the region, built when the command is sent */
+  struct socket_region_table *table;
+};
+
+static inline struct socket_region_entry *socket_region_entries(struct socket_region_table *table)
+{
+    return (struct socket_region_entry *)(table + 1);
+}
+
+/**
+ * Header of the data region of a streamed command (`COMMAND_FLAG_STREAM`)
+ * on the wire. It is followed by `count` entries in region order, and then
+ * by the region without the streamed buffers. The streamed buffers follow
+ * the command in the same order.
+ */
+struct socket_stream_table {
+  uint64_t count;
+  uint64_t raw_region_size;
+};
+
+struct socket_stream_entry {
+  uint64_t offset;      /* offset of the buffer in the raw data region */
+  uint64_t size;
+};
+
+static inline struct socket_stream_entry *socket_stream_entries(struct socket_stream_table *table)
+{
+    return (struct socket_stream_entry *)(table + 1);
+}
+
+/**
+ * Streamed buffers of a command being built by the sender, in region order.
+ */
+struct socket_stream_list {
+  size_t count;
+  size_t capacity;
+  struct socket_stream_entry *entries;
+  int *iov;                             /* index of the buffer in socket_sg_list::iov */
+  struct socket_stream_table *table;    /* built when the command is sent */
+};
+
+/**
+ * Streamed buffers of a received command.
+ */
+struct socket_stream {
+  struct command_channel_socket *chan;
+  uint64_t count;
+  uint64_t next;                        /* the buffer at the head of the connection */
+  struct socket_stream_entry *entries;
+  void **whole;                         /* buffers received whole for get_buffer, or NULL */
+};
+
+/**
+ * Record a buffer at `offset` in the data region that is streamed, and
+ * whose bytes are the next entry of the command's iov.
+ */
+static void socket_stream_add(struct socket_sg_list *sg, size_t offset, size_t size)
+{
+    struct socket_stream_list *list = sg->streams;
+
+    if (!list)
+        list = sg->streams = (struct socket_stream_list *)calloc(1, sizeof(struct socket_stream_list));
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 2;
+        list->entries = (struct socket_stream_entry *)realloc(list->entries,
+                list->capacity * sizeof(struct socket_stream_entry));
+        list->iov = (int *)realloc(list->iov, list->capacity * sizeof(int));
+    }
+    list->entries[list->count].offset = offset;
+    list->entries[list->count].size = size;
+    list->iov[list->count] = sg->count;
+    list->count++;
+}
+
+static void socket_stream_list_free(struct socket_stream_list *list)
+{
+    if (!list)
+        return;
+    free(list->entries);
+    free(list->iov);
+    free(list->table);
+    free(list);
+}
+
+/**
+ * Compress a buffer of a scatter-gather command. Returns the compressed
+ * buffer and sets `wire_size`, or returns NULL if the buffer should be sent
+ * as it is.
+ */
+static void *socket_compress_buffer(struct command_channel_socket *chan, const void *buffer, size_t size,
+                                    size_t *wire_size)
+{
+    struct cmd_compress_stats *stats = &chan->compress_stats;
+    uint64_t start = cmd_compress_thread_time();
+    void *out = NULL;
+    size_t n = 0;
+
+    __atomic_fetch_add(&stats->buffers, 1, __ATOMIC_RELAXED);
+    if (!cmd_compress_sample(buffer, size)) {
+        __atomic_fetch_add(&stats->skipped, 1, __ATOMIC_RELAXED);
+    }
+    else {
+        out = cmd_buffer_pool_alloc(chan->cmd_pool, cmd_compress_bound(size));
+        n = cmd_compress(buffer, size, out, size * (100 - AVA_COMPRESS_MIN_SAVING) / 100);
+        if (n == 0) {
+            cmd_buffer_pool_release(out);
+            out = NULL;
+        }
+    }
+    __atomic_fetch_add(&stats->compress_ns, cmd_compress_thread_time() - start, __ATOMIC_RELAXED);
+    if (!out)
+        return NULL;
+
+    __atomic_fetch_add(&stats->compressed, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->bytes_in, size, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->bytes_out, n, __ATOMIC_RELAXED);
+    *wire_size = n;
+    return out;
+}
+
+/**
+ * Record an encoded buffer at `offset` in the data region, whose wire bytes
+ * are the next entry of the command's iov.
+ */
+static void socket_region_add(struct socket_sg_list *sg, size_t offset, const void *raw, size_t raw_size,
+                              void *compressed, size_t wire_size, const struct socket_dedup_key *key)
+{
+    struct socket_region_list *list = sg->region;
+
+    if (!list)
+        list = sg->region = (struct socket_region_list *)calloc(1, sizeof(struct socket_region_list));
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 4;
+        list->entries = (struct socket_region_entry *)realloc(list->entries,
+                list->capacity * sizeof(struct socket_region_entry));
+        list->iov = (int *)realloc(list->iov, list->capacity * sizeof(int));
+        list->buffers = (void **)realloc(list->buffers, list->capacity * sizeof(void *));
+        list->raw = (const void **)realloc(list->raw, list->capacity * sizeof(void *));
+        list->keys = (struct socket_dedup_key *)realloc(list->keys,
+                list->capacity * sizeof(struct socket_dedup_key));
+    }
+
+    struct socket_region_entry *entry = &list->entries[list->count];
+    entry->offset = offset;
+    entry->raw_size = raw_size;
+    entry->wire_size = wire_size;
+    entry->kind = compressed ? SOCKET_REGION_COMPRESSED : 0;
+    entry->slot = SOCKET_DEDUP_NO_SLOT;
+    list->iov[list->count] = sg->count;
+    list->buffers[list->count] = compressed;
+    list->raw[list->count] = raw;
+    if (key)
+        list->keys[list->count] = *key;
+    else
+        list->keys[list->count].size = 0;
+    list->count++;
+}
+
+/**
+ * Decide which deduplicated buffers of a command the receiver already has,
+ * and build the region table. Buffers it has are dropped from the wire;
+ * the others are assigned a cache slot, evicting older buffers first.
+ * The caller holds `send_mutex`.
+ */
+static void socket_dedup_resolve(struct command_channel_socket *chan, struct command_base *cmd)
+{
+    struct socket_sg_list *sg = socket_command_private(cmd)->sg;
+    struct socket_region_list *list = sg ? sg->region : NULL;
+    std::vector<uint32_t> drops;
+
+    if (!list || !chan->dedup || list->table)
+        return;
+
+    std::vector<struct socket_region_entry> wire;
+    for (size_t i = 0; i < list->count; i++) {
+        struct socket_region_entry entry = list->entries[i];
+        if (list->keys[i].size) {
+            uint32_t slot;
+            drops.clear();
+            if (socket_dedup_sender_lookup(chan->dedup, &list->keys[i], &slot, drops)) {
+                entry.kind = SOCKET_REGION_CACHED;
+                entry.wire_size = 0;
+                sg->iov[list->iov[i]].iov_len = 0;
+                __atomic_fetch_add(&chan->dedup_stats.hits, 1, __ATOMIC_RELAXED);
+                __atomic_fetch_add(&chan->dedup_stats.bytes_avoided, entry.raw_size, __ATOMIC_RELAXED);
+            }
+            else if (slot != SOCKET_DEDUP_NO_SLOT) {
+                entry.kind |= SOCKET_REGION_STORE;
+            }
+            entry.slot = slot;
+            /* Evictions take effect before the buffer that caused them */
+            for (uint32_t dropped : drops)
+                wire.push_back({0, 0, 0, SOCKET_REGION_DROP, dropped});
+        }
+        wire.push_back(entry);
+    }
+
+    list->table = (struct socket_region_table *)malloc(sizeof(struct socket_region_table) +
+                                                       wire.size() * sizeof(struct socket_region_entry));
+    list->table->count = wire.size();
+    memcpy(socket_region_entries(list->table), wire.data(), wire.size() * sizeof(struct socket_region_entry));
+}
+
 /**
  * Attach a buffer to a command and return a location independent
  * buffer ID. `buffer` must be valid until after the call to
@@ -99,14 +468,619 @@ struct command_base* command_channel_socket_new_command(struct command_channel*
 void* command_channel_socket_attach_buffer(struct command_channel* c, struct command_base* cmd, void* buffer, size_t size) {
     assert(buffer && size != 0);
 
-    struct block_seeker *seeker = (struct block_seeker *)cmd->reserved_area;
-    void *offset = (void *)seeker->cur_offset;
-    void *dst = (void *)((uintptr_t)cmd + seeker->cur_offset);
-    seeker->cur_offset += size;
-    memcpy(dst, buffer, size);
+    struct socket_command_private *priv = socket_command_private(cmd);
+    void *offset = (void *)priv->cur_offset;
+    priv->cur_offset += size;
+    assert(priv->cur_offset <= cmd->command_size + cmd->region_size);
+
+    struct socket_sg_list *sg = priv->sg;
+    if (!sg) {
+        cmd_copy((void *)((uintptr_t)cmd + (uintptr_t)offset), buffer, size, CMD_COPY_PRIVATE);
+        return offset;
+    }
+
+    if (sg->count == sg->capacity) {
+        sg->capacity *= 2;
+        sg = priv->sg = (struct socket_sg_list *)realloc(sg,
+                sizeof(struct socket_sg_list) + sg->capacity * sizeof(struct iovec));
+    }
+
+    /* Huge buffers are streamed behind the rest of the region */
+    struct command_channel_socket *chan = sg->chan;
+    if (chan->stream_threshold && size >= chan->stream_threshold) {
+        socket_stream_add(sg, (size_t)offset - cmd->command_size, size);
+        sg->iov[sg->count].iov_base = buffer;
+        sg->iov[sg->count].iov_len = size;
+        sg->count++;
+        return offset;
+    }
+
+    /* Large buffers are deduplicated, and compressed when they shrink enough */
+    bool dedup = chan->dedup && size >= AVA_DEDUP_MIN_SIZE;
+    bool compress = chan->compress_threshold && size >= chan->compress_threshold &&
+                    size > AVA_SOCKET_SG_COPY_SIZE;
+    if (dedup || compress) {
+        struct socket_dedup_key key;
+        void *compressed = NULL;
+        size_t wire_size = size;
+
+        if (dedup) {
+            uint64_t start = cmd_compress_thread_time();
+            socket_dedup_hash(buffer, size, &key);
+            __atomic_fetch_add(&chan->dedup_stats.buffers, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&chan->dedup_stats.hash_ns, cmd_compress_thread_time() - start, __ATOMIC_RELAXED);
+            /* Likely sent as a reference; do not spend time compressing it */
+            if (socket_dedup_sender_contains(chan->dedup, &key))
+                compress = false;
+        }
+        if (compress)
+            compressed = socket_compress_buffer(chan, buffer, size, &wire_size);
+
+        if (dedup || compressed) {
+            socket_region_add(sg, (size_t)offset - cmd->command_size, buffer, size, compressed, wire_size,
+                              dedup ? &key : NULL);
+            sg->iov[sg->count].iov_base = compressed ? compressed : buffer;
+            sg->iov[sg->count].iov_len = wire_size;
+            sg->count++;
+            return offset;
+        }
+    }
+
+    struct iovec *last = &sg->iov[sg->count - 1];
+    if (size <= AVA_SOCKET_SG_COPY_SIZE && sg->inline_used + size <= AVA_SOCKET_SG_INLINE_SIZE) {
+        char *dst = (char *)cmd + cmd->command_size + sg->inline_used;
+        memcpy(dst, buffer, size);
+        sg->inline_used += size;
+        /* Merge adjacent inline copies */
+        if (sg->count > 1 && (char *)last->iov_base + last->iov_len == dst) {
+            last->iov_len += size;
+            return offset;
+        }
+        buffer = dst;
+    }
+    sg->iov[sg->count].iov_base = buffer;
+    sg->iov[sg->count].iov_len = size;
+    sg->count++;
     return offset;
 }
 
+/**
+ * Move the streamed buffers of a command behind the rest of its region,
+ * and insert the stream table in front of the region. The region size
+ * becomes the size of the table and the rest of the region.
+ */
+static void socket_stream_finalize(struct socket_command_private *priv, struct command_base *cmd)
+{
+    struct socket_sg_list *sg = priv->sg;
+    struct socket_stream_list *list = sg->streams;
+    const size_t table_size = sizeof(struct socket_stream_table) + list->count * sizeof(struct socket_stream_entry);
+
+    list->table = (struct socket_stream_table *)malloc(table_size);
+    list->table->count = list->count;
+    list->table->raw_region_size = cmd->region_size;
+    memcpy(socket_stream_entries(list->table), list->entries, list->count * sizeof(struct socket_stream_entry));
+
+    std::vector<struct iovec> iov;
+    iov.reserve(sg->count + 1);
+    iov.push_back(sg->iov[0]);
+    iov.push_back({list->table, table_size});
+    size_t next = 0;
+    for (int i = 1; i < sg->count; i++) {
+        if (next < list->count && list->iov[next] == i)
+            next++;
+        else
+            iov.push_back(sg->iov[i]);
+    }
+    cmd->region_size = 0;
+    for (size_t i = 1; i < iov.size(); i++)
+        cmd->region_size += iov[i].iov_len;
+    for (size_t i = 0; i < list->count; i++) {
+        iov.push_back(sg->iov[list->iov[i]]);
+        sg->chan->stream_stats.sent_bytes += list->entries[i].size;
+    }
+    sg->chan->stream_stats.sent_buffers += list->count;
+
+    if ((size_t)sg->capacity < iov.size()) {
+        sg->capacity = iov.size();
+        sg = priv->sg = (struct socket_sg_list *)realloc(sg,
+                sizeof(struct socket_sg_list) + sg->capacity * sizeof(struct iovec));
+    }
+    memcpy(sg->iov, iov.data(), iov.size() * sizeof(struct iovec));
+    sg->count = iov.size();
+    cmd->flags |= COMMAND_FLAG_STREAM;
+}
+
+/**
+ * Prepare a command to be sent. The data region of a scatter-gather
+ * command is shrunk to the attached buffers. If buffers were encoded, the
+ * region table is inserted in front of the region and the region size
+ * becomes its size on the wire. Otherwise streamed buffers are moved
+ * behind the region, after a stream table.
+ */
+void command_channel_socket_finalize_command(struct command_base* cmd)
+{
+    struct socket_command_private *priv = socket_command_private(cmd);
+    struct socket_sg_list *sg = priv->sg;
+
+    cmd->command_type = NW_NEW_INVOCATION;
+    if (!sg)
+        return;
+    cmd->region_size = priv->cur_offset - cmd->command_size;
+    if (sg->streams && !sg->region) {
+        socket_stream_finalize(priv, cmd);
+        return;
+    }
+    /* Commands with encoded buffers are sent whole */
+    socket_stream_list_free(sg->streams);
+    sg->streams = NULL;
+    if (!sg->region)
+        return;
+
+    /* Without deduplication the table is the list of compressed buffers */
+    struct socket_region_list *list = sg->region;
+    if (!list->table) {
+        list->table = (struct socket_region_table *)malloc(sizeof(struct socket_region_table) +
+                                                           list->count * sizeof(struct socket_region_entry));
+        list->table->count = list->count;
+        memcpy(socket_region_entries(list->table), list->entries, list->count * sizeof(struct socket_region_entry));
+    }
+    list->table->raw_region_size = cmd->region_size;
+
+    if (sg->count == sg->capacity) {
+        sg->capacity *= 2;
+        sg = priv->sg = (struct socket_sg_list *)realloc(sg,
+                sizeof(struct socket_sg_list) + sg->capacity * sizeof(struct iovec));
+    }
+    memmove(&sg->iov[2], &sg->iov[1], (sg->count - 1) * sizeof(struct iovec));
+    sg->iov[1].iov_base = list->table;
+    sg->iov[1].iov_len = sizeof(struct socket_region_table) + list->table->count * sizeof(struct socket_region_entry);
+    sg->count++;
+
+    cmd->region_size = 0;
+    for (int i = 1; i < sg->count; i++)
+        cmd->region_size += sg->iov[i].iov_len;
+    cmd->flags |= COMMAND_FLAG_ENCODED;
+}
+
+/**
+ * Write the wire header of a finalized command. A compact header is
+ * written into `reserved_area`, right in front of the fields that follow
+ * `command_base`, so that the command still goes out from its own buffer.
+ * @size: set to the size of the first wire segment, which is the whole
+ * command unless it is a scatter-gather one
+ * @return The first byte of the command on the wire.
+ */
+static char *socket_wire_encode(struct command_channel_socket *chan, struct command_base *cmd, size_t *size)
+{
+    struct socket_sg_list *sg = socket_command_private(cmd)->sg;
+    const size_t body_size = cmd->command_size - sizeof(struct command_base);
+    char *start = (char *)cmd;
+    size_t header_size = sizeof(struct command_base);
+
+    if (chan->wire_version != COMMAND_WIRE_VERBATIM) {
+        /* The sender's private data in front of the header stays intact */
+        const size_t headroom = sizeof(cmd->reserved_area) - sizeof(struct socket_command_private);
+        uint8_t header[COMMAND_WIRE_HEADER_MAX];
+        header_size = command_wire_encode(cmd, 0, header);
+        if (header_size > headroom) {
+            fprintf(stderr, "Command header of %zu bytes does not fit in the command\n", header_size);
+            exit(-1);
+        }
+        start = (char *)cmd + sizeof(struct command_base) - header_size;
+        memcpy(start, header, header_size);
+    }
+    else if (!sg) {
+        /* The verbatim header carries no private data to the receiver */
+        socket_command_private(cmd)->cur_offset = 0;
+    }
+    else {
+        /* The private data is needed until the command is released, so a
+         * scatter-gather command goes out with a cleaned copy of its struct */
+        sg->wire_head = realloc(sg->wire_head, sizeof(struct command_base) + body_size);
+        memcpy(sg->wire_head, cmd, sizeof(struct command_base) + body_size);
+        command_channel_socket_clear_private((struct command_base *)sg->wire_head);
+        start = (char *)sg->wire_head;
+    }
+
+    chan->wire_stats.commands++;
+    chan->wire_stats.header_bytes += header_size;
+    chan->wire_stats.bytes += header_size + body_size + cmd->region_size;
+    if (sg) {
+        sg->iov[0].iov_base = start;
+        sg->iov[0].iov_len = header_size + body_size;
+        *size = sg->iov[0].iov_len;
+    }
+    else {
+        *size = header_size + body_size + cmd->region_size;
+    }
+    return start;
+}
+
+/**
+ * Append the buffers of a finalized command to `iov`, with its wire header.
+ */
+void command_channel_socket_command_iov(struct command_channel_socket *chan, struct command_base* cmd,
+                                        std::vector<struct iovec>& iov)
+{
+    struct socket_sg_list *sg = socket_command_private(cmd)->sg;
+    size_t size;
+    char *start = socket_wire_encode(chan, cmd, &size);
+
+    if (!sg) {
+        iov.push_back({start, size});
+        return;
+    }
+    iov.insert(iov.end(), sg->iov, sg->iov + sg->count);
+}
+
+/**
+ * Returns true if the command references buffers owned by the caller,
+ * which must then be sent before `command_channel_send_command` returns.
+ */
+bool command_channel_socket_command_has_references(const struct command_base* cmd)
+{
+    return socket_command_private(cmd)->sg != NULL;
+}
+
+/**
+ * Copy the data region of a command built for a vectored write into one
+ * buffer, with the attached bytes of the encoded buffers.
+ */
+static void *socket_sg_gather_region(const struct socket_sg_list *sg, const struct command_base *cmd)
+{
+    const struct socket_region_list *list = sg->region;
+    char *region = (char *)malloc(cmd->region_size);
+    size_t offset = 0;
+    size_t next = 0;
+
+    /* The iov is still in region order until the command is sent */
+    assert(!(list && list->table) && !(sg->streams && sg->streams->table));
+    for (int i = 1; i < sg->count; i++) {
+        if (list && next < list->count && list->iov[next] == i) {
+            cmd_copy(region + offset, list->raw[next], list->entries[next].raw_size, CMD_COPY_PRIVATE);
+            offset += list->entries[next].raw_size;
+            next++;
+            continue;
+        }
+        cmd_copy(region + offset, sg->iov[i].iov_base, sg->iov[i].iov_len, CMD_COPY_PRIVATE);
+        offset += sg->iov[i].iov_len;
+    }
+    assert(offset <= cmd->region_size);
+    memset(region + offset, 0, cmd->region_size - offset);
+    return region;
+}
+
+/**
+ * Free a command created by `command_channel_socket_new_command` after
+ * it has been sent.
+ */
+void command_channel_socket_release_command(struct command_base* cmd)
+{
+    struct socket_sg_list *sg = socket_command_private(cmd)->sg;
+
+    if (sg)
+        socket_stream_list_free(sg->streams);
+    if (sg && sg->region) {
+        struct socket_region_list *list = sg->region;
+        for (size_t i = 0; i < list->count; i++)
+            cmd_buffer_pool_release(list->buffers[i]);
+        free(list->entries);
+        free(list->iov);
+        free(list->buffers);
+        free(list->raw);
+        free(list->keys);
+        free(list->table);
+        free(list);
+    }
+    if (sg) {
+        free(sg->region_copy);
+        free(sg->wire_head);
+    }
+    free(sg);
+    cmd_buffer_pool_release(cmd);
+}
+
+/**
+ * Clear the channel private data of a command. A verbatim header carries
+ * the sender's, so every receive path clears it.
+ */
+void command_channel_socket_clear_private(struct command_base* cmd)
+{
+    memset(socket_command_private(cmd), 0, sizeof(struct socket_command_private));
+}
+
+/**
+ * Wait until the kernel has released every buffer sent with MSG_ZEROCOPY.
+ * Stop using MSG_ZEROCOPY when the kernel reports that it copied the data
+ * anyway, e.g. over loopback.
+ */
+static void command_channel_socket_wait_zerocopy(struct command_channel_socket *chan)
+{
+    char control[128];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+
+    while ((int32_t)(chan->zerocopy_done - chan->zerocopy_sent) < 0) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(chan->sock_fd, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                struct pollfd pfd = {chan->sock_fd, 0, 0};
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            perror("ERROR receiving zerocopy notification");
+            close(chan->sock_fd);
+            exit(0);
+        }
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err *serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            chan->zerocopy_done = serr->ee_data + 1;
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                chan->zerocopy = -1;
+        }
+    }
+}
+
+/**
+ * Send a scatter-gather command with a single vectored write, after its
+ * wire header has been written. Large data regions are sent with
+ * MSG_ZEROCOPY when the socket supports it, and the call waits for the
+ * kernel to release the buffers because they are only valid until
+ * `command_channel_send_command` returns.
+ */
+static void command_channel_socket_send_sg(struct command_channel_socket *chan, struct command_base *cmd)
+{
+    struct socket_sg_list *sg = socket_command_private(cmd)->sg;
+    int flags = 0;
+
+    if (chan->zerocopy >= 0 && cmd->region_size >= AVA_SOCKET_ZEROCOPY_THRESHOLD) {
+        if (chan->zerocopy == 0) {
+            int opt = 1;
+            chan->zerocopy = setsockopt(chan->sock_fd, SOL_SOCKET, SO_ZEROCOPY, &opt, sizeof(opt)) ? -1 : 1;
+        }
+        if (chan->zerocopy > 0)
+            flags |= MSG_ZEROCOPY;
+    }
+
+    unsigned nr_zerocopy = 0;
+    send_socket_iov(chan->sock_fd, sg->iov, sg->count, flags, &nr_zerocopy);
+    if (nr_zerocopy) {
+        chan->zerocopy_sent += nr_zerocopy;
+        command_channel_socket_wait_zerocopy(chan);
+    }
+}
+
+/**
+ * Outbound buffer of deferrable commands. Commands are appended under
+ * `send_mutex` in the order they are sent, and the buffer is written out
+ * ahead of the next command that cannot be deferred, when it is full, or
+ * by the flusher thread `delay_us` after the first command was buffered.
+ */
+struct socket_coalesce {
+  char buf[AVA_SOCKET_COALESCE_SIZE];
+  size_t len;
+  struct timespec deadline;
+  unsigned delay_us;
+
+  pthread_t flusher;
+  pthread_cond_t cond;
+  bool closing;
+
+  /* Statistics */
+  uint64_t commands;       /* commands written through the buffer */
+  uint64_t writes;         /* writes of the buffer */
+  uint64_t timer_writes;   /* writes forced by the delay bound */
+};
+
+/**
+ * Write out the buffered commands. The caller holds `send_mutex`.
+ */
+static void socket_coalesce_flush(struct command_channel_socket *chan)
+{
+    struct socket_coalesce *co = chan->coalesce;
+
+    if (!co || co->len == 0)
+        return;
+    send_socket(chan->sock_fd, co->buf, co->len);
+    co->len = 0;
+    co->writes++;
+}
+
+/**
+ * Flush the buffer once its deadline passes, so that a guest which stops
+ * issuing calls still gets its last deferred commands executed.
+ */
+static void *socket_coalesce_flusher(void *arg)
+{
+    struct command_channel_socket *chan = (struct command_channel_socket *)arg;
+    struct socket_coalesce *co = chan->coalesce;
+    struct timespec now;
+
+    pthread_mutex_lock(&chan->send_mutex);
+    while (!co->closing) {
+        if (co->len == 0) {
+            pthread_cond_wait(&co->cond, &chan->send_mutex);
+            continue;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > co->deadline.tv_sec ||
+                (now.tv_sec == co->deadline.tv_sec && now.tv_nsec >= co->deadline.tv_nsec)) {
+            socket_coalesce_flush(chan);
+            co->timer_writes++;
+            continue;
+        }
+        pthread_cond_timedwait(&co->cond, &chan->send_mutex, &co->deadline);
+    }
+    pthread_mutex_unlock(&chan->send_mutex);
+    return NULL;
+}
+
+/**
+ * Buffer a deferrable command, which is `size` bytes on the wire from
+ * `wire`, instead of writing it. Returns false if the command has to be
+ * written now. The caller holds `send_mutex`.
+ */
+static bool socket_coalesce_append(struct command_channel_socket *chan, struct command_base *cmd,
+                                   const char *wire, size_t size)
+{
+    struct socket_coalesce *co = chan->coalesce;
+
+    if (!(cmd->flags & COMMAND_FLAG_DEFERRABLE) || command_channel_socket_command_has_references(cmd) ||
+            size > AVA_SOCKET_COALESCE_COPY_SIZE)
+        return false;
+
+    if (co->len + size > AVA_SOCKET_COALESCE_SIZE)
+        socket_coalesce_flush(chan);
+    if (co->len == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &co->deadline);
+        co->deadline.tv_nsec += (long)co->delay_us * 1000;
+        co->deadline.tv_sec += co->deadline.tv_nsec / 1000000000;
+        co->deadline.tv_nsec %= 1000000000;
+        pthread_cond_signal(&co->cond);
+    }
+    memcpy(co->buf + co->len, wire, size);
+    co->len += size;
+    co->commands++;
+    return true;
+}
+
+/**
+ * Coalesce the writes of deferrable commands (`COMMAND_FLAG_DEFERRABLE`).
+ * They are held back for at most `delay_us` microseconds and are always
+ * written before any later command, so the order of commands on the wire
+ * does not change.
+ */
+void command_channel_socket_enable_coalescing(struct command_channel_socket *chan, unsigned delay_us)
+{
+    struct socket_coalesce *co;
+    pthread_condattr_t attr;
+
+    assert(chan->uring == NULL && "io_uring channels batch their writes already");
+    co = (struct socket_coalesce *)malloc(sizeof(struct socket_coalesce));
+    co->len = 0;
+    co->delay_us = delay_us;
+    co->closing = false;
+    co->commands = 0;
+    co->writes = 0;
+    co->timer_writes = 0;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&co->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    chan->coalesce = co;
+    pthread_create(&co->flusher, NULL, socket_coalesce_flusher, chan);
+}
+
+/**
+ * Stop the flusher thread and write out the remaining commands.
+ */
+static void socket_coalesce_free(struct command_channel_socket *chan)
+{
+    struct socket_coalesce *co = chan->coalesce;
+
+    pthread_mutex_lock(&chan->send_mutex);
+    co->closing = true;
+    pthread_cond_signal(&co->cond);
+    pthread_mutex_unlock(&chan->send_mutex);
+    pthread_join(co->flusher, NULL);
+
+    socket_coalesce_flush(chan);
+    if (command_channel_stats_enabled())
+        fprintf(stderr, "[socket] coalescing: %lu commands in %lu writes (%lu on timer)\n",
+                co->commands, co->writes, co->timer_writes);
+    pthread_cond_destroy(&co->cond);
+    free(co);
+    chan->coalesce = NULL;
+}
+
+/**
+ * Carry the data regions of at least `threshold` bytes on the connection
+ * `fd`, so that they do not hold up the commands of other guest threads.
+ * Only the command struct of such a command is sent on the main
+ * connection. Both ends must enable the lane before any command is sent.
+ */
+void command_channel_socket_enable_bulk(struct command_channel_socket *chan, int fd, size_t threshold)
+{
+    struct socket_bulk *bulk = new socket_bulk();
+
+    assert(chan->uring == NULL && "io_uring channels do not support the bulk lane");
+    bulk->fd = fd;
+    bulk->threshold = threshold;
+    pthread_mutex_init(&bulk->send_mutex, NULL);
+    bulk->filled = 0;
+    bulk->sent_commands = 0;
+    bulk->sent_bytes = 0;
+    bulk->received_commands = 0;
+    bulk->received_bytes = 0;
+    bulk->overtaking = 0;
+    chan->bulk = bulk;
+}
+
+/**
+ * Returns true if the encoded region of a finalized command does not touch
+ * the receiver's buffer cache, so it may be expanded out of order.
+ */
+static bool socket_region_is_stateless(const struct socket_sg_list *sg)
+{
+    if (!sg->region)
+        return true;
+    struct socket_region_entry *entries = socket_region_entries(sg->region->table);
+    for (uint64_t i = 0; i < sg->region->table->count; i++) {
+        if (entries[i].kind & (SOCKET_REGION_CACHED | SOCKET_REGION_STORE | SOCKET_REGION_DROP))
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Send a command with a large data region over the bulk lane. The command
+ * struct is written to the main connection, and the region follows on the
+ * bulk connection after `send_mutex` is released, so that small commands
+ * of other threads can pass it. Bulk commands take `bulk->send_mutex`
+ * first, so their regions are sent in the order of their command structs.
+ * Returns false if the command is not large enough.
+ */
+static bool command_channel_socket_send_bulk(struct command_channel_socket *chan, struct command_base *cmd)
+{
+    struct socket_bulk *bulk = chan->bulk;
+    struct socket_command_private *priv = socket_command_private(cmd);
+
+    if (!bulk->threshold || !priv->sg || priv->cur_offset - cmd->command_size < bulk->threshold)
+        return false;
+
+    pthread_mutex_lock(&bulk->send_mutex);
+    pthread_mutex_lock(&chan->send_mutex);
+    socket_dedup_resolve(chan, cmd);
+    command_channel_socket_finalize_command(cmd);
+    socket_coalesce_flush(chan);
+    size_t size;
+    if (!socket_region_is_stateless(priv->sg)) {
+        /* Cache updates have to arrive in connection order */
+        pthread_mutex_unlock(&bulk->send_mutex);
+        socket_wire_encode(chan, cmd, &size);
+        command_channel_socket_send_sg(chan, cmd);
+        pthread_mutex_unlock(&chan->send_mutex);
+        return true;
+    }
+    cmd->flags |= COMMAND_FLAG_BULK;
+    char *wire = socket_wire_encode(chan, cmd, &size);
+    send_socket(chan->sock_fd, wire, size);
+    pthread_mutex_unlock(&chan->send_mutex);
+
+    send_socket_iov(bulk->fd, priv->sg->iov + 1, priv->sg->count - 1, 0, NULL);
+    bulk->sent_commands++;
+    bulk->sent_bytes += cmd->region_size;
+    pthread_mutex_unlock(&bulk->send_mutex);
+    return true;
+}
+
 /**
  * Send the message and all its attached buffers.
  *
@@ -116,15 +1090,43 @@ void* command_channel_socket_attach_buffer(struct command_channel* c, struct com
 void command_channel_socket_send_command(struct command_channel* c, struct command_base* cmd)
 {
     struct command_channel_socket *chan = (struct command_channel_socket *)c;
-    cmd->command_type = NW_NEW_INVOCATION;
+
+    if (chan->bulk && command_channel_socket_send_bulk(chan, cmd)) {
+        command_channel_socket_release_command(cmd);
+        return;
+    }
 
     /* vsock interposition does not block send_message */
     pthread_mutex_lock(&chan->send_mutex);
-    send_socket(chan->sock_fd, cmd, cmd->command_size + cmd->region_size);
+    /* The receiver's cache changes in the order commands are sent */
+    socket_dedup_resolve(chan, cmd);
+    command_channel_socket_finalize_command(cmd);
+    size_t size;
+    char *wire = socket_wire_encode(chan, cmd, &size);
+    if (chan->coalesce && socket_coalesce_append(chan, cmd, wire, size)) {
+        /* Held back until a later command or the flusher writes it */
+    }
+    else if (command_channel_socket_command_has_references(cmd)) {
+        socket_coalesce_flush(chan);
+        command_channel_socket_send_sg(chan, cmd);
+    }
+    else if (chan->coalesce && chan->coalesce->len > 0) {
+        /* Write the held back commands and this one together */
+        struct iovec iov[2] = {
+            {chan->coalesce->buf, chan->coalesce->len},
+            {wire, size},
+        };
+        send_socket_iov(chan->sock_fd, iov, 2, 0, NULL);
+        chan->coalesce->writes++;
+        chan->coalesce->len = 0;
+    }
+    else {
+        send_socket(chan->sock_fd, wire, size);
+    }
     pthread_mutex_unlock(&chan->send_mutex);
 
     // Free the local copy of the command and buffers.
-    free(cmd);
+    command_channel_socket_release_command(cmd);
 }
 
 void command_channel_socket_transfer_command(struct command_channel* c, const struct command_channel *source,
@@ -133,84 +1135,919 @@ void command_channel_socket_transfer_command(struct command_channel* c, const st
     struct command_channel_socket *chan = (struct command_channel_socket *)c;
     void *cmd_data_region = command_channel_get_data_region(source, cmd);
 
-    send_socket(chan->sock_fd, cmd, cmd->command_size);
+    pthread_mutex_lock(&chan->send_mutex);
+    socket_coalesce_flush(chan);
+    /* The private data of the source channel is not sent */
+    struct command_base verbatim;
+    uint8_t header[COMMAND_WIRE_HEADER_MAX];
+    struct iovec iov[2] = {
+        {header, 0},
+        {(char *)cmd + sizeof(struct command_base), cmd->command_size - sizeof(struct command_base)},
+    };
+    if (chan->wire_version == COMMAND_WIRE_VERBATIM) {
+        memcpy(&verbatim, cmd, sizeof(struct command_base));
+        command_channel_socket_clear_private(&verbatim);
+        iov[0] = {&verbatim, sizeof(struct command_base)};
+    }
+    else {
+        iov[0].iov_len = command_wire_encode(cmd, 0, header);
+    }
+    send_socket_iov(chan->sock_fd, iov, 2, 0, NULL);
     send_socket(chan->sock_fd, cmd_data_region, cmd->region_size);
+    pthread_mutex_unlock(&chan->send_mutex);
 }
 
 //! Receiving
 
+static inline uint64_t socket_busy_poll_now(clockid_t clock = CLOCK_MONOTONIC)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Spin on non-blocking reads into `buf` for up to `busy_poll_ns`. `flags`
+ * are passed on to recv, so MSG_PEEK waits without consuming the bytes.
+ * @return The number of bytes read, or 0 if none arrived in time or the
+ * read failed; the blocking path then takes over and handles the failure.
+ */
+static size_t socket_busy_poll(struct command_channel_socket *chan, void *buf, size_t size, int flags)
+{
+    if (chan->busy_poll_pin) {
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &chan->busy_poll_cores);
+        chan->busy_poll_pin = 0;
+    }
+
+    const uint64_t start = socket_busy_poll_now();
+    const uint64_t start_cpu = chan->busy_poll_cpu_time ? socket_busy_poll_now(CLOCK_THREAD_CPUTIME_ID) : 0;
+    uint64_t now = start;
+    ssize_t ret;
+    chan->busy_poll_stats.receives++;
+    do {
+        ret = recv(chan->sock_fd, buf, size, flags | MSG_DONTWAIT);
+        chan->recv_stats.syscalls++;
+        if (ret > 0) {
+            chan->busy_poll_stats.hits++;
+            break;
+        }
+        if (ret == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            break;
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+        now = socket_busy_poll_now();
+    } while (now - start < chan->busy_poll_ns);
+    /* Wall time also counts the time the thread was descheduled. Reading
+     * the thread's CPU clock is a system call, so it is only done for the
+     * stats. */
+    if (chan->busy_poll_cpu_time) {
+        chan->busy_poll_stats.spin_cpu_ns += socket_busy_poll_now(CLOCK_THREAD_CPUTIME_ID) - start_cpu;
+        now = socket_busy_poll_now();
+    }
+    chan->busy_poll_stats.spin_ns += now - start;
+    return ret > 0 ? ret : 0;
+}
+
+/**
+ * Block until a command is readable from the socket, after spinning in
+ * busy-poll mode. The process exits when the peer shuts down.
+ */
+void command_channel_socket_wait_command(struct command_channel_socket *chan)
+{
+    ssize_t ret;
+    char byte;
+
+    if (chan->busy_poll_ns && socket_busy_poll(chan, &byte, 1, MSG_PEEK))
+        return;
+
+    /* Zerocopy notifications wake up poll with POLLERR; they are
+     * consumed by the sender. */
+    do {
+        ret = poll(&chan->pfd, 1, -1);
+        if (ret < 0) {
+            fprintf(stderr, "failed to poll\n");
+            exit(-1);
+        }
+    } while (!(chan->pfd.revents & (POLLIN | POLLRDHUP | POLLHUP)));
+
+    /* terminate guestlib when worker exits */
+    if (chan->pfd.revents & (POLLRDHUP | POLLHUP)) {
+        DEBUG_PRINT("command_channel_socket shutdown\n");
+        close(chan->pfd.fd);
+        exit(-1);
+    }
+}
+
+/**
+ * Read once from the socket into `buf`, blocking until some bytes arrive.
+ * In busy-poll mode the read spins first. The process exits when the peer
+ * shuts down.
+ * @return The number of bytes read.
+ */
+static size_t socket_recv_some(struct command_channel_socket *chan, void *buf, size_t size)
+{
+    if (chan->busy_poll_ns) {
+        size_t n = socket_busy_poll(chan, buf, size, 0);
+        if (n)
+            return n;
+    }
+    for (;;) {
+        ssize_t ret = recv(chan->sock_fd, buf, size, 0);
+        chan->recv_stats.syscalls++;
+        if (ret > 0)
+            return ret;
+        if (ret == 0) {
+            DEBUG_PRINT("command_channel_socket shutdown\n");
+            close(chan->sock_fd);
+            exit(-1);
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            command_channel_socket_wait_command(chan);
+            chan->recv_stats.syscalls++;
+        }
+        else if (errno != EINTR) {
+            perror("ERROR receiving from socket");
+            close(chan->sock_fd);
+            exit(0);
+        }
+    }
+}
+
+/**
+ * Make sure at least `need` bytes are staged, reading as much as the
+ * socket has ready on every call.
+ */
+static void socket_recv_fill(struct command_channel_socket *chan, size_t need)
+{
+    assert(need <= AVA_SOCKET_RECV_BUFFER_SIZE);
+    if (!chan->recv_buf)
+        chan->recv_buf = (char *)malloc(AVA_SOCKET_RECV_BUFFER_SIZE);
+    while (chan->recv_end - chan->recv_begin < need) {
+        if (chan->recv_begin == chan->recv_end)
+            chan->recv_begin = chan->recv_end = 0;
+        if (AVA_SOCKET_RECV_BUFFER_SIZE - chan->recv_begin < need) {
+            memmove(chan->recv_buf, chan->recv_buf + chan->recv_begin, chan->recv_end - chan->recv_begin);
+            chan->recv_end -= chan->recv_begin;
+            chan->recv_begin = 0;
+        }
+        chan->recv_end += socket_recv_some(chan, chan->recv_buf + chan->recv_end,
+                                           AVA_SOCKET_RECV_BUFFER_SIZE - chan->recv_end);
+    }
+}
+
+/**
+ * Parse the header of the next command from the `size` bytes at `buf`
+ * into `cmd_base`. The process exits if the header is corrupt.
+ * @return The size of the header on the wire, or 0 if more bytes are needed.
+ */
+size_t command_channel_socket_peek_header(const struct command_channel_socket *chan, const char *buf, size_t size,
+                                          struct command_base *cmd_base)
+{
+    size_t header_size;
+
+    if (chan->wire_version == COMMAND_WIRE_VERBATIM) {
+        if (size < sizeof(struct command_base))
+            return 0;
+        memcpy(cmd_base, buf, sizeof(struct command_base));
+        header_size = sizeof(struct command_base);
+    }
+    else if (!(header_size = command_wire_decode(buf, size, cmd_base))) {
+        return 0;
+    }
+
+    if (cmd_base->command_size < sizeof(struct command_base)) {
+        fprintf(stderr, "Corrupt command header (command_size=%ld, region_size=%ld)\n",
+                cmd_base->command_size, cmd_base->region_size);
+        exit(-1);
+    }
+    return header_size;
+}
+
+static bool socket_recv_staged(struct command_channel_socket *chan)
+{
+    struct command_base cmd_base;
+    const size_t staged = chan->recv_end - chan->recv_begin;
+    const size_t header_size = command_channel_socket_peek_header(chan, chan->recv_buf + chan->recv_begin,
+                                                                  staged, &cmd_base);
+
+    return header_size &&
+           staged - header_size >= cmd_base.command_size - sizeof(struct command_base) + cmd_base.region_size;
+}
+
+/**
+ * Returns true if a whole command has been read into the staging buffer,
+ * so that receiving it will not block.
+ */
+bool command_channel_socket_has_staged_command(struct command_channel_socket *chan)
+{
+    bool staged;
+
+    pthread_mutex_lock(&chan->recv_mutex);
+    staged = !chan->stream && socket_recv_staged(chan);
+    pthread_mutex_unlock(&chan->recv_mutex);
+    return staged;
+}
+
+/**
+ * Shut down when the peer has closed a connection of the channel.
+ */
+static void socket_bulk_peer_shutdown(struct command_channel_socket *chan)
+{
+    DEBUG_PRINT("command_channel_socket shutdown\n");
+    close(chan->sock_fd);
+    exit(-1);
+}
+
+/**
+ * Return the oldest complete command whose guest thread does not wait for
+ * an earlier bulk command, or NULL. Commands behind more than a few bulk
+ * commands in flight wait for the oldest ones to complete.
+ */
+static struct command_base *socket_bulk_pop(struct socket_bulk *bulk)
+{
+    int64_t waiting[8];
+    size_t nr_waiting = 0;
+
+    for (auto it = bulk->queue.begin(); it != bulk->queue.end(); ++it) {
+        int64_t thread_id = it->cmd->thread_id;
+        if (!it->complete) {
+            if (nr_waiting == sizeof(waiting) / sizeof(waiting[0]))
+                return NULL;
+            waiting[nr_waiting++] = thread_id;
+            continue;
+        }
+        if (std::find(waiting, waiting + nr_waiting, thread_id) != waiting + nr_waiting)
+            continue;
+
+        struct command_base *cmd = it->cmd;
+        if (nr_waiting)
+            bulk->overtaking++;
+        bulk->queue.erase(it);
+        return cmd;
+    }
+    return NULL;
+}
+
+/**
+ * Take the next command out of the staging buffer, if it is there. The
+ * region of a bulk command is received later; any other command that does
+ * not fit in the staging buffer is received in place.
+ * @return False if more bytes are needed.
+ */
+static bool socket_bulk_carve(struct command_channel_socket *chan)
+{
+    struct socket_bulk *bulk = chan->bulk;
+    struct command_base cmd_base;
+    size_t staged = chan->recv_end - chan->recv_begin;
+    const size_t header_size = command_channel_socket_peek_header(chan, chan->recv_buf + chan->recv_begin,
+                                                                  staged, &cmd_base);
+
+    if (!header_size)
+        return false;
+    /* Bytes that follow the header on this connection */
+    const bool is_bulk = cmd_base.flags & COMMAND_FLAG_BULK;
+    const size_t wire_size = cmd_base.command_size - sizeof(struct command_base) +
+                             (is_bulk ? 0 : cmd_base.region_size);
+    staged -= header_size;
+    /* Wait for a small remainder only if the staging buffer can hold it */
+    if (staged < wire_size && wire_size - staged < AVA_SOCKET_RECV_BUFFER_SIZE / 2 &&
+        header_size + wire_size <= AVA_SOCKET_RECV_BUFFER_SIZE)
+        return false;
+
+    struct command_base *cmd = (struct command_base *)cmd_buffer_pool_alloc(
+            chan->cmd_pool, cmd_base.command_size + cmd_base.region_size);
+    char *dst = (char *)cmd + sizeof(struct command_base);
+    memcpy(cmd, &cmd_base, sizeof(struct command_base));
+    command_channel_socket_clear_private(cmd);
+    chan->recv_begin += header_size;
+    size_t n = std::min(staged, wire_size);
+    memcpy(dst, chan->recv_buf + chan->recv_begin, n);
+    chan->recv_begin += n;
+    while (n < wire_size) {
+        size_t ret = socket_recv_some(chan, dst + n, wire_size - n);
+        chan->recv_stats.direct_bytes += ret;
+        n += ret;
+    }
+    chan->recv_stats.commands++;
+
+    if (is_bulk) {
+        bulk->queue.push_back({cmd, false});
+    }
+    else {
+        /* Bulk commands never touch the buffer cache, so this is in order */
+        bulk->queue.push_back({command_channel_socket_expand_command(chan, cmd), true});
+    }
+    return true;
+}
+
+/**
+ * Read what the main connection has ready into the staging buffer. The
+ * buffer is compacted when it is full; a command that does not fit in it
+ * is taken out by `socket_bulk_carve` first, so that there is then room.
+ */
+static void socket_bulk_read_main(struct command_channel_socket *chan)
+{
+    if (!chan->recv_buf)
+        chan->recv_buf = (char *)malloc(AVA_SOCKET_RECV_BUFFER_SIZE);
+    if (chan->recv_begin == chan->recv_end)
+        chan->recv_begin = chan->recv_end = 0;
+    if (chan->recv_begin >= AVA_SOCKET_RECV_BUFFER_SIZE / 2 || chan->recv_end == AVA_SOCKET_RECV_BUFFER_SIZE) {
+        memmove(chan->recv_buf, chan->recv_buf + chan->recv_begin, chan->recv_end - chan->recv_begin);
+        chan->recv_end -= chan->recv_begin;
+        chan->recv_begin = 0;
+    }
+    /* A zero-length recv would look like the peer's shutdown */
+    if (chan->recv_end == AVA_SOCKET_RECV_BUFFER_SIZE)
+        return;
+
+    ssize_t ret = recv(chan->sock_fd, chan->recv_buf + chan->recv_end,
+                       AVA_SOCKET_RECV_BUFFER_SIZE - chan->recv_end, MSG_DONTWAIT);
+    chan->recv_stats.syscalls++;
+    if (ret == 0)
+        socket_bulk_peer_shutdown(chan);
+    if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        perror("ERROR receiving from socket");
+        close(chan->sock_fd);
+        exit(0);
+    }
+    if (ret > 0)
+        chan->recv_end += ret;
+}
+
+/**
+ * Read what the bulk connection has ready into the region of the oldest
+ * incomplete bulk command.
+ */
+static void socket_bulk_read_region(struct command_channel_socket *chan)
+{
+    struct socket_bulk *bulk = chan->bulk;
+    auto it = std::find_if(bulk->queue.begin(), bulk->queue.end(),
+                           [](const struct socket_bulk::entry& e) { return !e.complete; });
+    assert(it != bulk->queue.end());
+
+    struct command_base *cmd = it->cmd;
+    char *region = (char *)cmd + cmd->command_size;
+    if (bulk->filled < cmd->region_size) {
+        ssize_t ret = recv(bulk->fd, region + bulk->filled, cmd->region_size - bulk->filled, MSG_DONTWAIT);
+        chan->recv_stats.syscalls++;
+        if (ret == 0)
+            socket_bulk_peer_shutdown(chan);
+        if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            perror("ERROR receiving from socket");
+            close(bulk->fd);
+            exit(0);
+        }
+        if (ret > 0)
+            bulk->filled += ret;
+    }
+    if (bulk->filled == cmd->region_size) {
+        bulk->received_commands++;
+        bulk->received_bytes += cmd->region_size;
+        bulk->filled = 0;
+        cmd->flags &= ~COMMAND_FLAG_BULK;
+        it->cmd = command_channel_socket_expand_command(chan, cmd);
+        it->complete = true;
+    }
+}
+
+/**
+ * Receive the next command of a channel with a bulk lane. The caller holds
+ * `recv_mutex`. Both connections are read as data arrives, and commands
+ * are returned in arrival order except that a bulk command holds back the
+ * later commands of its guest thread until its region is complete.
+ */
+static struct command_base *socket_bulk_receive(struct command_channel_socket *chan)
+{
+    struct socket_bulk *bulk = chan->bulk;
+    struct command_base *cmd;
+
+    while (!(cmd = socket_bulk_pop(bulk))) {
+        if (socket_bulk_carve(chan))
+            continue;
+
+        bool incomplete = std::any_of(bulk->queue.begin(), bulk->queue.end(),
+                                      [](const struct socket_bulk::entry& e) { return !e.complete; });
+        struct pollfd pfds[2] = {
+            {chan->sock_fd, POLLIN | POLLRDHUP, 0},
+            {bulk->fd, (short)(incomplete ? POLLIN | POLLRDHUP : POLLRDHUP), 0},
+        };
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "failed to poll\n");
+            exit(-1);
+        }
+        chan->recv_stats.syscalls++;
+        if (incomplete && (pfds[1].revents & (POLLIN | POLLRDHUP | POLLHUP)))
+            socket_bulk_read_region(chan);
+        else if (pfds[1].revents & (POLLRDHUP | POLLHUP | POLLERR))
+            socket_bulk_peer_shutdown(chan);
+        if (pfds[0].revents & (POLLIN | POLLRDHUP | POLLHUP | POLLERR))
+            socket_bulk_read_main(chan);
+    }
+    return cmd;
+}
+
+/**
+ * Set up the streamed buffers of a received command. The stream table is
+ * dropped from the region, which is left with the buffers that were sent
+ * with the command. The caller holds `recv_mutex`.
+ */
+static void socket_stream_begin(struct command_channel_socket *chan, struct command_base *cmd)
+{
+    struct socket_stream_table table;
+    char *region = (char *)cmd + cmd->command_size;
+    uint64_t streamed = 0;
+
+    if (cmd->region_size < sizeof(table))
+        goto corrupt;
+    memcpy(&table, region, sizeof(table));
+    if (table.count == 0 || table.count > (cmd->region_size - sizeof(table)) / sizeof(struct socket_stream_entry))
+        goto corrupt;
+
+    {
+        struct socket_stream *stream = (struct socket_stream *)malloc(sizeof(struct socket_stream));
+        const size_t table_size = sizeof(table) + table.count * sizeof(struct socket_stream_entry);
+        stream->chan = chan;
+        stream->count = table.count;
+        stream->next = 0;
+        stream->entries = (struct socket_stream_entry *)malloc(table.count * sizeof(struct socket_stream_entry));
+        memcpy(stream->entries, region + sizeof(table), table.count * sizeof(struct socket_stream_entry));
+        stream->whole = (void **)calloc(table.count, sizeof(void *));
+
+        uint64_t end = 0;
+        for (uint64_t i = 0; i < table.count; i++) {
+            const struct socket_stream_entry *entry = &stream->entries[i];
+            if (entry->offset < end || entry->size == 0 || entry->offset > table.raw_region_size ||
+                    entry->size > table.raw_region_size - entry->offset) {
+                free(stream->entries);
+                free(stream->whole);
+                free(stream);
+                goto corrupt;
+            }
+            end = entry->offset + entry->size;
+            streamed += entry->size;
+        }
+        if (table.raw_region_size - streamed != cmd->region_size - table_size) {
+            free(stream->entries);
+            free(stream->whole);
+            free(stream);
+            goto corrupt;
+        }
+
+        memmove(region, region + table_size, cmd->region_size - table_size);
+        cmd->region_size -= table_size;
+        socket_command_private(cmd)->stream = stream;
+        chan->stream = stream;
+        return;
+    }
+
+corrupt:
+    fprintf(stderr, "Corrupt streamed command (api_id=%d, command_id=%ld)\n", cmd->api_id, cmd->command_id);
+    exit(-1);
+}
+
+/**
+ * Receive `size` streamed bytes, first from the staging buffer and then
+ * from the socket. The first `limit` bytes are passed to `fn`, or received
+ * into `arg` when `fn` is NULL; the rest is dropped. Chunks are at most the
+ * size of the staging buffer. The caller holds `recv_mutex`.
+ */
+static void socket_stream_receive(struct command_channel_socket *chan, size_t size, size_t limit,
+                                  command_channel_chunk_fn fn, void *arg)
+{
+    size_t done = 0;
+
+    if (!chan->recv_buf)
+        chan->recv_buf = (char *)malloc(AVA_SOCKET_RECV_BUFFER_SIZE);
+    while (done < size) {
+        if (chan->recv_begin == chan->recv_end) {
+            chan->recv_begin = chan->recv_end = 0;
+            if (!fn && done < limit) {
+                size_t n = socket_recv_some(chan, (char *)arg + done, std::min(size, limit) - done);
+                chan->recv_stats.direct_bytes += n;
+                done += n;
+                continue;
+            }
+            chan->recv_end = socket_recv_some(chan, chan->recv_buf, AVA_SOCKET_RECV_BUFFER_SIZE);
+        }
+
+        size_t n = std::min(size - done, chan->recv_end - chan->recv_begin);
+        if (done < limit) {
+            const char *chunk = chan->recv_buf + chan->recv_begin;
+            size_t used = std::min(n, limit - done);
+            if (fn)
+                fn(arg, chunk, done, used);
+            else
+                memcpy((char *)arg + done, chunk, used);
+        }
+        chan->recv_begin += n;
+        done += n;
+    }
+}
+
+/**
+ * Mark the streamed buffer at the head of the connection as received, and
+ * let the next command be received after the last one. The caller holds
+ * `recv_mutex`.
+ */
+static void socket_stream_next(struct socket_stream *stream)
+{
+    struct command_channel_socket *chan = stream->chan;
+
+    chan->stream_stats.received_buffers++;
+    chan->stream_stats.received_bytes += stream->entries[stream->next].size;
+    /* Buffers in front of `next` are read without the lock */
+    __atomic_store_n(&stream->next, stream->next + 1, __ATOMIC_RELEASE);
+    if (stream->next == stream->count) {
+        chan->stream = NULL;
+        pthread_cond_broadcast(&chan->stream_done);
+    }
+}
+
+/**
+ * Receive the streamed buffers in front of buffer `index`, keeping them
+ * whole in case they are read later. The caller holds `recv_mutex`.
+ */
+static void socket_stream_skip_to(struct socket_stream *stream, uint64_t index)
+{
+    while (stream->next < index) {
+        const struct socket_stream_entry *entry = &stream->entries[stream->next];
+        stream->whole[stream->next] = malloc(entry->size);
+        socket_stream_receive(stream->chan, entry->size, entry->size, NULL, stream->whole[stream->next]);
+        stream->chan->stream_stats.whole_bytes += entry->size;
+        socket_stream_next(stream);
+    }
+}
+
+/**
+ * Wait up to AVA_SOCKET_STREAM_WAIT for the handler of the previous command
+ * to read its streamed buffers. Its thread may be busy with earlier calls,
+ * or waiting for a reply behind the stream, so the rest of the stream is
+ * then received whole, to be read from memory, and the next command can be
+ * received. The caller holds `recv_mutex`.
+ */
+static void socket_stream_wait(struct command_channel_socket *chan)
+{
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += AVA_SOCKET_STREAM_WAIT * 1000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+    while (chan->stream &&
+           pthread_cond_timedwait(&chan->stream_done, &chan->recv_mutex, &deadline) != ETIMEDOUT)
+        ;
+
+    struct socket_stream *stream = chan->stream;
+    if (stream) {
+        chan->stream_stats.spills++;
+        socket_stream_skip_to(stream, stream->count);
+    }
+}
+
+/**
+ * Returns the index of the streamed buffer at `buffer_id`, or -1.
+ */
+static int64_t socket_stream_find(const struct command_base *cmd, uintptr_t buffer_id)
+{
+    struct socket_stream *stream = socket_command_private(cmd)->stream;
+    const uint64_t offset = buffer_id - cmd->command_size;
+
+    for (uint64_t i = 0; i < stream->count && stream->entries[i].offset <= offset; i++) {
+        if (stream->entries[i].offset == offset)
+            return i;
+    }
+    return -1;
+}
+
+/**
+ * Returns streamed buffer `index` as a whole, receiving it first if needed.
+ * A buffer that has been received already is returned without taking
+ * `recv_mutex`, which the receiver holds while it waits for the next
+ * command.
+ */
+static void *socket_stream_whole(struct socket_stream *stream, const struct command_base *cmd, uint64_t index)
+{
+    struct command_channel_socket *chan = stream->chan;
+
+    if (index < __atomic_load_n(&stream->next, __ATOMIC_ACQUIRE) && stream->whole[index])
+        return stream->whole[index];
+
+    pthread_mutex_lock(&chan->recv_mutex);
+    if (!stream->whole[index]) {
+        const struct socket_stream_entry *entry = &stream->entries[index];
+        if (index < stream->next) {
+            fprintf(stderr, "Streamed buffer of command %ld was already read\n", cmd->command_id);
+            exit(-1);
+        }
+        socket_stream_skip_to(stream, index);
+        stream->whole[index] = malloc(entry->size);
+        socket_stream_receive(chan, entry->size, entry->size, NULL, stream->whole[index]);
+        chan->stream_stats.whole_bytes += entry->size;
+        socket_stream_next(stream);
+    }
+    pthread_mutex_unlock(&chan->recv_mutex);
+    return stream->whole[index];
+}
+
+/**
+ * Drop the streamed buffers of a command that were not read, and free the
+ * buffers kept whole.
+ */
+static void socket_stream_free(struct socket_stream *stream)
+{
+    struct command_channel_socket *chan = stream->chan;
+
+    if (__atomic_load_n(&stream->next, __ATOMIC_ACQUIRE) < stream->count) {
+        pthread_mutex_lock(&chan->recv_mutex);
+        while (stream->next < stream->count) {
+            socket_stream_receive(chan, stream->entries[stream->next].size, 0, NULL, NULL);
+            socket_stream_next(stream);
+        }
+        pthread_mutex_unlock(&chan->recv_mutex);
+    }
+
+    for (uint64_t i = 0; i < stream->count; i++)
+        free(stream->whole[i]);
+    free(stream->whole);
+    free(stream->entries);
+    free(stream);
+}
+
 /**
  * Receive a command from a channel. The returned Command pointer
  * should be interpreted based on its `command_id` field.
  *
  * This call blocks waiting for a command to be sent along this
  * channel.
+ *
+ * Bytes are read into a staging buffer as they become available, so a
+ * burst of small commands is carved out of a single read. The remainder
+ * of a large command is received directly into the command. The streamed
+ * buffers of the previous command are read by its handler before the next
+ * command is received, or received whole if that takes too long.
  */
 struct command_base* command_channel_socket_receive_command(struct command_channel* c)
 {
     struct command_channel_socket *chan = (struct command_channel_socket *)c;
     struct command_base cmd_base;
     struct command_base *cmd;
-    ssize_t ret;
 
-    ret = poll(&chan->pfd, 1, -1);
-    if (ret < 0) {
-        fprintf(stderr, "failed to poll\n");
-        exit(-1);
+    pthread_mutex_lock(&chan->recv_mutex);
+    if (chan->bulk) {
+        cmd = socket_bulk_receive(chan);
+        pthread_mutex_unlock(&chan->recv_mutex);
+
+        command_channel_socket_print_command(c, cmd);
+        return cmd;
     }
+    if (chan->stream)
+        socket_stream_wait(chan);
+    if (socket_recv_staged(chan))
+        chan->recv_stats.buffered++;
+    size_t header_size;
+    while (!(header_size = command_channel_socket_peek_header(chan, chan->recv_buf + chan->recv_begin,
+                                                              chan->recv_end - chan->recv_begin, &cmd_base)))
+        socket_recv_fill(chan, chan->recv_end - chan->recv_begin + 1);
+    chan->recv_begin += header_size;
 
-    if (chan->pfd.revents == 0)
-        return NULL;
+    const size_t total_size = cmd_base.command_size + cmd_base.region_size;
+    cmd = (struct command_base *)cmd_buffer_pool_alloc(chan->cmd_pool, total_size);
+    memcpy(cmd, &cmd_base, sizeof(struct command_base));
+    command_channel_socket_clear_private(cmd);
 
-    /* terminate guestlib when worker exits */
-    if (chan->pfd.revents & POLLRDHUP) {
-        DEBUG_PRINT("command_channel_socket shutdown\n");
-        close(chan->pfd.fd);
-        exit(-1);
+    size_t received = sizeof(struct command_base);
+    while (received < total_size) {
+        if (chan->recv_end == chan->recv_begin) {
+            /* Large remainders go directly into the command */
+            if (total_size - received >= AVA_SOCKET_RECV_BUFFER_SIZE / 2) {
+                size_t n = socket_recv_some(chan, (char *)cmd + received, total_size - received);
+                chan->recv_stats.direct_bytes += n;
+                received += n;
+                continue;
+            }
+            socket_recv_fill(chan, 1);
+        }
+        size_t n = std::min(total_size - received, chan->recv_end - chan->recv_begin);
+        memcpy((char *)cmd + received, chan->recv_buf + chan->recv_begin, n);
+        chan->recv_begin += n;
+        received += n;
     }
+    chan->recv_stats.commands++;
+    /* Cached buffers are updated in the order commands arrive */
+    cmd = command_channel_socket_expand_command(chan, cmd);
+    if (cmd->flags & COMMAND_FLAG_STREAM)
+        socket_stream_begin(chan, cmd);
+    pthread_mutex_unlock(&chan->recv_mutex);
 
-    if (chan->pfd.revents & POLLIN) {
-        pthread_mutex_lock(&chan->recv_mutex);
-        memset(&cmd_base, 0, sizeof(struct command_base));
-        recv_socket(chan->pfd.fd, &cmd_base, sizeof(struct command_base));
-        cmd = (struct command_base *)malloc(cmd_base.command_size + cmd_base.region_size);
-        memcpy(cmd, &cmd_base, sizeof(struct command_base));
+    command_channel_socket_print_command(c, cmd);
+    return cmd;
+}
 
-        recv_socket(chan->pfd.fd, (uint8_t *)cmd + sizeof(struct command_base),
-                    cmd_base.command_size + cmd_base.region_size - sizeof(struct command_base));
-        pthread_mutex_unlock(&chan->recv_mutex);
+/**
+ * Expand a received command whose data region contains encoded buffers
+ * (`COMMAND_FLAG_ENCODED`) into a new command with the raw region, and
+ * free the received one. Other commands are returned as they are.
+ * The caller holds `recv_mutex`, so that the cache of deduplicated buffers
+ * is updated in connection order.
+ */
+struct command_base* command_channel_socket_expand_command(struct command_channel_socket *chan,
+                                                           struct command_base* cmd)
+{
+    struct socket_region_table table;
+    struct command_base *raw;
 
-        command_channel_socket_print_command(c, cmd);
+    if (!(cmd->flags & COMMAND_FLAG_ENCODED))
         return cmd;
+
+    const char *wire = (const char *)cmd + cmd->command_size;
+    const char *wire_end = wire + cmd->region_size;
+    if (cmd->region_size < sizeof(table))
+        goto corrupt;
+    memcpy(&table, wire, sizeof(table));
+    if (table.count > (cmd->region_size - sizeof(table)) / sizeof(struct socket_region_entry))
+        goto corrupt;
+
+    {
+        const char *pos = wire + sizeof(table) + table.count * sizeof(struct socket_region_entry);
+        size_t done = 0;
+
+        raw = (struct command_base *)cmd_buffer_pool_alloc(chan->cmd_pool, cmd->command_size + table.raw_region_size);
+        memcpy(raw, cmd, cmd->command_size);
+        char *region = (char *)raw + cmd->command_size;
+
+        for (uint64_t i = 0; i < table.count; i++) {
+            struct socket_region_entry entry;
+            memcpy(&entry, wire + sizeof(table) + i * sizeof(entry), sizeof(entry));
+
+            if (entry.kind & SOCKET_REGION_DROP) {
+                if (!chan->dedup_rx || !socket_dedup_receiver_drop(chan->dedup_rx, entry.slot))
+                    goto corrupt_raw;
+                continue;
+            }
+            if (entry.offset < done || entry.offset > table.raw_region_size ||
+                    entry.raw_size > table.raw_region_size - entry.offset ||
+                    entry.wire_size > (size_t)(wire_end - pos) ||
+                    entry.offset - done > (size_t)(wire_end - pos) - entry.wire_size)
+                goto corrupt_raw;
+
+            memcpy(region + done, pos, entry.offset - done);
+            pos += entry.offset - done;
+            if (entry.kind & SOCKET_REGION_CACHED) {
+                const void *cached = chan->dedup_rx ?
+                    socket_dedup_receiver_get(chan->dedup_rx, entry.slot, entry.raw_size) : NULL;
+                if (!cached || entry.wire_size != 0)
+                    goto corrupt_raw;
+                memcpy(region + entry.offset, cached, entry.raw_size);
+                __atomic_fetch_add(&chan->dedup_stats.served, 1, __ATOMIC_RELAXED);
+            }
+            else if (entry.kind & SOCKET_REGION_COMPRESSED) {
+                uint64_t start = cmd_compress_thread_time();
+                if (cmd_decompress(pos, entry.wire_size, region + entry.offset, entry.raw_size))
+                    goto corrupt_raw;
+                __atomic_fetch_add(&chan->compress_stats.decompress_ns, cmd_compress_thread_time() - start,
+                                   __ATOMIC_RELAXED);
+            }
+            else {
+                if (entry.wire_size != entry.raw_size)
+                    goto corrupt_raw;
+                memcpy(region + entry.offset, pos, entry.raw_size);
+            }
+            if (entry.kind & SOCKET_REGION_STORE) {
+                if (!chan->dedup_rx)
+                    chan->dedup_rx = socket_dedup_receiver_new();
+                if (!socket_dedup_receiver_store(chan->dedup_rx, entry.slot, region + entry.offset, entry.raw_size))
+                    goto corrupt_raw;
+            }
+            pos += entry.wire_size;
+            done = entry.offset + entry.raw_size;
+        }
+        if (table.raw_region_size - done != (size_t)(wire_end - pos))
+            goto corrupt_raw;
+        memcpy(region + done, pos, table.raw_region_size - done);
     }
 
-    return NULL;
+    raw->region_size = table.raw_region_size;
+    raw->flags &= ~COMMAND_FLAG_ENCODED;
+    cmd_buffer_pool_release(cmd);
+    return raw;
+
+corrupt_raw:
+    cmd_buffer_pool_release(raw);
+corrupt:
+    fprintf(stderr, "Corrupt encoded command (api_id=%d, command_id=%ld)\n", cmd->api_id, cmd->command_id);
+    exit(-1);
 }
 
 /**
  * Translate a buffer_id (as returned by
  * `command_channel_attach_buffer` in the sender) into a data pointer.
  * The returned pointer will be valid until
- * `command_channel_free_command` is called on `cmd`.
+ * `command_channel_free_command` is called on `cmd`. A streamed buffer is
+ * received whole.
  */
 void* command_channel_socket_get_buffer(const struct command_channel *chan, const struct command_base *cmd, void* buffer_id) {
+    if (cmd->flags & COMMAND_FLAG_STREAM) {
+        struct socket_stream *stream = socket_command_private(cmd)->stream;
+        int64_t index = socket_stream_find(cmd, (uintptr_t)buffer_id);
+        if (index >= 0)
+            return socket_stream_whole(stream, cmd, index);
+
+        /* The streamed buffers in front of it are not in the region */
+        uintptr_t shift = 0;
+        for (uint64_t i = 0; i < stream->count &&
+                stream->entries[i].offset < (uintptr_t)buffer_id - cmd->command_size; i++)
+            shift += stream->entries[i].size;
+        return (void *)((uintptr_t)cmd + (uintptr_t)buffer_id - shift);
+    }
     return (void *)((uintptr_t)cmd + buffer_id);
 }
 
+/**
+ * Pass the first `size` bytes of a buffer to `fn`, or copy them into `arg`
+ * if `fn` is NULL. A streamed buffer is received chunk by chunk, or
+ * directly into `arg`.
+ */
+void command_channel_socket_read_buffer(struct command_channel *c, const struct command_base *cmd,
+                                       void* buffer_id, size_t size, command_channel_chunk_fn fn, void *arg)
+{
+    int64_t index = (cmd->flags & COMMAND_FLAG_STREAM) ? socket_stream_find(cmd, (uintptr_t)buffer_id) : -1;
+
+    if (index >= 0) {
+        struct socket_stream *stream = socket_command_private(cmd)->stream;
+        struct command_channel_socket *chan = stream->chan;
+        const struct socket_stream_entry *entry = &stream->entries[index];
+
+        /* A buffer received already is read from memory without the lock */
+        if (index >= (int64_t)__atomic_load_n(&stream->next, __ATOMIC_ACQUIRE) || !stream->whole[index]) {
+            pthread_mutex_lock(&chan->recv_mutex);
+            if (!stream->whole[index]) {
+                if (index < (int64_t)stream->next) {
+                    fprintf(stderr, "Streamed buffer of command %ld was already read\n", cmd->command_id);
+                    exit(-1);
+                }
+                socket_stream_skip_to(stream, index);
+                socket_stream_receive(chan, entry->size, std::min(size, (size_t)entry->size), fn, arg);
+                socket_stream_next(stream);
+                pthread_mutex_unlock(&chan->recv_mutex);
+                return;
+            }
+            pthread_mutex_unlock(&chan->recv_mutex);
+        }
+        size = std::min(size, (size_t)entry->size);
+    }
+
+    const void *buffer = command_channel_socket_get_buffer(c, cmd, buffer_id);
+    if (fn)
+        fn(arg, buffer, 0, size);
+    else
+        memcpy(arg, buffer, size);
+}
+
 /**
  * Returns the pointer to data region. The returned pointer is mainly
- * used for data extraction for migration.
+ * used for data extraction for migration. Streamed buffers of received
+ * commands are not part of it, which is why an API server that records
+ * calls does not accept streaming.
+ *
+ * Only the inline area follows a command being sent with a vectored write,
+ * so its region is gathered into a copy that lives as long as the command.
+ * This must happen before the command is sent.
  */
 void* command_channel_socket_get_data_region(const struct command_channel *c, const struct command_base *cmd)
 {
-    return (void *)((uintptr_t)cmd + cmd->command_size);
+    struct socket_sg_list *sg = socket_command_private(cmd)->sg;
+    if (!sg)
+        return (void *)((uintptr_t)cmd + cmd->command_size);
+    if (!sg->region_copy)
+        sg->region_copy = socket_sg_gather_region(sg, cmd);
+    return sg->region_copy;
 }
 
 /**
  * Free a command returned by `command_channel_receive_command`.
  */
 void command_channel_socket_free_command(struct command_channel* c, struct command_base* cmd) {
-    free(cmd);
+    if (cmd->flags & COMMAND_FLAG_STREAM)
+        socket_stream_free(socket_command_private(cmd)->stream);
+    cmd_buffer_pool_release(cmd);
 }
 
 };  // namespace chansocketutil
+
+/**
+ * Set the busy-poll receive mode of the socket channels created afterwards.
+ */
+void command_channel_socket_set_busy_poll(unsigned long spin_us, const char *cores)
+{
+    chansocketutil::socket_busy_poll_ns = (uint64_t)spin_us * 1000;
+    chansocketutil::socket_busy_poll_pin = 0;
+    if (spin_us && cores && cores[0]) {
+        if (command_channel_parse_cores(cores, &chansocketutil::socket_busy_poll_cores) > 0)
+            chansocketutil::socket_busy_poll_pin = 1;
+        else
+            fprintf(stderr, "Ignore malformed busy-poll cores \"%s\"\n", cores);
+    }
+}
@@ -1,12 +1,138 @@
 #ifndef AVA_COMMON_CMD_CHANNEL_SOCKET_UTILITIES_H_
 #define AVA_COMMON_CMD_CHANNEL_SOCKET_UTILITIES_H_
 
+#include <deque>
+#include <string>
 #include <vector>
 
 #include <poll.h>
+#include <sys/uio.h>
+
+#include "common/cmd_compress.h"
+#include "common/cmd_wire.h"
+
+struct cmd_buffer_pool;
 
 namespace chansocketutil {
 
+struct socket_uring;
+struct socket_coalesce;
+struct socket_region_list;
+struct socket_stream_list;
+struct socket_stream;
+struct socket_dedup_sender;
+struct socket_dedup_receiver;
+struct command_channel_socket;
+
+/**
+ * Buffers of a command whose data region exceeds AVA_SOCKET_SG_THRESHOLD.
+ * `iov[0]` is the command struct, and the remaining entries are the data
+ * region segments in order. Small buffers are copied into the inline area
+ * following the command struct, and larger ones are referenced.
+ */
+struct socket_sg_list {
+  size_t inline_used;
+  int count;
+  int capacity;
+
+  /* The channel whose compression and dedup settings apply, and the
+   * buffers that are compressed or deduplicated (NULL if none) */
+  struct command_channel_socket *chan;
+  struct socket_region_list *region;
+
+  /* Buffers sent after the rest of the region (NULL if none) */
+  struct socket_stream_list *streams;
+
+  /* The data region gathered into one buffer by get_data_region, for the
+   * migration log (NULL until then) */
+  void *region_copy;
+
+  /* Copy of the command struct sent with a verbatim header, without the
+   * sender's private data (NULL if none) */
+  void *wire_head;
+
+  struct iovec iov[];
+};
+
+/**
+ * Content key of a deduplicated buffer.
+ */
+struct socket_dedup_key {
+  uint64_t hash[2];
+  uint64_t size;
+};
+
+#define SOCKET_DEDUP_NO_SLOT UINT32_MAX
+
+struct socket_dedup_stats {
+  uint64_t buffers;        /* sent buffers large enough to be considered */
+  uint64_t hits;           /* sent as a reference to the receiver's cache */
+  uint64_t bytes_avoided;  /* raw bytes of those buffers */
+  uint64_t hash_ns;        /* thread CPU time spent hashing */
+  uint64_t served;         /* received buffers copied from the cache */
+};
+
+struct socket_recv_stats {
+  uint64_t commands;       /* commands received on the plain socket path */
+  uint64_t syscalls;       /* recv and poll calls made for them */
+  uint64_t buffered;       /* commands found complete in the staging buffer */
+  uint64_t direct_bytes;   /* bytes of large commands received in place */
+};
+
+struct socket_busy_poll_stats {
+  uint64_t receives;       /* reads that spun before blocking */
+  uint64_t hits;           /* of them, served while spinning */
+  uint64_t spin_ns;        /* wall-clock time spent spinning */
+  uint64_t spin_cpu_ns;    /* CPU time of the spinning thread meanwhile */
+};
+
+struct socket_stream_stats {
+  uint64_t sent_buffers;
+  uint64_t sent_bytes;
+  uint64_t received_buffers;
+  uint64_t received_bytes;
+  uint64_t whole_bytes;    /* received bytes that had to be kept whole for get_buffer */
+  uint64_t spills;         /* streams received whole so that the next command could be */
+};
+
+/**
+ * Bulk lane of a socket channel: a second connection that carries large
+ * data regions, while their command structs stay on the main connection.
+ * Each end chooses its own threshold; the receiving end always accepts
+ * bulk commands once the lane exists.
+ */
+struct socket_bulk {
+  int fd;
+  size_t threshold;             /* send regions of at least this size here, 0 never */
+  pthread_mutex_t send_mutex;   /* taken before the channel's `send_mutex` */
+
+  /* Received commands in arrival order. Bulk commands are incomplete until
+   * their region has arrived, and hold back later commands of the same
+   * guest thread. */
+  struct entry {
+    struct command_base *cmd;
+    bool complete;
+  };
+  std::deque<struct entry> queue;
+  size_t filled;                /* region bytes of the oldest incomplete entry */
+
+  /* Statistics */
+  uint64_t sent_commands;
+  uint64_t sent_bytes;
+  uint64_t received_commands;
+  uint64_t received_bytes;
+  uint64_t overtaking;          /* commands returned while a bulk region was in flight */
+};
+
+/**
+ * Channel private data stored in `command_base::reserved_area`.
+ */
+struct socket_command_private {
+  size_t cur_offset;
+  struct socket_sg_list *sg;
+  struct socket_stream *stream;   /* set on received commands with COMMAND_FLAG_STREAM */
+};
+
 struct command_channel_socket {
   struct command_channel_base base;
   int sock_fd;
@@ -23,8 +149,67 @@ struct command_channel_socket {
   uint8_t init_command_type;
 
   std::vector<struct command_channel_socket*> channels;
+
+  /* MSG_ZEROCOPY state: 0 unknown, 1 enabled, -1 unsupported */
+  int zerocopy;
+  uint32_t zerocopy_sent;
+  uint32_t zerocopy_done;
+
+  /* io_uring state, NULL when the plain socket path is used */
+  struct socket_uring *uring;
+
+  /* Recycled buffers for sent and received commands */
+  struct cmd_buffer_pool *cmd_pool;
+
+  /* Outbound buffer of deferrable commands, NULL when writes are not coalesced */
+  struct socket_coalesce *coalesce;
+
+  /* Referenced buffers of at least this size are compressed, 0 disables */
+  size_t compress_threshold;
+  struct cmd_compress_stats compress_stats;
+
+  /* Buffer deduplication; the sender side is NULL when disabled, and the
+   * receiver side is created by the first buffer the peer asks to cache */
+  struct socket_dedup_sender *dedup;
+  struct socket_dedup_receiver *dedup_rx;
+  struct socket_dedup_stats dedup_stats;
+
+  /* Staging buffer of the plain receive path, allocated on first use.
+   * Bytes in [recv_begin, recv_end) have been read but not consumed. */
+  char *recv_buf;
+  size_t recv_begin;
+  size_t recv_end;
+  struct socket_recv_stats recv_stats;
+
+  /* Busy-poll receive mode: reads spin on the socket for up to
+   * `busy_poll_ns` before they block, 0 disables. The first thread that
+   * spins is pinned to `busy_poll_cores` if `busy_poll_pin` is set. */
+  uint64_t busy_poll_ns;
+  cpu_set_t busy_poll_cores;
+  int busy_poll_pin;
+  int busy_poll_cpu_time;  /* measure spin_cpu_ns, only with channel stats */
+  struct socket_busy_poll_stats busy_poll_stats;
+
+  /* Bulk lane, NULL when data regions share the main connection */
+  struct socket_bulk *bulk;
+
+  /* Buffers of at least this size are streamed, 0 disables. While the
+   * buffers of a received command are in flight, `stream` is set and no
+   * other command can be received; `stream_done` is signaled when they
+   * have been read. */
+  size_t stream_threshold;
+  struct socket_stream *stream;
+  pthread_cond_t stream_done;
+  struct socket_stream_stats stream_stats;
+
+  /* Encoding of command headers agreed with the peer (COMMAND_WIRE_*) */
+  int wire_version;
+  struct command_wire_stats wire_stats;
 };
 
+void command_channel_socket_preinitialize(struct command_channel_socket *chan,
+                                          struct command_channel_vtable *vtable);
+
 void command_channel_socket_print_command(const struct command_channel *chan,
                                           const struct command_base *cmd);
 void command_channel_socket_free(struct command_channel* c);
@@ -42,14 +227,52 @@ void command_channel_socket_send_command(struct command_channel* c,
 void command_channel_socket_transfer_command(struct command_channel* c,
                                              const struct command_channel *source,
                                              const struct command_base *cmd);
+void command_channel_socket_wait_command(struct command_channel_socket *chan);
 struct command_base* command_channel_socket_receive_command(struct command_channel* c);
+bool command_channel_socket_has_staged_command(struct command_channel_socket *chan);
+struct command_base* command_channel_socket_expand_command(struct command_channel_socket *chan,
+                                                           struct command_base* cmd);
 void* command_channel_socket_get_buffer(const struct command_channel *chan,
                                         const struct command_base *cmd,
                                         void* buffer_id);
+void command_channel_socket_read_buffer(struct command_channel *c, const struct command_base *cmd,
+                                       void* buffer_id, size_t size, command_channel_chunk_fn fn, void *arg);
 void* command_channel_socket_get_data_region(const struct command_channel *c,
                                              const struct command_base *cmd);
 void command_channel_socket_free_command(struct command_channel* c, struct command_base* cmd);
 
+void command_channel_socket_finalize_command(struct command_base* cmd);
+void command_channel_socket_command_iov(struct command_channel_socket *chan, struct command_base* cmd,
+                                        std::vector<struct iovec>& iov);
+size_t command_channel_socket_peek_header(const struct command_channel_socket *chan, const char *buf, size_t size,
+                                          struct command_base *cmd_base);
+bool command_channel_socket_command_has_references(const struct command_base* cmd);
+void command_channel_socket_release_command(struct command_base* cmd);
+void command_channel_socket_clear_private(struct command_base* cmd);
+
+std::vector<std::string> request_worker_assignment();
+
+void command_channel_socket_enable_coalescing(struct command_channel_socket *chan, unsigned delay_us);
+void command_channel_socket_enable_bulk(struct command_channel_socket *chan, int fd, size_t threshold);
+
+int socket_uring_init(struct command_channel_socket *chan, int sqpoll);
+
+void socket_dedup_hash(const void *buffer, size_t size, struct socket_dedup_key *key);
+struct socket_dedup_sender *socket_dedup_sender_new(size_t capacity);
+void socket_dedup_sender_free(struct socket_dedup_sender *dedup);
+bool socket_dedup_sender_contains(struct socket_dedup_sender *dedup, const struct socket_dedup_key *key);
+bool socket_dedup_sender_lookup(struct socket_dedup_sender *dedup, const struct socket_dedup_key *key,
+                                uint32_t *slot, std::vector<uint32_t>& drops);
+struct socket_dedup_receiver *socket_dedup_receiver_new(void);
+void socket_dedup_receiver_free(struct socket_dedup_receiver *dedup);
+bool socket_dedup_receiver_drop(struct socket_dedup_receiver *dedup, uint32_t slot);
+bool socket_dedup_receiver_store(struct socket_dedup_receiver *dedup, uint32_t slot,
+                                 const void *buffer, size_t size);
+const void *socket_dedup_receiver_get(struct socket_dedup_receiver *dedup, uint32_t slot, size_t size);
+void socket_dedup_print_stats(const struct socket_dedup_stats *stats, const char *name, FILE *stream);
+
+struct command_channel* command_channel_socket_striped_new(struct command_channel_socket **stripes, int count);
+
 };  // namespace chansocketutil
 
 #endif  // AVA_COMMON_CMD_CHANNEL_SOCKET_UTILITIES_H_
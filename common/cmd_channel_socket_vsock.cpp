@@ -26,9 +26,7 @@ namespace {
 struct command_channel* command_channel_socket_new()
 {
     struct chansocketutil::command_channel_socket *chan = (struct chansocketutil::command_channel_socket *)malloc(sizeof(struct chansocketutil::command_channel_socket));
-    command_channel_preinitialize((struct command_channel *)chan, &command_channel_socket_vsock_vtable);
-    pthread_mutex_init(&chan->send_mutex, NULL);
-    pthread_mutex_init(&chan->recv_mutex, NULL);
+    chansocketutil::command_channel_socket_preinitialize(chan, &command_channel_socket_vsock_vtable);
 
     chan->vm_id = nw_global_vm_id = 1;
 
@@ -78,9 +76,7 @@ struct command_channel* command_channel_socket_new()
 struct command_channel* command_channel_socket_worker_new(int listen_port)
 {
     struct chansocketutil::command_channel_socket *chan = (struct chansocketutil::command_channel_socket *)malloc(sizeof(struct chansocketutil::command_channel_socket));
-    command_channel_preinitialize((struct command_channel *)chan, &command_channel_socket_vsock_vtable);
-    pthread_mutex_init(&chan->send_mutex, NULL);
-    pthread_mutex_init(&chan->recv_mutex, NULL);
+    chansocketutil::command_channel_socket_preinitialize(chan, &command_channel_socket_vsock_vtable);
 
     // TODO: notify executor when VM created or destroyed
     printf("spawn worker port#%d\n", listen_port);
@@ -0,0 +1,290 @@
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <unordered_map>
+
+#include "common/cmd_channel_impl.h"
+#include "common/cmd_trace.h"
+#include "common/debug.h"
+#include "common/devconf.h"
+
+/**
+ * Tracing channel.
+ *
+ * Wraps another channel and forwards every call to it, while it writes
+ * each command sent or received to a trace file (see `cmd_trace.h`) with
+ * a timestamp and the ID of the calling thread. Commands belong to the
+ * inner channel, which may send attached buffers straight from the
+ * application's memory, so the tracing channel copies every attached buffer
+ * into a region of its own until the command is sent. Received commands
+ * are traced from the inner channel's data region.
+ *
+ * Records are written through a stdio buffer under a lock. If the trace
+ * cannot be written, tracing stops and the channel keeps forwarding.
+ */
+
+namespace {
+
+extern struct command_channel_vtable command_channel_trace_vtable;
+
+/* Data region of a command being built */
+struct trace_region {
+    char *data;
+    size_t cur_offset;
+};
+
+struct command_channel_trace {
+    struct command_channel_base base;
+    struct command_channel *inner;
+
+    pthread_mutex_t lock;       /* protects the fields below */
+    FILE *file;                 /* NULL once tracing has stopped */
+    char *path;
+    uint64_t start_ns;
+    std::unordered_map<const struct command_base *, struct trace_region> building;
+
+    /* Statistics */
+    uint64_t records;
+    uint64_t bytes;
+};
+
+static inline uint64_t trace_clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Append a record of `cmd` and its data region `region` to the trace.
+ */
+static void trace_write(struct command_channel_trace *chan, int direction, int flags,
+                        const struct command_base *cmd, const void *region)
+{
+    struct command_trace_record record;
+    memset(&record, 0, sizeof(record));
+    record.thread_id = (uint32_t)syscall(SYS_gettid);
+    record.direction = direction;
+    record.flags = flags;
+    record.command_size = cmd->command_size;
+    record.region_size = region ? cmd->region_size : 0;
+
+    pthread_mutex_lock(&chan->lock);
+    if (chan->file) {
+        record.timestamp_ns = trace_clock_ns(CLOCK_MONOTONIC) - chan->start_ns;
+        if (fwrite(&record, sizeof(record), 1, chan->file) != 1 ||
+                fwrite(cmd, cmd->command_size, 1, chan->file) != 1 ||
+                (record.region_size && fwrite(region, record.region_size, 1, chan->file) != 1)) {
+            fprintf(stderr, "Failed to write trace %s: %s; tracing stops\n", chan->path, strerror(errno));
+            fclose(chan->file);
+            chan->file = NULL;
+        }
+        else {
+            chan->records++;
+            chan->bytes += sizeof(record) + record.command_size + record.region_size;
+        }
+    }
+    pthread_mutex_unlock(&chan->lock);
+}
+
+/**
+ * Print a command for debugging.
+ */
+void command_channel_trace_print_command(const struct command_channel *c, const struct command_base *cmd)
+{
+    struct command_channel_trace *chan = (struct command_channel_trace *)c;
+    command_channel_print_command(chan->inner, cmd);
+}
+
+/**
+ * Close the trace and free the inner channel.
+ */
+void command_channel_trace_free(struct command_channel *c)
+{
+    struct command_channel_trace *chan = (struct command_channel_trace *)c;
+
+    if (chan->file && fclose(chan->file))
+        fprintf(stderr, "Failed to write trace %s: %s\n", chan->path, strerror(errno));
+    if (command_channel_stats_enabled())
+        fprintf(stderr, "[trace] %lu commands, %lu KB written to %s\n",
+                chan->records, chan->bytes >> 10, chan->path);
+
+    for (auto &entry : chan->building)
+        free(entry.second.data);
+    command_channel_free(chan->inner);
+    pthread_mutex_destroy(&chan->lock);
+    free(chan->path);
+    delete chan;
+}
+
+//! Sending
+
+size_t command_channel_trace_buffer_size(const struct command_channel *c, size_t size)
+{
+    struct command_channel_trace *chan = (struct command_channel_trace *)c;
+    return command_channel_buffer_size(chan->inner, size);
+}
+
+struct command_base *command_channel_trace_new_command(struct command_channel *c, size_t command_struct_size,
+                                                       size_t data_region_size)
+{
+    struct command_channel_trace *chan = (struct command_channel_trace *)c;
+    struct command_base *cmd = command_channel_new_command(chan->inner, command_struct_size, data_region_size);
+
+    if (data_region_size) {
+        struct trace_region region = {(char *)calloc(1, data_region_size), 0};
+        pthread_mutex_lock(&chan->lock);
+        chan->building[cmd] = region;
+        pthread_mutex_unlock(&chan->lock);
+    }
+    return cmd;
+}
+
+/**
+ * Attach a buffer through the inner channel, and copy it into the traced
+ * region at the offset the inner channel gives it.
+ */
+void *command_channel_trace_attach_buffer(struct command_channel *c, struct command_base *cmd, void *buffer,
+                                          size_t size)
+{
+    struct command_channel_trace *chan = (struct command_channel_trace *)c;
+    void *buffer_id = command_channel_attach_buffer(chan->inner, cmd, buffer, size);
+
+    pthread_mutex_lock(&chan->lock);
+    struct trace_region &region = chan->building.at(cmd);
+    pthread_mutex_unlock(&chan->lock);
+    assert(region.cur_offset + size <= cmd->region_size);
+    memcpy(region.data + region.cur_offset, buffer, size);
+    region.cur_offset += command_channel_buffer_size(chan->inner, size);
+    return buffer_id;
+}
+
+void command_channel_trace_send_command(struct command_channel *c, struct command_base *cmd)
+{
+    struct command_channel_trace *chan = (struct command_channel_trace *)c;
+    char *region = NULL;
+
+    if (cmd->region_size) {
+        pthread_mutex_lock(&chan->lock);
+        auto entry = chan->building.find(cmd);
+        region = entry->second.data;
+        chan->building.erase(entry);
+        pthread_mutex_unlock(&chan->lock);
+    }
+
+    cmd->command_type = NW_NEW_INVOCATION;
+    trace_write(chan, COMMAND_TRACE_SENT, 0, cmd, region);
+    free(region);
+    command_channel_send_command(chan->inner, cmd);
+}
+
+void command_channel_trace_transfer_command(struct command_channel *c, const struct command_channel *source,
+                                            const struct command_base *cmd)
+{
+    struct command_channel_trace *chan = (struct command_channel_trace *)c;
+    trace_write(chan, COMMAND_TRACE_SENT, 0, cmd, command_channel_get_data_region(source, cmd));
+    command_channel_transfer_command(chan->inner, source, cmd);
+}
+
+//! Receiving
+
+struct command_base *command_channel_trace_receive_command(struct command_channel *c)
+{
+    struct command_channel_trace *chan = (struct command_channel_trace *)c;
+    struct command_base *cmd = command_channel_receive_command(chan->inner);
+
+    if (cmd)
+        trace_write(chan, COMMAND_TRACE_RECEIVED, (cmd->flags & COMMAND_FLAG_STREAM) ? COMMAND_TRACE_PARTIAL : 0,
+                    cmd, command_channel_get_data_region(chan->inner, cmd));
+    return cmd;
+}
+
+void *command_channel_trace_get_buffer(const struct command_channel *c, const struct command_base *cmd,
+                                       void *buffer_id)
+{
+    const struct command_channel_trace *chan = (const struct command_channel_trace *)c;
+    return command_channel_get_buffer(chan->inner, cmd, buffer_id);
+}
+
+void command_channel_trace_read_buffer(struct command_channel *c, const struct command_base *cmd, void *buffer_id,
+                                       size_t size, command_channel_chunk_fn fn, void *arg)
+{
+    struct command_channel_trace *chan = (struct command_channel_trace *)c;
+    if (fn)
+        command_channel_read_buffer(chan->inner, cmd, buffer_id, size, fn, arg);
+    else
+        command_channel_copy_buffer(chan->inner, cmd, buffer_id, arg, size);
+}
+
+void *command_channel_trace_get_data_region(const struct command_channel *c, const struct command_base *cmd)
+{
+    const struct command_channel_trace *chan = (const struct command_channel_trace *)c;
+    return command_channel_get_data_region(chan->inner, cmd);
+}
+
+void command_channel_trace_free_command(struct command_channel *c, struct command_base *cmd)
+{
+    struct command_channel_trace *chan = (struct command_channel_trace *)c;
+    command_channel_free_command(chan->inner, cmd);
+}
+
+}  // namespace
+
+/**
+ * Wrap `inner` in a channel that traces its traffic to the file at `path`.
+ * The tracing channel owns `inner` and frees it with itself.
+ * @return The tracing channel, or `inner` itself if the trace cannot be
+ * created.
+ */
+struct command_channel *command_channel_trace_new(struct command_channel *inner, const char *path)
+{
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "Failed to create trace %s: %s; not tracing\n", path, strerror(errno));
+        return inner;
+    }
+    setvbuf(file, NULL, _IOFBF, AVA_TRACE_BUFFER_SIZE);
+
+    struct command_channel_trace *chan = new command_channel_trace();
+    command_channel_preinitialize((struct command_channel *)chan, &command_channel_trace_vtable);
+    chan->inner = inner;
+    pthread_mutex_init(&chan->lock, NULL);
+    chan->file = file;
+    chan->path = strdup(path);
+
+    struct command_trace_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = COMMAND_TRACE_MAGIC;
+    header.version = COMMAND_TRACE_VERSION;
+    header.pid = getpid();
+    header.start_realtime = trace_clock_ns(CLOCK_REALTIME);
+    header.start_ns = chan->start_ns = trace_clock_ns(CLOCK_MONOTONIC);
+    fwrite(&header, sizeof(header), 1, file);
+
+    fprintf(stderr, "Tracing command channel to %s\n", path);
+    return (struct command_channel *)chan;
+}
+
+namespace {
+  struct command_channel_vtable command_channel_trace_vtable = {
+    command_channel_trace_buffer_size,
+    command_channel_trace_new_command,
+    command_channel_trace_attach_buffer,
+    command_channel_trace_send_command,
+    command_channel_trace_transfer_command,
+    command_channel_trace_receive_command,
+    command_channel_trace_get_buffer,
+    command_channel_trace_get_data_region,
+    command_channel_trace_free_command,
+    command_channel_trace_free,
+    command_channel_trace_print_command,
+    command_channel_trace_read_buffer
+  };
+};
@@ -0,0 +1,268 @@
+#include <string.h>
+#include <time.h>
+
+#include "common/cmd_compress.h"
+#include "common/devconf.h"
+
+/**
+ * The compressed stream is a sequence of LZ4-style sequences:
+ *
+ *   token | [literal length bytes] | literals | offset | [match length bytes]
+ *
+ * The high nibble of the token is the literal length and the low nibble is
+ * the match length minus CMD_COMPRESS_MIN_MATCH; a nibble of 15 is continued
+ * by bytes that are added up until one is below 255. The offset is a 16-bit
+ * little-endian distance back into the output. The last sequence carries
+ * literals only and ends the stream.
+ */
+
+#define CMD_COMPRESS_HASH_LOG  12
+#define CMD_COMPRESS_MIN_MATCH 4
+#define CMD_COMPRESS_MAX_DIST  65535
+/* Stop looking for matches this close to the end so that 8-byte reads
+ * stay in bounds. */
+#define CMD_COMPRESS_TAIL      12
+
+static inline uint32_t cmd_compress_read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t cmd_compress_read64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t cmd_compress_hash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - CMD_COMPRESS_HASH_LOG);
+}
+
+static inline uint8_t *cmd_compress_put_length(uint8_t *op, size_t len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+/**
+ * Emit a sequence of `lit_len` literals followed by a match, or by nothing
+ * when `match_len` is 0. Returns NULL if the output does not fit.
+ */
+static uint8_t *cmd_compress_put_sequence(uint8_t *op, uint8_t *oend, const uint8_t *literals, size_t lit_len,
+                                          size_t offset, size_t match_len)
+{
+    uint8_t *token = op;
+    size_t need = 1 + lit_len + lit_len / 255 + 1 + (match_len ? 2 + match_len / 255 + 1 : 0);
+
+    if (need > (size_t)(oend - op))
+        return NULL;
+
+    op++;
+    if (lit_len >= 15) {
+        *token = 15 << 4;
+        op = cmd_compress_put_length(op, lit_len - 15);
+    }
+    else {
+        *token = (uint8_t)(lit_len << 4);
+    }
+    memcpy(op, literals, lit_len);
+    op += lit_len;
+
+    if (match_len) {
+        *op++ = (uint8_t)offset;
+        *op++ = (uint8_t)(offset >> 8);
+        match_len -= CMD_COMPRESS_MIN_MATCH;
+        if (match_len >= 15) {
+            *token |= 15;
+            op = cmd_compress_put_length(op, match_len - 15);
+        }
+        else {
+            *token |= (uint8_t)match_len;
+        }
+    }
+    return op;
+}
+
+size_t cmd_compress_bound(size_t size)
+{
+    return size + size / 255 + 16;
+}
+
+size_t cmd_compress(const void *src, size_t size, void *dst, size_t capacity)
+{
+    uint32_t table[1 << CMD_COMPRESS_HASH_LOG];
+    const uint8_t *base = (const uint8_t *)src;
+    const uint8_t *ip = base;
+    const uint8_t *anchor = base;
+    const uint8_t *end = base + size;
+    uint8_t *op = (uint8_t *)dst;
+    uint8_t *oend = op + capacity;
+
+    if (size > CMD_COMPRESS_TAIL) {
+        const uint8_t *match_limit = end - CMD_COMPRESS_TAIL;
+
+        memset(table, 0, sizeof(table));
+        ip++;
+        while (ip < match_limit) {
+            uint32_t seq = cmd_compress_read32(ip);
+            uint32_t h = cmd_compress_hash(seq);
+            const uint8_t *ref = base + table[h];
+            table[h] = (uint32_t)(ip - base);
+
+            if (ref >= ip || ip - ref > CMD_COMPRESS_MAX_DIST || cmd_compress_read32(ref) != seq) {
+                /* Step faster through data that does not match */
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+
+            const uint8_t *mp = ip + CMD_COMPRESS_MIN_MATCH;
+            const uint8_t *rp = ref + CMD_COMPRESS_MIN_MATCH;
+            while (mp + 8 <= end) {
+                uint64_t diff = cmd_compress_read64(mp) ^ cmd_compress_read64(rp);
+                if (diff) {
+                    mp += __builtin_ctzll(diff) >> 3;
+                    goto found;
+                }
+                mp += 8;
+                rp += 8;
+            }
+            while (mp < end && *mp == *rp) {
+                mp++;
+                rp++;
+            }
+found:
+            op = cmd_compress_put_sequence(op, oend, anchor, ip - anchor, ip - ref, mp - ip);
+            if (!op)
+                return 0;
+            ip = anchor = mp;
+            if (ip < match_limit)
+                table[cmd_compress_hash(cmd_compress_read32(ip - 2))] = (uint32_t)(ip - 2 - base);
+        }
+    }
+
+    op = cmd_compress_put_sequence(op, oend, anchor, end - anchor, 0, 0);
+    if (!op)
+        return 0;
+    return op - (uint8_t *)dst;
+}
+
+int cmd_decompress(const void *src, size_t size, void *dst, size_t raw_size)
+{
+    const uint8_t *ip = (const uint8_t *)src;
+    const uint8_t *iend = ip + size;
+    uint8_t *op = (uint8_t *)dst;
+    uint8_t *oend = op + raw_size;
+    uint8_t b;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+
+        size_t lit_len = token >> 4;
+        if (lit_len == 15) {
+            do {
+                if (ip >= iend)
+                    return -1;
+                b = *ip++;
+                lit_len += b;
+            } while (b == 255);
+        }
+        if (lit_len > (size_t)(iend - ip) || lit_len > (size_t)(oend - op))
+            return -1;
+        /* Short copies are done in one fixed-size move when there is room */
+        if (lit_len <= 16 && iend - ip >= 16 && oend - op >= 16)
+            memcpy(op, ip, 16);
+        else
+            memcpy(op, ip, lit_len);
+        op += lit_len;
+        ip += lit_len;
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        size_t offset = ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15) {
+            do {
+                if (ip >= iend)
+                    return -1;
+                b = *ip++;
+                match_len += b;
+            } while (b == 255);
+        }
+        match_len += CMD_COMPRESS_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - (uint8_t *)dst) || match_len > (size_t)(oend - op))
+            return -1;
+
+        if (offset >= 16 && match_len <= 16 && oend - op >= 16) {
+            memcpy(op, op - offset, 16);
+            op += match_len;
+            continue;
+        }
+        if (offset == 1) {
+            memset(op, op[-1], match_len);
+            op += match_len;
+            continue;
+        }
+        /* Overlapping matches repeat the last `offset` bytes; copy whole
+         * periods, doubling the distance as the pattern grows. */
+        while (match_len) {
+            size_t n = match_len < offset ? match_len : offset;
+            memcpy(op, op - offset, n);
+            op += n;
+            match_len -= n;
+            offset += n;
+        }
+    }
+    return op == oend ? 0 : -1;
+}
+
+int cmd_compress_sample(const void *src, size_t size)
+{
+    uint8_t out[AVA_COMPRESS_SAMPLE_SIZE + AVA_COMPRESS_SAMPLE_SIZE / 255 + 16];
+    size_t in_total = 0, out_total = 0;
+    int i;
+
+    if (size < AVA_COMPRESS_SAMPLES * AVA_COMPRESS_SAMPLE_SIZE)
+        return 1;
+
+    for (i = 0; i < AVA_COMPRESS_SAMPLES; i++) {
+        size_t offset = (size - AVA_COMPRESS_SAMPLE_SIZE) / (AVA_COMPRESS_SAMPLES - 1) * i;
+        size_t n = cmd_compress((const uint8_t *)src + offset, AVA_COMPRESS_SAMPLE_SIZE, out, sizeof(out));
+        in_total += AVA_COMPRESS_SAMPLE_SIZE;
+        out_total += n ? n : AVA_COMPRESS_SAMPLE_SIZE;
+    }
+    return out_total * 100 <= in_total * (100 - AVA_COMPRESS_MIN_SAVING);
+}
+
+uint64_t cmd_compress_thread_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void cmd_compress_print_stats(const struct cmd_compress_stats *stats, const char *name, FILE *stream)
+{
+    fprintf(stream, "[%s] compression: %lu of %lu buffers compressed, %lu skipped by sampling, "
+            "%lu KB -> %lu KB (%.1f%% saved), CPU %.3f ms compress, %.3f ms decompress\n",
+            name, stats->compressed, stats->buffers, stats->skipped,
+            stats->bytes_in >> 10, stats->bytes_out >> 10,
+            stats->bytes_in ? 100.0 * (stats->bytes_in - stats->bytes_out) / stats->bytes_in : 0.0,
+            stats->compress_ns / 1e6, stats->decompress_ns / 1e6);
+}
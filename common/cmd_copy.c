@@ -0,0 +1,230 @@
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "common/cmd_copy.h"
+#include "common/devconf.h"
+
+/**
+ * A split copy. Chunks are claimed with an atomic counter by the caller and
+ * the helpers alike, so a helper that is scheduled late takes fewer chunks.
+ */
+struct cmd_copy_job {
+    char *dst;
+    const char *src;
+    size_t size;
+    size_t chunk_size;
+    size_t chunks;
+    size_t next_chunk;
+    int dest;
+    int pending;  /* helpers that have not finished the job */
+};
+
+static struct {
+    pthread_once_t once;
+    int helpers;
+
+    pthread_mutex_t split_lock;  /* held by the caller of a split copy */
+    pthread_mutex_t lock;        /* protects the fields below */
+    pthread_cond_t start;
+    pthread_cond_t done;
+    uint64_t generation;
+    struct cmd_copy_job *job;
+
+    struct cmd_copy_stats stats;
+} cmd_copy_engine = {
+    .once = PTHREAD_ONCE_INIT,
+    .split_lock = PTHREAD_MUTEX_INITIALIZER,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .start = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+static inline uint64_t cmd_copy_clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Copy with non-temporal stores. The destination is aligned to 16 bytes
+ * with a short `memcpy`; the source may be unaligned.
+ */
+static void cmd_copy_stream(char *dst, const char *src, size_t size)
+{
+#ifdef __SSE2__
+    size_t head = (-(uintptr_t)dst) & 15;
+    if (head > size)
+        head = size;
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    size -= head;
+
+    for (; size >= 64; size -= 64, dst += 64, src += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)src);
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(src + 48));
+        _mm_stream_si128((__m128i *)dst, a);
+        _mm_stream_si128((__m128i *)(dst + 16), b);
+        _mm_stream_si128((__m128i *)(dst + 32), c);
+        _mm_stream_si128((__m128i *)(dst + 48), d);
+    }
+    /* Order the streaming stores before whatever publishes the copy */
+    _mm_sfence();
+#endif
+    memcpy(dst, src, size);
+}
+
+static inline void cmd_copy_range(char *dst, const char *src, size_t size, int dest)
+{
+    if (dest == CMD_COPY_SHARED)
+        cmd_copy_stream(dst, src, size);
+    else
+        memcpy(dst, src, size);
+}
+
+static void cmd_copy_run(struct cmd_copy_job *job)
+{
+    size_t i;
+    while ((i = __atomic_fetch_add(&job->next_chunk, 1, __ATOMIC_RELAXED)) < job->chunks) {
+        size_t offset = i * job->chunk_size;
+        size_t size = job->size - offset < job->chunk_size ? job->size - offset : job->chunk_size;
+        cmd_copy_range(job->dst + offset, job->src + offset, size, job->dest);
+    }
+}
+
+static void *cmd_copy_helper(void *arg)
+{
+    uint64_t seen = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&cmd_copy_engine.lock);
+        while (cmd_copy_engine.generation == seen)
+            pthread_cond_wait(&cmd_copy_engine.start, &cmd_copy_engine.lock);
+        seen = cmd_copy_engine.generation;
+        struct cmd_copy_job *job = cmd_copy_engine.job;
+        pthread_mutex_unlock(&cmd_copy_engine.lock);
+
+        cmd_copy_run(job);
+
+        pthread_mutex_lock(&cmd_copy_engine.lock);
+        if (--job->pending == 0)
+            pthread_cond_signal(&cmd_copy_engine.done);
+        pthread_mutex_unlock(&cmd_copy_engine.lock);
+    }
+    return NULL;
+}
+
+/**
+ * Start one helper per spare online CPU, up to AVA_COPY_MAX_HELPERS.
+ */
+static void cmd_copy_init(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int wanted = cpus > 1 ? (int)(cpus - 1) : 0;
+    if (wanted > AVA_COPY_MAX_HELPERS)
+        wanted = AVA_COPY_MAX_HELPERS;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (int i = 0; i < wanted; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, &attr, cmd_copy_helper, NULL))
+            break;
+        cmd_copy_engine.helpers++;
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/**
+ * Split a copy across the helpers. Returns 0 if there are no helpers or
+ * another split copy is running.
+ */
+static int cmd_copy_split(char *dst, const char *src, size_t size, int dest)
+{
+    pthread_once(&cmd_copy_engine.once, cmd_copy_init);
+    if (!cmd_copy_engine.helpers || pthread_mutex_trylock(&cmd_copy_engine.split_lock))
+        return 0;
+
+    struct cmd_copy_job job;
+    size_t parts = (size_t)(cmd_copy_engine.helpers + 1) * 4;
+    job.dst = dst;
+    job.src = src;
+    job.size = size;
+    job.chunk_size = size / parts > AVA_COPY_SPLIT_CHUNK ? size / parts : AVA_COPY_SPLIT_CHUNK;
+    job.chunk_size = (job.chunk_size + 4095) & ~(size_t)4095;
+    job.chunks = (size + job.chunk_size - 1) / job.chunk_size;
+    job.next_chunk = 0;
+    job.dest = dest;
+    job.pending = cmd_copy_engine.helpers;
+
+    pthread_mutex_lock(&cmd_copy_engine.lock);
+    cmd_copy_engine.job = &job;
+    cmd_copy_engine.generation++;
+    pthread_cond_broadcast(&cmd_copy_engine.start);
+    pthread_mutex_unlock(&cmd_copy_engine.lock);
+
+    cmd_copy_run(&job);
+
+    pthread_mutex_lock(&cmd_copy_engine.lock);
+    while (job.pending)
+        pthread_cond_wait(&cmd_copy_engine.done, &cmd_copy_engine.lock);
+    pthread_mutex_unlock(&cmd_copy_engine.lock);
+
+    pthread_mutex_unlock(&cmd_copy_engine.split_lock);
+    return 1;
+}
+
+void cmd_copy(void *dst, const void *src, size_t size, int dest)
+{
+    if (size < AVA_COPY_STREAM_THRESHOLD) {
+        memcpy(dst, src, size);
+        return;
+    }
+
+    struct cmd_copy_stats *stats = &cmd_copy_engine.stats;
+    uint64_t start = cmd_copy_clock_ns();
+
+    if (size >= AVA_COPY_SPLIT_THRESHOLD && cmd_copy_split((char *)dst, (const char *)src, size, dest))
+        __atomic_fetch_add(&stats->split, 1, __ATOMIC_RELAXED);
+    else
+        cmd_copy_range((char *)dst, (const char *)src, size, dest);
+
+    if (dest == CMD_COPY_SHARED)
+        __atomic_fetch_add(&stats->streamed, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->copies, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->bytes, size, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->ns, cmd_copy_clock_ns() - start, __ATOMIC_RELAXED);
+}
+
+void cmd_copy_get_stats(struct cmd_copy_stats *stats)
+{
+    stats->copies = __atomic_load_n(&cmd_copy_engine.stats.copies, __ATOMIC_RELAXED);
+    stats->streamed = __atomic_load_n(&cmd_copy_engine.stats.streamed, __ATOMIC_RELAXED);
+    stats->split = __atomic_load_n(&cmd_copy_engine.stats.split, __ATOMIC_RELAXED);
+    stats->bytes = __atomic_load_n(&cmd_copy_engine.stats.bytes, __ATOMIC_RELAXED);
+    stats->ns = __atomic_load_n(&cmd_copy_engine.stats.ns, __ATOMIC_RELAXED);
+}
+
+void cmd_copy_print_stats(const char *name, FILE *stream)
+{
+    struct cmd_copy_stats stats;
+
+    cmd_copy_get_stats(&stats);
+    if (!stats.copies)
+        return;
+    fprintf(stream, "[%s] copy engine: %lu large copies (%lu MB) at %.0f MB/s, "
+            "%lu with non-temporal stores, %lu split over %d helpers\n",
+            name, stats.copies, stats.bytes >> 20,
+            stats.ns ? (double)stats.bytes / (1 << 20) / (stats.ns / 1e9) : 0.0,
+            stats.streamed, stats.split, cmd_copy_engine.helpers);
+}
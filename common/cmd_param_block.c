@@ -0,0 +1,208 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "common/cmd_param_block.h"
+
+/**
+ * Header of a region in shared memory. Positions count bytes reserved
+ * since the allocator was created, so a stale header left by an earlier
+ * lap of the ring never matches the position being reclaimed.
+ */
+struct cmd_param_block_header {
+    uint64_t position;  /* written by the sender */
+    uint64_t size;      /* size of the region, including the header */
+    uint64_t released;  /* set to `position` by the receiver */
+} __attribute__((aligned(CMD_PARAM_BLOCK_ALIGN)));
+
+struct cmd_param_block {
+    char *base;
+    uintptr_t start;
+    uint64_t size;
+
+    /* Positions of the next region and of the oldest unreclaimed one */
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t tail __attribute__((aligned(64)));
+    pthread_spinlock_t reclaim_lock;
+
+    uint64_t allocs;
+    uint64_t bytes;
+    uint64_t pad_bytes;
+    uint64_t stalls;
+    uint64_t stall_ns;
+    uint64_t peak_used;
+    uint64_t peak_fragmented;
+};
+
+static inline struct cmd_param_block_header *cmd_param_block_header_at(struct cmd_param_block *pb, uint64_t position)
+{
+    return (struct cmd_param_block_header *)(pb->base + pb->start + position % pb->size);
+}
+
+static inline uint64_t cmd_param_block_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void cmd_param_block_update_max(uint64_t *max, uint64_t value)
+{
+    uint64_t cur = __atomic_load_n(max, __ATOMIC_RELAXED);
+    while (value > cur &&
+           !__atomic_compare_exchange_n(max, &cur, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/**
+ * Advance the tail over the regions the receiver has released. Only one
+ * thread reclaims at a time; the others wait for it.
+ * @stalled: also measure the freed bytes that cannot be reclaimed yet
+ */
+static void cmd_param_block_reclaim(struct cmd_param_block *pb, int stalled)
+{
+    if (pthread_spin_trylock(&pb->reclaim_lock))
+        return;
+
+    uint64_t head = __atomic_load_n(&pb->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = pb->tail;
+    while (tail < head) {
+        struct cmd_param_block_header *hdr = cmd_param_block_header_at(pb, tail);
+        if (__atomic_load_n(&hdr->released, __ATOMIC_ACQUIRE) != tail)
+            break;
+        tail += hdr->size;
+    }
+    __atomic_store_n(&pb->tail, tail, __ATOMIC_RELEASE);
+
+    if (stalled) {
+        /* Skip the region in use at the tail and add up released ones */
+        uint64_t fragmented = 0;
+        uint64_t pos = tail;
+        while (pos < head) {
+            struct cmd_param_block_header *hdr = cmd_param_block_header_at(pb, pos);
+            if (__atomic_load_n(&hdr->position, __ATOMIC_ACQUIRE) != pos)
+                break;  /* being written by its sender */
+            if (__atomic_load_n(&hdr->released, __ATOMIC_ACQUIRE) == pos)
+                fragmented += hdr->size;
+            pos += hdr->size;
+        }
+        cmd_param_block_update_max(&pb->peak_fragmented, fragmented);
+    }
+    pthread_spin_unlock(&pb->reclaim_lock);
+}
+
+struct cmd_param_block *cmd_param_block_new(void *base, uintptr_t start, size_t size)
+{
+    struct cmd_param_block *pb;
+
+    if (posix_memalign((void **)&pb, 64, sizeof(struct cmd_param_block)))
+        return NULL;
+    pb->base = (char *)base;
+    pb->start = start;
+    pb->size = size & ~(uint64_t)(CMD_PARAM_BLOCK_ALIGN - 1);
+    /* Start one lap in, so that zeroed memory does not look released */
+    pb->head = pb->tail = pb->size;
+    pthread_spin_init(&pb->reclaim_lock, PTHREAD_PROCESS_PRIVATE);
+    pb->allocs = 0;
+    pb->bytes = 0;
+    pb->pad_bytes = 0;
+    pb->stalls = 0;
+    pb->stall_ns = 0;
+    pb->peak_used = 0;
+    pb->peak_fragmented = 0;
+    return pb;
+}
+
+void cmd_param_block_free(struct cmd_param_block *pb)
+{
+    pthread_spin_destroy(&pb->reclaim_lock);
+    free(pb);
+}
+
+uintptr_t cmd_param_block_reserve(struct cmd_param_block *pb, size_t size)
+{
+    uint64_t head, pad, stall_start = 0;
+
+    size = cmd_param_block_align(size);
+    if (size > pb->size) {
+        fprintf(stderr, "Data region of %zu bytes exceeds the parameter block (%lu bytes)\n", size, pb->size);
+        exit(-1);
+    }
+
+    head = __atomic_load_n(&pb->head, __ATOMIC_RELAXED);
+    for (;;) {
+        uint64_t tail = __atomic_load_n(&pb->tail, __ATOMIC_ACQUIRE);
+        uint64_t offset = head % pb->size;
+
+        /* Regions do not wrap; skip the rest of the ring instead */
+        pad = offset + size > pb->size ? pb->size - offset : 0;
+        if (head + pad + size - tail > pb->size) {
+            cmd_param_block_reclaim(pb, stall_start != 0);
+            if (__atomic_load_n(&pb->tail, __ATOMIC_ACQUIRE) == tail) {
+                if (!stall_start)
+                    stall_start = cmd_param_block_now();
+                sched_yield();
+            }
+            head = __atomic_load_n(&pb->head, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (__atomic_compare_exchange_n(&pb->head, &head, head + pad + size, 1,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            break;
+    }
+
+    if (pad) {
+        struct cmd_param_block_header *hdr = cmd_param_block_header_at(pb, head);
+        hdr->size = pad;
+        __atomic_store_n(&hdr->position, head, __ATOMIC_RELEASE);
+        __atomic_store_n(&hdr->released, head, __ATOMIC_RELEASE);
+        head += pad;
+    }
+    struct cmd_param_block_header *hdr = cmd_param_block_header_at(pb, head);
+    hdr->size = size;
+    __atomic_store_n(&hdr->position, head, __ATOMIC_RELEASE);
+
+    if (stall_start) {
+        __atomic_fetch_add(&pb->stalls, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&pb->stall_ns, cmd_param_block_now() - stall_start, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&pb->allocs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&pb->bytes, pad + size, __ATOMIC_RELAXED);
+    if (pad)
+        __atomic_fetch_add(&pb->pad_bytes, pad, __ATOMIC_RELAXED);
+    cmd_param_block_update_max(&pb->peak_used, head + size - __atomic_load_n(&pb->tail, __ATOMIC_RELAXED));
+
+    return pb->start + head % pb->size;
+}
+
+void cmd_param_block_release(void *base, uintptr_t offset)
+{
+    struct cmd_param_block_header *hdr = (struct cmd_param_block_header *)((char *)base + offset);
+    __atomic_store_n(&hdr->released, __atomic_load_n(&hdr->position, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+}
+
+void cmd_param_block_get_stats(struct cmd_param_block *pb, struct cmd_param_block_stats *stats)
+{
+    stats->allocs = __atomic_load_n(&pb->allocs, __ATOMIC_RELAXED);
+    stats->bytes = __atomic_load_n(&pb->bytes, __ATOMIC_RELAXED);
+    stats->pad_bytes = __atomic_load_n(&pb->pad_bytes, __ATOMIC_RELAXED);
+    stats->stalls = __atomic_load_n(&pb->stalls, __ATOMIC_RELAXED);
+    stats->stall_ns = __atomic_load_n(&pb->stall_ns, __ATOMIC_RELAXED);
+    stats->peak_used = __atomic_load_n(&pb->peak_used, __ATOMIC_RELAXED);
+    stats->peak_fragmented = __atomic_load_n(&pb->peak_fragmented, __ATOMIC_RELAXED);
+}
+
+void cmd_param_block_print_stats(struct cmd_param_block *pb, const char *name, FILE *stream)
+{
+    struct cmd_param_block_stats stats;
+
+    cmd_param_block_get_stats(pb, &stats);
+    fprintf(stream, "[%s] param block: %lu regions, %lu KB reserved (%lu KB padding), "
+            "peak %lu KB of %lu KB in use, %lu stalls for %.3f ms, "
+            "up to %lu KB freed behind a busy region\n",
+            name, stats.allocs, stats.bytes >> 10, stats.pad_bytes >> 10,
+            stats.peak_used >> 10, pb->size >> 10, stats.stalls, stats.stall_ns / 1e6,
+            stats.peak_fragmented >> 10);
+}
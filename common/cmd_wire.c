@@ -0,0 +1,160 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "common/cmd_wire.h"
+
+/* Presence bits of the compact header */
+#define COMMAND_WIRE_VM_ID           0x01
+#define COMMAND_WIRE_ORIGINAL_THREAD 0x02
+#define COMMAND_WIRE_DATA_REGION     0x04
+#define COMMAND_WIRE_PRIVATE         0x08
+#define COMMAND_WIRE_KNOWN           0x0f
+
+static inline uint8_t *command_wire_put(uint8_t *p, uint64_t v)
+{
+    while (v >= 0x80) {
+        *p++ = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+/**
+ * Read a varint from [*p, end).
+ * @return 0 if the bytes end before the varint does, -1 if it does not
+ * fit in 64 bits, and 1 otherwise.
+ */
+static inline int command_wire_get(const uint8_t **p, const uint8_t *end, uint64_t *v)
+{
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (*p == end)
+            return 0;
+        uint8_t byte = *(*p)++;
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *v = value;
+            return 1;
+        }
+    }
+    return -1;
+}
+
+size_t command_wire_encode(const struct command_base *cmd, size_t private_size, void *buf)
+{
+    uint8_t *start = (uint8_t *)buf;
+    uint8_t *p = start + 3;
+    uint8_t present = 0;
+
+    p = command_wire_put(p, cmd->command_type);
+    p = command_wire_put(p, cmd->command_id);
+    p = command_wire_put(p, cmd->command_size - sizeof(struct command_base));
+    p = command_wire_put(p, cmd->region_size);
+    p = command_wire_put(p, (uint64_t)cmd->thread_id);
+    if (cmd->vm_id) {
+        present |= COMMAND_WIRE_VM_ID;
+        *p++ = cmd->vm_id;
+    }
+    if (cmd->original_thread_id) {
+        present |= COMMAND_WIRE_ORIGINAL_THREAD;
+        p = command_wire_put(p, (uint64_t)cmd->original_thread_id);
+    }
+    if ((uintptr_t)cmd->data_region != cmd->command_size) {
+        present |= COMMAND_WIRE_DATA_REGION;
+        p = command_wire_put(p, (uintptr_t)cmd->data_region);
+    }
+    if (private_size) {
+        present |= COMMAND_WIRE_PRIVATE;
+        *p++ = (uint8_t)private_size;
+        memcpy(p, cmd->reserved_area, private_size);
+        p += private_size;
+    }
+
+    start[0] = present;
+    start[1] = cmd->api_id;
+    start[2] = (uint8_t)cmd->flags;
+    return p - start;
+}
+
+static void command_wire_corrupt(void)
+{
+    fprintf(stderr, "Corrupt command header\n");
+    exit(-1);
+}
+
+size_t command_wire_decode(const void *buf, size_t size, struct command_base *cmd)
+{
+    const uint8_t *start = (const uint8_t *)buf;
+    const uint8_t *end = start + size;
+    const uint8_t *p = start + 3;
+    uint64_t command_type, command_id, body_size, region_size, thread_id;
+    uint64_t original_thread_id = 0, data_region;
+    int ret;
+
+    if (size < 3)
+        return 0;
+    const uint8_t present = start[0];
+    if (present & ~COMMAND_WIRE_KNOWN)
+        command_wire_corrupt();
+
+#define COMMAND_WIRE_GET(v)                                 \
+    do {                                                    \
+        if ((ret = command_wire_get(&p, end, &(v))) <= 0) { \
+            if (ret < 0)                                    \
+                command_wire_corrupt();                     \
+            return 0;                                       \
+        }                                                   \
+    } while (0)
+    COMMAND_WIRE_GET(command_type);
+    COMMAND_WIRE_GET(command_id);
+    COMMAND_WIRE_GET(body_size);
+    COMMAND_WIRE_GET(region_size);
+    COMMAND_WIRE_GET(thread_id);
+    if (body_size > SIZE_MAX / 2 || region_size > SIZE_MAX / 2)
+        command_wire_corrupt();
+
+    memset(cmd, 0, sizeof(struct command_base));
+    if (present & COMMAND_WIRE_VM_ID) {
+        if (p == end)
+            return 0;
+        cmd->vm_id = *p++;
+    }
+    if (present & COMMAND_WIRE_ORIGINAL_THREAD)
+        COMMAND_WIRE_GET(original_thread_id);
+    data_region = sizeof(struct command_base) + body_size;
+    if (present & COMMAND_WIRE_DATA_REGION)
+        COMMAND_WIRE_GET(data_region);
+    if (present & COMMAND_WIRE_PRIVATE) {
+        if (p == end)
+            return 0;
+        size_t private_size = *p++;
+        if (private_size > COMMAND_WIRE_PRIVATE_MAX)
+            command_wire_corrupt();
+        if ((size_t)(end - p) < private_size)
+            return 0;
+        memcpy(cmd->reserved_area, p, private_size);
+        p += private_size;
+    }
+#undef COMMAND_WIRE_GET
+
+    cmd->api_id = start[1];
+    cmd->flags = (int8_t)start[2];
+    cmd->command_type = command_type;
+    cmd->command_id = command_id;
+    cmd->command_size = sizeof(struct command_base) + body_size;
+    cmd->region_size = region_size;
+    cmd->thread_id = (int64_t)thread_id;
+    cmd->original_thread_id = (int64_t)original_thread_id;
+    cmd->data_region = (void *)(uintptr_t)data_region;
+    return p - start;
+}
+
+void command_wire_print_stats(const struct command_wire_stats *stats, int version, const char *name, FILE *stream)
+{
+    if (!stats->commands)
+        return;
+    fprintf(stream, "[%s] wire format %d: %lu commands, %.1f header bytes and %.1f bytes per command\n",
+            name, version, stats->commands, (double)stats->header_bytes / stats->commands,
+            (double)stats->bytes / stats->commands);
+}
@@ -4,61 +4,364 @@
 
 #include <stdio.h>
 #include <assert.h>
+#include <string.h>
+#include <time.h>
 #include "common/endpoint_lib.h"
 #include "common/cmd_handler.h"
 #include "common/debug.h"
+#include "common/devconf.h"
 #include "common/linkage.h"
 #include "common/shadow_thread_pool.h"
 
+/* Initial capacity of the command queue of a thread; it grows as needed */
+#define SHADOW_THREAD_QUEUE_SIZE 64
+/* Initial number of slots of the thread table */
+#define SHADOW_THREAD_TABLE_SIZE 64
+/* ava_id of an empty slot in the thread table */
+#define SHADOW_THREAD_NO_ID ((intptr_t)-1)
+
+/**
+ * Thread table, an open-addressing hash table from ava IDs to threads.
+ *
+ * Commands are dispatched by looking up their thread without a lock. Slots
+ * are only ever claimed, never freed: removing a thread clears the slot's
+ * `thread`, and the ID reuses the slot when it comes back. When the table
+ * becomes half full, the live threads are moved into a new table, and the
+ * old one is kept until the next dispatch since the dispatcher, the only
+ * reader without the lock, may still be reading it. Changes are made under
+ * the pool lock.
+ */
+struct shadow_thread_slot {
+    intptr_t ava_id;                /* SHADOW_THREAD_NO_ID for an empty slot */
+    struct shadow_thread_t *thread; /* NULL if the thread has been removed */
+};
+
+struct shadow_thread_table {
+    size_t mask;
+    size_t used;                          /* slots with an ava_id */
+    struct shadow_thread_table *next_retired;
+    struct shadow_thread_slot slots[];
+};
+
 struct shadow_thread_pool_t {
-    GHashTable *threads; /* Keys are ava IDs, values are shadow_thread_t* */
-    pthread_mutex_t lock;
+    struct shadow_thread_table *table;
+    pthread_mutex_t lock;  /* serializes changes to the table */
     pthread_key_t key;
+
+    /* Threads removed from the table and tables replaced by a larger one,
+     * freed at the next dispatch. `retired_tables` is protected by `lock`. */
+    struct shadow_thread_t *retired;
+    struct shadow_thread_table *retired_tables;
+
+    /* Shadow threads whose guest thread has exited, waiting to be given a
+     * new ID, and their number. Protected by `lock`. */
+    struct shadow_thread_t *idle;
+    size_t idle_count;
+    size_t idle_max;  /* most threads kept parked, 0 to let every thread exit */
+    uint64_t start_ns;
+
+    /* Limits on the async calls of a thread awaiting their replies, 0 for none */
+    uint64_t credit_calls;
+    uint64_t credit_bytes;
+    struct shadow_thread_pool_stats stats;
+};
+
+struct shadow_thread_command_t {
+    struct command_channel* chan;
+    struct command_base* cmd;
 };
 
 struct shadow_thread_t {
     intptr_t ava_id;
-    GAsyncQueue *queue;
     pthread_t thread;
     struct shadow_thread_pool_t *pool;
-};
+    struct shadow_thread_t *next_retired;
+    struct shadow_thread_t *next_idle;
 
-struct shadow_thread_command_t {
-    struct command_channel* chan;
-    struct command_base* cmd;
+    /* Commands dispatched to this thread, a ring of `queue_capacity`
+     * entries between the counters `queue_head` and `queue_tail` */
+    pthread_mutex_t queue_lock;
+    pthread_cond_t queue_cond;
+    struct shadow_thread_command_t *queue;
+    size_t queue_capacity;
+    size_t queue_head;
+    size_t queue_tail;
+    int queue_waiting;
+
+    /* Async calls of this thread awaiting their replies, and their size */
+    uint64_t async_calls;
+    uint64_t async_bytes;
 };
 
 static void* shadow_thread_loop(void *arg);
 
-struct shadow_thread_t* shadow_thread_new(struct shadow_thread_pool_t *pool, intptr_t ava_id) {
-    assert(g_hash_table_lookup(pool->threads, (gpointer) ava_id) == NULL);
-    DEBUG_PRINT("Creating shadow thread id = %lx\n", ava_id);
+static inline uint64_t shadow_thread_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void shadow_thread_update_max(uint64_t *max, uint64_t value) {
+    uint64_t cur = __atomic_load_n(max, __ATOMIC_RELAXED);
+    while (value > cur &&
+           !__atomic_compare_exchange_n(max, &cur, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static inline size_t shadow_thread_hash(intptr_t ava_id) {
+    uint64_t h = (uint64_t)ava_id * 0x9e3779b97f4a7c15ULL;
+    return (size_t)(h ^ (h >> 32));
+}
+
+static struct shadow_thread_table *shadow_thread_table_new(size_t size) {
+    struct shadow_thread_table *table =
+            malloc(sizeof(struct shadow_thread_table) + size * sizeof(struct shadow_thread_slot));
+    table->mask = size - 1;
+    table->used = 0;
+    table->next_retired = NULL;
+    for (size_t i = 0; i < size; i++) {
+        table->slots[i].ava_id = SHADOW_THREAD_NO_ID;
+        table->slots[i].thread = NULL;
+    }
+    return table;
+}
+
+/**
+ * @return The slot of `ava_id` in `table`, or the empty slot where it belongs.
+ */
+static struct shadow_thread_slot *shadow_thread_table_find(struct shadow_thread_table *table, intptr_t ava_id) {
+    for (size_t i = shadow_thread_hash(ava_id) & table->mask;; i = (i + 1) & table->mask) {
+        intptr_t id = __atomic_load_n(&table->slots[i].ava_id, __ATOMIC_ACQUIRE);
+        if (id == ava_id || id == SHADOW_THREAD_NO_ID)
+            return &table->slots[i];
+    }
+}
+
+/**
+ * Look up the thread of `ava_id` without taking the pool lock.
+ */
+static struct shadow_thread_t *shadow_thread_lookup(struct shadow_thread_pool_t *pool, intptr_t ava_id) {
+    struct shadow_thread_table *table = __atomic_load_n(&pool->table, __ATOMIC_ACQUIRE);
+    struct shadow_thread_slot *slot = shadow_thread_table_find(table, ava_id);
+    return __atomic_load_n(&slot->thread, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Map `ava_id` to `t`. The caller holds the pool lock.
+ */
+static void shadow_thread_table_set(struct shadow_thread_pool_t *pool, intptr_t ava_id, struct shadow_thread_t *t) {
+    assert(ava_id != SHADOW_THREAD_NO_ID);
+    struct shadow_thread_table *table = pool->table;
+    struct shadow_thread_slot *slot = shadow_thread_table_find(table, ava_id);
+    if (slot->ava_id == ava_id) {
+        __atomic_store_n(&slot->thread, t, __ATOMIC_RELEASE);
+        return;
+    }
+
+    if ((table->used + 1) * 2 > table->mask + 1) {
+        size_t live = 0;
+        for (size_t i = 0; i <= table->mask; i++)
+            live += table->slots[i].thread != NULL;
+        size_t size = SHADOW_THREAD_TABLE_SIZE;
+        while (size < (live + 1) * 4)
+            size *= 2;
+
+        struct shadow_thread_table *grown = shadow_thread_table_new(size);
+        for (size_t i = 0; i <= table->mask; i++) {
+            if (table->slots[i].thread) {
+                *shadow_thread_table_find(grown, table->slots[i].ava_id) = table->slots[i];
+                grown->used++;
+            }
+        }
+        __atomic_store_n(&pool->table, grown, __ATOMIC_RELEASE);
+        table->next_retired = pool->retired_tables;
+        __atomic_store_n(&pool->retired_tables, table, __ATOMIC_RELAXED);
+        table = grown;
+        slot = shadow_thread_table_find(table, ava_id);
+    }
+    slot->thread = t;
+    __atomic_store_n(&slot->ava_id, ava_id, __ATOMIC_RELEASE);
+    table->used++;
+}
+
+/**
+ * Remove `t` from the table unless its ID has been taken over by another
+ * thread. The caller holds the pool lock.
+ */
+static void shadow_thread_table_remove(struct shadow_thread_pool_t *pool, struct shadow_thread_t *t) {
+    struct shadow_thread_slot *slot = shadow_thread_table_find(pool->table, t->ava_id);
+    if (slot->thread == t)
+        __atomic_store_n(&slot->thread, NULL, __ATOMIC_RELEASE);
+}
+
+static struct shadow_thread_t *shadow_thread_alloc(struct shadow_thread_pool_t *pool, intptr_t ava_id) {
     struct shadow_thread_t* t = malloc(sizeof(struct shadow_thread_t));
     t->ava_id = ava_id;
-    t->queue = g_async_queue_new_full(NULL);
     t->pool = pool;
-    int r = pthread_create(&t->thread, NULL, shadow_thread_loop, t);
-    assert(r == 0);
+    t->next_retired = NULL;
+    t->next_idle = NULL;
+    pthread_mutex_init(&t->queue_lock, NULL);
+    pthread_cond_init(&t->queue_cond, NULL);
+    t->queue = malloc(SHADOW_THREAD_QUEUE_SIZE * sizeof(struct shadow_thread_command_t));
+    t->queue_capacity = SHADOW_THREAD_QUEUE_SIZE;
+    t->queue_head = 0;
+    t->queue_tail = 0;
+    t->queue_waiting = 0;
+    t->async_calls = 0;
+    t->async_bytes = 0;
+    return t;
+}
+
+static void shadow_thread_release(struct shadow_thread_t *t) {
+    pthread_mutex_destroy(&t->queue_lock);
+    pthread_cond_destroy(&t->queue_cond);
+    free(t->queue);
+    free(t);
+}
+
+/**
+ * Queue a command for `t`.
+ * @return The number of commands queued for `t`.
+ */
+static size_t shadow_thread_push(struct shadow_thread_t *t, struct command_channel *chan, struct command_base *cmd) {
+    pthread_mutex_lock(&t->queue_lock);
+    if (t->queue_tail - t->queue_head == t->queue_capacity) {
+        /* Unwrap the ring into an array of twice the size */
+        struct shadow_thread_command_t *queue = malloc(2 * t->queue_capacity * sizeof(struct shadow_thread_command_t));
+        for (size_t i = 0; i < t->queue_capacity; i++)
+            queue[i] = t->queue[(t->queue_head + i) % t->queue_capacity];
+        free(t->queue);
+        t->queue = queue;
+        t->queue_head = 0;
+        t->queue_tail = t->queue_capacity;
+        t->queue_capacity *= 2;
+    }
+    struct shadow_thread_command_t *scmd = &t->queue[t->queue_tail % t->queue_capacity];
+    scmd->chan = chan;
+    scmd->cmd = cmd;
+    size_t length = ++t->queue_tail - t->queue_head;
+    if (t->queue_waiting)
+        pthread_cond_signal(&t->queue_cond);
+    pthread_mutex_unlock(&t->queue_lock);
+    return length;
+}
+
+/**
+ * Take the oldest command for `t`, waiting for one if there is none.
+ */
+static struct shadow_thread_command_t shadow_thread_pop(struct shadow_thread_t *t) {
+    pthread_mutex_lock(&t->queue_lock);
+    while (t->queue_head == t->queue_tail) {
+        t->queue_waiting = 1;
+        pthread_cond_wait(&t->queue_cond, &t->queue_lock);
+        t->queue_waiting = 0;
+    }
+    struct shadow_thread_command_t scmd = t->queue[t->queue_head++ % t->queue_capacity];
+    pthread_mutex_unlock(&t->queue_lock);
+    return scmd;
+}
+
+/**
+ * Hand a thread removed from the table to the dispatcher, which frees it
+ * at its next dispatch, when it no longer holds a pointer to it.
+ */
+static void shadow_thread_retire(struct shadow_thread_pool_t *pool, struct shadow_thread_t *t) {
+    t->next_retired = __atomic_load_n(&pool->retired, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&pool->retired, &t->next_retired, t, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+}
+
+static void shadow_thread_release_retired(struct shadow_thread_pool_t *pool) {
+    struct shadow_thread_t *t = __atomic_exchange_n(&pool->retired, NULL, __ATOMIC_ACQUIRE);
+    while (t) {
+        struct shadow_thread_t *next = t->next_retired;
+        shadow_thread_release(t);
+        t = next;
+    }
+}
+
+/**
+ * Free the tables replaced since the last dispatch. The caller holds the
+ * pool lock.
+ */
+static void shadow_thread_release_tables(struct shadow_thread_pool_t *pool) {
+    struct shadow_thread_table *table = pool->retired_tables;
+    pool->retired_tables = NULL;
+    while (table) {
+        struct shadow_thread_table *next = table->next_retired;
+        free(table);
+        table = next;
+    }
+}
+
+/**
+ * Park a shadow thread that has handled its THREAD_EXIT, unless there are
+ * already `idle_max` parked threads.
+ * @return 1 if the thread was parked and should wait for commands of its
+ * next ID, 0 if it should exit.
+ */
+static int shadow_thread_park(struct shadow_thread_t *t) {
+    struct shadow_thread_pool_t *pool = t->pool;
+    int parked = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->idle_count < pool->idle_max) {
+        /* Replies to calls of the exited thread go to its old ID */
+        t->async_calls = 0;
+        t->async_bytes = 0;
+        t->next_idle = pool->idle;
+        pool->idle = t;
+        pool->idle_count++;
+        shadow_thread_update_max(&pool->stats.peak_parked, pool->idle_count);
+        parked = 1;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return parked;
+}
+
+/**
+ * Start a shadow thread for `ava_id`, or give the ID to a parked thread.
+ * The caller holds the pool lock.
+ */
+struct shadow_thread_t* shadow_thread_new(struct shadow_thread_pool_t *pool, intptr_t ava_id) {
+    assert(shadow_thread_lookup(pool, ava_id) == NULL);
+    struct shadow_thread_t* t = pool->idle;
+    if (t) {
+        DEBUG_PRINT("Reusing shadow thread id = %lx for id = %lx\n", t->ava_id, ava_id);
+        pool->idle = t->next_idle;
+        pool->idle_count--;
+        t->next_idle = NULL;
+        // The thread reads its new ID after it takes the next command off its queue.
+        t->ava_id = ava_id;
+        __atomic_fetch_add(&pool->stats.threads_reused, 1, __ATOMIC_RELAXED);
+    }
+    else {
+        DEBUG_PRINT("Creating shadow thread id = %lx\n", ava_id);
+        t = shadow_thread_alloc(pool, ava_id);
+        int r = pthread_create(&t->thread, NULL, shadow_thread_loop, t);
+        assert(r == 0);
+        (void)r;
+        // Nothing joins shadow threads; let their resources go when they exit.
+        pthread_detach(t->thread);
+        __atomic_fetch_add(&pool->stats.threads_created, 1, __ATOMIC_RELAXED);
+    }
     assert(t->thread != ava_id); // TODO: This may spuriously fail.
-    r = g_hash_table_insert(pool->threads, (gpointer) ava_id, t);
-    assert(r);
-    (void)r;
+    shadow_thread_table_set(pool, ava_id, t);
     return t;
 }
 
 struct shadow_thread_t* shadow_thread_self(struct shadow_thread_pool_t *pool) {
     struct shadow_thread_t* t = pthread_getspecific(pool->key);
     if (t == NULL) {
-        t = malloc(sizeof(struct shadow_thread_t));
         intptr_t ava_id = (intptr_t)pthread_self(); // TODO: This may not work correctly on non-Linux
-        assert(g_hash_table_lookup(pool->threads, (gpointer) ava_id) == NULL);
-        t->ava_id = ava_id;
-        t->queue = g_async_queue_new_full(NULL);
-        t->pool = pool;
+        t = shadow_thread_alloc(pool, ava_id);
         t->thread = pthread_self();
-        gboolean r = g_hash_table_insert(pool->threads, (gpointer) ava_id, t);
-        assert(r);
-        (void)r;
+        pthread_mutex_lock(&pool->lock);
+        assert(shadow_thread_lookup(pool, ava_id) == NULL);
+        shadow_thread_table_set(pool, ava_id, t);
+        pthread_mutex_unlock(&pool->lock);
         pthread_setspecific(pool->key, t);
     }
     return t;
@@ -79,22 +382,26 @@ void shadow_thread_free_from_thread(struct shadow_thread_t*t) {
     }
 
     // Drop this thread from the pool.
-    g_hash_table_remove(t->pool->threads, (gpointer) t->ava_id);
+    shadow_thread_table_remove(t->pool, t);
     pthread_mutex_unlock(&t->pool->lock);
 
-    g_async_queue_unref(t->queue);
-    t->queue = NULL;
-    free(t);
+    shadow_thread_retire(t->pool, t);
 }
 
 struct shadow_thread_pool_t* shadow_thread_pool_new() {
     struct shadow_thread_pool_t* pool = malloc(sizeof(struct shadow_thread_pool_t));
-    pool->threads = g_hash_table_new_full(
-            nw_hash_pointer,
-            g_direct_equal,
-            NULL, NULL);
+    pool->table = shadow_thread_table_new(SHADOW_THREAD_TABLE_SIZE);
     pthread_key_create(&pool->key, (void (*)(void *)) shadow_thread_free_from_thread);
     pthread_mutex_init(&pool->lock, NULL);
+    pool->retired = NULL;
+    pool->retired_tables = NULL;
+    pool->idle = NULL;
+    pool->idle_count = 0;
+    pool->idle_max = 0;
+    pool->start_ns = shadow_thread_now();
+    pool->credit_calls = 0;
+    pool->credit_bytes = 0;
+    memset(&pool->stats, 0, sizeof(pool->stats));
     return pool;
 }
 
@@ -105,11 +412,10 @@ intptr_t shadow_thread_id(struct shadow_thread_pool_t *pool) {
 
 int shadow_thread_handle_single_command(struct shadow_thread_pool_t *pool) {
     struct shadow_thread_t *t = shadow_thread_self(pool);
-    struct shadow_thread_command_t *scmd = g_async_queue_pop(t->queue);
+    struct shadow_thread_command_t scmd = shadow_thread_pop(t);
 
-    struct command_channel *chan = scmd->chan;
-    struct command_base *cmd = scmd->cmd;
-    free(scmd);
+    struct command_channel *chan = scmd.chan;
+    struct command_base *cmd = scmd.cmd;
 
     if (cmd->api_id == COMMAND_HANDLER_API && cmd->command_id == COMMAND_HANDLER_THREAD_EXIT) {
         command_channel_free_command(chan, cmd);
@@ -129,30 +435,137 @@ static void* shadow_thread_loop(void *arg) {
     int exit_thread_flag;
     do {
         exit_thread_flag = shadow_thread_handle_single_command(t->pool);
+        if (exit_thread_flag && shadow_thread_park(t))
+            exit_thread_flag = 0;
     } while(!exit_thread_flag);
     return NULL;
 }
 
 void shadow_thread_pool_free(struct shadow_thread_pool_t *pool) {
     pthread_mutex_lock(&pool->lock);
-    g_hash_table_destroy(pool->threads);
+    shadow_thread_release_retired(pool);
+    shadow_thread_release_tables(pool);
+    free(pool->table);
     free(pool);
 }
 
+/**
+ * Commands are dispatched by a single thread, the command handler. It
+ * finds the thread of a command without a lock, and only takes the pool
+ * lock to start a new shadow thread or to retire one.
+ */
 void shadow_thread_pool_dispatch(struct shadow_thread_pool_t *pool, struct command_channel *chan, struct command_base *cmd) {
-    pthread_mutex_lock(&pool->lock);
-    struct shadow_thread_t* t = g_hash_table_lookup(pool->threads, (gpointer) cmd->thread_id);
+    if (__atomic_load_n(&pool->retired, __ATOMIC_RELAXED))
+        shadow_thread_release_retired(pool);
+    if (__atomic_load_n(&pool->retired_tables, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&pool->lock);
+        shadow_thread_release_tables(pool);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    const int thread_exit = cmd->api_id == INTERNAL_API && cmd->command_id == COMMAND_HANDLER_THREAD_EXIT;
+    struct shadow_thread_t* t = shadow_thread_lookup(pool, cmd->thread_id);
     if (t == NULL) {
-        if (cmd->api_id == INTERNAL_API && cmd->command_id == COMMAND_HANDLER_THREAD_EXIT) {
+        if (thread_exit) {
             // If a thread for which we have no shadow is exiting, just drop the message.
-            pthread_mutex_unlock(&pool->lock);
+            command_channel_free_command(chan, cmd);
             return;
         }
+        pthread_mutex_lock(&pool->lock);
         t = shadow_thread_new(pool, cmd->thread_id);
+        pthread_mutex_unlock(&pool->lock);
     }
-    struct shadow_thread_command_t* scmd = malloc(sizeof(struct shadow_thread_command_t));
-    scmd->chan = chan;
-    scmd->cmd = cmd;
-    g_async_queue_push(t->queue, scmd);
+    else if (thread_exit) {
+        // Later commands with this ID come from a new remote thread and get a new shadow.
+        pthread_mutex_lock(&pool->lock);
+        shadow_thread_table_remove(pool, t);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    shadow_thread_update_max(&pool->stats.peak_queued, (uint64_t)shadow_thread_push(t, chan, cmd));
+}
+
+void shadow_thread_pool_set_credits(struct shadow_thread_pool_t *pool, size_t calls, size_t bytes) {
+    pool->credit_calls = calls;
+    pool->credit_bytes = bytes;
+}
+
+void shadow_thread_pool_set_idle_max(struct shadow_thread_pool_t *pool, size_t threads) {
+    pthread_mutex_lock(&pool->lock);
+    pool->idle_max = threads < AVA_SHADOW_THREAD_IDLE_MAX ? threads : AVA_SHADOW_THREAD_IDLE_MAX;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void shadow_thread_acquire_credit(struct shadow_thread_pool_t *pool, size_t size) {
+    if (!pool->credit_calls && !pool->credit_bytes)
+        return;
+
+    /* A call larger than the byte limit is let through alone */
+    struct shadow_thread_t *t = shadow_thread_self(pool);
+    uint64_t stall_start = 0;
+    while (t->async_calls &&
+           ((pool->credit_calls && t->async_calls >= pool->credit_calls) ||
+            (pool->credit_bytes && t->async_bytes + size > pool->credit_bytes))) {
+        if (!stall_start)
+            stall_start = shadow_thread_now();
+        /* The replies of this thread's calls are handled here and return their credit */
+        int r = shadow_thread_handle_single_command(pool);
+        assert(r == 0 && "Thread exit requested while waiting for async credit");
+        (void)r;
+    }
+    if (stall_start) {
+        __atomic_fetch_add(&pool->stats.stalls, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&pool->stats.stall_ns, shadow_thread_now() - stall_start, __ATOMIC_RELAXED);
+    }
+
+    t->async_calls++;
+    t->async_bytes += size;
+    __atomic_fetch_add(&pool->stats.async_calls, 1, __ATOMIC_RELAXED);
+    shadow_thread_update_max(&pool->stats.peak_calls, t->async_calls);
+    shadow_thread_update_max(&pool->stats.peak_bytes, t->async_bytes);
+}
+
+void shadow_thread_release_credit(struct shadow_thread_pool_t *pool, size_t size) {
+    if (!pool->credit_calls && !pool->credit_bytes)
+        return;
+
+    /* Replies to calls of an exited thread reach a new shadow with no credit taken */
+    struct shadow_thread_t *t = shadow_thread_self(pool);
+    if (t->async_calls) {
+        t->async_calls--;
+        t->async_bytes -= size < t->async_bytes ? size : t->async_bytes;
+    }
+}
+
+void shadow_thread_pool_get_stats(struct shadow_thread_pool_t *pool, struct shadow_thread_pool_stats *stats) {
+    stats->async_calls = __atomic_load_n(&pool->stats.async_calls, __ATOMIC_RELAXED);
+    stats->stalls = __atomic_load_n(&pool->stats.stalls, __ATOMIC_RELAXED);
+    stats->stall_ns = __atomic_load_n(&pool->stats.stall_ns, __ATOMIC_RELAXED);
+    stats->peak_calls = __atomic_load_n(&pool->stats.peak_calls, __ATOMIC_RELAXED);
+    stats->peak_bytes = __atomic_load_n(&pool->stats.peak_bytes, __ATOMIC_RELAXED);
+    stats->peak_queued = __atomic_load_n(&pool->stats.peak_queued, __ATOMIC_RELAXED);
+    stats->threads_created = __atomic_load_n(&pool->stats.threads_created, __ATOMIC_RELAXED);
+    stats->threads_reused = __atomic_load_n(&pool->stats.threads_reused, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&pool->lock);
+    stats->threads_parked = pool->idle_count;
+    stats->peak_parked = pool->stats.peak_parked;
     pthread_mutex_unlock(&pool->lock);
 }
+
+void shadow_thread_pool_print_stats(struct shadow_thread_pool_t *pool, const char *name, FILE *stream) {
+    struct shadow_thread_pool_stats stats;
+
+    shadow_thread_pool_get_stats(pool, &stats);
+    fprintf(stream, "[%s] async credit: %lu calls, %lu stalls for %.3f ms, "
+            "peak %lu calls and %lu KB awaiting replies in a thread (limits %lu calls, %lu KB), "
+            "peak %lu commands queued for a thread\n",
+            name, stats.async_calls, stats.stalls, stats.stall_ns / 1e6,
+            stats.peak_calls, stats.peak_bytes >> 10, pool->credit_calls, pool->credit_bytes >> 10,
+            stats.peak_queued);
+
+    double seconds = (shadow_thread_now() - pool->start_ns) / 1e9;
+    fprintf(stream, "[%s] shadow threads: %lu created (%.1f per second), %lu new IDs served by parked threads, "
+            "%lu parked (peak %lu, limit %zu)\n",
+            name, stats.threads_created, seconds > 0 ? stats.threads_created / seconds : 0.0,
+            stats.threads_reused, stats.threads_parked, stats.peak_parked, pool->idle_max);
+}
@@ -5,9 +5,11 @@
 #include <netinet/tcp.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
 #include <sys/select.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <assert.h>
 
@@ -218,6 +220,45 @@ size_t send_socket(int sockfd, const void *buf, size_t size)
     return ret;
 }
 
+size_t send_socket_iov(int sockfd, struct iovec *iov, int iovcnt, int flags, unsigned *nr_zerocopy)
+{
+    struct msghdr msg;
+    size_t total = 0;
+    ssize_t ret;
+
+    memset(&msg, 0, sizeof(msg));
+    while (iovcnt > 0) {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+        if ((ret = sendmsg(sockfd, &msg, flags)) <= 0) {
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret < 0 && errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+                flags &= ~MSG_ZEROCOPY;
+                continue;
+            }
+            perror("ERROR sending to socket");
+            close(sockfd);
+            exit(0);
+        }
+        if (nr_zerocopy && (flags & MSG_ZEROCOPY))
+            (*nr_zerocopy)++;
+        total += ret;
+
+        /* Skip the sent buffers */
+        while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0 && ret > 0) {
+            iov->iov_base = (char *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+    return total;
+}
+
 size_t recv_socket(int sockfd, void *buf, size_t size)
 {
     ssize_t ret = -1;
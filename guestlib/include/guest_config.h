@@ -13,6 +13,23 @@ constexpr char kConfigFilePath[]          = "/etc/ava/guest.conf";
 constexpr char kDefaultChannel[]          = "TCP";
 constexpr uint64_t kDefaultConnectTimeout = 5000;
 constexpr char kDefaultManagerAddress[]   = "0.0.0.0:3334";
+constexpr char kDefaultTcpIoUring[]       = "off";
+constexpr int kDefaultTcpConnections      = 1;
+constexpr int kDefaultTcpCoalesceDelay    = 100;
+constexpr int kDefaultTcpCompressThreshold = 0;
+constexpr int kDefaultTcpDedupCache       = 0;
+constexpr int kDefaultTcpBulkThreshold    = 0;
+constexpr int kDefaultTcpStreamThreshold  = 0;
+constexpr int kDefaultTcpWireVersion      = 1;
+constexpr char kDefaultShmDoorbell[]      = "vsock";
+constexpr int kDefaultAsyncCreditCalls   = 1024;
+constexpr int kDefaultAsyncCreditBytes   = 64 << 20;
+constexpr int kDefaultShmPollSpin         = 50;
+constexpr char kDefaultShmPollCores[]     = "";
+constexpr int kDefaultBusyPollSpin        = 0;
+constexpr char kDefaultBusyPollCores[]    = "";
+constexpr char kDefaultLocalWorker[]      = "libworker_local.so";
+constexpr char kDefaultTraceFile[]        = "";
 
 class GuestConfig {
 public:
@@ -28,6 +45,23 @@ public:
               << "  channel = " << channel_ << std::endl
               << "  connect_timeout = " << connect_timeout_ << std::endl
               << "  manager_address = " << manager_address_ << std::endl
+              << "  tcp_io_uring = " << tcp_io_uring_ << std::endl
+              << "  tcp_connections = " << tcp_connections_ << std::endl
+              << "  tcp_coalesce_delay = " << tcp_coalesce_delay_ << std::endl
+              << "  tcp_compress_threshold = " << tcp_compress_threshold_ << std::endl
+              << "  tcp_dedup_cache = " << tcp_dedup_cache_ << std::endl
+              << "  tcp_bulk_threshold = " << tcp_bulk_threshold_ << std::endl
+              << "  tcp_stream_threshold = " << tcp_stream_threshold_ << std::endl
+              << "  tcp_wire_version = " << tcp_wire_version_ << std::endl
+              << "  shm_doorbell = " << shm_doorbell_ << std::endl
+              << "  shm_poll_spin = " << shm_poll_spin_ << std::endl
+              << "  shm_poll_cores = " << shm_poll_cores_ << std::endl
+              << "  busy_poll_spin = " << busy_poll_spin_ << std::endl
+              << "  busy_poll_cores = " << busy_poll_cores_ << std::endl
+              << "  async_credit_calls = " << async_credit_calls_ << std::endl
+              << "  async_credit_bytes = " << async_credit_bytes_ << std::endl
+              << "  local_worker = " << local_worker_ << std::endl
+              << "  trace_file = " << trace_file_ << std::endl
               << "  instance_type = (ignored)" << std::endl
               << "  gpu_count = (ignored)" << std::endl
               << "  gpu_memory = [";
@@ -42,6 +76,23 @@ public:
   std::string instance_type_; // not used
   int gpu_count_;             // not used, represented by gpu_memory_.size()
   std::vector<uint64_t> gpu_memory_;
+  std::string tcp_io_uring_ = kDefaultTcpIoUring;
+  int tcp_connections_ = kDefaultTcpConnections;
+  int tcp_coalesce_delay_ = kDefaultTcpCoalesceDelay;
+  int tcp_compress_threshold_ = kDefaultTcpCompressThreshold;
+  int tcp_dedup_cache_ = kDefaultTcpDedupCache;
+  int tcp_bulk_threshold_ = kDefaultTcpBulkThreshold;
+  int tcp_stream_threshold_ = kDefaultTcpStreamThreshold;
+  int tcp_wire_version_ = kDefaultTcpWireVersion;
+  std::string shm_doorbell_ = kDefaultShmDoorbell;
+  int shm_poll_spin_ = kDefaultShmPollSpin;
+  std::string shm_poll_cores_ = kDefaultShmPollCores;
+  int busy_poll_spin_ = kDefaultBusyPollSpin;
+  std::string busy_poll_cores_ = kDefaultBusyPollCores;
+  int async_credit_calls_ = kDefaultAsyncCreditCalls;
+  int async_credit_bytes_ = kDefaultAsyncCreditBytes;
+  std::string local_worker_ = kDefaultLocalWorker;
+  std::string trace_file_ = kDefaultTraceFile;
 };
 
 std::shared_ptr<GuestConfig> readGuestConfig();
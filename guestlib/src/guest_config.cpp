@@ -26,6 +26,23 @@ std::shared_ptr<GuestConfig> readGuestConfig() {
   unsigned long long connect_timeout = guestconfig::kDefaultConnectTimeout;
   std::string manager_address = guestconfig::kDefaultManagerAddress;
   std::vector<uint64_t> gpu_memory;
+  std::string tcp_io_uring = guestconfig::kDefaultTcpIoUring;
+  int tcp_connections = guestconfig::kDefaultTcpConnections;
+  int tcp_coalesce_delay = guestconfig::kDefaultTcpCoalesceDelay;
+  int tcp_compress_threshold = guestconfig::kDefaultTcpCompressThreshold;
+  int tcp_dedup_cache = guestconfig::kDefaultTcpDedupCache;
+  int tcp_bulk_threshold = guestconfig::kDefaultTcpBulkThreshold;
+  int tcp_stream_threshold = guestconfig::kDefaultTcpStreamThreshold;
+  int tcp_wire_version = guestconfig::kDefaultTcpWireVersion;
+  std::string shm_doorbell = guestconfig::kDefaultShmDoorbell;
+  int shm_poll_spin = guestconfig::kDefaultShmPollSpin;
+  std::string shm_poll_cores = guestconfig::kDefaultShmPollCores;
+  int busy_poll_spin = guestconfig::kDefaultBusyPollSpin;
+  std::string busy_poll_cores = guestconfig::kDefaultBusyPollCores;
+  int async_credit_calls = guestconfig::kDefaultAsyncCreditCalls;
+  int async_credit_bytes = guestconfig::kDefaultAsyncCreditBytes;
+  std::string local_worker = guestconfig::kDefaultLocalWorker;
+  std::string trace_file = guestconfig::kDefaultTraceFile;
 
   try {
     root.lookupValue("channel", channel);
@@ -42,6 +59,91 @@ std::shared_ptr<GuestConfig> readGuestConfig() {
   }
   catch(const libconfig::SettingNotFoundException& nfex) {
   }
+  try {
+    root.lookupValue("tcp_io_uring", tcp_io_uring);
+  }
+  catch(const libconfig::SettingNotFoundException& nfex) {
+  }
+  try {
+    root.lookupValue("tcp_connections", tcp_connections);
+  }
+  catch(const libconfig::SettingNotFoundException& nfex) {
+  }
+  try {
+    root.lookupValue("tcp_coalesce_delay", tcp_coalesce_delay);
+  }
+  catch(const libconfig::SettingNotFoundException& nfex) {
+  }
+  try {
+    root.lookupValue("tcp_compress_threshold", tcp_compress_threshold);
+  }
+  catch(const libconfig::SettingNotFoundException& nfex) {
+  }
+  try {
+    root.lookupValue("tcp_dedup_cache", tcp_dedup_cache);
+  }
+  catch(const libconfig::SettingNotFoundException& nfex) {
+  }
+  try {
+    root.lookupValue("tcp_bulk_threshold", tcp_bulk_threshold);
+  }
+  catch(const libconfig::SettingNotFoundException& nfex) {
+  }
+  try {
+    root.lookupValue("tcp_stream_threshold", tcp_stream_threshold);
+  }
+  catch(const libconfig::SettingNotFoundException& nfex) {
+  }
+  try {
+    root.lookupValue("tcp_wire_version", tcp_wire_version);
+  }
+  catch(const libconfig::SettingNotFoundException& nfex) {
+  }
+  try {
+    root.lookupValue("shm_doorbell", shm_doorbell);
+  }
+  catch(const libconfig::SettingNotFoundException& nfex) {
+  }
+  try {
+    root.lookupValue("shm_poll_spin", shm_poll_spin);
+  }
+  catch(const libconfig::SettingNotFoundException& nfex) {
+  }
+  try {
+    root.lookupValue("shm_poll_cores", shm_poll_cores);
+  }
+  catch(const libconfig::SettingNotFoundException& nfex) {
+  }
+  try {
+    root.lookupValue("busy_poll_spin", busy_poll_spin);
+  }
+  catch(const libconfig::SettingNotFoundException& nfex) {
+  }
+  try {
+    root.lookupValue("busy_poll_cores", busy_poll_cores);
+  }
+  catch(const libconfig::SettingNotFoundException& nfex) {
+  }
+  try {
+    root.lookupValue("async_credit_calls", async_credit_calls);
+  }
+  catch(const libconfig::SettingNotFoundException& nfex) {
+  }
+  try {
+    root.lookupValue("async_credit_bytes", async_credit_bytes);
+  }
+  catch(const libconfig::SettingNotFoundException& nfex) {
+  }
+  try {
+    root.lookupValue("local_worker", local_worker);
+  }
+  catch(const libconfig::SettingNotFoundException& nfex) {
+  }
+  try {
+    root.lookupValue("trace_file", trace_file);
+  }
+  catch(const libconfig::SettingNotFoundException& nfex) {
+  }
   try {
     const libconfig::Setting& gpu_mem_settings = cfg.lookup("gpu_memory");
     for (int i = 0; i < gpu_mem_settings.getLength(); ++i)
@@ -54,7 +156,25 @@ std::shared_ptr<GuestConfig> readGuestConfig() {
     return nullptr;
   }
 
-  return std::make_shared<GuestConfig>(channel, manager_address, connect_timeout, gpu_memory);
+  auto config = std::make_shared<GuestConfig>(channel, manager_address, connect_timeout, gpu_memory);
+  config->tcp_io_uring_ = tcp_io_uring;
+  config->tcp_connections_ = tcp_connections;
+  config->tcp_coalesce_delay_ = tcp_coalesce_delay;
+  config->tcp_compress_threshold_ = tcp_compress_threshold;
+  config->tcp_dedup_cache_ = tcp_dedup_cache;
+  config->tcp_bulk_threshold_ = tcp_bulk_threshold;
+  config->tcp_stream_threshold_ = tcp_stream_threshold;
+  config->tcp_wire_version_ = tcp_wire_version;
+  config->shm_doorbell_ = shm_doorbell;
+  config->shm_poll_spin_ = shm_poll_spin;
+  config->shm_poll_cores_ = shm_poll_cores;
+  config->busy_poll_spin_ = busy_poll_spin;
+  config->busy_poll_cores_ = busy_poll_cores;
+  config->async_credit_calls_ = async_credit_calls;
+  config->async_credit_bytes_ = async_credit_bytes;
+  config->local_worker_ = local_worker;
+  config->trace_file_ = trace_file;
+  return config;
 }
 
 }  // namespace guestconfig
@@ -4,6 +4,7 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 
+#include <algorithm>
 #include <iostream>
 #include <string.h>
 #include <vector>
@@ -16,10 +17,11 @@
 #include "common/endpoint_lib.h"
 #include "common/cmd_channel.h"
 #include "common/cmd_channel_impl.h"
+#include "common/cmd_channel_static.h"
 
 struct command_channel *chan;
 
-struct param_block_info nw_global_pb_info = {0, 0};
+extern struct param_block_info nw_global_pb_info;
 extern int nw_global_vm_id;
 
 static struct command_channel* channel_create()
@@ -43,6 +45,12 @@ EXPORTED_WEAKLY void nw_init_guestlib(intptr_t api_id)
     gettimeofday(&ts, NULL);
 #endif
 
+    shadow_thread_pool_set_credits(nw_shadow_thread_pool,
+                                   std::max(guestconfig::config->async_credit_calls_, 0),
+                                   std::max(guestconfig::config->async_credit_bytes_, 0));
+    command_channel_socket_set_busy_poll(std::max(guestconfig::config->busy_poll_spin_, 0),
+                                         guestconfig::config->busy_poll_cores_.c_str());
+
     /* Create connection to worker and start command handler thread */
     if (guestconfig::config->channel_ == "TCP") {
       std::vector<struct command_channel*> channels = command_channel_socket_tcp_guest_new();
@@ -54,16 +62,34 @@ EXPORTED_WEAKLY void nw_init_guestlib(intptr_t api_id)
     else if (guestconfig::config->channel_ == "VSOCK") {
         chan = command_channel_socket_new();
     }
+    else if (guestconfig::config->channel_ == "SHM_RING") {
+        chan = command_channel_shm_ring_guest_new();
+    }
+    else if (guestconfig::config->channel_ == "UNIX") {
+        chan = command_channel_socket_unix_guest_new();
+    }
+    else if (guestconfig::config->channel_ == "LOCAL") {
+        chan = command_channel_loopback_guest_new();
+    }
     else {
         std::cerr << "Unsupported channel specified in "
                   << guestconfig::kConfigFilePath
-                  << ", expect channel = [\"TCP\" | \"SHM\" | \"VSOCK\"]" << std::endl;
+                  << ", expect channel = [\"TCP\" | \"SHM\" | \"VSOCK\" | \"SHM_RING\" | \"UNIX\" | \"LOCAL\"]" << std::endl;
         exit(0);
     }
     if (!chan) {
       std::cerr << "Failed to create command channel" << std::endl;
       exit(1);
     }
+    if (!guestconfig::config->trace_file_.empty())
+        chan = command_channel_trace_new(chan, guestconfig::config->trace_file_.c_str());
+#ifdef AVA_STATIC_CHANNEL
+    if (!command_channel_static_matches(chan)) {
+      std::cerr << "This guestlib is built for the " AVA_STATIC_CHANNEL_NAME " channel only, "
+                << "without tracing" << std::endl;
+      exit(1);
+    }
+#endif
     init_command_handler(channel_create);
     init_internal_command_handler();
 
@@ -97,6 +123,9 @@ EXPORTED_WEAKLY void nw_destroy_guestlib(void)
     api_shutdown_command = command_channel_receive_command(chan);
     */
 
+    if (command_channel_stats_enabled())
+        shadow_thread_pool_print_stats(nw_shadow_thread_pool, "guestlib", stderr);
+
     // TODO: This is called by the guestlib so destructor for each API. This is safe, but will make the handler shutdown when the FIRST API unloads when having it shutdown with the last would be better.
     destroy_command_handler();
 }
@@ -0,0 +1,69 @@
+#ifndef AVA_CMD_BUFFER_POOL_H
+#define AVA_CMD_BUFFER_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A command buffer pool recycles the buffers that command channels build
+ * and receive commands in. Requests are rounded up to a power-of-two size
+ * class and served from the class's free list; buffers returned to the pool
+ * are kept for reuse until the class caches AVA_CMD_BUFFER_POOL_CLASS_CACHE
+ * bytes.
+ * Requests larger than the largest class fall through to malloc.
+ *
+ * Every buffer remembers the pool it came from, so it can be returned from
+ * any thread, and the pool is safe to use concurrently.
+ */
+struct cmd_buffer_pool;
+
+struct cmd_buffer_pool_stats {
+    uint64_t allocs;        /* buffers handed out */
+    uint64_t hits;          /* allocations served from a free list */
+    uint64_t oversized;     /* allocations larger than the largest class */
+    uint64_t in_use_bytes;  /* bytes currently handed out */
+    uint64_t cached_bytes;  /* bytes held in the free lists */
+    uint64_t peak_bytes;    /* high-water mark of in_use_bytes + cached_bytes */
+};
+
+/**
+ * @return A newly-constructed empty pool.
+ */
+struct cmd_buffer_pool *cmd_buffer_pool_new(void);
+
+/**
+ * Release all cached buffers and the pool itself. Buffers still handed out
+ * may be returned afterwards and are then freed directly.
+ */
+void cmd_buffer_pool_free(struct cmd_buffer_pool *pool);
+
+/**
+ * Get a buffer of at least `size` bytes. The buffer is aligned to 64 bytes.
+ */
+void *cmd_buffer_pool_alloc(struct cmd_buffer_pool *pool, size_t size);
+
+/**
+ * Return a buffer obtained from `cmd_buffer_pool_alloc` to its pool.
+ */
+void cmd_buffer_pool_release(void *buf);
+
+/**
+ * Take a snapshot of the pool counters.
+ */
+void cmd_buffer_pool_get_stats(struct cmd_buffer_pool *pool, struct cmd_buffer_pool_stats *stats);
+
+/**
+ * Print the pool counters to `stream`, prefixed with `name`.
+ */
+void cmd_buffer_pool_print_stats(struct cmd_buffer_pool *pool, const char *name, FILE *stream);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // AVA_CMD_BUFFER_POOL_H
@@ -108,6 +108,39 @@ struct command_base {
   char reserved_area[64];
 };
 
+/**
+ * Set in `command_base::flags` by the sender of a command whose caller
+ * does not wait for a reply (an `ava_async` call). A channel may hold such
+ * a command back and send it together with later commands, as long as
+ * commands leave in the order they were sent.
+ */
+#define COMMAND_FLAG_DEFERRABLE 0x40
+
+/**
+ * Set in `command_base::flags` on the wire when some buffers of the data
+ * region are encoded, i.e. compressed or replaced by a reference to a
+ * buffer the receiver has cached. The receiving channel expands the region
+ * and clears the flag before returning the command.
+ */
+#define COMMAND_FLAG_ENCODED 0x20
+
+/**
+ * Set in `command_base::flags` on the wire when the data region follows on
+ * a separate bulk connection instead of behind the command struct. The
+ * receiving channel joins the two and clears the flag before returning the
+ * command.
+ */
+#define COMMAND_FLAG_BULK 0x10
+
+/**
+ * Set in `command_base::flags` when some buffers of the data region are
+ * streamed: they follow the command on the wire and are read by the
+ * receiver with `command_channel_read_buffer` while they arrive, instead of
+ * being received before the command is returned. The flag stays set on the
+ * received command.
+ */
+#define COMMAND_FLAG_STREAM 0x08
+
 /**
  * Disconnect this command channel and free all resources associated
  * with it.
@@ -184,9 +217,38 @@ struct command_base* command_channel_receive_command(struct command_channel* cha
 __attribute__ ((pure))
 void* command_channel_get_buffer(const struct command_channel* chan, const struct command_base* cmd, const void* buffer_id);
 
+/**
+ * Called by `command_channel_read_buffer` for consecutive chunks of a
+ * buffer. `offset` is the position of `chunk` in the buffer, and `chunk`
+ * is only valid during the call.
+ */
+typedef void (*command_channel_chunk_fn)(void* arg, const void* chunk, size_t offset, size_t size);
+
+/**
+ * Pass the first `size` bytes of a buffer of `cmd` to `fn` in chunks. A
+ * streamed buffer is handed over as it arrives, so that the caller can
+ * move it to its final destination while the rest is still in flight and
+ * the channel never holds the whole buffer.
+ *
+ * A streamed buffer can be read once; reading it again, or calling
+ * `command_channel_get_buffer` on it afterwards, is an error. Getting it
+ * with `command_channel_get_buffer` instead receives it whole.
+ */
+void command_channel_read_buffer(struct command_channel* chan, const struct command_base* cmd, const void* buffer_id,
+                                 size_t size, command_channel_chunk_fn fn, void* arg);
+
+/**
+ * Copy the first `size` bytes of a buffer of `cmd` to `dest`, receiving a
+ * streamed buffer directly into `dest`. The same rules as for
+ * `command_channel_read_buffer` apply.
+ */
+void command_channel_copy_buffer(struct command_channel* chan, const struct command_base* cmd, const void* buffer_id,
+                                 void* dest, size_t size);
+
 /**
  * Returns the pointer to data region. The returned pointer is mainly
- * used for data extraction for migration.
+ * used for data extraction for migration. Streamed buffers are not part
+ * of it.
  */
 __attribute__ ((pure))
 void* command_channel_get_data_region(const struct command_channel* c, const struct command_base* cmd);
@@ -322,6 +384,22 @@ struct command_channel* command_channel_socket_tcp_migration_new(int worker_port
 std::vector<struct command_channel*> command_channel_socket_tcp_guest_new();
 #endif
 struct command_channel* command_channel_socket_tcp_worker_new(int worker_port);
+struct command_channel* command_channel_shm_ring_guest_new(void);
+struct command_channel* command_channel_shm_ring_worker_new(int worker_port);
+struct command_channel* command_channel_socket_unix_guest_new(void);
+struct command_channel* command_channel_socket_unix_worker_new(int worker_port);
+struct command_channel* command_channel_loopback_new(struct command_channel **worker_end);
+struct command_channel* command_channel_loopback_guest_new(void);
+struct command_channel* command_channel_trace_new(struct command_channel *inner, const char *path);
+
+/**
+ * Busy-poll receive mode of the TCP, VSOCK and UNIX channels created
+ * afterwards. A read that finds no data spins on non-blocking reads for up
+ * to `spin_us` microseconds before it blocks (0 disables), and the
+ * receiving thread is pinned to the CPUs in the list `cores`, such as
+ * "2,4-7" (NULL or empty leaves it unpinned).
+ */
+void command_channel_socket_set_busy_poll(unsigned long spin_us, const char *cores);
 struct command_channel_log *command_channel_log_new(int worker_port);
 
 //! Hypervisor
@@ -4,6 +4,7 @@
 #ifndef __KERNEL__
 
 #include <assert.h>
+#include <sched.h>
 
 #include "cmd_channel.h"
 
@@ -23,6 +24,10 @@ struct command_channel_vtable {
     void (*command_channel_free_command)(struct command_channel* chan, struct command_base* cmd);
     void (*command_channel_free)(struct command_channel* chan);
     void (*command_channel_print_command)(const struct command_channel* chan, const struct command_base* cmd);
+    /* Optional, NULL reads every buffer with `command_channel_get_buffer`.
+     * A NULL `fn` copies into `arg`. */
+    void (*command_channel_read_buffer)(struct command_channel* chan, const struct command_base* cmd, void* buffer_id,
+                                        size_t size, command_channel_chunk_fn fn, void* arg);
 };
 
 #define __COMMAND_CHANNEL_VTABLE_CHECK_METHOD(vtable, n) assert(vtable.n != NULL && (#vtable " is missing value for " #n))
@@ -55,6 +60,12 @@ static inline void command_channel_preinitialize(struct command_channel* chan, s
 /// A simple default implementation of print_command for use in command_channel implementations.
 void command_channel_simple_print_command(const struct command_channel* chan, const struct command_base* cmd);
 
+/// Whether channels should print their statistics to stderr when freed (AVA_CHANNEL_STATS is set).
+int command_channel_stats_enabled(void);
+
+/// Parse a CPU list such as "2,4-7" into `set`. Returns the number of CPUs in the list, or -1 if it is malformed.
+int command_channel_parse_cores(const char* list, cpu_set_t* set);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,90 @@
+#ifndef AVA_CMD_CHANNEL_STATIC_H
+#define AVA_CMD_CHANNEL_STATIC_H
+
+#include <string.h>
+
+#include "common/cmd_channel.h"
+#include "common/cmd_channel_impl.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Channels that a build can be fixed to. A channel qualifies when its
+ * methods on the hot path are exported as `command_channel_<name>_<method>`,
+ * it reads every buffer with `get_buffer`, and each of its ends is created
+ * by the code that uses it. The loopback channel is not: the guestlib
+ * creates both ends, and the API server, in a link-map namespace of its
+ * own, would call its own copy of the methods on its end and free buffers
+ * with another copy of libc.
+ */
+size_t command_channel_shm_ring_buffer_size(const struct command_channel *c, size_t size);
+struct command_base *command_channel_shm_ring_new_command(struct command_channel *c, size_t command_struct_size,
+                                                          size_t data_region_size);
+void *command_channel_shm_ring_attach_buffer(struct command_channel *c, struct command_base *cmd, void *buffer,
+                                             size_t size);
+void command_channel_shm_ring_send_command(struct command_channel *c, struct command_base *cmd);
+struct command_base *command_channel_shm_ring_receive_command(struct command_channel *c);
+void *command_channel_shm_ring_get_buffer(const struct command_channel *chan, const struct command_base *cmd,
+                                          void *buffer_id);
+void command_channel_shm_ring_free_command(struct command_channel *c, struct command_base *cmd);
+
+/**
+ * Compile-time channel selection.
+ *
+ * Building with `AVA_STATIC_CHANNEL` set to a channel name above (such as
+ * `shm_ring`) turns the channel calls of the including file into direct
+ * calls of that channel's methods, which the compiler can inline across
+ * files with link-time optimization. Only the generated code and the
+ * endpoint setup are built this way; the rest of AvA keeps the vtable, so
+ * that wrapping channels and the migration log still work with their own
+ * channels. The endpoint checks with `command_channel_static_matches` that
+ * it created the channel the build is fixed to.
+ */
+#ifdef AVA_STATIC_CHANNEL
+
+#define __AVA_STATIC_CHANNEL_FN(name, method) command_channel_##name##_##method
+#define _AVA_STATIC_CHANNEL_FN(name, method) __AVA_STATIC_CHANNEL_FN(name, method)
+#define AVA_STATIC_CHANNEL_FN(method) _AVA_STATIC_CHANNEL_FN(AVA_STATIC_CHANNEL, method)
+#define __AVA_STATIC_CHANNEL_STR(name) #name
+#define _AVA_STATIC_CHANNEL_STR(name) __AVA_STATIC_CHANNEL_STR(name)
+#define AVA_STATIC_CHANNEL_NAME _AVA_STATIC_CHANNEL_STR(AVA_STATIC_CHANNEL)
+
+static inline void command_channel_static_copy_buffer(struct command_channel *chan, const struct command_base *cmd,
+                                                      const void *buffer_id, void *dest, size_t size)
+{
+    memcpy(dest, AVA_STATIC_CHANNEL_FN(get_buffer)(chan, cmd, (void *)buffer_id), size);
+}
+
+#define command_channel_buffer_size(chan, size) AVA_STATIC_CHANNEL_FN(buffer_size)(chan, size)
+#define command_channel_new_command(chan, command_struct_size, data_region_size) \
+    AVA_STATIC_CHANNEL_FN(new_command)(chan, command_struct_size, data_region_size)
+#define command_channel_attach_buffer(chan, cmd, buffer, size) \
+    AVA_STATIC_CHANNEL_FN(attach_buffer)(chan, cmd, (void *)(buffer), size)
+#define command_channel_send_command(chan, cmd) AVA_STATIC_CHANNEL_FN(send_command)(chan, cmd)
+#define command_channel_receive_command(chan) AVA_STATIC_CHANNEL_FN(receive_command)(chan)
+#define command_channel_get_buffer(chan, cmd, buffer_id) \
+    AVA_STATIC_CHANNEL_FN(get_buffer)(chan, cmd, (void *)(buffer_id))
+#define command_channel_copy_buffer(chan, cmd, buffer_id, dest, size) \
+    command_channel_static_copy_buffer(chan, cmd, buffer_id, dest, size)
+#define command_channel_free_command(chan, cmd) AVA_STATIC_CHANNEL_FN(free_command)(chan, cmd)
+
+/**
+ * Whether `chan` is the channel this build is fixed to.
+ */
+static inline int command_channel_static_matches(const struct command_channel *chan)
+{
+    const struct command_channel_vtable *vtable = ((const struct command_channel_base *)chan)->vtable;
+    return vtable->command_channel_new_command == AVA_STATIC_CHANNEL_FN(new_command) &&
+           vtable->command_channel_send_command == AVA_STATIC_CHANNEL_FN(send_command) &&
+           vtable->command_channel_read_buffer == NULL;
+}
+
+#endif  // AVA_STATIC_CHANNEL
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // AVA_CMD_CHANNEL_STATIC_H
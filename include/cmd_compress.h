@@ -0,0 +1,67 @@
+#ifndef AVA_CMD_COMPRESS_H
+#define AVA_CMD_COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A small LZ77 block compressor for command data regions. It trades ratio
+ * for speed so that compressing a buffer costs less than sending the bytes
+ * it saves over a 10GbE link. Long runs, such as zero-filled tensors,
+ * compress to a few bytes per 64 KB and decompress at memset speed.
+ */
+
+struct cmd_compress_stats {
+    uint64_t buffers;        /* buffers large enough to be considered */
+    uint64_t compressed;     /* buffers sent compressed */
+    uint64_t skipped;        /* buffers rejected by the sample check */
+    uint64_t bytes_in;       /* raw size of the compressed buffers */
+    uint64_t bytes_out;      /* compressed size of the compressed buffers */
+    uint64_t compress_ns;    /* thread CPU time spent compressing */
+    uint64_t decompress_ns;  /* thread CPU time spent decompressing */
+};
+
+/**
+ * @return The largest compressed size of `size` bytes.
+ */
+size_t cmd_compress_bound(size_t size);
+
+/**
+ * Compress a few samples of the buffer and check whether the whole buffer
+ * is likely to shrink by at least AVA_COMPRESS_MIN_SAVING.
+ * @return Non-zero if the buffer is worth compressing.
+ */
+int cmd_compress_sample(const void *src, size_t size);
+
+/**
+ * Compress `size` bytes from `src` into `dst`.
+ * @return The compressed size, or 0 if it does not fit in `capacity`.
+ */
+size_t cmd_compress(const void *src, size_t size, void *dst, size_t capacity);
+
+/**
+ * Decompress `size` bytes from `src` into exactly `raw_size` bytes at `dst`.
+ * @return 0 on success, or -1 if the input is corrupt.
+ */
+int cmd_decompress(const void *src, size_t size, void *dst, size_t raw_size);
+
+/**
+ * @return The CPU time consumed by the calling thread, in nanoseconds.
+ */
+uint64_t cmd_compress_thread_time(void);
+
+/**
+ * Print the counters to `stream`, prefixed with `name`.
+ */
+void cmd_compress_print_stats(const struct cmd_compress_stats *stats, const char *name, FILE *stream);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // AVA_CMD_COMPRESS_H
@@ -0,0 +1,61 @@
+#ifndef AVA_CMD_COPY_H
+#define AVA_CMD_COPY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Copy engine for attached buffers. `cmd_copy` picks a strategy by the
+ * size of the copy and by its destination:
+ *
+ * - Copies below AVA_COPY_STREAM_THRESHOLD are plain `memcpy`s.
+ * - Large copies into memory shared with the other endpoint (a shared
+ *   memory region or BAR), which this side does not read again, use
+ *   non-temporal stores that bypass the caches instead of evicting the
+ *   application's working set.
+ * - Copies of at least AVA_COPY_SPLIT_THRESHOLD are split into chunks that
+ *   the calling thread and up to AVA_COPY_MAX_HELPERS helper threads copy
+ *   in parallel. The helpers are started at the first such copy. Only one
+ *   split copy runs at a time; a concurrent one is copied by its caller
+ *   alone.
+ */
+
+/* Destination of a copy */
+#define CMD_COPY_PRIVATE 0  /* memory read again by this process */
+#define CMD_COPY_SHARED  1  /* memory read by the other endpoint */
+
+struct cmd_copy_stats {
+    uint64_t copies;    /* copies of at least AVA_COPY_STREAM_THRESHOLD */
+    uint64_t streamed;  /* of them, copied with non-temporal stores */
+    uint64_t split;     /* of them, split across helper threads */
+    uint64_t bytes;     /* bytes copied by them */
+    uint64_t ns;        /* wall-clock time spent copying them */
+};
+
+/**
+ * Copy `size` bytes from `src` to `dst`, which must not overlap.
+ * @param dest `CMD_COPY_PRIVATE` or `CMD_COPY_SHARED`.
+ */
+void cmd_copy(void *dst, const void *src, size_t size, int dest);
+
+/**
+ * Take a snapshot of the process-wide counters.
+ */
+void cmd_copy_get_stats(struct cmd_copy_stats *stats);
+
+/**
+ * Print the counters to `stream`, prefixed with `name`, if any large copy
+ * has been made.
+ */
+void cmd_copy_print_stats(const char *name, FILE *stream);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // AVA_CMD_COPY_H
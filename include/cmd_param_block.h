@@ -0,0 +1,87 @@
+#ifndef AVA_CMD_PARAM_BLOCK_H
+#define AVA_CMD_PARAM_BLOCK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Allocator of data regions in one direction of the shared memory
+ * parameter block.
+ *
+ * Regions are carved out of a ring in the order commands are built, and
+ * every region starts with a one cache line header in shared memory. The
+ * receiver of a command marks the header when it frees the command, and
+ * the sender reclaims the ring from its oldest end up to the first region
+ * that is still in use. Regions and the buffers in them are aligned to
+ * a cache line.
+ *
+ * Reserving a region is a compare-and-swap on the ring head, so threads
+ * only contend when the ring is full. Then the sender waits for the
+ * receiver to free old commands.
+ */
+struct cmd_param_block;
+
+struct cmd_param_block_stats {
+    uint64_t allocs;          /* regions reserved */
+    uint64_t bytes;           /* bytes reserved, including headers and padding */
+    uint64_t pad_bytes;       /* bytes skipped at the end of the ring */
+    uint64_t stalls;          /* reservations that waited for the receiver */
+    uint64_t stall_ns;        /* time spent waiting */
+    uint64_t peak_used;       /* high-water mark of reserved, unreclaimed bytes */
+    uint64_t peak_fragmented; /* most freed bytes stuck behind a region in use during a stall */
+};
+
+#define CMD_PARAM_BLOCK_ALIGN       64
+/* Bytes in front of the first buffer of a region */
+#define CMD_PARAM_BLOCK_HEADER_SIZE CMD_PARAM_BLOCK_ALIGN
+
+/**
+ * @return `size` rounded up to the alignment of regions and buffers.
+ */
+static inline size_t cmd_param_block_align(size_t size)
+{
+    return (size + CMD_PARAM_BLOCK_ALIGN - 1) & ~(size_t)(CMD_PARAM_BLOCK_ALIGN - 1);
+}
+
+/**
+ * @base: local mapping of the parameter block
+ * @start: offset of the sender's half in the parameter block
+ * @size: size of the sender's half
+ */
+struct cmd_param_block *cmd_param_block_new(void *base, uintptr_t start, size_t size);
+
+void cmd_param_block_free(struct cmd_param_block *pb);
+
+/**
+ * Reserve a region of `size` bytes, including the header, and wait for
+ * space if the ring is full. The process exits if `size` can never fit.
+ * @return The offset of the region in the parameter block.
+ */
+uintptr_t cmd_param_block_reserve(struct cmd_param_block *pb, size_t size);
+
+/**
+ * Called by the receiver of a command when it no longer needs the region
+ * at `offset` of the parameter block mapped at `base`.
+ */
+void cmd_param_block_release(void *base, uintptr_t offset);
+
+/**
+ * Take a snapshot of the allocator counters.
+ */
+void cmd_param_block_get_stats(struct cmd_param_block *pb, struct cmd_param_block_stats *stats);
+
+/**
+ * Print the allocator counters to `stream`, prefixed with `name`.
+ */
+void cmd_param_block_print_stats(struct cmd_param_block *pb, const char *name, FILE *stream);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // AVA_CMD_PARAM_BLOCK_H
@@ -0,0 +1,56 @@
+#ifndef AVA_CMD_TRACE_H
+#define AVA_CMD_TRACE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Traffic trace written by the tracing channel (`command_channel_trace_new`).
+ *
+ * The file starts with a `struct command_trace_header`, followed by one
+ * record per command in the order the commands passed the channel: a
+ * `struct command_trace_record`, the command struct as the application
+ * built or received it, and its data region. The region holds the
+ * attached buffers at the offsets the traced channel laid them out at, so
+ * buffer IDs in the command struct keep their meaning. The TCP, UNIX,
+ * SHM_RING and LOCAL channels use the offset of a buffer from the start of
+ * the command as its ID; a trace taken on one of them can be replayed on
+ * any of them. All integers are in the byte order of the tracing host.
+ */
+#define COMMAND_TRACE_MAGIC   0x4543415254415641ULL  /* "AVATRACE" */
+#define COMMAND_TRACE_VERSION 1
+
+struct command_trace_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t pid;
+    uint64_t start_ns;        /* CLOCK_MONOTONIC when the trace was opened */
+    uint64_t start_realtime;  /* CLOCK_REALTIME at the same moment, in ns */
+};
+
+/* Direction of a record */
+#define COMMAND_TRACE_SENT     0
+#define COMMAND_TRACE_RECEIVED 1
+
+/* The data region lacks streamed buffers, which are not part of it when
+ * the command is received */
+#define COMMAND_TRACE_PARTIAL  0x01
+
+struct command_trace_record {
+    uint64_t timestamp_ns;    /* CLOCK_MONOTONIC, relative to `start_ns` */
+    uint32_t thread_id;       /* OS thread that sent or received the command */
+    uint8_t direction;
+    uint8_t flags;
+    uint16_t reserved;
+    uint64_t command_size;
+    uint64_t region_size;
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // AVA_CMD_TRACE_H
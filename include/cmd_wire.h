@@ -0,0 +1,70 @@
+#ifndef AVA_CMD_WIRE_H
+#define AVA_CMD_WIRE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "common/cmd_channel.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Encodings of `struct command_base` between the two ends of a channel.
+ * The ends agree on a version when they connect; generated code always
+ * sees the full in-memory struct.
+ *
+ * Version 0 sends the struct verbatim. Version 1 sends a compact header
+ * in its place: a byte of presence bits, `api_id`, `flags`, and then
+ * LEB128 varints of `command_type`, `command_id`, the size of the command
+ * struct beyond `command_base`, `region_size` and `thread_id`. The fields
+ * that are usually zero or implied follow only when their presence bit is
+ * set: `vm_id`, `original_thread_id`, `data_region` if it is not
+ * `command_size`, and a prefix of `reserved_area` that the channel needs
+ * on the receiving end. A command header with a bit unknown to the
+ * receiver is rejected.
+ */
+#define COMMAND_WIRE_VERBATIM   0
+#define COMMAND_WIRE_COMPACT    1
+/* The newest version this build speaks */
+#define COMMAND_WIRE_VERSION    COMMAND_WIRE_COMPACT
+
+/* Largest compact header without a `reserved_area` prefix, and the
+ * largest prefix a channel may carry */
+#define COMMAND_WIRE_HEADER_MAX  80
+#define COMMAND_WIRE_PRIVATE_MAX 32
+
+struct command_wire_stats {
+    uint64_t commands;       /* commands sent */
+    uint64_t header_bytes;   /* bytes of their headers on the wire */
+    uint64_t bytes;          /* bytes of their command structs and inline regions on the wire */
+};
+
+/**
+ * Encode the compact header of `cmd` into `buf`, which must hold
+ * COMMAND_WIRE_HEADER_MAX + `private_size` bytes.
+ * @private_size: bytes at the start of `reserved_area` to carry
+ * @return The size of the header.
+ */
+size_t command_wire_encode(const struct command_base *cmd, size_t private_size, void *buf);
+
+/**
+ * Decode a compact header from the `size` bytes at `buf` into `cmd`. The
+ * rest of `reserved_area` is zeroed. The process exits if the header is
+ * corrupt.
+ * @return The size of the header, or 0 if `size` bytes do not hold all of it.
+ */
+size_t command_wire_decode(const void *buf, size_t size, struct command_base *cmd);
+
+/**
+ * Print the counters to `stream`, prefixed with `name`.
+ */
+void command_wire_print_stats(const struct command_wire_stats *stats, int version, const char *name, FILE *stream);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // AVA_CMD_WIRE_H
@@ -75,6 +75,94 @@
 #define AVA_GUEST_SHM_SIZE        MB(512)
 #define AVA_HOST_SHM_SIZE         ((size_t)AVA_GUEST_SHM_SIZE * MAX_VM_NUM)
 
+/* Polling doorbell of the shared memory channel. The parameter block
+ * starts with a control page and one descriptor ring per direction; the
+ * data regions are placed behind them. */
+#define AVA_SHM_DOORBELL_CONTROL_SIZE KB(4)
+#define AVA_SHM_DESC_RING_SIZE        KB(512)
+#define AVA_SHM_POLL_SPIN_DEFAULT     50      /* microsecond */
+#define AVA_SHM_POLL_SPIN_MIN_DIV     16      /* shortest spin, as a fraction of it */
+
+/* Same-host shared-memory ring channel. The ring size is per direction. */
+#define AVA_SHM_RING_NAME_PREFIX  "/ava_shm_ring."
+#define AVA_SHM_RING_SIZE_DEFAULT MB(64)
+#define AVA_SHM_RING_SPIN_COUNT   4096
+
+/* In-process loopback channel */
+#define AVA_LOOPBACK_SPIN_COUNT   4096
+
+/* Copy engine for attached buffers (cmd_copy.h). Split copies are cut into
+ * chunks of at least SPLIT_CHUNK bytes. */
+#define AVA_COPY_STREAM_THRESHOLD MB(1)
+#define AVA_COPY_SPLIT_THRESHOLD  MB(32)
+#define AVA_COPY_SPLIT_CHUNK      MB(2)
+#define AVA_COPY_MAX_HELPERS      3
+
+/* Upper bound of the API server's AVA_SHADOW_THREAD_IDLE setting, the shadow
+ * threads kept parked for reuse after their remote thread exits */
+#define AVA_SHADOW_THREAD_IDLE_MAX 64
+
+/* Traffic traces, written through a buffer of this size */
+#define AVA_TRACE_BUFFER_SIZE     MB(4)
+
+/* Scatter-gather send in the socket channel. Data regions larger than the
+ * threshold are sent by reference; buffers up to the copy size are still
+ * copied into a small inline area to keep the vector short. */
+#define AVA_SOCKET_SG_THRESHOLD       KB(64)
+#define AVA_SOCKET_SG_INLINE_SIZE     KB(4)
+#define AVA_SOCKET_SG_COPY_SIZE       512
+#define AVA_SOCKET_ZEROCOPY_THRESHOLD KB(512)
+
+/* Receive staging buffer of the socket channel. Each read takes as many
+ * pending commands as fit, and remainders of at least half the buffer are
+ * received directly into the command. Streamed buffers are passed on in
+ * chunks of up to this size. */
+#define AVA_SOCKET_RECV_BUFFER_SIZE KB(256)
+
+/* Longest time the next command waits for the streamed buffers in front of
+ * it to be read before they are received whole */
+#define AVA_SOCKET_STREAM_WAIT 1000    /* microsecond */
+
+/* Upper bound of the guestlib's tcp_connections setting */
+#define AVA_SOCKET_TCP_MAX_CONNECTIONS 16
+
+/* Write coalescing in the TCP channel. Deferrable commands up to the copy
+ * size are gathered in a buffer that is written out at the next command
+ * that cannot be deferred, when it fills up, or after the guestlib's
+ * tcp_coalesce_delay. */
+#define AVA_SOCKET_COALESCE_SIZE      KB(64)
+#define AVA_SOCKET_COALESCE_COPY_SIZE KB(8)
+
+/* Compression of large buffers in the socket channel. Buffers are sampled
+ * first and sent raw unless the samples shrink by MIN_SAVING percent. */
+#define AVA_COMPRESS_SAMPLE_SIZE KB(4)
+#define AVA_COMPRESS_SAMPLES     4
+#define AVA_COMPRESS_MIN_SAVING  10
+
+/* Deduplication of large buffers in the socket channel. Buffers of at
+ * least MIN_SIZE are cached by the receiver, in at most MAX_SLOTS slots
+ * and the guestlib's tcp_dedup_cache bytes per connection. */
+#define AVA_DEDUP_MIN_SIZE  KB(64)
+#define AVA_DEDUP_MAX_SLOTS 4096
+
+/* io_uring socket channel */
+#define AVA_SOCKET_URING_ENTRIES          64
+#define AVA_SOCKET_URING_RECV_BUFFER_SIZE KB(256)
+#define AVA_SOCKET_URING_SQ_THREAD_IDLE   50      /* millisecond */
+#define AVA_SOCKET_URING_SPIN_COUNT       4096
+
+/* Unix-domain socket channel. Data regions of at least the threshold are
+ * passed as shared memory file descriptors instead of being streamed. */
+#define AVA_SOCKET_UNIX_NAME_PREFIX  "ava_worker."
+#define AVA_SOCKET_UNIX_FD_THRESHOLD KB(256)
+
+/* Receive buffer pools. Commands are received into power-of-two size
+ * classes between 2^MIN_SHIFT and 2^MAX_SHIFT bytes; each class keeps at
+ * most CLASS_CACHE bytes of freed buffers for reuse. */
+#define AVA_CMD_BUFFER_POOL_MIN_SHIFT   8       /* 256 B */
+#define AVA_CMD_BUFFER_POOL_MAX_SHIFT   22      /* 4 MB */
+#define AVA_CMD_BUFFER_POOL_CLASS_CACHE MB(16)
+
 /* DMA_CMA region, the default size is 32 MB.
  * The size cannot be larger than that specified in the boot parameter cma=nnM */
 #define VGPU_ZERO_COPY_SIZE       MB(16)
@@ -23,6 +23,7 @@ using namespace std;
 
 #include "common/murmur3.h"
 #include "common/cmd_channel.h"
+#include "common/cmd_channel_static.h"
 #include "common/cmd_handler.h"
 #include "common/shadow_thread_pool.h"
 #include "common/zcopy.h"
@@ -35,7 +35,7 @@ struct block_seeker
 {
     uintptr_t global_offset; /* local_offset + param_block.offset */
     uintptr_t local_offset;  /* start from 0 */
-    uintptr_t cur_offset;    /* start from local_offset + 0x4 */
+    uintptr_t cur_offset;    /* start from local_offset + CMD_PARAM_BLOCK_HEADER_SIZE */
 };
 
 struct param_block_info {
@@ -5,7 +5,9 @@
 #ifndef AVA_SHADOWN_THREAD_POOL_H
 #define AVA_SHADOWN_THREAD_POOL_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -20,9 +22,28 @@ struct command_base;
  * The pool will also handle "solid" threads: threads where are not managed by the pool,
  * and have a remote shadow at the other end of the AvA transport. A thread become a solid
  * thread as soon as it calls `shadow_thread_id(pool)`.
+ *
+ * When the remote thread of a shadow exits, the shadow thread exits too. With
+ * `shadow_thread_pool_set_idle_max`, it is parked instead and serves the next
+ * new `thread_id`. Its async call credit starts over, but thread-local state
+ * of the API, such as the current CUDA device or context, carries over to the
+ * new ID, so reuse is only for APIs without such state.
  */
 struct shadow_thread_pool_t;
 
+struct shadow_thread_pool_stats {
+    uint64_t async_calls;    /* async calls that took credit */
+    uint64_t stalls;         /* calls that waited for credit */
+    uint64_t stall_ns;       /* time spent waiting */
+    uint64_t peak_calls;     /* most async calls of one thread awaiting replies */
+    uint64_t peak_bytes;     /* most bytes of them */
+    uint64_t peak_queued;    /* longest queue of dispatched commands of one thread */
+    uint64_t threads_created;  /* shadow threads started */
+    uint64_t threads_reused;   /* IDs given to a parked shadow thread instead */
+    uint64_t threads_parked;   /* shadow threads parked now */
+    uint64_t peak_parked;      /* most shadow threads parked at once */
+};
+
 /**
  * @return A newly-constructed empty shadow_thread_pool_t.
  */
@@ -53,6 +74,7 @@ intptr_t shadow_thread_id(struct shadow_thread_pool_t *pool);
 
 /**
  * Dispatch a single command to a thread pool. This call in non-blocking.
+ * Commands must be dispatched by one thread at a time.
  *
  * @param pool The shadow_thread_pool_t
  * @param chan The channel from which `cmd` came.
@@ -60,6 +82,47 @@ intptr_t shadow_thread_id(struct shadow_thread_pool_t *pool);
  */
 void shadow_thread_pool_dispatch(struct shadow_thread_pool_t *pool, struct command_channel *chan, struct command_base *cmd);
 
+/**
+ * Limit the async calls of each thread that have not been answered yet.
+ * Both limits default to 0, which disables them.
+ *
+ * @param pool The pool.
+ * @param calls The number of calls.
+ * @param bytes The total size of their commands and data regions.
+ */
+void shadow_thread_pool_set_credits(struct shadow_thread_pool_t *pool, size_t calls, size_t bytes);
+
+/**
+ * Keep up to `threads` shadow threads parked after their remote thread
+ * exits, to serve new `thread_id`s. Defaults to 0, so that every new ID gets
+ * a fresh thread; at most AVA_SHADOW_THREAD_IDLE_MAX.
+ *
+ * @param pool The pool.
+ * @param threads The number of parked threads.
+ */
+void shadow_thread_pool_set_idle_max(struct shadow_thread_pool_t *pool, size_t threads);
+
+/**
+ * Take credit for an async call of `size` bytes before it is sent. While
+ * the thread is over a limit, this executes the commands destined for it,
+ * which include the replies that return credit.
+ *
+ * @param pool The pool.
+ * @param size The size of the command and its data region.
+ */
+void shadow_thread_acquire_credit(struct shadow_thread_pool_t *pool, size_t size);
+
+/**
+ * Return the credit of an async call when its reply is handled.
+ *
+ * @param pool The pool.
+ * @param size The size passed to `shadow_thread_acquire_credit`.
+ */
+void shadow_thread_release_credit(struct shadow_thread_pool_t *pool, size_t size);
+
+void shadow_thread_pool_get_stats(struct shadow_thread_pool_t *pool, struct shadow_thread_pool_stats *stats);
+void shadow_thread_pool_print_stats(struct shadow_thread_pool_t *pool, const char *name, FILE *stream);
+
 /**
  * Block until a command for this thread is executed and the
  * predicate is true.
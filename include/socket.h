@@ -74,6 +74,23 @@ int accept_vm_socket(int listen_fd, int *guest_cid);
  **/
 size_t send_socket(int sockfd, const void *buf, size_t size);
 
+struct iovec;
+
+/**
+ * send_socket_iov - Send a list of buffers to the socket in one go
+ * @sockfd: socket file descriptor
+ * @iov: the buffers to be sent, updated in place on partial sends
+ * @iovcnt: the number of buffers
+ * @flags: flags passed to `sendmsg`
+ * @nr_zerocopy: incremented for every `sendmsg` sent with MSG_ZEROCOPY,
+ *     may be NULL
+ *
+ * MSG_ZEROCOPY is dropped when the kernel runs out of notification
+ * memory. This function is lock-free, and should be protected by locks
+ * when being used.
+ **/
+size_t send_socket_iov(int sockfd, struct iovec *iov, int iovcnt, int flags, unsigned *nr_zerocopy);
+
 /**
  * recv_socket - Receive buffer from the socket
  * @sockfd: socket file descriptor
@@ -13,9 +13,11 @@ void benchmark(const char* kind, int repetitions, size_t size, time_t work, benc
 
 void benchmark_noop_wrapper(void *, size_t, time_t);
 void benchmark_copy_out_shadow_buffer_wrapper(void *, size_t, time_t);
+void benchmark_async_burst_wrapper(void *, size_t, time_t);
+void benchmark_tiny_calls_wrapper(void *, size_t, time_t);
 
 static void usage(const char *name) {
-    fprintf(stderr, "Usage: %s [-w ms] [-r nreps] [-s kiB] benchmark\nbenchmarks are: noop, in_transfer, in_shadow, out_existing, out_shadow\n",
+    fprintf(stderr, "Usage: %s [-w ms] [-r nreps] [-s kiB] benchmark\nbenchmarks are: noop, in_transfer, in_shadow, out_existing, out_shadow, async_burst, tiny_calls\n",
             name);
     exit(EXIT_FAILURE);
 }
@@ -58,12 +60,14 @@ int main(int argc, const char **argv)
     BENCHMARK_TYPE_CASE("out_existing", 5, benchmark_copy_out_existing_buffer, malloc, free);
     BENCHMARK_TYPE_CASE("out_shadow", 5, benchmark_copy_out_shadow_buffer_wrapper, malloc, free);
     BENCHMARK_TYPE_CASE("out_zerocopy", 5, benchmark_zero_copy_out, special_alloc, special_free);
+    BENCHMARK_TYPE_CASE("async_burst", 5, benchmark_async_burst_wrapper, malloc, free);
+    BENCHMARK_TYPE_CASE("tiny_calls", 4, benchmark_tiny_calls_wrapper, malloc, free);
     BENCHMARK_TYPE_CASE("all", 3, (void*)1, NULL, NULL);
 #undef BENCHMARK_TYPE_CASE
     if (benchmark_func == NULL)
         usage(argv[0]);
 
-    printf("test,rep,time_ms\n");
+    printf("test,rep,time_ms,MB_per_s\n");
 
     if (benchmark_func == (void*)1) {
         benchmark("noop", repetitions, size, work, benchmark_noop_wrapper, malloc, free);
@@ -73,6 +77,8 @@ int main(int argc, const char **argv)
         benchmark("out_existing", repetitions, size, work, benchmark_copy_out_existing_buffer, malloc, free);
         benchmark("out_shadow", repetitions, size, work, benchmark_copy_out_shadow_buffer_wrapper, malloc, free);
         benchmark("out_zerocopy", repetitions, size, work, benchmark_zero_copy_out, special_alloc, special_free);
+        benchmark("async_burst", repetitions, size, work, benchmark_async_burst_wrapper, malloc, free);
+        benchmark("tiny_calls", repetitions, size, work, benchmark_tiny_calls_wrapper, malloc, free);
     } else {
         benchmark(benchmark_name, repetitions, size, work, benchmark_func, alloc_func, free_func);
     }
@@ -84,6 +90,8 @@ void benchmark(const char *kind, int repetitions, size_t size, time_t work, benc
 {
     struct timestamp total_time;
     char *buffer = alloc(size);
+    /* The in_* and out_* benchmarks move `size` bytes per repetition */
+    int moves_data = strncmp(kind, "in_", 3) == 0 || strncmp(kind, "out_", 4) == 0;
 
     // Warm-up
     memset(buffer, 42, size);
@@ -96,7 +104,10 @@ void benchmark(const char *kind, int repetitions, size_t size, time_t work, benc
         func(buffer, size, work);
         float total = probe_time_end(&total_time);
 
-        printf("%s,%2d,%.3f\n", kind, rep, total);
+        if (moves_data && total > 0)
+            printf("%s,%2d,%.3f,%.1f\n", kind, rep, total, size / 1048576.0 / (total / 1000.0));
+        else
+            printf("%s,%2d,%.3f,\n", kind, rep, total);
     }
     free(buffer);
 }
@@ -117,3 +128,33 @@ void benchmark_zerocopy_wrapper(void *data, size_t size, time_t work)
 {
     void *ret = benchmark_copy_out_shadow_buffer(size, work);
 }
+
+#define ASYNC_BURST_CALLS 50
+#define ASYNC_BURST_BYTES 64
+
+/**
+ * Issue a burst of small asynchronous calls followed by a synchronous one,
+ * which is where receiving several commands per read pays off. `work` is
+ * not used.
+ */
+void benchmark_async_burst_wrapper(void *data, size_t size, time_t work)
+{
+    size_t count = (size < ASYNC_BURST_BYTES ? size : ASYNC_BURST_BYTES) / sizeof(int);
+
+    for (int i = 0; i < ASYNC_BURST_CALLS; i++)
+        read_call_buffer(data, count);
+    function1();
+}
+
+#define TINY_CALLS 1000
+
+/**
+ * Make many synchronous calls without arguments, so that the time is
+ * dominated by command headers and round trips. `size` and `work` are not
+ * used.
+ */
+void benchmark_tiny_calls_wrapper(void *data, size_t size, time_t work)
+{
+    for (int i = 0; i < TINY_CALLS; i++)
+        function1();
+}
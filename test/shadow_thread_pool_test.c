@@ -0,0 +1,209 @@
+/**
+ * Unit test of the shadow thread pool: commands are dispatched to a thread
+ * per ID in order, an ID that exits and comes back gets a thread again, and
+ * many short-lived IDs are served by created or parked threads.
+ *
+ * The pool is linked in directly; the command handler and the channel are
+ * replaced by stubs that record which thread handled each command.
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common/cmd_channel.h"
+#include "common/cmd_handler.h"
+#include "common/shadow_thread_pool.h"
+#include "common/zcopy.h"
+
+#include "testing_hack.h"
+
+#define MAX_COMMANDS 4096
+
+struct command_channel *nw_global_command_channel;
+
+/* Written by the shadow threads; read once wait_handled has seen them all */
+static pthread_mutex_t handled_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t handled_by[MAX_COMMANDS];
+static uint64_t handled_at[MAX_COMMANDS];
+static uint64_t handled;
+
+void handle_command_and_notify(struct command_channel *chan, struct command_base *cmd)
+{
+    uintptr_t seq = cmd->command_type;
+    pthread_mutex_lock(&handled_lock);
+    handled_by[seq] = pthread_self();
+    handled_at[seq] = ++handled;
+    pthread_mutex_unlock(&handled_lock);
+    free(cmd);
+}
+
+struct command_base *command_channel_new_command(struct command_channel *chan, size_t command_struct_size,
+                                                 size_t data_region_size)
+{
+    return calloc(1, command_struct_size);
+}
+
+void command_channel_send_command(struct command_channel *chan, struct command_base *cmd)
+{
+    free(cmd);
+}
+
+void command_channel_free_command(struct command_channel *chan, struct command_base *cmd)
+{
+    free(cmd);
+}
+
+void *ava_zcopy_region_alloc(struct ava_zcopy_region *region, size_t size) { return NULL; }
+void ava_zcopy_region_free(struct ava_zcopy_region *region, void *ptr) {}
+uintptr_t ava_zcopy_region_get_physical_address(struct ava_zcopy_region *region, const void *ptr) { return 0; }
+
+static void dispatch_call(struct shadow_thread_pool_t *pool, int64_t thread_id, uintptr_t seq)
+{
+    struct command_base *cmd = calloc(1, sizeof(struct command_base));
+    cmd->api_id = 1;
+    cmd->thread_id = thread_id;
+    cmd->command_type = seq;
+    shadow_thread_pool_dispatch(pool, NULL, cmd);
+}
+
+static void dispatch_exit(struct shadow_thread_pool_t *pool, int64_t thread_id)
+{
+    struct command_base *cmd = calloc(1, sizeof(struct command_base));
+    cmd->api_id = INTERNAL_API;
+    cmd->command_id = COMMAND_HANDLER_THREAD_EXIT;
+    cmd->thread_id = thread_id;
+    shadow_thread_pool_dispatch(pool, NULL, cmd);
+}
+
+static uint64_t handled_count(void)
+{
+    pthread_mutex_lock(&handled_lock);
+    uint64_t count = handled;
+    pthread_mutex_unlock(&handled_lock);
+    return count;
+}
+
+static void wait_handled(uint64_t count)
+{
+    for (int i = 0; i < 10000 && handled_count() < count; i++)
+        usleep(1000);
+    ck_assert_uint_eq(handled_count(), count);
+}
+
+static void reset_handled(void)
+{
+    pthread_mutex_lock(&handled_lock);
+    memset(handled_by, 0, sizeof(handled_by));
+    memset(handled_at, 0, sizeof(handled_at));
+    handled = 0;
+    pthread_mutex_unlock(&handled_lock);
+}
+
+START_TEST(dispatch_in_order)
+    struct shadow_thread_pool_t *pool = shadow_thread_pool_new();
+    const int ids = 8, calls = 100;
+    reset_handled();
+
+    for (int seq = 0; seq < ids * calls; seq++)
+        dispatch_call(pool, seq % ids, seq);
+    wait_handled(ids * calls);
+
+    for (int seq = ids; seq < ids * calls; seq++) {
+        ck_assert_int_ne(pthread_equal(handled_by[seq], handled_by[seq - ids]), 0);
+        ck_assert_uint_lt(handled_at[seq - ids], handled_at[seq]);
+    }
+    for (int id = 1; id < ids; id++)
+        ck_assert_int_eq(pthread_equal(handled_by[id], handled_by[0]), 0);
+END_TEST
+
+START_TEST(exit_and_reuse_id)
+    struct shadow_thread_pool_t *pool = shadow_thread_pool_new();
+    reset_handled();
+
+    /* An exit for an ID without a thread is dropped */
+    dispatch_exit(pool, 7);
+    for (int seq = 0; seq < 10; seq++)
+        dispatch_call(pool, 0, seq);
+    dispatch_exit(pool, 0);
+    /* The ID comes back right away, before its old thread has exited */
+    for (int seq = 10; seq < 20; seq++)
+        dispatch_call(pool, 0, seq);
+    wait_handled(20);
+
+    for (int seq = 1; seq < 20; seq++) {
+        if (seq != 10)
+            ck_assert_uint_lt(handled_at[seq - 1], handled_at[seq]);
+    }
+    struct shadow_thread_pool_stats stats;
+    shadow_thread_pool_get_stats(pool, &stats);
+    /* Threads are not reused unless asked for */
+    ck_assert_uint_eq(stats.threads_created, 2);
+    ck_assert_uint_eq(stats.threads_reused, 0);
+END_TEST
+
+START_TEST(many_short_lived_ids)
+    struct shadow_thread_pool_t *pool = shadow_thread_pool_new();
+    const int ids = 1000;
+    shadow_thread_pool_set_idle_max(pool, 16);
+    reset_handled();
+
+    /* Enough IDs to grow the table several times */
+    for (int id = 0; id < ids; id++) {
+        dispatch_call(pool, 1000 + id, id);
+        dispatch_call(pool, 1000 + id, ids + id);
+        if (id % 2)
+            dispatch_exit(pool, 1000 + id);
+    }
+    wait_handled(2 * ids);
+
+    for (int id = 0; id < ids; id++) {
+        ck_assert_int_ne(pthread_equal(handled_by[id], handled_by[ids + id]), 0);
+        ck_assert_uint_lt(handled_at[id], handled_at[ids + id]);
+    }
+    struct shadow_thread_pool_stats stats;
+    shadow_thread_pool_get_stats(pool, &stats);
+    ck_assert_uint_eq(stats.threads_created + stats.threads_reused, ids);
+    ck_assert_uint_gt(stats.threads_reused, 0);
+    shadow_thread_pool_print_stats(pool, "test", stdout);
+END_TEST
+
+Suite *suite_shadow_thread_pool(void)
+{
+    Suite *s;
+
+    s = suite_create("ShadowThreadPool");
+
+    START_TCASE(shadow_thread_pool)
+        ADD_TEST(dispatch_in_order);
+        ADD_TEST(exit_and_reuse_id);
+        ADD_TEST(many_short_lived_ids);
+    END_TCASE
+
+    return s;
+}
+
+int main(int argc, char **argv)
+{
+    int number_failed;
+    Suite *s;
+    s = suite_shadow_thread_pool();
+
+#ifdef CHECK_MAJOR_VERSION
+    SRunner *sr;
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+#else
+    (void)s;
+    (void)number_failed;
+    return 0;
+#endif
+}
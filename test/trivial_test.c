@@ -13,6 +13,8 @@
 
 void *test_thread(void *);
 
+void *small_calls_thread(void *);
+
 int error_handler(int, void *);
 
 void callback1(void *arg, char *v);
@@ -71,6 +73,35 @@ START_TEST(buffers_simple2)
     free(buffer);
 END_TEST
 
+START_TEST(buffers_compressible)
+    /* A repetitive half that compresses well and a random half that does not */
+    const int size = 4 * 1024 * 1024;
+    int *buffer = malloc(sizeof(int) * size);
+    int *expected = malloc(sizeof(int) * size);
+    for (int i = 0; i < size; i++)
+        expected[i] = buffer[i] = i < size / 2 ? i % 17 : random() & 0xffff;
+    mutate_call_buffer(buffer, size);
+    for (int i = 0; i < size; i++)
+        ck_assert_int_eq(expected[i] * 3, buffer[i]);
+    free(expected);
+    free(buffer);
+END_TEST
+
+START_TEST(buffers_repeated)
+    /* The same contents are sent again and may come from the channel's cache */
+    const int size = 1024 * 1024;
+    int *buffer = malloc(sizeof(int) * size);
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < size; i++)
+            buffer[i] = 3;
+        mutate_call_buffer(buffer, size);
+        read_call_buffer(buffer, size);
+        read_call_buffer(buffer, size);
+    }
+    ck_assert_int_buffer_elements_eq(buffer, size, 9);
+    free(buffer);
+END_TEST
+
 START_TEST(buffers_manual_simple)
     const int size = 1024 * 1024;
     int *buffer = calloc(sizeof(int), size);
@@ -195,6 +226,21 @@ START_TEST(threads_simple)
     function1();
 END_TEST
 
+START_TEST(threads_streamed)
+    /* Another thread keeps calling while a large buffer may be streamed */
+    const int size = 16 * 1024 * 1024;
+    int *buffer = malloc(sizeof(int) * size);
+    pthread_t t;
+    for (int i = 0; i < size; i++)
+        buffer[i] = 1;
+    pthread_create(&t, NULL, small_calls_thread, NULL);
+    for (int round = 0; round < 3; round++)
+        mutate_call_buffer(buffer, size);
+    pthread_join(t, NULL);
+    ck_assert_int_buffer_elements_eq(buffer, size, 27);
+    free(buffer);
+END_TEST
+
 START_TEST(callbacks)
     int x = 4;
     function2(error_handler, &x);
@@ -233,6 +279,8 @@ Suite *suite_trivial(void)
     START_TCASE(buffers)
         ADD_TEST(buffers_simple1);
         ADD_TEST(buffers_simple2);
+        ADD_TEST(buffers_compressible);
+        ADD_TEST(buffers_repeated);
         ADD_TEST(buffers_manual_simple);
         ADD_TEST(buffers_manual_reuse);
         ADD_TEST(buffers_special_simple);
@@ -245,6 +293,7 @@ Suite *suite_trivial(void)
 
     START_TCASE(threads)
         ADD_TEST(threads_simple);
+        ADD_TEST(threads_streamed);
     END_TCASE
 
     START_TCASE(structs)
@@ -285,6 +334,13 @@ void *test_thread(void *arg)
     return NULL;
 }
 
+void *small_calls_thread(void *arg)
+{
+    for (int i = 0; i < 100; i++)
+        function1();
+    return NULL;
+}
+
 int error_handler(int errno, void *arg)
 {
     ck_assert_int_eq(4, *(int*)arg);
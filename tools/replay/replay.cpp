@@ -0,0 +1,386 @@
+/**
+ * Replay the guestlib side of a traffic trace against an API server.
+ *
+ * The trace is written by a guestlib with `trace_file` set (see
+ * `include/cmd_trace.h`). Every command the guestlib sent is sent again,
+ * in its recorded order per guest thread, over the channel configured in
+ * `/etc/ava/guest.conf` or the one given with `-c`. By default each command
+ * leaves at the time it was traced relative to the first one; with `-f` it
+ * leaves as soon as the calls it depends on have been answered.
+ *
+ * Replies are matched to calls per guest thread in order: the k-th reply
+ * of a thread answers its k-th API call. A call waits for the replies that
+ * its thread had received when it was traced, so synchronous calls stay
+ * synchronous and async calls stay pipelined. Handles and pointers in the
+ * commands are replayed as recorded, which is faithful when the API server
+ * hands out the same ones, as for a deterministic sequence of calls on a
+ * fresh API server. Callbacks from the API server are not replayed.
+ *
+ * The replayer prints the throughput and the latency percentiles of the
+ * replayed calls next to those in the trace.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common/cmd_channel.h"
+#include "common/cmd_channel_impl.h"
+#include "common/cmd_handler.h"
+#include "common/cmd_trace.h"
+#include "guest_config.h"
+
+/* Seconds to wait for a missing reply after the last call was sent */
+#define REPLAY_DEFAULT_WAIT 10
+
+struct replay_call {
+    const struct command_base *cmd;
+    const char *region;
+    uint64_t timestamp_ns;
+    size_t replies_before;     /* replies its thread had received when it was traced */
+};
+
+struct replay_thread {
+    std::vector<struct replay_call> calls;
+    std::vector<uint64_t> traced_sent;     /* trace timestamps of calls answered in the trace */
+    std::vector<uint64_t> traced_latency;
+
+    /* The replay */
+    std::vector<uint64_t> sent_ns;         /* send times of the calls that expect a reply */
+    std::vector<uint64_t> latency;
+    size_t received;
+    pthread_mutex_t lock;
+    pthread_cond_t replied;
+};
+
+static struct command_channel *chan;
+static struct replay_call init_call;
+static std::map<int64_t, struct replay_thread> threads;
+
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t progress = PTHREAD_COND_INITIALIZER;
+static size_t replies_expected;
+static size_t replies_received;
+static size_t replies_unexpected;
+
+static inline uint64_t replay_clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-f] [-c channel] [-w seconds] <trace>\n"
+            "  -f          send calls as fast as their dependencies allow, not at their traced times\n"
+            "  -c channel  channel to replay over instead of the one in %s\n"
+            "  -w seconds  time to wait for missing replies (default %d)\n",
+            prog, guestconfig::kConfigFilePath, REPLAY_DEFAULT_WAIT);
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * Map the trace and sort its sent commands into guest threads.
+ */
+static void load_trace(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    if ((size_t)st.st_size < sizeof(struct command_trace_header)) {
+        fprintf(stderr, "%s is not a command trace\n", path);
+        exit(EXIT_FAILURE);
+    }
+    const char *data = (const char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    const struct command_trace_header *header = (const struct command_trace_header *)data;
+    if (header->magic != COMMAND_TRACE_MAGIC || header->version != COMMAND_TRACE_VERSION) {
+        fprintf(stderr, "%s is not a version %d command trace\n", path, COMMAND_TRACE_VERSION);
+        exit(EXIT_FAILURE);
+    }
+
+    const char *end = data + st.st_size;
+    const char *p = data + sizeof(struct command_trace_header);
+    bool first = true;
+    while (end - p >= (ptrdiff_t)sizeof(struct command_trace_record)) {
+        const struct command_trace_record *record = (const struct command_trace_record *)p;
+        p += sizeof(struct command_trace_record);
+        if (record->command_size < sizeof(struct command_base) ||
+                (uint64_t)(end - p) < record->command_size ||
+                (uint64_t)(end - p) - record->command_size < record->region_size) {
+            fprintf(stderr, "%s is truncated; replaying the complete records\n", path);
+            break;
+        }
+        const struct command_base *cmd = (const struct command_base *)p;
+        const char *region = p + record->command_size;
+        p = region + record->region_size;
+
+        if (first) {
+            if (record->direction != COMMAND_TRACE_SENT || cmd->api_id != COMMAND_HANDLER_API ||
+                    cmd->command_id != COMMAND_HANDLER_INITIALIZE_API) {
+                fprintf(stderr, "%s was not traced by a guestlib\n", path);
+                exit(EXIT_FAILURE);
+            }
+            init_call = {cmd, region, record->timestamp_ns, 0};
+            first = false;
+            continue;
+        }
+
+        struct replay_thread &thread = threads[cmd->thread_id];
+        if (record->direction == COMMAND_TRACE_SENT) {
+            thread.calls.push_back({cmd, region, record->timestamp_ns, thread.traced_latency.size()});
+            if (cmd->api_id != COMMAND_HANDLER_API)
+                thread.traced_sent.push_back(record->timestamp_ns);
+        }
+        else if (cmd->api_id != COMMAND_HANDLER_API &&
+                 thread.traced_latency.size() < thread.traced_sent.size()) {
+            thread.traced_latency.push_back(record->timestamp_ns - thread.traced_sent[thread.traced_latency.size()]);
+        }
+    }
+
+    for (auto &entry : threads) {
+        struct replay_thread &thread = entry.second;
+        thread.sent_ns.resize(thread.traced_latency.size());
+        thread.received = 0;
+        pthread_mutex_init(&thread.lock, NULL);
+        pthread_cond_init(&thread.replied, NULL);
+        replies_expected += thread.traced_latency.size();
+    }
+}
+
+static struct command_channel *replay_channel_new(const std::string &channel)
+{
+    if (channel == "TCP")
+        return command_channel_socket_tcp_guest_new()[0];
+    if (channel == "SHM")
+        return command_channel_shm_new();
+    if (channel == "VSOCK")
+        return command_channel_socket_new();
+    if (channel == "SHM_RING")
+        return command_channel_shm_ring_guest_new();
+    if (channel == "UNIX")
+        return command_channel_socket_unix_guest_new();
+    if (channel == "LOCAL")
+        return command_channel_loopback_guest_new();
+    std::cerr << "Unsupported channel " << channel
+              << ", expect [\"TCP\" | \"SHM\" | \"VSOCK\" | \"SHM_RING\" | \"UNIX\" | \"LOCAL\"]" << std::endl;
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * Send a copy of the traced command `call` on the replay channel.
+ */
+static void replay_send(const struct replay_call &call)
+{
+    const struct command_base *orig = call.cmd;
+    struct command_base *cmd = command_channel_new_command(chan, orig->command_size, orig->region_size);
+
+    memcpy((char *)cmd + sizeof(struct command_base), (const char *)orig + sizeof(struct command_base),
+           orig->command_size - sizeof(struct command_base));
+    cmd->api_id = orig->api_id;
+    cmd->command_id = orig->command_id;
+    cmd->thread_id = orig->thread_id;
+    cmd->original_thread_id = orig->original_thread_id;
+    cmd->flags |= orig->flags & COMMAND_FLAG_DEFERRABLE;
+
+    /* Attaching the region as one buffer gives every buffer in it the ID
+     * it had, if the channel numbers buffers by their offset */
+    if (orig->region_size) {
+        void *buffer_id = command_channel_attach_buffer(chan, cmd, call.region, orig->region_size);
+        if ((uintptr_t)buffer_id != orig->command_size) {
+            fprintf(stderr, "The channel does not number buffers by their offset in the command, "
+                    "and cannot replay this trace\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    command_channel_send_command(chan, cmd);
+}
+
+static void replay_thread_main(struct replay_thread *thread, uint64_t start_ns, uint64_t trace_start_ns, bool fast)
+{
+    size_t answered = 0;
+
+    for (const struct replay_call &call : thread->calls) {
+        if (!fast) {
+            uint64_t due = start_ns + (call.timestamp_ns - trace_start_ns);
+            struct timespec ts = {(time_t)(due / 1000000000ULL), (long)(due % 1000000000ULL)};
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+                ;
+        }
+
+        pthread_mutex_lock(&thread->lock);
+        while (thread->received < call.replies_before)
+            pthread_cond_wait(&thread->replied, &thread->lock);
+        pthread_mutex_unlock(&thread->lock);
+
+        if (call.cmd->api_id != COMMAND_HANDLER_API && answered < thread->sent_ns.size())
+            thread->sent_ns[answered++] = replay_clock_ns();
+        replay_send(call);
+    }
+}
+
+static void replay_receive_main(void)
+{
+    while (true) {
+        struct command_base *cmd = command_channel_receive_command(chan);
+        uint64_t now = replay_clock_ns();
+        bool expected = false;
+
+        if (cmd->api_id != COMMAND_HANDLER_API) {
+            auto entry = threads.find(cmd->thread_id);
+            if (entry != threads.end()) {
+                struct replay_thread &thread = entry->second;
+                pthread_mutex_lock(&thread.lock);
+                if (thread.received < thread.sent_ns.size()) {
+                    thread.latency.push_back(now - thread.sent_ns[thread.received]);
+                    thread.received++;
+                    expected = true;
+                    pthread_cond_broadcast(&thread.replied);
+                }
+                pthread_mutex_unlock(&thread.lock);
+            }
+        }
+        command_channel_free_command(chan, cmd);
+
+        pthread_mutex_lock(&progress_lock);
+        if (expected)
+            replies_received++;
+        else
+            replies_unexpected++;
+        pthread_cond_broadcast(&progress);
+        pthread_mutex_unlock(&progress_lock);
+    }
+}
+
+static void print_latency(const char *name, std::vector<uint64_t> &latency)
+{
+    if (latency.empty())
+        return;
+    std::sort(latency.begin(), latency.end());
+    auto pct = [&](double p) {
+        return latency[std::min(latency.size() - 1, (size_t)(p * latency.size()))] / 1000.0;
+    };
+    printf("[replay] %s latency: p50 %.1f us, p90 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+           name, pct(0.5), pct(0.9), pct(0.99), pct(0.999), latency.back() / 1000.0);
+}
+
+int main(int argc, char *argv[])
+{
+    bool fast = false;
+    int wait_s = REPLAY_DEFAULT_WAIT;
+    const char *channel = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "fc:w:")) != -1) {
+        switch (opt) {
+        case 'f':
+            fast = true;
+            break;
+        case 'c':
+            channel = optarg;
+            break;
+        case 'w':
+            wait_s = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1)
+        usage(argv[0]);
+
+    guestconfig::config = guestconfig::readGuestConfig();
+    if (guestconfig::config == nullptr)
+        exit(EXIT_FAILURE);
+    if (channel)
+        guestconfig::config->channel_ = channel;
+
+    load_trace(argv[optind]);
+    size_t calls = 1, region_bytes = init_call.cmd->region_size;
+    for (auto &entry : threads) {
+        calls += entry.second.calls.size();
+        for (const struct replay_call &call : entry.second.calls)
+            region_bytes += call.cmd->region_size;
+    }
+
+    chan = replay_channel_new(guestconfig::config->channel_);
+    if (!chan) {
+        std::cerr << "Failed to create command channel" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    std::thread receiver(replay_receive_main);
+    receiver.detach();
+
+    /* The initialization command goes first, as the guestlib sends it */
+    uint64_t start_ns = replay_clock_ns();
+    replay_send(init_call);
+    std::vector<std::thread> senders;
+    for (auto &entry : threads)
+        if (!entry.second.calls.empty())
+            senders.emplace_back(replay_thread_main, &entry.second, start_ns, init_call.timestamp_ns, fast);
+    for (auto &sender : senders)
+        sender.join();
+
+    /* Wait for the replies as long as they keep coming */
+    pthread_mutex_lock(&progress_lock);
+    while (replies_received < replies_expected) {
+        size_t before = replies_received;
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += wait_s;
+        while (replies_received == before &&
+               pthread_cond_timedwait(&progress, &progress_lock, &deadline) != ETIMEDOUT)
+            ;
+        if (replies_received == before)
+            break;
+    }
+    uint64_t elapsed_ns = replay_clock_ns() - start_ns;
+    size_t received = replies_received, unexpected = replies_unexpected;
+    pthread_mutex_unlock(&progress_lock);
+
+    std::vector<uint64_t> latency, traced_latency;
+    for (auto &entry : threads) {
+        pthread_mutex_lock(&entry.second.lock);
+        latency.insert(latency.end(), entry.second.latency.begin(), entry.second.latency.end());
+        pthread_mutex_unlock(&entry.second.lock);
+        traced_latency.insert(traced_latency.end(), entry.second.traced_latency.begin(),
+                              entry.second.traced_latency.end());
+    }
+
+    double seconds = elapsed_ns / 1e9;
+    printf("[replay] %zu commands from %zu threads in %.3f s: %.0f commands/s, %.1f MB/s of data regions\n",
+           calls, senders.size(), seconds, calls / seconds, region_bytes / seconds / (1 << 20));
+    print_latency("replayed", latency);
+    print_latency("traced", traced_latency);
+    if (received < replies_expected || unexpected)
+        printf("[replay] %zu replies missing, %zu unexpected commands received\n",
+               replies_expected - received, unexpected);
+
+    /* The receiver still blocks on the channel, which is not freed */
+    fflush(stdout);
+    _exit(received < replies_expected ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -94,8 +94,25 @@ ava_proto::WorkerAssignReply ManagerServiceServerBase::HandleRequest(
     visible_devices += std::to_string(request.gpu_count() - 1);
     environments.push_back(visible_devices);
   }
-  // Let API server use TCP channel
-  environments.push_back("AVA_CHANNEL=TCP");
+  // Let API server use the manager's channel (TCP by default) and forward
+  // the channel and shadow thread settings. SHM_RING requires the guestlib
+  // to run on the same host.
+  const char *channel = getenv("AVA_CHANNEL");
+  environments.push_back(std::string("AVA_CHANNEL=") + (channel ? channel : "TCP"));
+  static const char *const forwarded_environments[] = {
+    "AVA_TCP_COMPRESS_THRESHOLD", "AVA_TCP_DEDUP_CACHE",
+    "AVA_TCP_BULK_THRESHOLD",     "AVA_TCP_STREAM_THRESHOLD",
+    "AVA_TCP_WIRE_VERSION",       "AVA_TCP_IO_URING",
+    "AVA_SHM_POLL_SPIN",          "AVA_SHM_POLL_CORES",
+    "AVA_BUSY_POLL_SPIN",         "AVA_BUSY_POLL_CORES",
+    "AVA_SHADOW_THREAD_IDLE",     "AVA_CHANNEL_STATS",
+    "AVA_TRACE_FILE",
+  };
+  for (const char *name : forwarded_environments) {
+    const char *value = getenv(name);
+    if (value)
+      environments.push_back(std::string(name) + "=" + value);
+  }
 
   // Pass only port to API server
   auto port = worker_port_base_ +
@@ -16,8 +16,11 @@
 #include "provision_gpu.h"
 #include "common/cmd_channel.h"
 #include "common/cmd_channel_impl.h"
+#include "common/cmd_channel_static.h"
 #include "common/cmd_handler.h"
+#include "common/endpoint_lib.h"
 #include "common/ioctl.h"
+#include "common/linkage.h"
 #include "common/register.h"
 #include "common/socket.h"
 
@@ -80,15 +83,9 @@ static struct command_channel* channel_create()
     return chan;
 }
 
-int main(int argc, char *argv[])
+/* Read GPU provision information. */
+static void init_provision_gpu()
 {
-    if (!(argc == 3 && !strcmp(argv[1], "migrate")) && (argc != 2)) {
-        printf("Usage: %s <listen_port>\n"
-               "or     %s <mode> <listen_port> \n", argv[0], argv[0]);
-        return 0;
-    }
-
-    /* Read GPU provision information. */
     char const* cuda_uuid_str = getenv("CUDA_VISIBLE_DEVICES");
     std::string cuda_uuid     = cuda_uuid_str ? std::string(cuda_uuid_str) : "";
     char const* gpu_uuid_str  = getenv("AVA_GPU_UUID");
@@ -96,6 +93,52 @@ int main(int argc, char *argv[])
     char const* gpu_mem_str   = getenv("AVA_GPU_MEMORY");
     std::string gpu_mem       = gpu_mem_str ? std::string(gpu_mem_str) : "";
     provision_gpu             = new ProvisionGpu(cuda_uuid, gpu_uuid, gpu_mem);
+}
+
+/**
+ * AVA_SHADOW_THREAD_IDLE=<threads> parks shadow threads of exited guest
+ * threads for new ones. A reused thread keeps the API's per-thread state,
+ * so it is off unless set.
+ */
+static void init_shadow_thread_reuse(void)
+{
+    if (getenv("AVA_SHADOW_THREAD_IDLE"))
+        shadow_thread_pool_set_idle_max(nw_shadow_thread_pool, strtoul(getenv("AVA_SHADOW_THREAD_IDLE"), NULL, 0));
+}
+
+/**
+ * Serve a guestlib in the same process over `c`, the API server end of a
+ * loopback channel. The guestlib calls this after it loads the library
+ * build of the API server; the command handler runs when it returns.
+ */
+extern "C" EXPORTED void nw_worker_start_local(struct command_channel *c)
+{
+    init_provision_gpu();
+    init_shadow_thread_reuse();
+    nw_worker_id = 0;
+    chan = c;
+#ifdef AVA_STATIC_CHANNEL
+    if (!command_channel_static_matches(chan)) {
+        fprintf(stderr, "This API server is built for the " AVA_STATIC_CHANNEL_NAME " channel only\n");
+        abort();
+    }
+#endif
+    nw_record_command_channel = command_channel_log_new(0);
+    init_internal_command_handler();
+    init_command_handler(channel_create);
+    DEBUG_PRINT("[worker] start polling tasks in process\n");
+}
+
+int main(int argc, char *argv[])
+{
+    if (!(argc == 3 && !strcmp(argv[1], "migrate")) && (argc != 2)) {
+        printf("Usage: %s <listen_port>\n"
+               "or     %s <mode> <listen_port> \n", argv[0], argv[0]);
+        return 0;
+    }
+
+    init_provision_gpu();
+    init_shadow_thread_reuse();
 
     /* setup signal handler */
     if ((original_sigint_handler = signal(SIGINT, sigint_handler)) == SIG_ERR)
@@ -113,6 +156,10 @@ int main(int argc, char *argv[])
 
     /* live migration */
     if (!strcmp(argv[1], "migrate")) {
+#ifdef AVA_STATIC_CHANNEL
+        fprintf(stderr, "This API server is built for the " AVA_STATIC_CHANNEL_NAME " channel only, without migration\n");
+        return 0;
+#endif
         listen_port = atoi(argv[2]);
         chan = (struct command_channel *)command_channel_socket_tcp_migration_new(listen_port, 0);
         nw_record_command_channel = command_channel_log_new(listen_port);
@@ -129,6 +176,11 @@ int main(int argc, char *argv[])
     /* parse arguments */
     listen_port = atoi(argv[1]);
 
+    /* AVA_BUSY_POLL_SPIN=<us> spins before blocking in the socket receive path */
+    if (getenv("AVA_BUSY_POLL_SPIN"))
+        command_channel_socket_set_busy_poll(strtoul(getenv("AVA_BUSY_POLL_SPIN"), NULL, 0),
+                                             getenv("AVA_BUSY_POLL_CORES"));
+
     if (!getenv("AVA_CHANNEL") || !strcmp(getenv("AVA_CHANNEL"), "TCP")) {
         chan_hv = NULL;
         chan = command_channel_socket_tcp_worker_new(listen_port);
@@ -141,16 +193,34 @@ int main(int argc, char *argv[])
         chan_hv = command_channel_hv_new(listen_port);
         chan = command_channel_socket_worker_new(listen_port);
     }
+    else if (!strcmp(getenv("AVA_CHANNEL"), "SHM_RING")) {
+        chan_hv = NULL;
+        chan = command_channel_shm_ring_worker_new(listen_port);
+    }
+    else if (!strcmp(getenv("AVA_CHANNEL"), "UNIX")) {
+        chan_hv = NULL;
+        chan = command_channel_socket_unix_worker_new(listen_port);
+    }
     else {
-        printf("Unsupported AVA_CHANNEL type (export AVA_CHANNEL=[TCP | SHM | VSOCK]\n");
+        printf("Unsupported AVA_CHANNEL type (export AVA_CHANNEL=[TCP | SHM | VSOCK | SHM_RING | UNIX]\n");
+        return 0;
+    }
+    if (getenv("AVA_TRACE_FILE"))
+        chan = command_channel_trace_new(chan, getenv("AVA_TRACE_FILE"));
+#ifdef AVA_STATIC_CHANNEL
+    if (!command_channel_static_matches(chan)) {
+        fprintf(stderr, "This API server is built for the " AVA_STATIC_CHANNEL_NAME " channel only, without tracing\n");
         return 0;
     }
+#endif
 
     nw_record_command_channel = command_channel_log_new(listen_port);
     init_internal_command_handler();
     init_command_handler(channel_create);
     DEBUG_PRINT("[worker#%d] start polling tasks\n", listen_port);
     wait_for_command_handler();
+    if (command_channel_stats_enabled())
+        shadow_thread_pool_print_stats(nw_shadow_thread_pool, "worker", stderr);
     command_channel_free(chan);
     command_channel_free((struct command_channel *) nw_record_command_channel);
     if (chan_hv) command_channel_hv_free(chan_hv);